@@ -104,6 +104,17 @@ compat_file_read( compat_fd fd, utils_file *file )
   return 0;
 }
 
+int
+compat_file_seek( compat_fd fd, off_t offset )
+{
+  if( fseek( fd, offset, SEEK_SET ) ) {
+    ui_error( UI_ERROR_ERROR, "error seeking in file: %s", strerror( errno ) );
+    return 1;
+  }
+
+  return 0;
+}
+
 int
 compat_file_write( compat_fd fd, const unsigned char *buffer, size_t length )
 {
@@ -36,15 +36,22 @@
 #include "movie.h"
 #include "peripherals/scld.h"
 #include "rectangle.h"
+#include "runahead.h"
 #include "screenshot.h"
 #include "settings.h"
+#include "sound.h"
 #include "spectrum.h"
+#include "timer/timer.h"
 #include "ui/ui.h"
 #include "ui/uidisplay.h"
 
 /* Set once we have initialised the UI */
 int display_ui_initialised = 0;
 
+/* How many frames the adaptive frame skip dropped in the last emulated
+   second */
+int display_frames_skipped = 0;
+
 /* The current border colour */
 libspectrum_byte display_lores_border;
 libspectrum_byte display_hires_border;
@@ -109,12 +116,28 @@ struct border_change_t {
 
 display_dirty_fn display_dirty;
 display_write_if_dirty_fn display_write_if_dirty;
+display_write_run_if_dirty_fn display_write_run_if_dirty;
 
-static struct border_change_t border_change_end_sentinel =
-  { DISPLAY_SCREEN_WIDTH_COLS, DISPLAY_SCREEN_HEIGHT - 1, 0 };
+/* A stretch of one colour along a line of the border, from column `x' up
+   to the start of the next run or the end of the line */
+typedef struct border_run_t {
+  libspectrum_byte x;
+  libspectrum_byte colour;
+} border_run_t;
 
-/* The current border colour */
-int current_border[ DISPLAY_SCREEN_HEIGHT ][ DISPLAY_SCREEN_WIDTH_COLS ];
+/* The runs on a line, in order; no two neighbours share a colour */
+typedef struct border_line_t {
+  int count;
+  border_run_t runs[ DISPLAY_SCREEN_WIDTH_COLS ];
+} border_line_t;
+
+/* The border as it was drawn at the end of the last frame; a count of zero
+   means the line has to be drawn again whatever happens */
+static border_line_t border_lines[ DISPLAY_SCREEN_HEIGHT ];
+
+/* The colour of the whole border if it was all one colour last frame and
+   is still there on every line, or -1 */
+static int border_uniform_colour = -1;
 
 static void display_dirty8( libspectrum_word address );
 static void display_dirty64( libspectrum_word address );
@@ -156,6 +179,8 @@ display_init( int *argc, char ***argv )
   int i, j, k, x, y;
   int error;
 
+  uidisplay_expand_init();
+
   if(ui_init(argc, argv))
     return 1;
 
@@ -199,6 +224,17 @@ display_init( int *argc, char ***argv )
   display_last_border = scld_last_dec.name.hires ?
                             display_hires_border : display_lores_border;
 
+  runahead_state_register( &display_lores_border,
+                           sizeof( display_lores_border ) );
+  runahead_state_register( &display_hires_border,
+                           sizeof( display_hires_border ) );
+  runahead_state_register( &display_last_border,
+                           sizeof( display_last_border ) );
+  runahead_state_register( &display_frame_count,
+                           sizeof( display_frame_count ) );
+  runahead_state_register( &display_flash_reversed,
+                           sizeof( display_flash_reversed ) );
+
   return 0;
 }
 
@@ -536,12 +572,72 @@ display_write_if_dirty_sinclair( int x, int y )
   }
 }
 
+void
+display_write_run_if_dirty_cells( int x, int end, int y )
+{
+  for( ; x < end; x++ ) display_write_if_dirty( x, y );
+}
+
+/* The common case of plain Spectrum video: check the whole run against
+   what was drawn last time at once, and hand each stretch of changed
+   chunks to the UI in a single call */
+void
+display_write_run_if_dirty_sinclair( int x, int end, int y )
+{
+  libspectrum_dword detail[ DISPLAY_WIDTH_COLS ];
+  libspectrum_byte data[ DISPLAY_WIDTH_COLS ];
+  libspectrum_byte ink[ DISPLAY_WIDTH_COLS ], paper[ DISPLAY_WIDTH_COLS ];
+  libspectrum_dword *last;
+  libspectrum_byte *screen;
+  int beam_x, beam_y;
+  int i, start, count = end - x;
+
+  beam_x = x + DISPLAY_BORDER_WIDTH_COLS;
+  beam_y = y + DISPLAY_BORDER_HEIGHT;
+
+  /* The bitmap bytes for a run are consecutive in memory */
+  screen = &RAM[ memory_current_screen ][ display_get_addr( x, y ) ];
+  last = &display_last_screen[ beam_x + beam_y * DISPLAY_SCREEN_WIDTH_COLS ];
+
+  for( i = 0; i < count; i++ )
+    detail[i] = ( display_flash_reversed << 24 ) |
+                ( display_get_attr_byte( x + i, y ) << 8 ) | screen[i];
+
+  /* Quite often nothing has actually changed */
+  if( !memcmp( detail, last, count * sizeof( *detail ) ) ) return;
+
+  i = 0;
+  while( i < count ) {
+
+    /* Skip the chunks which are as they were */
+    while( i < count && detail[i] == last[i] ) i++;
+    if( i == count ) break;
+
+    start = i;
+
+    do {
+      data[i] = screen[i];
+      display_parse_attr( detail[i] >> 8, &ink[i], &paper[i] );
+      last[i] = detail[i];
+      i++;
+    } while( i < count && detail[i] != last[i] );
+
+    uidisplay_plot8_line( beam_x + start, beam_y, i - start, &data[ start ],
+                          &ink[ start ], &paper[ start ] );
+
+    /* And now mark them dirty */
+    display_is_dirty[ beam_y ] |=
+      ( ( (libspectrum_qword)1 << ( i - start ) ) - 1 ) << ( beam_x + start );
+  }
+}
+
 /* Plot any dirty data from ( x, y ) to ( end, y ) of the critical
    region to the drawing region */
 static void
 copy_critical_region_line( int y, int x, int end )
 {
   libspectrum_dword bit_mask, dirty;
+  int start;
 
   if( x < DISPLAY_WIDTH_COLS ) {
 
@@ -574,17 +670,19 @@ copy_critical_region_line( int y, int x, int end )
 
     }
 
-    /* Walk to the end of the dirty region, writing the bytes to the
-       drawing area along the way */
-    do {
+    start = x;
 
-      display_write_if_dirty( x, y );
+    /* Walk to the end of the dirty region, then write it all to the
+       drawing area */
+    do {
 
       dirty >>= 1;
       x++;
 
     } while( dirty & 0x01 );
 
+    display_write_run_if_dirty( start, x, y );
+
   }
   
 }
@@ -824,75 +922,194 @@ border_change_write( int y, int start, int end, int colour )
 }
 
 static void
-border_change_line_part( int y, int start, int end, int colour )
+border_line_write( int y, const border_line_t *line )
 {
-  border_change_write( y, start, end, colour );
+  int i, end;
+
+  for( i = 0; i < line->count; i++ ) {
+    end = i + 1 < line->count ? line->runs[ i + 1 ].x :
+                                DISPLAY_SCREEN_WIDTH_COLS;
+    border_change_write( y, line->runs[i].x, end, line->runs[i].colour );
+  }
 }
 
+/* Take account of all the border colour changes which happened in this
+   frame */
 static void
-border_change_line( int y, int colour )
+update_border( void )
 {
-  border_change_write( y, 0, DISPLAY_SCREEN_WIDTH_COLS, colour );
+  struct border_change_t *change = border_changes,
+    *end = border_changes + border_changes_last;
+  border_line_t line;
+  border_run_t *last;
+  int colour, position, uniform, x, y;
+
+  /* The usual case: nothing changed all frame, and nothing changed last
+     frame either */
+  if( border_changes_last == 1 &&
+      border_changes[0].colour == border_uniform_colour ) return;
+
+  colour = change->colour;
+  change++;
+
+  uniform = 1;
+
+  for( y = 0; y < DISPLAY_SCREEN_HEIGHT; y++ ) {
+
+    line.count = 1;
+    line.runs[0].x = 0;
+    line.runs[0].colour = colour;
+
+    /* A change at the very end of a line takes effect on the next one */
+    for( ; change < end; change++ ) {
+
+      position = change->y * DISPLAY_SCREEN_WIDTH_COLS + change->x;
+      if( position >= ( y + 1 ) * DISPLAY_SCREEN_WIDTH_COLS ) break;
+
+      x = position - y * DISPLAY_SCREEN_WIDTH_COLS;
+      colour = change->colour;
+      last = &line.runs[ line.count - 1 ];
+
+      if( last->x == x ) {
+        last->colour = colour;
+        if( line.count > 1 && last[-1].colour == colour ) line.count--;
+      } else if( last->colour != colour ) {
+        line.count++;
+        last[1].x = x;
+        last[1].colour = colour;
+      }
+    }
+
+    if( line.count != 1 || line.runs[0].colour != border_changes[0].colour )
+      uniform = 0;
+
+    /* Draw only the lines which have changed */
+    if( line.count != border_lines[y].count ||
+        memcmp( line.runs, border_lines[y].runs,
+                line.count * sizeof( border_run_t ) ) ) {
+      border_line_write( y, &line );
+      border_lines[y] = line;
+    }
+  }
+
+  border_uniform_colour = uniform ? border_changes[0].colour : -1;
+
+  border_changes_last = 0;
+
+  add_border_sentinel();
 }
 
-static void
-do_border_change( struct border_change_t *first,
-		  struct border_change_t *second )
+/* Adaptive frame skip. Emulation itself is paced by the sound card or the
+   timer and is never slowed down; instead, when the host can't keep up,
+   frames are not sent to the UI, which is usually the expensive part */
+
+/* Never skip more than this many frames in a row, so the picture always
+   moves on a few times a second */
+#define FRAME_SKIP_MAX_RUN 8
+
+/* Sound buffer levels below which we're about to run dry and must skip,
+   and above which we're comfortably ahead and needn't */
+#define FRAME_SKIP_SOUND_LOW 0.25
+#define FRAME_SKIP_SOUND_HIGH 0.75
+
+/* How far behind real time the emulation has fallen, in seconds */
+static double frame_skip_debt;
+static double frame_skip_last_time = -1;
+static int frame_skip_run;
+static int frame_skip_count, frame_skip_frames;
+
+/* Decide whether to skip sending this frame to the UI; 'frames' is the
+   number of frames emulated since the last time we were asked */
+static int
+frame_skip_wanted( int frames )
 {
-  if( first->x ) {
-    if( first->x != DISPLAY_SCREEN_WIDTH_COLS )
-      border_change_line_part( first->y, first->x, DISPLAY_SCREEN_WIDTH_COLS,
-			       first->colour );
-    /* Don't extend region past the end of the screen */
-    if( first->y < DISPLAY_SCREEN_HEIGHT - 1 ) first->y++;
-  }
+  double now, period, elapsed, fill = -1;
+  float speed;
+
+  now = timer_get_time(); if( now < 0 ) return 0;
+
+  speed = ( settings_current.emulation_speed < 1 ?
+            1.0                                  :
+            settings_current.emulation_speed ) / 100.0;
+  period = (double)machine_current->timings.tstates_per_frame /
+           machine_current->timings.processor_speed / speed;
+
+  elapsed = now - frame_skip_last_time;
+  frame_skip_last_time = now;
 
-  for( ; first->y < second->y; first->y++ ) {
-    border_change_line( first->y, first->colour );
+  /* Each frame that took longer than it should have puts us further
+     behind. Gaps of over a second are pauses or menus, not slowness */
+  if( elapsed > 1.0 ) {
+    frame_skip_debt = 0;
+  } else {
+    frame_skip_debt += elapsed - frames * period;
+    if( frame_skip_debt < 0 ) frame_skip_debt = 0;
+    if( frame_skip_debt > FRAME_SKIP_MAX_RUN * period )
+      frame_skip_debt = FRAME_SKIP_MAX_RUN * period;
   }
 
-  if( second->x ) {
-    if( second->x == DISPLAY_SCREEN_WIDTH_COLS ) {
-      border_change_line( first->y, first->colour );
-    } else {
-      border_change_line_part( first->y, 0, second->x, first->colour );
+  if( frame_skip_run >= FRAME_SKIP_MAX_RUN ) return 0;
+
+  /* The sound buffer is the better guide when we can see it, as its
+     clock is the one which really matters */
+  if( sound_enabled && settings_current.sound ) fill = sound_fill_level();
+  if( fill >= 0 ) {
+    if( fill < FRAME_SKIP_SOUND_LOW ) return 1;
+    if( fill > FRAME_SKIP_SOUND_HIGH ) {
+      frame_skip_debt = 0;
+      return 0;
     }
   }
+
+  return frame_skip_debt > period;
 }
 
-/* Take account of all the border colour changes which happened in this
-   frame */
+/* Count the skipped frames once per emulated second */
 static void
-update_border( void )
+frame_skip_account( int skipped, int frames )
 {
-  int pos;
-  int error;
+  int frames_per_second = machine_current->timings.processor_speed /
+                          machine_current->timings.tstates_per_frame;
 
-  /* Put the final sentinel onto the list */
-  struct border_change_t *end_sentinel = alloc_change();
+  frame_skip_run = skipped ? frame_skip_run + 1 : 0;
+  frame_skip_count += skipped;
 
-  memcpy( end_sentinel, &border_change_end_sentinel,
-          sizeof( struct border_change_t ) );
-
-  for( pos = 0; pos < border_changes_last-1; pos++ ) {
-    do_border_change( border_changes+pos, border_changes+pos+1 );
+  frame_skip_frames += frames;
+  if( frame_skip_frames >= frames_per_second ) {
+    display_frames_skipped = frame_skip_count;
+    frame_skip_count = frame_skip_frames = 0;
   }
-
-  border_changes_last = 0;
-
-  error = add_border_sentinel(); if( error ) return;
 }
 
 /* Send the updated screen to the UI-specific code */
 static void
 update_ui_screen( void )
 {
-  static int frame_count = 0;
+  static int frame_count = 0, frames_unchecked = 0;
   int scale = machine_current->timex ? 2 : 1;
   size_t i;
   struct rectangle *ptr;
 
+  /* Run-ahead shows the last frame it runs instead of the real one. The
+     changed areas are kept until then */
+  if( runahead_frame_hidden() ) return;
+
+  frames_unchecked++;
+
   if( settings_current.frame_rate <= ++frame_count ) {
+
+    /* Movies need every frame_rate'th frame. A skipped frame's changed
+       areas stay in the rectangle list for the next frame shown */
+    if( settings_current.auto_frame_skip && !movie_recording ) {
+      int skip = frame_skip_wanted( frames_unchecked );
+      frame_skip_account( skip, frames_unchecked );
+      frames_unchecked = 0;
+      if( skip ) return;
+    } else {
+      display_frames_skipped = 0;
+      frames_unchecked = 0;
+    }
+
     frame_count = 0;
     if( movie_recording ) {
       movie_start_frame();
@@ -908,6 +1125,7 @@ update_ui_screen( void )
                       scale * DISPLAY_SCREEN_HEIGHT );
       display_redraw_all = 0;
     } else {
+      rectangle_merge();
       for( i = 0, ptr = rectangle_inactive;
            i < rectangle_inactive_count;
            i++, ptr++ ) {
@@ -1025,6 +1243,23 @@ void display_refresh_all(void)
   memset( display_last_screen, 0xff,
           DISPLAY_SCREEN_WIDTH_COLS * DISPLAY_SCREEN_HEIGHT 
           * sizeof(libspectrum_dword) );
+
+  for( i = 0; i < DISPLAY_SCREEN_HEIGHT; i++ )
+    border_lines[i].count = 0;
+  border_uniform_colour = -1;
+}
+
+/* The machine has been put back to the start of an earlier frame without
+   the screen being drawn again. What's on screen still matches
+   display_last_screen and the border lines, so look at every cell again
+   next frame and let the comparisons decide what to redraw */
+void
+display_rollback( void )
+{
+  display_refresh_main_screen();
+
+  border_changes_last = 0;
+  add_border_sentinel();
 }
 
 #if defined(VKEYBOARD) || defined(GCWZERO)
@@ -1075,8 +1310,11 @@ void display_refresh_rect( int x, int y, int w, int h, int save )
   dirty >>= column;
   dirty <<= column + ( DISPLAY_SCREEN_WIDTH_COLS - ( column + bytes ) );
   dirty >>= ( DISPLAY_SCREEN_WIDTH_COLS - ( column + bytes ) );
+  border_uniform_colour = -1;
+
   for( i = row; i < row + height && i < DISPLAY_SCREEN_HEIGHT; i++ ) {
     display_is_dirty[i] |= dirty;
+    border_lines[i].count = 0;
     for ( j = column; j < column + bytes; j++) {
       index = j + i * DISPLAY_SCREEN_WIDTH_COLS;
       if ( save ) {
@@ -61,6 +61,7 @@
 #define DISPLAY_ASPECT_WIDTH  ( DISPLAY_SCREEN_WIDTH / 2 )
 
 extern int display_ui_initialised;
+extern int display_frames_skipped;
 
 extern libspectrum_byte display_lores_border;
 extern libspectrum_byte display_hires_border;
@@ -97,6 +98,13 @@ void display_write_if_dirty_timex( int x, int y );
 void display_write_if_dirty_pentagon_16_col( int x, int y );
 void display_write_if_dirty_sinclair( int x, int y );
 
+typedef void (*display_write_run_if_dirty_fn)( int x, int end, int y );
+/* Function to write the dirty 8x1 chunks from ( (8*x) , y ) up to
+   ( (8*end) , y ) to the display */
+extern display_write_run_if_dirty_fn display_write_run_if_dirty;
+void display_write_run_if_dirty_cells( int x, int end, int y );
+void display_write_run_if_dirty_sinclair( int x, int end, int y );
+
 typedef void (*display_dirty_flashing_fn)(void);
 /* Function to dirty the pixels which are changed by virtue of having a flash
    attribute */
@@ -115,6 +123,7 @@ int display_dirty_border(void);
 int display_frame(void);
 void display_refresh_main_screen(void);
 void display_refresh_all(void);
+void display_rollback( void );
 #if defined(VKEYBOARD) || defined(GCWZERO)
 void display_refresh_main_screen_rect( int x, int y, int w, int h );
 void display_refresh_rect( int x, int y, int w, int h, int save );
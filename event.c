@@ -241,6 +241,41 @@ event_reset( void )
   event_free = NULL;
 }
 
+static void
+event_copy_entry( gpointer data, gpointer user_data )
+{
+  GSList **list = user_data;
+  event_t *copy = libspectrum_new( event_t, 1 );
+
+  *copy = *(event_t*)data;
+  *list = g_slist_append( *list, copy );
+}
+
+/* Take a copy of the event list, to be put back later with
+   event_list_replace() */
+GSList*
+event_list_copy( void )
+{
+  GSList *list = NULL;
+
+  g_slist_foreach( event_list, event_copy_entry, &list );
+
+  return list;
+}
+
+/* Throw away the current event list and use one from event_list_copy()
+   instead */
+void
+event_list_replace( GSList *list )
+{
+  g_slist_foreach( event_list, event_free_entry, NULL );
+  g_slist_free( event_list );
+  event_list = list;
+
+  event_next_event = event_list ?
+    ((event_t*)(event_list->data))->tstates : event_no_events;
+}
+
 /* Call a user-supplied function for every event in the current list */
 void
 event_foreach( GFunc function, gpointer user_data )
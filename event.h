@@ -77,6 +77,10 @@ void event_remove_type_user_data( int type, gpointer user_data );
 /* Clear the event stack */
 void event_reset( void );
 
+/* Save and put back the event list */
+GSList* event_list_copy( void );
+void event_list_replace( GSList *list );
+
 /* Call a user-supplied function for every event in the current list */
 void event_foreach( GFunc function, gpointer user_data );
 
@@ -67,6 +67,7 @@
 #include "fuse.h"
 #include "infrastructure/startup_manager.h"
 #include "keyboard.h"
+#include "loader.h"
 #include "machine.h"
 #include "machines/machines_periph.h"
 #include "memory_pages.h"
@@ -102,6 +103,7 @@
 #include "pokefinder/pokemem.h"
 #include "profile.h"
 #include "psg.h"
+#include "runahead.h"
 #include "rzx.h"
 #include "screenshot.h"
 #include "settings.h"
@@ -325,6 +327,7 @@ run_startup_manager( int *argc, char ***argv )
   keyboard_register_startup();
   libspectrum_register_startup();
   libxml2_register_startup();
+  loader_register_startup();
   machine_register_startup();
   machines_periph_register_startup();
   melodik_register_startup();
@@ -337,6 +340,7 @@ run_startup_manager( int *argc, char ***argv )
   printer_register_startup();
   profile_register_startup();
   psg_register_startup();
+  runahead_register_startup();
   rzx_register_startup();
   scld_register_startup();
   screenshot_register_startup();
@@ -47,6 +47,7 @@ typedef enum startup_manager_module {
   STARTUP_MANAGER_MODULE_KEYBOARD,
   STARTUP_MANAGER_MODULE_LIBSPECTRUM,
   STARTUP_MANAGER_MODULE_LIBXML2,
+  STARTUP_MANAGER_MODULE_LOADER,
   STARTUP_MANAGER_MODULE_MACHINE,
   STARTUP_MANAGER_MODULE_MACHINES_PERIPH,
   STARTUP_MANAGER_MODULE_MELODIK,
@@ -59,6 +60,7 @@ typedef enum startup_manager_module {
   STARTUP_MANAGER_MODULE_PRINTER,
   STARTUP_MANAGER_MODULE_PROFILE,
   STARTUP_MANAGER_MODULE_PSG,
+  STARTUP_MANAGER_MODULE_RUNAHEAD,
   STARTUP_MANAGER_MODULE_RZX,
   STARTUP_MANAGER_MODULE_SCLD,
   STARTUP_MANAGER_MODULE_SCREENSHOT,
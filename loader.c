@@ -23,14 +23,18 @@
 
 #include "config.h"
 
+#include "compat.h"
 #include "event.h"
+#include "infrastructure/startup_manager.h"
 #include "loader.h"
 #include "memory_pages.h"
+#include "runahead.h"
 #include "rzx.h"
 #include "settings.h"
 #include "spectrum.h"
 #include "tape.h"
 #include "z80/z80.h"
+#include "z80/z80_macros.h"
 
 static int successive_reads = 0;
 static libspectrum_signed_dword last_tstates_read = -100000;
@@ -47,9 +51,118 @@ typedef enum acceleration_mode_t {
 static acceleration_mode_t acceleration_mode;
 static size_t acceleration_pc;
 
+/* Custom loaders which can be flash loaded: copies of the ROM's LD-BYTES
+   routine which may have been moved elsewhere in memory and had their
+   timing constants changed. Each pattern covers LD-LOOP (0x05a9) up to the
+   end of LD-SAMPLE; entries above 0xff match any byte, or the address of
+   the given offset into the pattern */
+#define FLASH_ANY 0x100
+#define FLASH_ADDRESS( offset ) ( 0x200 | ( offset ) )
+#define FLASH_PATTERN_LENGTH 0x51
+
+static const libspectrum_word flash_pattern_rom[ FLASH_PATTERN_LENGTH ] = {
+  0x08, 0x20, 0x07, 0x30, 0x0f, 0xdd, 0x75, 0x00, 0x18, 0x0f, 0xcb, 0x11,
+  0xad, 0xc0, 0x79, 0x1f, 0x4f, 0x13, 0x18, 0x07, 0xdd, 0x7e, 0x00, 0xad,
+  0xc0, 0xdd, 0x23, 0x1b, 0x08, 0x06, FLASH_ANY, 0x2e, 0x01,
+  0xcd, FLASH_ADDRESS( 0x3a ), FLASH_ANY, 0xd0, 0x3e, FLASH_ANY, 0xb8, 0xcb,
+  0x15, 0x06, FLASH_ANY, 0xd2, FLASH_ADDRESS( 0x21 ), FLASH_ANY, 0x7c, 0xad,
+  0x67, 0x7a, 0xb3, 0x20, 0xca, 0x7c, 0xfe, 0x01, 0xc9,
+  0xcd, FLASH_ADDRESS( 0x3e ), FLASH_ANY, 0xd0, 0x3e, FLASH_ANY, 0x3d, 0x20,
+  0xfd, 0xa7, 0x04, 0xc8, 0x3e, FLASH_ANY, 0xdb, 0xfe, 0x1f, 0xd0, 0xa9,
+  0xe6, 0x20, 0x28, 0xf3,
+};
+
+/* As above, but without the check for BREAK in LD-SAMPLE, as used by
+   Bleepload and similar loaders */
+static const libspectrum_word
+flash_pattern_no_break[ FLASH_PATTERN_LENGTH ] = {
+  0x08, 0x20, 0x07, 0x30, 0x0f, 0xdd, 0x75, 0x00, 0x18, 0x0f, 0xcb, 0x11,
+  0xad, 0xc0, 0x79, 0x1f, 0x4f, 0x13, 0x18, 0x07, 0xdd, 0x7e, 0x00, 0xad,
+  0xc0, 0xdd, 0x23, 0x1b, 0x08, 0x06, FLASH_ANY, 0x2e, 0x01,
+  0xcd, FLASH_ADDRESS( 0x3a ), FLASH_ANY, 0xd0, 0x3e, FLASH_ANY, 0xb8, 0xcb,
+  0x15, 0x06, FLASH_ANY, 0xd2, FLASH_ADDRESS( 0x21 ), FLASH_ANY, 0x7c, 0xad,
+  0x67, 0x7a, 0xb3, 0x20, 0xca, 0x7c, 0xfe, 0x01, 0xc9,
+  0xcd, FLASH_ADDRESS( 0x3e ), FLASH_ANY, 0xd0, 0x3e, FLASH_ANY, 0x3d, 0x20,
+  0xfd, 0xa7, 0x04, 0xc8, 0x3e, FLASH_ANY, 0xdb, 0xfe, 0x1f, 0x00, 0xa9,
+  0xe6, 0x20, 0x28, 0xf3,
+};
+
+typedef struct flash_loader_t {
+
+  const libspectrum_word *pattern;
+
+  int sample_tstates;		/* Length of one pass round LD-SAMPLE */
+
+} flash_loader_t;
+
+static const flash_loader_t flash_loaders[] = {
+  { flash_pattern_rom, 59 },
+  { flash_pattern_no_break, 58 },
+};
+
+/* Offsets into the patterns */
+#define FLASH_OFFSET_THRESHOLD 0x26	/* LD A,$CB */
+#define FLASH_OFFSET_BIT_START 0x2b	/* LD B,$B0 */
+#define FLASH_OFFSET_RET 0x39		/* The RET at 0x05e2 */
+#define FLASH_OFFSET_DELAY 0x3f		/* LD A,$16 in LD-EDGE-1 */
+#define FLASH_OFFSET_READ 0x4a		/* Just after the IN in LD-SAMPLE */
+#define FLASH_OFFSET_START ( -0x53 )	/* LD-BYTES */
+
+/* Other loaders whose edge routine is recognised by the acceleration code
+   (Speedlock, Alkatraz, Bleepload and so on) are flash loaded a byte at a
+   time: when the loader starts on a pair of edges inside a bit loop like
+   LD-8-BITS's, the rest of the byte is decoded straight from the tape and
+   the loader is left at the end of the bit loop to deal with the byte in
+   its own way */
+typedef struct flash_bits_t {
+
+  libspectrum_word pc, sp;	/* Where the loader was when it was found */
+  libspectrum_dword read;	/* When it was found */
+  libspectrum_dword since;	/* How long before that it last read the ULA */
+
+  libspectrum_word exit;	/* The instruction after the bit loop */
+  libspectrum_byte shift;	/* The RL r or RR r which collects the bits */
+  libspectrum_byte threshold;	/* The LD A,n before the CP B */
+  libspectrum_byte start;	/* The LD B,n before the next bit */
+
+  int delay;			/* The edge routine's delay loop constant */
+  int sample_tstates;		/* Length of one pass round the sampling loop */
+
+} flash_bits_t;
+
+/* The shortest possible sampling loop: just IN A,(n) and JR Z */
+#define FLASH_SAMPLE_MIN_TSTATES ( 11 + 12 )
+
+static int flash_load_event;
+static const flash_loader_t *flash_loader;
+static flash_bits_t flash_bits;
+static int flash_bits_found;
+
+static void flash_load( libspectrum_dword last_tstates, int type,
+                        void *user_data );
+
+static int
+loader_init( void *context )
+{
+  flash_load_event = event_register( flash_load, "Flash load" );
+
+  return 0;
+}
+
+void
+loader_register_startup( void )
+{
+  startup_manager_module dependencies[] = { STARTUP_MANAGER_MODULE_EVENT };
+  startup_manager_register( STARTUP_MANAGER_MODULE_LOADER, dependencies,
+                            ARRAY_SIZE( dependencies ), loader_init, NULL,
+                            NULL );
+}
+
 void
 loader_frame( libspectrum_dword frame_length )
 {
+  if( runahead_running ) return;
+
   if( last_tstates_read > -100000 ) {
     last_tstates_read -= frame_length;
   }
@@ -91,7 +204,6 @@ do_acceleration( void )
     z80.pc.b.l = readbyte_internal( z80.sp.w ); z80.sp.w++;
     z80.pc.b.h = readbyte_internal( z80.sp.w ); z80.sp.w++;
 
-    event_remove_type( tape_edge_event );
     tape_next_edge( tstates, 1 );
 
     successive_reads = 0;
@@ -402,12 +514,397 @@ check_for_acceleration( void )
   if( acceleration_mode ) do_acceleration();
 }
 
+static int
+flash_loader_matches( const flash_loader_t *loader, libspectrum_word loop )
+{
+  size_t i;
+  libspectrum_word address, entry;
+
+  for( i = 0; i < FLASH_PATTERN_LENGTH; i++ ) {
+    entry = loader->pattern[i];
+
+    if( entry == FLASH_ANY ) continue;
+
+    if( entry & 0x200 ) {
+      address = readbyte_internal( loop + i ) |
+                readbyte_internal( loop + i + 1 ) << 8;
+      if( address != (libspectrum_word)( loop + ( entry & 0xff ) ) ) return 0;
+      continue;
+    }
+
+    if( readbyte_internal( loop + i ) != entry ) return 0;
+  }
+
+  return 1;
+}
+
+/* Is the code doing this IN a copy of LD-BYTES we could flash load? The
+   ROM's own copy is left to the tape traps */
+static const flash_loader_t*
+flash_loader_detect( void )
+{
+  libspectrum_word loop = z80.pc.w - FLASH_OFFSET_READ;
+  size_t i;
+
+  if( loop == 0x05a9 && trap_check_rom( CHECK_TAPE_ROM ) ) return NULL;
+
+  for( i = 0; i < ARRAY_SIZE( flash_loaders ); i++ )
+    if( flash_loader_matches( &flash_loaders[i], loop ) )
+      return &flash_loaders[i];
+
+  return NULL;
+}
+
+/* Roughly how long a pair of edges the loader sees as the boundary
+   between a 0 and a 1 bit: two passes through LD-EDGE-1's delay and call
+   overheads, the bit handling in LD-8-BITS and then enough passes round
+   LD-SAMPLE to take B from its start value to the threshold */
+static libspectrum_dword
+flash_threshold( int delay, int sample_tstates, int samples )
+{
+  return 2 * ( 16 * delay + 74 ) + 73 +
+         sample_tstates * samples + sample_tstates / 2;
+}
+
+/* Load the whole block for a copy of LD-BYTES; returns 0 if it was
+   loaded */
+static int
+flash_load_block( const flash_loader_t *loader )
+{
+  libspectrum_word loop, start, sp, address;
+  libspectrum_dword threshold;
+  int delay, samples, i;
+
+  if( flash_loader_detect() != loader ) return 1;
+
+  loop = z80.pc.w - FLASH_OFFSET_READ;
+
+  delay = readbyte_internal( loop + FLASH_OFFSET_DELAY );
+  if( !delay ) delay = 0x100;
+
+  samples = readbyte_internal( loop + FLASH_OFFSET_THRESHOLD ) -
+            readbyte_internal( loop + FLASH_OFFSET_BIT_START );
+  if( samples <= 0 ) return 1;
+
+  threshold = flash_threshold( delay, loader->sample_tstates, samples );
+
+  if( tape_flash_load( threshold, 2 * loader->sample_tstates ) ) return 1;
+
+  /* Drop the return addresses of LD-EDGE-1 and LD-EDGE-2 if we were
+     called from within the loader, then leave as LD-BYTES would */
+  start = loop + FLASH_OFFSET_START;
+  sp = z80.sp.w;
+  for( i = 0; i < 2; i++ ) {
+    address = readbyte_internal( sp ) | readbyte_internal( sp + 1 ) << 8;
+    if( (libspectrum_word)( address - start ) >=
+        FLASH_PATTERN_LENGTH - FLASH_OFFSET_START )
+      break;
+    sp += 2;
+  }
+
+  z80.sp.w = sp;
+  z80.pc.w = loop + FLASH_OFFSET_RET;
+
+  return 0;
+}
+
+static libspectrum_word
+flash_read_word( libspectrum_word address )
+{
+  return readbyte_internal( address ) | readbyte_internal( address + 1 ) << 8;
+}
+
+/* The register an RL r or RR r shifts the bits into; only those not used
+   by the edge routine */
+static libspectrum_byte*
+flash_bits_register( libspectrum_byte shift )
+{
+  switch( shift & 0x07 ) {
+  case 2: return &z80.de.b.h;
+  case 3: return &z80.de.b.l;
+  case 4: return &z80.hl.b.h;
+  case 5: return &z80.hl.b.l;
+  default: return NULL;
+  }
+}
+
+/* The instructions found in the sampling loops the acceleration code
+   recognises: returns their length in tstates, or 0 if unknown */
+static int
+flash_sample_instruction( libspectrum_byte opcode, int *length )
+{
+  switch( opcode ) {
+  case 0x00:			/* NOP */
+  case 0x04:			/* INC B */
+  case 0x1f:			/* RRA */
+  case 0xa7:			/* AND A */
+  case 0xa9:			/* XOR C */
+    *length = 1; return 4;
+  case 0xc0:			/* RET NZ */
+  case 0xc8:			/* RET Z */
+  case 0xd0:			/* RET NC */
+  case 0xd8:			/* RET C */
+    *length = 1; return 5;	/* Not taken while sampling */
+  case 0x3e:			/* LD A,n */
+  case 0xe6:			/* AND n */
+    *length = 2; return 7;
+  case 0xdb:			/* IN A,(n) */
+    *length = 2; return 11;
+  default:
+    return 0;
+  }
+}
+
+/* How long one pass round the sampling loop which contains the IN just
+   before 'pc' takes, or 0 if it can't be worked out; sets 'start' to the
+   start of the loop */
+static int
+flash_sample_tstates( libspectrum_word pc, libspectrum_word *start )
+{
+  libspectrum_word address, loop_end;
+  libspectrum_byte opcode;
+  int i, length = 0, instruction_tstates, total, found_in = 0;
+
+  /* Find the JR Z which goes back round the loop... */
+  for( address = pc, i = 0; i < 8; i++, address += length ) {
+    opcode = readbyte_internal( address );
+    if( opcode == 0x28 ) break;
+    if( !flash_sample_instruction( opcode, &length ) ) return 0;
+  }
+  if( i == 8 ) return 0;
+
+  loop_end = address;
+  *start = loop_end + 2 +
+           (libspectrum_signed_byte)readbyte_internal( loop_end + 1 );
+
+  /* ...and add up the loop from there, following any JR NZ over the code
+     which deals with B overflowing, as Alkatraz has */
+  total = 12;
+  for( address = *start, i = 0; i < 16 && address != loop_end; i++ ) {
+    opcode = readbyte_internal( address );
+    if( opcode == 0x20 ) {
+      address += 2 +
+                 (libspectrum_signed_byte)readbyte_internal( address + 1 );
+      total += 12;
+      continue;
+    }
+    instruction_tstates = flash_sample_instruction( opcode, &length );
+    if( !instruction_tstates ) return 0;
+    if( opcode == 0xdb && address + 2 == pc ) found_in = 1;
+    total += instruction_tstates;
+    address += length;
+  }
+
+  return address == loop_end && found_in ? total : 0;
+}
+
+/* Is 'loop' the CALL of the edge pair routine in a bit loop such as
+   LD-8-BITS? That is, the CALL followed by a way out if it timed out (RET
+   NC, JR NC or JP NC), then LD A,n; CP B; RL r or RR r; LD B,n and a JR NC
+   or JP NC back to the CALL */
+static int
+flash_bits_loop( flash_bits_t *bits, libspectrum_word loop )
+{
+  libspectrum_word pc = loop + 3, target;
+
+  switch( readbyte_internal( pc ) ) {
+  case 0xd0: pc += 1; break;	/* RET NC */
+  case 0x30: pc += 2; break;	/* JR NC,e */
+  case 0xd2: pc += 3; break;	/* JP NC,nn */
+  default: return 0;
+  }
+
+  if( readbyte_internal( pc ) != 0x3e ||	/* LD A,n */
+      readbyte_internal( pc + 2 ) != 0xb8 ||	/* CP B */
+      readbyte_internal( pc + 3 ) != 0xcb ||	/* RL r or RR r */
+      readbyte_internal( pc + 5 ) != 0x06 )	/* LD B,n */
+    return 0;
+
+  bits->threshold = readbyte_internal( pc + 1 );
+  bits->shift = readbyte_internal( pc + 4 );
+  bits->start = readbyte_internal( pc + 6 );
+  pc += 7;
+
+  if( ( bits->shift & 0xf0 ) != 0x10 || !flash_bits_register( bits->shift ) ||
+      bits->threshold <= bits->start )
+    return 0;
+
+  switch( readbyte_internal( pc ) ) {
+  case 0x30:			/* JR NC,e */
+    target = pc + 2 + (libspectrum_signed_byte)readbyte_internal( pc + 1 );
+    pc += 2;
+    break;
+  case 0xd2:			/* JP NC,nn */
+    target = flash_read_word( pc + 1 );
+    pc += 3;
+    break;
+  default:
+    return 0;
+  }
+
+  if( target != loop ) return 0;
+
+  bits->exit = pc;
+
+  return 1;
+}
+
+/* Is the code doing this IN a recognised edge routine, waiting for the
+   first edge of a pair in a bit loop we can decode? 'since' is how long
+   ago the ULA was last read */
+static int
+flash_bits_detect( flash_bits_t *bits, libspectrum_dword since )
+{
+  libspectrum_word pair, edge, loop, start;
+
+  if( z80.pc.w == 0x05f3 && trap_check_rom( CHECK_TAPE_ROM ) ) return 0;
+
+  /* This is called on every IN while the tape is playing, so rule out
+     anything which can't be the first pass round a sampling loop before
+     looking at the code at all */
+  if( since <= 2 * FLASH_SAMPLE_MIN_TSTATES ) return 0;
+
+  /* Called from a routine which, like LD-EDGE-2, calls the edge routine
+     and then falls into it, and that from the bit loop */
+  pair = flash_read_word( z80.sp.w );
+  edge = pair + 1;
+  if( readbyte_internal( pair - 3 ) != 0xcd ||
+      flash_read_word( pair - 2 ) != edge ||
+      readbyte_internal( pair ) != 0xd0 )
+    return 0;
+
+  loop = flash_read_word( z80.sp.w + 2 ) - 3;
+  if( readbyte_internal( loop ) != 0xcd ||
+      flash_read_word( loop + 1 ) != (libspectrum_word)( pair - 3 ) ||
+      !flash_bits_loop( bits, loop ) )
+    return 0;
+
+  bits->sample_tstates = flash_sample_tstates( z80.pc.w, &start );
+  if( !bits->sample_tstates ) return 0;
+
+  /* Only try once for each pair of edges, on the first pass round the
+     sampling loop */
+  if( since <= (libspectrum_dword)( 2 * bits->sample_tstates ) ) return 0;
+
+  /* Only now that everything else matches, check this looks like a loader
+     at all */
+  if( acceleration_detector( z80.pc.w - 6 ) != ACCELERATION_MODE_INCREASING )
+    return 0;
+
+  /* The edge routine starts with a delay loop, or goes straight into
+     the sampling loop */
+  if( readbyte_internal( edge ) == 0x3e &&
+      readbyte_internal( edge + 2 ) == 0x3d &&
+      readbyte_internal( edge + 3 ) == 0x20 &&
+      readbyte_internal( edge + 4 ) == 0xfd ) {
+    bits->delay = readbyte_internal( edge + 1 );
+    if( !bits->delay ) bits->delay = 0x100;
+  } else {
+    bits->delay = 0;
+  }
+  if( (libspectrum_word)( start - edge ) > 8 ) return 0;
+
+  bits->pc = z80.pc.w;
+  bits->sp = z80.sp.w;
+  bits->read = tstates;
+  bits->since = since;
+
+  return 1;
+}
+
+/* Decode the rest of the byte from the tape and leave the bit loop as the
+   loader would */
+static void
+flash_load_bits( const flash_bits_t *bits )
+{
+  libspectrum_dword pulses[16], threshold, timeout, margin, minimum, pair;
+  libspectrum_byte *reg, value, bit;
+  int rl, remaining, i;
+
+  if( z80.pc.w != bits->pc || z80.sp.w != bits->sp || tstates < bits->read )
+    return;
+
+  reg = flash_bits_register( bits->shift );
+  rl = !( bits->shift & 0x08 );
+
+  /* Work out how many bits are left from where the marker bit which ends
+     the loop has got to */
+  value = *reg;
+  if( !value ) return;
+  if( rl ) {
+    for( i = 7; !( value & ( 1 << i ) ); i-- ) ;
+    remaining = 8 - i;
+  } else {
+    for( i = 0; !( value & ( 1 << i ) ); i++ ) ;
+    remaining = i + 1;
+  }
+
+  if( tape_peek_pulses( bits->since + ( tstates - bits->read ), pulses,
+                        2 * remaining ) )
+    return;
+
+  /* The loader's threshold and timeout, and the edges' distance from
+     them we're prepared to trust. The first bit of each byte is started
+     later than the others, but loaders make up for that by starting B
+     higher, as LD-BYTES does */
+  threshold = flash_threshold( bits->delay, bits->sample_tstates,
+                               bits->threshold - bits->start );
+  timeout = flash_threshold( bits->delay, bits->sample_tstates,
+                             0xff - bits->start );
+  margin = 4 * bits->sample_tstates;
+  minimum = 16 * bits->delay + 74 + bits->sample_tstates;
+
+  for( i = 0; i < remaining; i++ ) {
+    if( pulses[ 2 * i ] < minimum || pulses[ 2 * i + 1 ] < minimum ) return;
+
+    pair = pulses[ 2 * i ] + pulses[ 2 * i + 1 ];
+    if( pair + margin > threshold && pair < threshold + margin ) return;
+    if( pair + margin > timeout ) return;
+
+    bit = pair > threshold;
+    value = rl ? value << 1 | bit : value >> 1 | bit << 7;
+  }
+
+  for( i = 0; i < 2 * remaining; i++ ) tape_next_edge( tstates, 1 );
+
+  /* The registers as the last pass round the bit loop leaves them, with
+     the marker bit shifted out into carry */
+  *reg = value;
+  z80.af.b.h = bits->threshold;
+  z80.af.b.l = FLAG_C | sz53p_table[ value ];
+  z80.bc.b.h = bits->start;
+  z80.sp.w = bits->sp + 4;
+  z80.pc.w = bits->exit;
+}
+
+/* Run once the IN which found the loader has completed, so the loader can
+   be left without anything else changing the registers */
+static void
+flash_load( libspectrum_dword last_tstates, int type, void *user_data )
+{
+  const flash_loader_t *loader = flash_loader;
+  int bits_found = flash_bits_found;
+
+  flash_loader = NULL;
+  flash_bits_found = 0;
+
+  if( !tape_is_playing() || rzx_playback || rzx_recording ) return;
+
+  if( loader && !flash_load_block( loader ) ) return;
+
+  if( bits_found ) flash_load_bits( &flash_bits );
+}
+
 void
 loader_detect_loader( void )
 {
   libspectrum_dword tstates_diff = tstates - last_tstates_read;
   libspectrum_byte b_diff = z80.bc.b.h - last_b_read;
 
+  /* Don't start or stop the tape because of frames which will be thrown
+     away */
+  if( runahead_running ) return;
+
   last_tstates_read = tstates;
   last_b_read = z80.bc.b.h;
 
@@ -440,6 +937,18 @@ loader_detect_loader( void )
 
   }
 
+  if( settings_current.flash_load && tape_is_playing() &&
+      !rzx_playback && !rzx_recording ) {
+    flash_loader = flash_loader_detect();
+    flash_bits_found = flash_bits_detect( &flash_bits, tstates_diff );
+    if( flash_loader || flash_bits_found )
+      event_add( tstates, flash_load_event );
+
+    /* Accelerating this edge would take the loader away before the
+       byte could be decoded */
+    if( flash_bits_found ) return;
+  }
+
   if( settings_current.accelerate_loader && tape_is_playing() &&
       !rzx_recording )
     check_for_acceleration();
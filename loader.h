@@ -26,6 +26,8 @@
 
 #include "libspectrum.h"
 
+void loader_register_startup( void );
+
 void loader_frame( libspectrum_dword frame_length );
 void loader_tape_play( void );
 void loader_tape_stop( void );
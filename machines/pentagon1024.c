@@ -134,6 +134,7 @@ pentagon1024_v22_memoryport_write( libspectrum_word port GCC_UNUSED,
   if( b & 0x01 ) {
     display_dirty = display_dirty_pentagon_16_col;
     display_write_if_dirty = display_write_if_dirty_pentagon_16_col;
+    display_write_run_if_dirty = display_write_run_if_dirty_cells;
     display_dirty_flashing = display_dirty_flashing_pentagon_16_col;
     memory_display_dirty = memory_display_dirty_pentagon_16_col;
   } else {
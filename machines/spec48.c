@@ -96,6 +96,7 @@ spec48_common_display_setup( void )
 {
   display_dirty = display_dirty_sinclair;
   display_write_if_dirty = display_write_if_dirty_sinclair;
+  display_write_run_if_dirty = display_write_run_if_dirty_sinclair;
   display_dirty_flashing = display_dirty_flashing_sinclair;
 
   memory_display_dirty = memory_display_dirty_sinclair;
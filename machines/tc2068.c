@@ -218,6 +218,7 @@ tc2068_tc2048_common_display_setup( void )
 {
   display_dirty = display_dirty_timex;
   display_write_if_dirty = display_write_if_dirty_timex;
+  display_write_run_if_dirty = display_write_run_if_dirty_cells;
   display_dirty_flashing = display_dirty_flashing_timex;
 
   memory_display_dirty = memory_display_dirty_sinclair;
@@ -45,6 +45,7 @@
 #include "peripherals/spectranet.h"
 #include "peripherals/ttx2000s.h"
 #include "peripherals/ula.h"
+#include "runahead.h"
 #include "settings.h"
 #include "spectrum.h"
 #include "ui/ui.h"
@@ -139,6 +140,13 @@ memory_init( void *context )
 
   module_register( &memory_module_info );
 
+  runahead_state_register( memory_map_read, sizeof( memory_map_read ) );
+  runahead_state_register( memory_map_write, sizeof( memory_map_write ) );
+  runahead_state_register( &memory_current_screen,
+                           sizeof( memory_current_screen ) );
+  runahead_state_register( &memory_screen_mask,
+                           sizeof( memory_screen_mask ) );
+
   return 0;
 }
 
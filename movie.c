@@ -106,6 +106,23 @@
                                                 C - TS2068
                                                 D - Pentagon
                                                 E - 48 NTSC
+      D -> screen area (slice) delta against the previous frame
+      off  len  data          description
+      0    1    x		X coord (0-39)
+      1    2    y		Y coord (0-239)
+      3    1    w		width (1-40)
+      4    2    h		height (1-240)
+      6    ?    for every line of the area, zero or more runs of changed
+                cells, closed with an empty run:
+                  off  len  data  description
+                  0    1    skip  unchanged cells before the run (0-39)
+                  1    1    len   changed cells in the run (1-40, 0 -> EOL)
+                  2    ?    len cells, with the same bytes per cell as the
+                                $ chunk (bitmap1; attrib or
+                                bitmap1; bitmap2; attrib) but not
+                                runlength encoded
+                Cells not in any run are unchanged since the previous frame.
+
       In a frame there are no, one or several screen rectangle, changed from
       the previouse frame.
 
@@ -129,6 +146,12 @@ static char format = '?';
 static int framesiz = 4;
 
 static libspectrum_byte sbuff[ 4096 ];
+
+/* The cells as the movie player will have them after the last frame, used
+   to write 'D' chunks; movie_delta_valid is set once a full screen has
+   been written */
+static libspectrum_dword movie_last_screen[ 40 * 240 ];
+static int movie_delta_valid = 0;
 #ifdef HAVE_ZLIB_H
 #define ZBUF_SIZE 8192
 static int fmf_compr = -1;
@@ -259,6 +282,81 @@ movie_compress_area( int x, int y, int w, int h, int s )
   }
 }
 
+static libspectrum_dword
+movie_cell_mask( void )
+{
+  return fmf_screen == 'R' ? 0xffffff : 0xffff;
+}
+
+/* Remember what the player will have in the area after a '$' chunk */
+static void
+movie_store_area( int x, int y, int w, int h )
+{
+  libspectrum_dword mask = movie_cell_mask();
+  int w0, h0, index;
+
+  for( h0 = y; h0 < y + h; h0++ ) {
+    index = x + 40 * h0;
+    for( w0 = w; w0 > 0; w0--, index++ )
+      movie_last_screen[ index ] = display_last_screen[ index ] & mask;
+  }
+}
+
+static int
+movie_area_changed( int x, int y, int w, int h )
+{
+  libspectrum_dword mask = movie_cell_mask();
+  int w0, h0, index;
+
+  for( h0 = y; h0 < y + h; h0++ ) {
+    index = x + 40 * h0;
+    for( w0 = w; w0 > 0; w0--, index++ )
+      if( ( display_last_screen[ index ] & mask ) !=
+          movie_last_screen[ index ] )
+        return 1;
+  }
+
+  return 0;
+}
+
+static void
+movie_delta_area( int x, int y, int w, int h )
+{
+  libspectrum_dword d, mask;
+  libspectrum_byte *b, *run;
+  libspectrum_byte buff[ 256 ];	/* worst case 20 runs of 1 cell per line */
+  int w0, h0, index, skip;
+
+  mask = movie_cell_mask();
+
+  for( h0 = y; h0 < y + h; h0++ ) {
+    index = x + 40 * h0;
+    b = buff; run = NULL; skip = 0;
+    for( w0 = w; w0 > 0; w0--, index++ ) {
+      d = display_last_screen[ index ] & mask;
+      if( d == movie_last_screen[ index ] ) {
+        run = NULL;			/* close the run, if any */
+        skip++;
+        continue;
+      }
+      movie_last_screen[ index ] = d;
+      if( run == NULL ) {		/* open a new run */
+        *b++ = skip;
+        run = b++;
+        *run = 0;
+        skip = 0;
+      }
+      (*run)++;
+      *b++ = d & 0xff;			/* bitmap1 */
+      *b++ = ( d >> 8 ) & 0xff;		/* attrib/b2 */
+      if( fmf_screen == 'R' )
+        *b++ = ( d >> 16 ) & 0xff;	/* HiRes attrib */
+    }
+    *b++ = 0; *b++ = 0;			/* end of line */
+    fwrite_compr( buff, b - buff, 1, of );
+  }
+}
+
 /* Fetch pixel (x, y). On a Timex this will be a point on a 640x480 canvas,
    on a Sinclair/Amstrad/Russian clone this will be a point on a 320x240
    canvas */
@@ -274,7 +372,14 @@ movie_add_area( int x, int y, int w, int h )
     movie_start_frame();
     return;
   }
-  head[0] = '$';			/* RLE compressed data... */
+
+  if( settings_current.movie_delta && movie_delta_valid ) {
+    /* Only the cells which differ from the previous frame */
+    if( !movie_area_changed( x, y, w, h ) ) return;
+    head[0] = 'D';
+  } else {
+    head[0] = '$';			/* RLE compressed data... */
+  }
   head[1] = x;
   head[2] = y & 0xff;
   head[3] = y >> 8;
@@ -282,10 +387,16 @@ movie_add_area( int x, int y, int w, int h )
   head[5] = h & 0xff;
   head[6] = h >> 8;
   fwrite_compr( head, 7, 1, of );
-  movie_compress_area( x, y, w, h, 0 );	/* Bitmap1 */
-  movie_compress_area( x, y, w, h, 8 );	/* Attrib/B2 */
-  if( fmf_screen == 'R' ) {
-    movie_compress_area( x, y, w, h, 16 );	/* HiRes attrib */
+  if( head[0] == 'D' ) {
+    movie_delta_area( x, y, w, h );
+  } else {
+    movie_compress_area( x, y, w, h, 0 );	/* Bitmap1 */
+    movie_compress_area( x, y, w, h, 8 );	/* Attrib/B2 */
+    if( fmf_screen == 'R' ) {
+      movie_compress_area( x, y, w, h, 16 );	/* HiRes attrib */
+    }
+    movie_store_area( x, y, w, h );
+    if( x == 0 && y == 0 && w == 40 && h == 240 ) movie_delta_valid = 1;
   }
   slice_no++;
 }
@@ -333,6 +444,8 @@ movie_start_fmf( const char *name )
   head[6] = stereo;
   head[7] = '\n';	/* padding */
   fwrite( head, 8, 1, of );		/* write initial params */
+  fmf_screen = head[1];
+  movie_delta_valid = 0;
   movie_add_area( 0, 0, 40, 240 );
 }
 
@@ -474,6 +587,13 @@ movie_start_frame( void )
   head[3] = get_timing();
   fwrite_compr( head, 4, 1, of );	/* New frame! */
   frame_no++;
+  if( fmf_screen != head[2] ) {
+    /* Cells are laid out differently, so start again from a full screen */
+    fmf_screen = head[2];
+    movie_delta_valid = 0;
+    if( settings_current.movie_delta && !movie_paused )
+      movie_add_area( 0, 0, 40, 240 );
+  }
   if( movie_paused ) {
     movie_paused = 0;
     movie_add_area( 0, 0, 40, 240 );
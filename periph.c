@@ -24,6 +24,8 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "libspectrum.h"
 
 #include "debugger/debugger.h"
@@ -64,6 +66,86 @@ typedef struct periph_port_private_t {
 /* The list of currently active ports */
 static GSList *ports = NULL;
 
+/* The responses which matched the last port read from or written to. A
+   block transfer such as INIR from a memory card hits the same port over
+   and over, so this saves walking the whole list for every byte */
+#define PORT_CACHE_SIZE 8
+
+typedef struct port_cache_t {
+  int valid;
+  libspectrum_word port;
+  size_t count;
+  periph_port_private_t *matches[ PORT_CACHE_SIZE ];
+} port_cache_t;
+
+static port_cache_t read_cache, write_cache;
+
+/* Bumped whenever the list of active ports changes */
+static unsigned int port_cache_generation;
+
+static void
+port_cache_invalidate( void )
+{
+  read_cache.valid = write_cache.valid = 0;
+  read_cache.count = write_cache.count = 0;
+  port_cache_generation++;
+}
+
+/* Call `function' for each response to `port'. Uses `cache' if it holds
+   the responses for this port, or otherwise walks the list once, filling
+   in the cache as it goes unless there are too many responses */
+static void
+port_dispatch( port_cache_t *cache, libspectrum_word port, int read,
+	       GFunc function, gpointer user_data )
+{
+  periph_port_private_t *matches[ PORT_CACHE_SIZE ];
+  unsigned int generation = port_cache_generation;
+  size_t i, count;
+  GSList *ptr, *next;
+  int cacheable = 1;
+
+  if( cache->valid && cache->port == port ) {
+    /* A handler may change the active ports and so empty the cache; the
+       rest of the responses are still called, as they would have been
+       from the list */
+    count = cache->count;
+    memcpy( matches, cache->matches, count * sizeof( matches[0] ) );
+    for( i = 0; i < count; i++ )
+      function( matches[i], user_data );
+    return;
+  }
+
+  cache->valid = 0;
+  cache->port = port;
+  cache->count = 0;
+
+  for( ptr = ports; ptr; ptr = next ) {
+    periph_port_private_t *private = ptr->data;
+    periph_port_t *response = &( private->port );
+
+    next = ptr->next;
+
+    if( ( read ? !response->read : !response->write ) ||
+        ( port & response->mask ) != response->value )
+      continue;
+
+    if( cache->count < PORT_CACHE_SIZE ) {
+      cache->matches[ cache->count++ ] = private;
+    } else {
+      cacheable = 0;	/* too many responses to this port */
+    }
+
+    function( private, user_data );
+  }
+
+  /* Don't keep a list made while the active ports were changing */
+  if( cacheable && generation == port_cache_generation ) {
+    cache->valid = 1;
+  } else {
+    cache->count = 0;
+  }
+}
+
 /* The strings used for debugger events */
 static const char * const page_event_string = "page",
   * const unpage_event_string = "unpage";
@@ -80,6 +162,7 @@ port_register( periph_type type, const periph_port_t *port )
   private->port = *port;
 
   ports = g_slist_append( ports, private );
+  port_cache_invalidate();
 }
 
 /* Register a peripheral with the system */
@@ -136,6 +219,7 @@ periph_activate_type( periph_type type, int active )
     GSList *found;
     while( ( found = g_slist_find_custom( ports, GINT_TO_POINTER( type ), find_by_type ) ) != NULL )
       ports = g_slist_remove( ports, found->data );
+    port_cache_invalidate();
   }
 
   return 1;
@@ -238,6 +322,7 @@ periph_clear( void )
   g_slist_foreach( ports, free_peripheral, NULL );
   g_slist_free( ports );
   ports = NULL;
+  port_cache_invalidate();
   set_types_inactive();
 }
 
@@ -248,6 +333,7 @@ periph_end( void )
   g_slist_foreach( ports, free_peripheral, NULL );
   g_slist_free( ports );
   ports = NULL;
+  port_cache_invalidate();
 
   g_hash_table_destroy( peripherals );
   peripherals = NULL;
@@ -341,7 +427,7 @@ readport_internal( libspectrum_word port )
   callback_info.attached = 0x00;
   callback_info.value = 0xff;
 
-  g_slist_foreach( ports, read_peripheral, &callback_info );
+  port_dispatch( &read_cache, port, 1, read_peripheral, &callback_info );
 
   if( callback_info.attached != 0xff )
     callback_info.value =
@@ -399,7 +485,7 @@ writeport_internal( libspectrum_word port, libspectrum_byte b )
   callback_info.port = port;
   callback_info.value = b;
   
-  g_slist_foreach( ports, write_peripheral, &callback_info );
+  port_dispatch( &write_cache, port, 0, write_peripheral, &callback_info );
 }
 
 /*
@@ -31,6 +31,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif			/* #ifdef HAVE_PTHREAD */
+
 #include "libspectrum.h"
 
 #include "bitmap.h"
@@ -104,6 +108,29 @@ typedef struct buffer_t {		/* to store buffer data */
   size_t index;
 } buffer_t;
 
+/* Disks opened from plain sector images don't have their raw tracks built
+   until something needs them, and tracks which haven't been written to can
+   be thrown away again and rebuilt later */
+#define DISK_LAZY_TRACKS 16
+
+/* flags in disk_lazy_t.changed */
+#define LAZY_TRACK_KEEP  0x01	/* differs from the image, must stay built */
+#define LAZY_TRACK_DIRTY 0x02	/* written to since last written back */
+
+typedef struct disk_lazy_t {
+  utils_file image;		/* the sector image the tracks come from */
+  libspectrum_byte **tracks;	/* each track, or NULL if not built yet */
+  libspectrum_byte *changed;	/* LAZY_TRACK_* flags for each track */
+  disk_type_t type;		/* the format of the image */
+  int built;			/* how many tracks are in memory */
+  int current;			/* the track last asked for */
+  int first;			/* tracks before this are not in the image */
+  size_t offset;		/* where track 'first' starts in the image */
+  size_t track_length;		/* image bytes per track */
+  int head_major;		/* all of side 0 before side 1? */
+  int sector_base, sectors, seclen, preindex, gap, interleave, autofill;
+} disk_lazy_t;
+
 void disk_update_tlens( disk_t *d );
 
 const char *
@@ -318,27 +345,35 @@ guess_track_geom( disk_t *d, int head, int track, int *sector_base,
 }
 
 static void
-update_tracks_mode( disk_t *d )
+update_track_mode( disk_t *d )
 {
-  int i, j, bpt;
+  int j, bpt;
   int mfm, fm, weak;
 
+  mfm = 0, fm = 0, weak = 0;
+  bpt = d->track[-3] + 256 * d->track[-2];
+  for( j = DISK_CLEN( bpt ) - 1; j >= 0; j-- ) {
+    mfm  |= ~d->fm[j];
+    fm   |= d->fm[j];
+    weak |= d->weak[j];
+  }
+  if( mfm && !fm ) d->track[-1] = 0x00;
+  if( !mfm && fm ) d->track[-1] = 0x01;
+  if( mfm &&  fm ) d->track[-1] = 0x02;
+  if( weak ) {
+    d->track[-1] |= 0x80;
+    d->have_weak = 1;
+  }
+}
+
+static void
+update_tracks_mode( disk_t *d )
+{
+  int i;
+
   for( i = 0; i < d->cylinders * d->sides; i++ ) {
     DISK_SET_TRACK_IDX( d, i );
-    mfm = 0, fm = 0, weak = 0;
-    bpt = d->track[-3] + 256 * d->track[-2];
-    for( j = DISK_CLEN( bpt ) - 1; j >= 0; j-- ) {
-      mfm  |= ~d->fm[j];
-      fm   |= d->fm[j];
-      weak |= d->weak[j];
-    }
-    if( mfm && !fm ) d->track[-1] = 0x00;
-    if( !mfm && fm ) d->track[-1] = 0x01;
-    if( mfm &&  fm ) d->track[-1] = 0x02;
-    if( weak ) {
-      d->track[-1] |= 0x80;
-      d->have_weak = 1;
-    }
+    update_track_mode( d );
   }
 }
 
@@ -689,6 +724,126 @@ trackgen( disk_t *d, buffer_t *buffer, int head, int track,
   return gap4_add( d, gap );
 }
 
+/* build a track of a lazily opened disk from its sector image */
+static int
+lazy_build_track( disk_t *d, int idx )
+{
+  disk_lazy_t *lazy = d->lazy;
+  disk_position_context_t context;
+  buffer_t buffer;
+  int head = idx % d->sides, track = idx / d->sides, n, error = 0;
+
+  position_context_save( d, &context );
+
+  lazy->tracks[ idx ] = libspectrum_new0( libspectrum_byte, d->tlen );
+  lazy->built++;
+
+  if( idx >= lazy->first ) {
+    n = lazy->head_major ? head * d->cylinders + track : idx;
+    buffer.file = lazy->image;
+    buffer.index = lazy->offset + ( n - lazy->first ) * lazy->track_length;
+    if( buffer.index > buffer.file.length )
+      buffer.index = buffer.file.length;
+
+    error = trackgen( d, &buffer, head, track, lazy->sector_base,
+		      lazy->sectors, lazy->seclen, lazy->preindex, lazy->gap,
+		      lazy->interleave, lazy->autofill );
+  }
+
+  DISK_SET_TRACK_IDX( d, idx );
+  if( d->track[-3] + 256 * d->track[-2] == 0 ) {
+    d->track[-3] = d->bpt & 0xff;
+    d->track[-2] = ( d->bpt >> 8 ) & 0xff;
+  }
+  update_track_mode( d );
+
+  position_context_restore( d, &context );
+  return error;
+}
+
+libspectrum_byte *
+disk_track_data( disk_t *d, int idx )
+{
+  if( d->lazy == NULL )
+    return d->data + idx * d->tlen;
+
+  d->lazy->current = idx;
+  /* the geometry was checked when the disk was opened */
+  if( d->lazy->tracks[ idx ] == NULL )
+    lazy_build_track( d, idx );
+
+  return d->lazy->tracks[ idx ];
+}
+
+void
+disk_track_changed( disk_t *d )
+{
+  disk_lazy_t *lazy = d->lazy;
+  int i;
+
+  if( lazy == NULL )
+    return;
+
+  /* someone may have looked at another track since d->track was set */
+  if( lazy->tracks[ lazy->current ] != d->track - 3 ) {
+    for( i = 0; i < d->sides * d->cylinders; i++ )
+      if( lazy->tracks[i] == d->track - 3 ) {
+        lazy->current = i;
+        break;
+      }
+  }
+  lazy->changed[ lazy->current ] = LAZY_TRACK_KEEP | LAZY_TRACK_DIRTY;
+}
+
+/* keep every track built so far, e.g. after changing them while opening */
+static void
+lazy_keep_tracks( disk_t *d )
+{
+  int i;
+
+  if( d->lazy == NULL )
+    return;
+
+  for( i = 0; i < d->sides * d->cylinders; i++ )
+    if( d->lazy->tracks[i] != NULL )
+      d->lazy->changed[i] |= LAZY_TRACK_KEEP;
+}
+
+void
+disk_release_tracks( disk_t *d )
+{
+  disk_lazy_t *lazy = d->lazy;
+  int i;
+
+  if( lazy == NULL || lazy->built <= DISK_LAZY_TRACKS )
+    return;
+
+  for( i = 0; i < d->sides * d->cylinders; i++ ) {
+    if( lazy->tracks[i] == NULL || lazy->changed[i] || i == lazy->current )
+      continue;
+    libspectrum_free( lazy->tracks[i] );
+    lazy->tracks[i] = NULL;
+    lazy->built--;
+  }
+}
+
+static void
+lazy_free( disk_t *d )
+{
+  int i;
+
+  if( d->lazy == NULL )
+    return;
+
+  for( i = 0; i < d->sides * d->cylinders; i++ )
+    libspectrum_free( d->lazy->tracks[i] );
+  libspectrum_free( d->lazy->tracks );
+  libspectrum_free( d->lazy->changed );
+  utils_close_file( &d->lazy->image );
+  libspectrum_free( d->lazy );
+  d->lazy = NULL;
+}
+
 /* close and destroy a disk structure and data */
 void
 disk_close( disk_t *d )
@@ -697,6 +852,7 @@ disk_close( disk_t *d )
     libspectrum_free( d->data );
     d->data = NULL;
   }
+  lazy_free( d );
   if( d->filename != NULL ) {
     libspectrum_free( d->filename );
     d->filename = NULL;
@@ -746,6 +902,62 @@ disk_alloc( disk_t *d )
   if( dlen == 0 ) return d->status = DISK_GEOM;
 
   d->data = libspectrum_new0( libspectrum_byte, dlen );
+  d->lazy = NULL;
+
+  return d->status = DISK_OK;
+}
+
+/* set up a disk whose tracks are built from the sector image in 'buffer'
+   when they are needed. The image must have 'sectors' sectors of 'seclen'
+   bytes for each track from 'first' on, starting at 'offset'; if
+   'head_major', all of side 0 comes before side 1. Takes over the buffer
+   once the disk is open */
+static int
+disk_alloc_lazy( disk_t *d, buffer_t *buffer, int first, size_t offset,
+		 int head_major, int sector_base, int sectors, int seclen,
+		 int preindex, int gap, int interleave, int autofill )
+{
+  disk_lazy_t *lazy;
+  int tracks;
+
+  if( disk_alloc( d ) != DISK_OK )
+    return d->status;
+
+  /* we only needed the geometry */
+  libspectrum_free( d->data );
+  d->data = NULL;
+
+  tracks = d->sides * d->cylinders;
+  lazy = libspectrum_new0( disk_lazy_t, 1 );
+  lazy->image = buffer->file;
+  lazy->tracks = libspectrum_new0( libspectrum_byte *, tracks );
+  lazy->changed = libspectrum_new0( libspectrum_byte, tracks );
+  lazy->type = d->type;
+  lazy->first = first;
+  lazy->offset = offset;
+  lazy->track_length = sectors * seclen;
+  lazy->head_major = head_major;
+  lazy->sector_base = sector_base;
+  lazy->sectors = sectors;
+  lazy->seclen = seclen;
+  lazy->preindex = preindex;
+  lazy->gap = gap;
+  lazy->interleave = interleave;
+  lazy->autofill = autofill;
+  d->lazy = lazy;
+
+  /* without autofill, the image must have all the data... */
+  if( autofill < 0 &&
+      buffer->file.length < offset + ( tracks - first ) * lazy->track_length )
+    return d->status = DISK_GEOM;
+
+  /* ...and every track is laid out the same way, so if one fits on the
+     disk, they all do */
+  if( first < tracks ) {
+    if( lazy_build_track( d, first ) )
+      return d->status = DISK_GEOM;
+    lazy->current = first;
+  }
 
   return d->status = DISK_OK;
 }
@@ -946,39 +1158,191 @@ udi_unpack_tracks( disk_t *d )
 					( type & 0x02 ? 1 : 0 ) + \
 					( type & 0x80 ? 1 : 0 ) ) )
 
+#ifdef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION
+
+/* Tracks are (de)compressed independently of each other, so the work is
+   shared out among up to UDI_ZLIB_THREADS threads, each taking every n'th
+   track. Each track is changed in place, so the image is still written in
+   track order */
+#define UDI_ZLIB_THREADS 8
+
+typedef struct udi_zlib_job_t {
+  libspectrum_byte **tracks;	/* each track, as d->track would point */
+  int count;			/* how many tracks */
+  int first, step;		/* which of them this job does */
+  int compress;			/* compress or uncompress? */
+  int error;			/* the track which failed, or -1 */
+} udi_zlib_job_t;
+
 static int
-udi_uncompress_tracks( disk_t *d )
+udi_uncompress_track( libspectrum_byte *track, libspectrum_byte **data,
+		      size_t *data_size )
 {
-  int i;
+  int bpt, tlen, clen, ttyp;
+
+  if( track[-1] != 0xf0 ) return 0;		/* if not compressed */
+
+  clen = track[-3] + 256 * track[-2] + 1;
+  ttyp = track[0];				/* compressed track type   */
+  bpt = track[1] + 256 * track[2];		/* compressed track len... */
+  tlen = UDI_TLEN( ttyp, bpt );
+  track[-1] = ttyp;
+  track[-3] = track[1];
+  track[-2] = track[2];
+  if( udi_read_compressed( track + 3, clen, tlen, data, data_size ) )
+    return 1;
+  memcpy( track, *data, tlen );			/* read track */
+  return 0;
+}
+
+static void
+udi_compress_track( libspectrum_byte *track, libspectrum_byte **data,
+		    size_t *data_size )
+{
+  int tlen;
+  size_t clen;
+
+  if( track[-1] == 0xf0 ) return;		/* already compressed??? */
+
+  tlen = UDI_TLEN( track[-1], track[-3] + 256 * track[-2] );
+	/* if fail to compress, skip ... */
+  if( udi_write_compressed( track, tlen, &clen, data, data_size ) ||
+							clen < 1 ) return;
+	/* if compression too large, skip... */
+  if( clen > 65535 || clen >= tlen ) return;
+  track[0] = track[-1];				/* track type... */
+  track[1] = track[-3];				/* compressed track len... */
+  track[2] = track[-2];				/* compressed track len... */
+  memcpy( track + 3, *data, clen );		/* read track */
+  clen--;
+  track[-1] = 0xf0;
+  track[-3] = clen & 0xff;
+  track[-2] = ( clen >> 8 ) & 0xff;
+}
+
+static void *
+udi_zlib_job( void *user_data )
+{
+  udi_zlib_job_t *job = user_data;
   libspectrum_byte *data = NULL;
-#ifdef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION
   size_t data_size = 0;
-  int bpt, tlen, clen, ttyp;
+  int i;
+
+  for( i = job->first; i < job->count && job->error == -1; i += job->step ) {
+    if( job->compress )
+      udi_compress_track( job->tracks[i], &data, &data_size );
+    else if( udi_uncompress_track( job->tracks[i], &data, &data_size ) )
+      job->error = i;
+  }
+
+  if( data ) libspectrum_free( data );
+  return NULL;
+}
+
+/* libspectrum's errors would end up in the UI from the worker threads, so
+   they're ignored while the workers are running and the failing track is
+   reported afterwards instead */
+static libspectrum_error
+udi_zlib_quiet_error( libspectrum_error error GCC_UNUSED,
+		      const char *format GCC_UNUSED, va_list ap GCC_UNUSED )
+{
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static int
+udi_zlib_threads( int count )
+{
+  int n = 1;
+
+#if defined HAVE_PTHREAD && defined _SC_NPROCESSORS_ONLN
+  n = sysconf( _SC_NPROCESSORS_ONLN );
+  if( n > UDI_ZLIB_THREADS ) n = UDI_ZLIB_THREADS;
+  if( n > count ) n = count;
+  if( n < 1 ) n = 1;
+#endif			/* #if defined HAVE_PTHREAD && ... */
+
+  return n;
+}
+
+static int
+udi_zlib_tracks( disk_t *d, int compress )
+{
+  udi_zlib_job_t jobs[ UDI_ZLIB_THREADS ];
+#ifdef HAVE_PTHREAD
+  pthread_t threads[ UDI_ZLIB_THREADS ];
+  int started[ UDI_ZLIB_THREADS ];
+#endif			/* #ifdef HAVE_PTHREAD */
+  libspectrum_error_function_t error_function = libspectrum_error_function;
+  libspectrum_byte **tracks;
+  int i, n, count = d->sides * d->cylinders, error = -1;
+
+  /* find (or build) all the tracks first; only this thread may do that */
+  tracks = libspectrum_new( libspectrum_byte *, count );
+  for( i = 0; i < count; i++ )
+    tracks[i] = disk_track_data( d, i ) + 3;
+
+  n = udi_zlib_threads( count );
+  for( i = 0; i < n; i++ ) {
+    jobs[i].tracks = tracks;
+    jobs[i].count = count;
+    jobs[i].first = i;
+    jobs[i].step = n;
+    jobs[i].compress = compress;
+    jobs[i].error = -1;
+  }
+
+#ifdef HAVE_PTHREAD
+  if( n > 1 ) libspectrum_error_function = udi_zlib_quiet_error;
+
+  for( i = 1; i < n; i++ )
+    started[i] = !pthread_create( &threads[i], NULL, udi_zlib_job, &jobs[i] );
+#endif			/* #ifdef HAVE_PTHREAD */
+
+  udi_zlib_job( &jobs[0] );
+
+  for( i = 1; i < n; i++ ) {
+#ifdef HAVE_PTHREAD
+    if( started[i] ) {
+      pthread_join( threads[i], NULL );
+      continue;
+    }
+#endif			/* #ifdef HAVE_PTHREAD */
+    udi_zlib_job( &jobs[i] );	/* couldn't start a thread, do it here */
+  }
+
+  libspectrum_error_function = error_function;
+
+  for( i = 0; i < n; i++ )
+    if( jobs[i].error != -1 && ( error == -1 || jobs[i].error < error ) )
+      error = jobs[i].error;
+
+  libspectrum_free( tracks );
+
+  if( error != -1 ) {
+    ui_error( UI_ERROR_ERROR, "couldn't uncompress UDI track %d", error );
+    return 1;
+  }
+
+  return 0;
+}
+
 #endif			/* #ifdef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION */
 
+static int
+udi_uncompress_tracks( disk_t *d )
+{
+#ifndef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION
+  int i;
+
   for( i = 0; i < d->sides * d->cylinders; i++ ) {
     DISK_SET_TRACK_IDX( d, i );
-    if( d->track[-1] != 0xf0 ) continue;	/* if not compressed */
-
-#ifndef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION
     /* if libspectrum cannot support */
-    return d->status = DISK_UNSUP;
+    if( d->track[-1] == 0xf0 ) return d->status = DISK_UNSUP;
+  }
 #else 			/* #ifndef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION */
-    clen = d->track[-3] + 256 * d->track[-2] + 1;
-    ttyp = d->track[0];				/* compressed track type   */
-    bpt = d->track[1] + 256 * d->track[2];	/* compressed track len... */
-    tlen = UDI_TLEN( ttyp, bpt );
-    d->track[-1] = ttyp;
-    d->track[-3] = d->track[1];
-    d->track[-2] = d->track[2];
-    if( udi_read_compressed( d->track + 3, clen, tlen, &data, &data_size ) ) {
-      if( data ) libspectrum_free( data );
-      return d->status = DISK_UNSUP;
-    }
-    memcpy( d->track, data, tlen );		/* read track */
+  if( udi_zlib_tracks( d, 0 ) )
+    return d->status = DISK_UNSUP;
 #endif			/* #ifndef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION */
-  }
-  if( data ) libspectrum_free( data );
   return DISK_OK;
 }
 
@@ -986,30 +1350,7 @@ udi_uncompress_tracks( disk_t *d )
 static int
 udi_compress_tracks( disk_t *d )
 {
-  int i, tlen;
-  libspectrum_byte *data = NULL;
-  size_t clen, data_size = 0;
-
-  for( i = 0; i < d->sides * d->cylinders; i++ ) {
-    DISK_SET_TRACK_IDX( d, i );
-    if( d->track[-1] == 0xf0 ) continue;	/* already compressed??? */
-
-    tlen = UDI_TLEN( d->track[-1], d->track[-3] + 256 * d->track[-2] );
-	/* if fail to compress, skip ... */
-    if( udi_write_compressed( d->track, tlen, &clen, &data, &data_size ) ||
-							clen < 1 ) continue;
-	/* if compression too large, skip... */
-    if( clen > 65535 || clen >= tlen ) continue;
-    d->track[0] = d->track[-1];			/* track type... */
-    d->track[1] = d->track[-3];			/* compressed track len... */
-    d->track[2] = d->track[-2];			/* compressed track len... */
-    memcpy( d->track + 3, data, clen );		/* read track */
-    clen--;
-    d->track[-1] = 0xf0;
-    d->track[-3] = clen & 0xff;
-    d->track[-2] = ( clen >> 8 ) & 0xff;
-  }
-  if( data ) libspectrum_free( data );
+  udi_zlib_tracks( d, 1 );
   return DISK_OK;
 }
 #endif			/* #ifdef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION */
@@ -1124,7 +1465,7 @@ open_udi( buffer_t *buffer, disk_t *d )
 static int
 open_img_mgt_opd( buffer_t *buffer, disk_t *d )
 {
-  int i, j, sectors, seclen;
+  int sectors, seclen;
 
   buffer->index = 0;
 
@@ -1154,35 +1495,23 @@ open_img_mgt_opd( buffer_t *buffer, disk_t *d )
 
   /* create a DD disk */
   d->density = DISK_DD;
-  if( disk_alloc( d ) != DISK_OK )
-    return d->status;
 
-  if( d->type == DISK_IMG ) {	/* IMG out-out */
-    for( j = 0; j < d->sides; j++ ) {
-      for( i = 0; i < d->cylinders; i++ ) {
-	if( trackgen( d, buffer, j, i, 1, sectors, seclen,
-		      NO_PREINDEX, GAP_MGT_PLUSD, NO_INTERLEAVE, NO_AUTOFILL ) )
-	  return d->status = DISK_GEOM;
-      }
-    }
-  } else {			/* MGT / OPD alt */
-    for( i = 0; i < d->cylinders; i++ ) {
-      for( j = 0; j < d->sides; j++ ) {
-        if( trackgen( d, buffer, j, i, d->type == DISK_MGT ? 1 : 0, sectors, seclen,
-		      NO_PREINDEX, GAP_MGT_PLUSD,
-		      d->type == DISK_MGT ? NO_INTERLEAVE : INTERLEAVE_OPUS, NO_AUTOFILL ) )
-	  return d->status = DISK_GEOM;
-      }
-    }
-  }
+  if( d->type == DISK_IMG )	/* IMG out-out */
+    return disk_alloc_lazy( d, buffer, 0, 0, 1, 1, sectors, seclen,
+			    NO_PREINDEX, GAP_MGT_PLUSD, NO_INTERLEAVE,
+			    NO_AUTOFILL );
 
-  return d->status = DISK_OK;
+  /* MGT / OPD alt */
+  return disk_alloc_lazy( d, buffer, 0, 0, 0, d->type == DISK_MGT ? 1 : 0,
+			  sectors, seclen, NO_PREINDEX, GAP_MGT_PLUSD,
+			  d->type == DISK_MGT ? NO_INTERLEAVE : INTERLEAVE_OPUS,
+			  NO_AUTOFILL );
 }
 
 static int
 open_d40_d80( buffer_t *buffer, disk_t *d )
 {
-  int i, j, sectors, seclen;
+  int sectors, seclen;
 
   if( buffavail( buffer ) < 180 )
     return d->status = DISK_OPEN;
@@ -1197,50 +1526,28 @@ open_d40_d80( buffer_t *buffer, disk_t *d )
 
   seclen = 512;
 
-  buffer->index = 0;
-
   /* create a DD disk */
   d->density = DISK_DD;
-  if( disk_alloc( d ) != DISK_OK )
-    return d->status;
-
-  for( i = 0; i < d->cylinders; i++ ) {
-      for( j = 0; j < d->sides; j++ ) {
-        if( trackgen( d, buffer, j, i, 1, sectors, seclen,
-		      NO_PREINDEX, GAP_MGT_PLUSD, NO_INTERLEAVE, NO_AUTOFILL ) )
-	  return d->status = DISK_GEOM;
-      }
-  }
-
-  return d->status = DISK_OK;
+  return disk_alloc_lazy( d, buffer, 0, 0, 0, 1, sectors, seclen,
+			  NO_PREINDEX, GAP_MGT_PLUSD, NO_INTERLEAVE,
+			  NO_AUTOFILL );
 }
 
 static int
 open_sad( buffer_t *buffer, disk_t *d, int preindex )
 {
-  int i, j, sectors, seclen;
+  int sectors, seclen;
 
   d->sides = buff[18];
   d->cylinders = buff[19];
   GEOM_CHECK;
   sectors = buff[20];
   seclen = buff[21] * 64;
-  buffer->index = 22;
 
   /* create a DD disk */
   d->density = DISK_DD;
-  if( disk_alloc( d ) != DISK_OK )
-    return d->status;
-
-  for( j = 0; j < d->sides; j++ ) {
-    for( i = 0; i < d->cylinders; i++ ) {
-      if( trackgen( d, buffer, j, i, 1, sectors, seclen, preindex, 
-		    GAP_MGT_PLUSD, NO_INTERLEAVE, NO_AUTOFILL ) )
-	return d->status = DISK_GEOM;
-    }
-  }
-
-  return d->status = DISK_OK;
+  return disk_alloc_lazy( d, buffer, 0, 22, 1, 1, sectors, seclen, preindex,
+			  GAP_MGT_PLUSD, NO_INTERLEAVE, NO_AUTOFILL );
 }
 
 /* 1 RANDOMIZE USR 15619: REM : RUN "        " */
@@ -1411,7 +1718,7 @@ trdos_insert_boot_loader( disk_t *d )
 static int
 open_trd( buffer_t *buffer, disk_t *d )
 {
-  int i, j, sectors, seclen;
+  int i, sectors, seclen;
   disk_position_context_t context;
 
   if( buffseek( buffer, 8*256, SEEK_CUR ) == -1 )
@@ -1436,22 +1743,15 @@ open_trd( buffer_t *buffer, disk_t *d )
 
   /* create a DD disk */
   d->density = DISK_DD;
-  if( disk_alloc( d ) != DISK_OK )
+  if( disk_alloc_lazy( d, buffer, 0, 0, 0, 1, sectors, seclen, NO_PREINDEX,
+		       GAP_TRDOS, INTERLEAVE_2, 0x00 ) != DISK_OK )
     return d->status;
-
-  buffer->index = 0;
-  for( i = 0; i < d->cylinders; i++ ) {
-    for( j = 0; j < d->sides; j++ ) {
-      if( trackgen( d, buffer, j, i, 1, sectors, seclen,
-                    NO_PREINDEX, GAP_TRDOS, INTERLEAVE_2, 0x00 ) )
-        return d->status = DISK_GEOM;
-    }
-  }
   
   if( settings_current.auto_load ) {
     position_context_save( d, &context );
     trdos_insert_boot_loader( d );
     position_context_restore( d, &context );
+    lazy_keep_tracks( d );
   }
 
   return d->status = DISK_OK;
@@ -1779,8 +2079,6 @@ open_scl( buffer_t *buffer, disk_t *d )
   d->sides = 2;
   d->cylinders = 80;
   d->density = DISK_DD;
-  if( disk_alloc( d ) != DISK_OK )
-    return d->status;
 
 /*
  TR-DOS:
@@ -1795,6 +2093,11 @@ open_scl( buffer_t *buffer, disk_t *d )
 
   if( ( scl_files = buff[8] ) > 128 || scl_files < 1 ) 	/* number of files */
     return d->status = DISK_GEOM;	/* too many file */
+
+  /* the data follows the entries, from track 1 on */
+  if( disk_alloc_lazy( d, buffer, 1, 9 + 14 * scl_files, 0, 1, 16, 256,
+		       NO_PREINDEX, GAP_TRDOS, INTERLEAVE_2, 0x00 ) != DISK_OK )
+    return d->status;
   buffer->index = 9;		/* read SCL entries */
 
   DISK_SET_TRACK_IDX( d, 0 );
@@ -1817,7 +2120,7 @@ open_scl( buffer_t *buffer, disk_t *d )
     head[ j + 15 ] = sectors / 16 + 1; /* ( sectors + 16 ) / 16 := sectors / 16 + 1
     							 starting track */
     sectors += head[ j + 13 ];
-    if( d->data[j] == 0x01 )		/* deleted file */
+    if( head[j] == 0x01 )		/* deleted file */
       scl_deleted++;
     if( sectors > 16 * 159 ) 	/* too many sectors needed */
       return d->status = DISK_MEM;	/* or DISK_GEOM??? */
@@ -1861,19 +2164,15 @@ open_scl( buffer_t *buffer, disk_t *d )
       memset( head, 0, 256 );		/* clear sector data... */
   }
   gap4_add( d, GAP_TRDOS );
+  update_track_mode( d );
 
-  /* now we continue with the data */
-  for( i = 1; i < d->sides * d->cylinders; i++ ) {
-    if( trackgen( d, buffer, i % 2, i / 2, 1, 16, 256,
-                  NO_PREINDEX, GAP_TRDOS, INTERLEAVE_2, 0x00 ) )
-      return d->status = DISK_OPEN;
-  }
-
+  /* the data tracks are built from the image when they are needed */
   if( settings_current.auto_load ) {
     position_context_save( d, &context );
     trdos_insert_boot_loader( d );
     position_context_restore( d, &context );
   }
+  lazy_keep_tracks( d );
 
   return d->status = DISK_OK;
 }
@@ -2102,6 +2401,7 @@ disk_open2( disk_t *d, const char *filename, int preindex )
     d->wrprot = 0;
 #endif			/* #ifdef GEKKO */
 
+  d->lazy = NULL;
   if( utils_read_file( filename, &buffer.file ) )
     return d->status = DISK_OPEN;
 
@@ -2161,13 +2461,20 @@ disk_open2( disk_t *d, const char *filename, int preindex )
   if( d->status != DISK_OK ) {
     if( d->data != NULL )
       libspectrum_free( d->data );
+    d->data = NULL;
+    if( d->lazy != NULL ) {
+      d->lazy->image.buffer = NULL;	/* still ours to close */
+      lazy_free( d );
+    }
     utils_close_file( &buffer.file );
     return d->status;
   }
-  utils_close_file( &buffer.file );
   d->dirty = 0;
-  disk_update_tlens( d );
-  update_tracks_mode( d );
+  if( d->lazy == NULL ) {	/* lazy tracks are set up as they are built */
+    utils_close_file( &buffer.file );
+    disk_update_tlens( d );
+    update_tracks_mode( d );
+  }
   d->filename = utils_safe_strdup( filename );
   return d->status = DISK_OK;
 }
@@ -2198,12 +2505,10 @@ disk_merge_sides( disk_t *d, disk_t *d1, disk_t *d2, int autofill )
     return d->status;
 
   clen = DISK_CLEN( d->bpt );
-  d->track = d->data;
-  d1->track = d1->data;
-  d2->track = d2->data;
   for( i = 0; i < d->cylinders; i++ ) {
+    d->track = disk_track_data( d, 2 * i );
     if( i < d1->cylinders )
-      memcpy( d->track, d1->track, d->tlen );
+      memcpy( d->track, disk_track_data( d1, i ), d->tlen );
     else {
       d->track[0] = d->bpt & 0xff;
       d->track[1] = ( d->bpt >> 8 ) & 0xff;
@@ -2211,10 +2516,9 @@ disk_merge_sides( disk_t *d, disk_t *d1, disk_t *d2, int autofill )
       memset( d->track + 3, autofill & 0xff, d->bpt );		/* fill data */
       memset( d->track + 3 + d->bpt, 0x00, 3 * clen );		/* no clock and other marks */
     }
-    d->track += d->tlen;
-    d1->track += d1->tlen;
+    d->track = disk_track_data( d, 2 * i + 1 );
     if( i < d2->cylinders )
-      memcpy( d->track, d2->track, d->tlen );
+      memcpy( d->track, disk_track_data( d2, i ), d->tlen );
     else {
       d->track[0] = d->bpt & 0xff;
       d->track[1] = ( d->bpt >> 8 ) & 0xff;
@@ -2222,8 +2526,6 @@ disk_merge_sides( disk_t *d, disk_t *d1, disk_t *d2, int autofill )
       memset( d->track + 1, autofill & 0xff, d->bpt );		/* fill data */
       memset( d->track + 1 + d->bpt, 0x00, 3 * clen );		/* no clock and other marks */
     }
-    d->track += d->tlen;
-    d2->track += d2->tlen;
   }
   disk_close( d1 );
   disk_close( d2 );
@@ -2943,3 +3245,95 @@ disk_write( disk_t *d, const char *filename )
 
   return d->status = DISK_OK;
 }
+
+/* copy the sectors of a track into 'dest', if the track is still laid out
+   the way the sector image expects */
+static int
+lazy_track_sectors( disk_t *d, int idx, libspectrum_byte *dest )
+{
+  disk_lazy_t *lazy = d->lazy;
+  int sbase, sectors, seclen, mfm, del, s;
+
+  if( guess_track_geom( d, idx % d->sides, idx / d->sides, &sbase, &sectors,
+			&seclen, &mfm ) &
+      ( DISK_ID_NOTMATCH | DISK_SECLEN_VARI | DISK_CORRUPT_SECTOR ) )
+    return 1;
+  if( sbase != lazy->sector_base || sectors != lazy->sectors ||
+      seclen != calc_lenid( lazy->seclen ) )
+    return 1;
+
+  for( s = 0; s < sectors; s++ ) {
+    if( !id_seek( d, sbase + s ) || !datamark_read( d, &del ) ||
+	d->i + lazy->seclen > d->bpt )
+      return 1;
+    memcpy( dest + s * lazy->seclen, &d->track[ d->i ], lazy->seclen );
+  }
+
+  return 0;
+}
+
+int
+disk_write_back( disk_t *d )
+{
+  disk_lazy_t *lazy = d->lazy;
+  disk_position_context_t context;
+  libspectrum_byte *data;
+  FILE *file;
+  size_t offset;
+  int i, n;
+
+  if( !d->dirty )
+    return d->status = DISK_OK;
+
+  /* only images which are just the sectors of each track in order can be
+     changed in place; SAD and SCL have headers which may need to change too */
+  if( lazy == NULL || d->filename == NULL || d->type != lazy->type ||
+      ( d->type != DISK_TRD && d->type != DISK_IMG && d->type != DISK_MGT &&
+	d->type != DISK_OPD && d->type != DISK_D40 && d->type != DISK_D80 ) )
+    return d->status = DISK_UNSUP;
+
+  if( ( file = fopen( d->filename, "r+b" ) ) == NULL )
+    return d->status = DISK_WRFILE;
+
+  data = libspectrum_new( libspectrum_byte, lazy->track_length );
+  position_context_save( d, &context );
+  d->status = DISK_OK;
+
+  for( i = 0; i < d->sides * d->cylinders; i++ ) {
+    if( !( lazy->changed[i] & LAZY_TRACK_DIRTY ) )
+      continue;
+
+    if( lazy_track_sectors( d, i, data ) ) {
+      d->status = DISK_GEOM;		/* needs a full save */
+      continue;
+    }
+
+    n = lazy->head_major ? ( i % d->sides ) * d->cylinders + i / d->sides :
+			   i;
+    offset = lazy->offset + n * lazy->track_length;
+    if( fseek( file, offset, SEEK_SET ) ||
+	fwrite( data, lazy->track_length, 1, file ) != 1 ) {
+      d->status = DISK_WRPART;
+      break;
+    }
+
+    /* the image in memory now matches the track again, so it can be
+       thrown away and rebuilt if need be */
+    lazy->changed[i] &= ~LAZY_TRACK_DIRTY;
+    if( offset + lazy->track_length <= lazy->image.length ) {
+      memcpy( lazy->image.buffer + offset, data, lazy->track_length );
+      lazy->changed[i] = 0;
+    }
+  }
+
+  position_context_restore( d, &context );
+  libspectrum_free( data );
+
+  if( fclose( file ) == -1 && d->status == DISK_OK )
+    d->status = DISK_WRFILE;
+
+  if( d->status == DISK_OK )
+    d->dirty = 0;
+
+  return d->status;
+}
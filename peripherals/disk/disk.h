@@ -104,6 +104,7 @@ typedef struct disk_t {
   int i;			/* index for track and clocks */
   disk_type_t type;		/* DISK_UDI, ... */
   disk_dens_t density;		/* DISK_SD DISK_DD, or DISK_HD */
+  struct disk_lazy_t *lazy;	/* tracks built when first needed, or NULL */
 } disk_t;
 
 /* every track data:
@@ -118,7 +119,7 @@ TRACK_LEN TYPE TRACK......DATA CLOCK..MARKS MF..MARKS WEAK..MARKS
 #define DISK_CLEN( bpt ) ( ( bpt ) / 8 + ( ( bpt ) % 8 ? 1 : 0 ) )
 
 #define DISK_SET_TRACK_IDX( d, idx ) \
-   d->track = d->data + 3 + ( idx ) * d->tlen; \
+   d->track = disk_track_data( d, idx ) + 3; \
    d->clocks = d->track  + d->bpt; \
    d->fm     = d->clocks + DISK_CLEN( d->bpt ); \
    d->weak   = d->fm     + DISK_CLEN( d->bpt )
@@ -135,6 +136,17 @@ typedef struct disk_position_context_t {
 } disk_position_context_t;
 
 const char *disk_strerror( int error );
+/* get the raw data of a track (starting with TRACK_LEN), building it
+   first if the disk was opened lazily
+*/
+libspectrum_byte *disk_track_data( disk_t *d, int idx );
+/* note that the current track has been written to, so it must be kept
+*/
+void disk_track_changed( disk_t *d );
+/* free tracks of a lazily opened disk which can be built again, if
+   there are too many of them; the current track is always kept
+*/
+void disk_release_tracks( disk_t *d );
 /* create an unformatted disk sides -> (1/2) cylinders -> track/side,
    dens -> 'density' related to unformatted length of a track (SD = 3125,
    DD = 6250, HD = 12500, type -> if write this disk we want to convert
@@ -157,6 +169,12 @@ int disk_merge_sides( disk_t *d, disk_t *d1, disk_t *d2, int autofill );
    UDI.
 */
 int disk_write( disk_t *d, const char *filename );
+/* write the tracks changed since the disk was opened back into its image
+   file, in place. Only possible for plain sector images (TRD, IMG, MGT,
+   OPD, D40 and D80) whose changed tracks still have the same layout;
+   otherwise the whole image has to be written with disk_write()
+*/
+int disk_write_back( disk_t *d );
 /* format disk to plus3 accept for formatting
 */
 int disk_preformat( disk_t *d );
@@ -0,0 +1,764 @@
+/* disktest.c: Test, benchmark and fuzz program for Fuse's disk images
+   Copyright (c) 2026 Fuse contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/* For each image given on the command line, this:
+
+   - opens it with disk_open(), writes it with disk_write() in the same
+     format (or UDI for formats we can't write), opens and writes that
+     again, and checks the two written images are identical;
+   - for formats which support it, marks every track as changed and
+     checks disk_write_back() leaves the image unchanged;
+   - with -b, times opening, building every track and writing the image;
+   - with -f, opens (and, if that works, writes) mutated copies of the
+     image, to be run under a memory checker.
+
+   Compressed (e.g. .bz2) images are uncompressed first. With -g, the same
+   is done to small TRD, SCL, SAD, D40, IMG, FDI and DSK images made up
+   here, so those formats are tested without needing image files. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STRINGS_STRCASECMP
+#include <strings.h>
+#endif      /* #ifdef HAVE_STRINGS_STRCASECMP */
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libspectrum.h"
+
+#include "peripherals/disk/disk.h"
+#include "settings.h"
+#include "ui/ui.h"
+#include "utils.h"
+
+static const char *progname;		/* argv[0] */
+static char work_base[ 256 ];		/* prefix of our temporary files */
+
+settings_info settings_current;
+
+typedef struct image_t {
+  const char *filename;			/* as given on the command line */
+  char ext[ 8 ];			/* extension of the uncompressed image */
+  libspectrum_byte *buffer;
+  size_t length;
+} image_t;
+
+static int read_image( image_t *image, const char *filename );
+static int test_image( const image_t *image, int bench, int fuzz_count,
+		       unsigned int seed );
+static int test_generated( int bench, int fuzz_count, unsigned int seed );
+static int round_trip( const image_t *image );
+static int benchmark( const image_t *image, int iterations );
+static int fuzz( const image_t *image, int iterations, unsigned int seed );
+
+int
+main( int argc, char **argv )
+{
+  int i, error = 0, bench = 0, fuzz_count = 0, generated = 0;
+  unsigned int seed = 1;
+  const char *tmpdir;
+  image_t image;
+
+  progname = argv[0];
+
+  for( i = 1; i < argc && argv[i][0] == '-'; i++ ) {
+    if( !strcmp( argv[i], "-g" ) ) {
+      generated = 1;
+      continue;
+    }
+    if( i + 1 >= argc ) break;
+    if( !strcmp( argv[i], "-b" ) ) {
+      bench = atoi( argv[ i + 1 ] );
+    } else if( !strcmp( argv[i], "-f" ) ) {
+      fuzz_count = atoi( argv[ i + 1 ] );
+    } else if( !strcmp( argv[i], "-s" ) ) {
+      seed = strtoul( argv[ i + 1 ], NULL, 0 );
+    } else {
+      break;
+    }
+    i++;
+  }
+
+  if( i >= argc && !generated ) {
+    fprintf( stderr,
+	     "Usage: %s [-g] [-b <iterations>] [-f <iterations>] [-s <seed>] "
+	     "[<image>...]\n", progname );
+    return 1;
+  }
+
+  if( libspectrum_init() ) return 1;
+
+  tmpdir = getenv( "TMPDIR" );
+  if( !tmpdir || !*tmpdir ) tmpdir = "/tmp";
+  snprintf( work_base, sizeof( work_base ), "%s/disktest-%ld", tmpdir,
+	    (long)getpid() );
+
+  if( generated && test_generated( bench, fuzz_count, seed ) ) error = 1;
+
+  for( ; i < argc; i++ ) {
+    if( read_image( &image, argv[i] ) ) {
+      error = 1;
+      continue;
+    }
+
+    if( test_image( &image, bench, fuzz_count, seed ) ) error = 1;
+
+    libspectrum_free( image.buffer );
+  }
+
+  return error;
+}
+
+static int
+test_image( const image_t *image, int bench, int fuzz_count,
+	    unsigned int seed )
+{
+  int error = 0;
+
+  if( round_trip( image ) ) error = 1;
+  if( bench && benchmark( image, bench ) ) error = 1;
+  if( fuzz_count && fuzz( image, fuzz_count, seed ) ) error = 1;
+
+  return error;
+}
+
+/* Things disk.c needs from the rest of Fuse */
+
+int
+ui_error( ui_error_level severity GCC_UNUSED, const char *format, ... )
+{
+  va_list ap;
+
+  va_start( ap, format );
+  fprintf( stderr, "%s: ", progname );
+  vfprintf( stderr, format, ap );
+  fputc( '\n', stderr );
+  va_end( ap );
+
+  return 0;
+}
+
+int
+ui_query( const char *message GCC_UNUSED )
+{
+  return 0;
+}
+
+int
+utils_read_file( const char *filename, utils_file *file )
+{
+  FILE *f;
+  long length;
+
+  f = fopen( filename, "rb" );
+  if( !f ) return 1;
+
+  if( fseek( f, 0, SEEK_END ) || ( length = ftell( f ) ) < 0 ||
+      fseek( f, 0, SEEK_SET ) ) {
+    fclose( f );
+    return 1;
+  }
+
+  file->length = length;
+  file->buffer = libspectrum_new( unsigned char, length ? length : 1 );
+  if( length && fread( file->buffer, length, 1, f ) != 1 ) {
+    libspectrum_free( file->buffer );
+    fclose( f );
+    return 1;
+  }
+
+  fclose( f );
+  return 0;
+}
+
+void
+utils_close_file( utils_file *file )
+{
+  libspectrum_free( file->buffer );
+}
+
+char *
+utils_safe_strdup( const char *src )
+{
+  char *dest = NULL;
+  if( src ) {
+    dest = libspectrum_new( char, strlen( src ) + 1 );
+    strcpy( dest, src );
+  }
+  return dest;
+}
+
+/* Helpers */
+
+static double
+get_time( void )
+{
+  struct timeval tv;
+
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+write_file( const char *filename, const libspectrum_byte *buffer,
+	    size_t length )
+{
+  FILE *f;
+  int error;
+
+  f = fopen( filename, "wb" );
+  if( !f ) {
+    fprintf( stderr, "%s: couldn't open `%s': %s\n", progname, filename,
+	     strerror( errno ) );
+    return 1;
+  }
+
+  error = length && fwrite( buffer, length, 1, f ) != 1;
+  if( fclose( f ) ) error = 1;
+  if( error )
+    fprintf( stderr, "%s: couldn't write `%s'\n", progname, filename );
+  return error;
+}
+
+static int
+compare_files( const char *filename1, const char *filename2 )
+{
+  utils_file file1, file2;
+  int differ;
+
+  if( utils_read_file( filename1, &file1 ) ) return 1;
+  if( utils_read_file( filename2, &file2 ) ) {
+    utils_close_file( &file1 );
+    return 1;
+  }
+
+  differ = file1.length != file2.length ||
+	   memcmp( file1.buffer, file2.buffer, file1.length );
+
+  utils_close_file( &file1 );
+  utils_close_file( &file2 );
+  return differ;
+}
+
+static int
+read_image( image_t *image, const char *filename )
+{
+  utils_file file;
+  libspectrum_id_t type;
+  libspectrum_class_t class;
+  const char *name = filename, *dot;
+  char *new_filename = NULL;
+
+  image->filename = filename;
+
+  if( utils_read_file( filename, &file ) ) {
+    fprintf( stderr, "%s: couldn't read `%s'\n", progname, filename );
+    return 1;
+  }
+  image->buffer = file.buffer;
+  image->length = file.length;
+
+  if( libspectrum_identify_file_with_class( &type, &class, filename,
+					    file.buffer, file.length ) ) {
+    libspectrum_free( file.buffer );
+    return 1;
+  }
+
+  if( class == LIBSPECTRUM_CLASS_COMPRESSED ) {
+    if( libspectrum_uncompress_file( &image->buffer, &image->length,
+				     &new_filename, type, file.buffer,
+				     file.length, filename ) ) {
+      fprintf( stderr, "%s: couldn't uncompress `%s'\n", progname,
+	       filename );
+      libspectrum_free( file.buffer );
+      return 1;
+    }
+    libspectrum_free( file.buffer );
+    name = new_filename;
+  }
+
+  dot = strrchr( name, '.' );
+  snprintf( image->ext, sizeof( image->ext ), "%s", dot ? dot + 1 : "udi" );
+  libspectrum_free( new_filename );
+
+  return 0;
+}
+
+static void
+work_file( char *filename, size_t length, const char *tag, const char *ext )
+{
+  snprintf( filename, length, "%s-%s.%s", work_base, tag, ext );
+}
+
+/* the format we write an image back as */
+static const char *
+write_ext( const image_t *image )
+{
+  /* TD0 can be read but not written */
+  if( !strcasecmp( image->ext, "td0" ) ) return "udi";
+  return image->ext;
+}
+
+static int
+open_disk( disk_t *d, const char *filename )
+{
+  memset( d, 0, sizeof( *d ) );
+  return disk_open( d, filename, 0, 0 );
+}
+
+static int
+write_disk( disk_t *d, const char *filename )
+{
+  d->type = DISK_TYPE_NONE;		/* guess from the extension */
+  return disk_write( d, filename );
+}
+
+/* make every track of the disk be built */
+static void
+build_tracks( disk_t *d )
+{
+  int i;
+
+  for( i = 0; i < d->sides * d->cylinders; i++ ) {
+    DISK_SET_TRACK_IDX( d, i );
+  }
+}
+
+/* Synthesised images */
+
+/* Make an image of 'length' bytes of sector data after 'offset' bytes of
+   (zeroed) header, filled so that no two sectors are the same */
+static libspectrum_byte *
+new_image( image_t *image, size_t offset, size_t length )
+{
+  size_t i;
+
+  image->length = offset + length;
+  image->buffer = libspectrum_new0( libspectrum_byte, image->length );
+  for( i = 0; i < length; i++ )
+    image->buffer[ offset + i ] = ( i * 7 + i / 251 ) & 0xff;
+
+  return image->buffer;
+}
+
+/* Empty single sided, 40 track TR-DOS disk */
+static void
+make_trd( image_t *image )
+{
+  libspectrum_byte *buffer;
+
+  buffer = new_image( image, 0, 40 * 16 * 256 );
+
+  /* empty directory and the disk info in sector 9 */
+  memset( buffer, 0, 9 * 256 );
+  buffer[ 8 * 256 + 0xe2 ] = 1;			/* first free track */
+  buffer[ 8 * 256 + 0xe3 ] = 0x19;		/* 40 track, single sided */
+  buffer[ 8 * 256 + 0xe5 ] = ( 39 * 16 ) & 0xff;	/* free sectors */
+  buffer[ 8 * 256 + 0xe6 ] = ( 39 * 16 ) >> 8;
+  buffer[ 8 * 256 + 0xe7 ] = 0x10;		/* TR-DOS ID byte */
+}
+
+/* Two code files, of two sectors each */
+static void
+make_scl( image_t *image )
+{
+  static const libspectrum_byte entries[ 2 * 14 ] = {
+    'd', 'i', 's', 'k', 't', 'e', 's', 't', 'C', 0x00, 0x80, 0x00, 0x02, 2,
+    'g', 'e', 'n', 'e', 'r', 'a', 't', 'e', 'C', 0x00, 0xc0, 0x2c, 0x01, 2,
+  };
+  libspectrum_byte *buffer;
+  libspectrum_dword sum = 0;
+  size_t i, length;
+
+  buffer = new_image( image, 9 + sizeof( entries ), 4 * 256 + 4 );
+  memcpy( buffer, "SINCLAIR", 8 );
+  buffer[8] = 2;
+  memcpy( buffer + 9, entries, sizeof( entries ) );
+
+  length = image->length - 4;
+  for( i = 0; i < length; i++ )
+    sum += buffer[i];
+  buffer[ length     ] = sum & 0xff;
+  buffer[ length + 1 ] = ( sum >> 8 ) & 0xff;
+  buffer[ length + 2 ] = ( sum >> 16 ) & 0xff;
+  buffer[ length + 3 ] = ( sum >> 24 ) & 0xff;
+}
+
+/* Double sided, 40 track disk with ten 512 byte sectors per track */
+static void
+make_sad( image_t *image )
+{
+  libspectrum_byte *buffer;
+
+  buffer = new_image( image, 22, 2 * 40 * 10 * 512 );
+  memcpy( buffer, "Aley's disk backup", 18 );
+  buffer[18] = 2;				/* sides */
+  buffer[19] = 40;				/* cylinders */
+  buffer[20] = 10;				/* sectors per track */
+  buffer[21] = 512 / 64;			/* sector length */
+}
+
+/* Single sided, 40 track Didaktik disk with nine 512 byte sectors */
+static void
+make_d40( image_t *image )
+{
+  libspectrum_byte *buffer;
+
+  buffer = new_image( image, 0, 40 * 9 * 512 );
+  buffer[0xb1] = 0x00;				/* single sided */
+  buffer[0xb2] = 40;				/* cylinders */
+  buffer[0xb3] = 9;				/* sectors per track */
+}
+
+/* Double sided, 80 track +D disk, stored one side after the other */
+static void
+make_img( image_t *image )
+{
+  new_image( image, 0, 2 * 80 * 10 * 512 );
+}
+
+/* Single sided, 40 track disk with sixteen 256 byte sectors per track */
+static void
+make_fdi( image_t *image )
+{
+  size_t data_offset = 14 + 40 * ( 7 + 16 * 7 ), offset;
+  libspectrum_byte *buffer, *header;
+  int track, sector;
+
+  buffer = new_image( image, data_offset, 40 * 16 * 256 );
+  memcpy( buffer, "FDI", 3 );
+  buffer[0x04] = 40;				/* cylinders */
+  buffer[0x06] = 1;				/* sides */
+  buffer[0x08] = data_offset & 0xff;		/* no description */
+  buffer[0x09] = data_offset >> 8;
+  buffer[0x0a] = data_offset & 0xff;		/* data offset */
+  buffer[0x0b] = data_offset >> 8;
+
+  header = buffer + 14;
+  for( track = 0; track < 40; track++ ) {
+    offset = track * 16 * 256;
+    header[0] = offset & 0xff;			/* track data offset */
+    header[1] = ( offset >> 8 ) & 0xff;
+    header[2] = ( offset >> 16 ) & 0xff;
+    header[6] = 16;				/* sectors */
+    header += 7;
+
+    for( sector = 0; sector < 16; sector++ ) {
+      header[0] = track;
+      header[1] = 0;				/* head */
+      header[2] = sector + 1;
+      header[3] = 1;				/* 256 bytes */
+      header[4] = 1 << 1;			/* CRC OK */
+      header[5] = ( sector * 256 ) & 0xff;	/* sector data offset */
+      header[6] = ( sector * 256 ) >> 8;
+      header += 7;
+    }
+  }
+}
+
+/* Single sided, 40 track +3 disk with nine 512 byte sectors per track */
+static void
+make_dsk( image_t *image )
+{
+  size_t track_length = 256 + 9 * 512;
+  libspectrum_byte *buffer, *header;
+  int track, sector;
+
+  buffer = new_image( image, 256, 40 * track_length );
+  memcpy( buffer, "MV - CPCEMU Disk-File\r\nDisk-Info\r\n", 34 );
+  buffer[0x30] = 40;				/* cylinders */
+  buffer[0x31] = 1;				/* sides */
+  buffer[0x32] = track_length & 0xff;
+  buffer[0x33] = track_length >> 8;
+
+  for( track = 0; track < 40; track++ ) {
+    header = buffer + 256 + track * track_length;
+    memset( header, 0, 256 );
+    memcpy( header, "Track-Info\r\n", 12 );
+    header[0x10] = track;
+    header[0x11] = 0;				/* side */
+    header[0x14] = 2;				/* 512 bytes */
+    header[0x15] = 9;				/* sectors */
+    header[0x16] = 0x4e;			/* gap */
+    header[0x17] = 0xe5;			/* filler */
+
+    for( sector = 0; sector < 9; sector++ ) {
+      header[ 0x18 + 8 * sector ] = track;
+      header[ 0x19 + 8 * sector ] = 0;		/* head */
+      header[ 0x1a + 8 * sector ] = sector + 1;
+      header[ 0x1b + 8 * sector ] = 2;		/* 512 bytes */
+    }
+  }
+}
+
+static const struct {
+  const char *filename;
+  const char *ext;
+  void (*make)( image_t *image );
+} generated_images[] = {
+  { "generated.trd", "trd", make_trd },
+  { "generated.scl", "scl", make_scl },
+  { "generated.sad", "sad", make_sad },
+  { "generated.d40", "d40", make_d40 },
+  { "generated.img", "img", make_img },
+  { "generated.fdi", "fdi", make_fdi },
+  { "generated.dsk", "dsk", make_dsk },
+};
+
+static int
+test_generated( int bench, int fuzz_count, unsigned int seed )
+{
+  image_t image;
+  size_t i;
+  int error = 0;
+
+  for( i = 0; i < sizeof( generated_images ) / sizeof( generated_images[0] );
+       i++ ) {
+    image.filename = generated_images[i].filename;
+    snprintf( image.ext, sizeof( image.ext ), "%s", generated_images[i].ext );
+    generated_images[i].make( &image );
+
+    if( test_image( &image, bench, fuzz_count, seed ) ) error = 1;
+
+    libspectrum_free( image.buffer );
+  }
+
+  return error;
+}
+
+/* Round trip */
+
+static int
+round_trip( const image_t *image )
+{
+  char in[ 320 ], out1[ 320 ], out2[ 320 ];
+  const char *ext = write_ext( image );
+  disk_t d;
+  int error, i, sides, cylinders;
+
+  work_file( in, sizeof( in ), "in", image->ext );
+  work_file( out1, sizeof( out1 ), "out1", ext );
+  work_file( out2, sizeof( out2 ), "out2", ext );
+
+  if( write_file( in, image->buffer, image->length ) ) return 1;
+
+  error = open_disk( &d, in );
+  if( error ) {
+    printf( "%s: FAIL open: %s\n", image->filename, disk_strerror( error ) );
+    unlink( in );
+    return 1;
+  }
+  sides = d.sides; cylinders = d.cylinders;
+  error = write_disk( &d, out1 );
+  disk_close( &d );
+  unlink( in );
+  if( error ) {
+    printf( "%s: FAIL write %s: %s\n", image->filename, ext,
+	    disk_strerror( error ) );
+    unlink( out1 );
+    return 1;
+  }
+
+  error = open_disk( &d, out1 );
+  if( error ) {
+    printf( "%s: FAIL reopen %s: %s\n", image->filename, ext,
+	    disk_strerror( error ) );
+    unlink( out1 );
+    return 1;
+  }
+  if( d.sides != sides || d.cylinders != cylinders ) {
+    printf( "%s: FAIL geometry %dx%d became %dx%d\n", image->filename,
+	    sides, cylinders, d.sides, d.cylinders );
+    error = 1;
+  }
+  if( !error ) error = write_disk( &d, out2 );
+  disk_close( &d );
+
+  if( !error && compare_files( out1, out2 ) ) {
+    printf( "%s: FAIL rewritten %s image differs\n", image->filename, ext );
+    error = 1;
+  }
+
+  /* writing back unchanged tracks must not change the image */
+  if( !error && !open_disk( &d, out2 ) ) {
+    disk_t *dp = &d;
+
+    for( i = 0; i < d.sides * d.cylinders; i++ ) {
+      DISK_SET_TRACK_IDX( dp, i );
+      disk_track_changed( dp );
+    }
+    d.dirty = 1;
+    error = disk_write_back( &d );
+    disk_close( &d );
+    if( error == DISK_UNSUP ) {
+      error = 0;
+    } else if( error ) {
+      printf( "%s: FAIL write back: %s\n", image->filename,
+	      disk_strerror( error ) );
+    } else if( compare_files( out1, out2 ) ) {
+      printf( "%s: FAIL write back changed the image\n", image->filename );
+      error = 1;
+    }
+  }
+
+  unlink( out1 );
+  unlink( out2 );
+
+  if( error ) return 1;
+
+  printf( "%s: OK %s %dx%d\n", image->filename, ext, sides, cylinders );
+  return 0;
+}
+
+/* Benchmark */
+
+static void
+report( const image_t *image, const char *what, int iterations,
+	double seconds )
+{
+  printf( "%s: %-7s %8.3f ms %8.1f MB/s\n", image->filename, what,
+	  seconds * 1000 / iterations,
+	  seconds > 0 ? image->length * (double)iterations / seconds / 1e6 : 0 );
+}
+
+static int
+benchmark( const image_t *image, int iterations )
+{
+  char in[ 320 ], out[ 320 ];
+  double start, open_time = 0, build_time = 0, write_time = 0;
+  disk_t d;
+  int i, error = 0;
+
+  work_file( in, sizeof( in ), "in", image->ext );
+  work_file( out, sizeof( out ), "out", write_ext( image ) );
+  if( write_file( in, image->buffer, image->length ) ) return 1;
+
+  for( i = 0; i < iterations && !error; i++ ) {
+    start = get_time();
+    error = open_disk( &d, in );
+    if( error ) break;
+    open_time += get_time() - start;
+
+    start = get_time();
+    build_tracks( &d );
+    build_time += get_time() - start;
+
+    start = get_time();
+    error = write_disk( &d, out );
+    write_time += get_time() - start;
+
+    disk_close( &d );
+  }
+
+  unlink( in );
+  unlink( out );
+
+  if( error ) {
+    printf( "%s: FAIL benchmark: %s\n", image->filename,
+	    disk_strerror( error ) );
+    return 1;
+  }
+
+  report( image, "open", iterations, open_time );
+  report( image, "tracks", iterations, build_time );
+  report( image, "write", iterations, write_time );
+  return 0;
+}
+
+/* Fuzz */
+
+static unsigned int fuzz_state;
+
+static unsigned int
+fuzz_random( void )
+{
+  /* xorshift32 */
+  fuzz_state ^= fuzz_state << 13;
+  fuzz_state ^= fuzz_state >> 17;
+  fuzz_state ^= fuzz_state << 5;
+  return fuzz_state;
+}
+
+static size_t
+fuzz_mutate( const image_t *image, libspectrum_byte *buffer )
+{
+  size_t length = image->length, offset;
+  int i, n;
+
+  memcpy( buffer, image->buffer, length );
+  if( !length ) return 0;
+
+  n = 1 + fuzz_random() % 8;
+  for( i = 0; i < n; i++ ) {
+    /* headers are where the interesting parsing happens */
+    if( fuzz_random() % 2 && length > 256 )
+      offset = fuzz_random() % 256;
+    else
+      offset = fuzz_random() % length;
+
+    switch( fuzz_random() % 4 ) {
+    case 0: buffer[ offset ] ^= 1 << ( fuzz_random() % 8 ); break;
+    case 1: buffer[ offset ] = fuzz_random(); break;
+    case 2: buffer[ offset ] = fuzz_random() % 2 ? 0xff : 0x00; break;
+    case 3: length = offset + 1; break;		/* truncate */
+    }
+  }
+
+  return length;
+}
+
+static int
+fuzz( const image_t *image, int iterations, unsigned int seed )
+{
+  char in[ 320 ], out[ 320 ];
+  libspectrum_byte *buffer;
+  size_t length;
+  disk_t d;
+  int i, opened = 0;
+
+  fuzz_state = seed ? seed : 1;
+  work_file( in, sizeof( in ), "fuzz", image->ext );
+  work_file( out, sizeof( out ), "fuzzout", write_ext( image ) );
+  buffer = libspectrum_new( libspectrum_byte,
+			    image->length ? image->length : 1 );
+
+  for( i = 0; i < iterations; i++ ) {
+    length = fuzz_mutate( image, buffer );
+    if( write_file( in, buffer, length ) ) break;
+
+    if( open_disk( &d, in ) ) continue;
+    opened++;
+    build_tracks( &d );
+    write_disk( &d, out );
+    disk_close( &d );
+  }
+
+  unlink( in );
+  unlink( out );
+  libspectrum_free( buffer );
+
+  printf( "%s: fuzz %d iterations, %d opened\n", image->filename, i,
+	  opened );
+  return i != iterations;
+}
@@ -133,6 +133,7 @@ fdd_set_data( fdd_t *d, int fact )
   }
 
   DISK_SET_TRACK( &d->disk, head, d->c_cylinder );
+  disk_release_tracks( &d->disk );
   d->c_bpt = d->disk.track[-3] + 256 * d->disk.track[-2];
   if( fact > 0 ) {
     /* this generate a bpt/fact +-10% triangular distribution skip in bytes 
@@ -187,9 +188,10 @@ fdd_init( fdd_t *d, fdd_type_t type, const fdd_params_t *dt, int reinit )
   if( reinit && loaded ) {
     fdd_unload( d );
     fdd_load( d, upsidedown );
-  }
-   else
+  } else {
     d->disk.data = NULL;
+    d->disk.lazy = NULL;
+  }
 
   return d->status = FDD_OK;
 }
@@ -220,9 +222,15 @@ fdd_motoron( fdd_t *d, int on )
 	pulse has been detected after item iii) is satisfied
   */
   event_remove_type_user_data( motor_event, d );		/* remove pending motor-on event for *this* drive */
+
+  /* the DOS has finished with the disk for now, so this is a good time to
+     update the image file */
+  if( !on && settings_current.disk_write_back )
+    disk_write_back( &d->disk );
+
   if( on ) {
-    event_add_with_data( tstates + 4 *			/* 2 revolution: 2 * 200 / 1000 */
-			 machine_current->timings.processor_speed / 10,
+    event_add_with_data( tstates + fdd_delay( 4 *	/* 2 revolution: 2 * 200 / 1000 */
+			 machine_current->timings.processor_speed / 10 ),
 			 motor_event, d );
     if( d->loaded ) /* index rotating */
       event_add_with_data( tstates + ( d->index_pulse ? 10 : 190 ) *
@@ -392,6 +400,7 @@ fdd_read_write_data( fdd_t *d, fdd_write_t write )
     bitmap_reset( d->disk.weak, d->disk.i );
 #endif
     d->disk.dirty = 1;
+    disk_track_changed( &d->disk );
   } else {	/* read */
     d->data = d->disk.track[ d->disk.i ];
     if( bitmap_test( d->disk.clocks, d->disk.i ) )
@@ -453,6 +462,17 @@ fdd_wait_index_hole( fdd_t *d )
   d->index = 1;
 }
 
+/* In fast disk mode the mechanics are FDD_FAST_FACTOR times quicker.
+   Timeouts are not affected, so the DOS still has as long as it ever had
+   to transfer each byte */
+#define FDD_FAST_FACTOR 16
+
+libspectrum_dword
+fdd_delay( libspectrum_dword delay )
+{
+  return settings_current.fast_disk ? delay / FDD_FAST_FACTOR : delay;
+}
+
 static void
 fdd_event( libspectrum_dword last_tstates, int event,
            void *user_data ) 
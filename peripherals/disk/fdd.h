@@ -151,6 +151,9 @@ int fdd_write_data( fdd_t *d );
 void fdd_wrprot( fdd_t *d, int wrprot );
 /* to reach index hole */
 void fdd_wait_index_hole( fdd_t *d );
+/* how long to wait for a mechanical delay (spin up, head load, step or a
+   sector coming round) of 'delay' tstates; less in fast disk mode */
+libspectrum_dword fdd_delay( libspectrum_dword delay );
 /* set floppy position ( upsidedown or not )*/
 void fdd_flip( fdd_t *d, int upsidedown );
 
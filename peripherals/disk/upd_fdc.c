@@ -496,8 +496,8 @@ seek_step( upd_fdc *f, int start )
     f->seek_age[i] = 1;
 
     /* wait step completion */
-    event_add_with_data( tstates + f->stp_rate * 
-                         machine_current->timings.processor_speed / 1000,
+    event_add_with_data( tstates + fdd_delay( f->stp_rate * 
+                         machine_current->timings.processor_speed / 1000 ),
                          fdc_event, f );
   }
 
@@ -521,8 +521,8 @@ start_read_id( upd_fdc *f )
     i = f->current_drive->disk.bpt ? 
       ( f->current_drive->disk.i - i ) * 200 / f->current_drive->disk.bpt : 200;
     if( i > 0 ) {
-      event_add_with_data( tstates + i *		/* i * 1/20 revolution */
-			 machine_current->timings.processor_speed / 1000,
+      event_add_with_data( tstates + fdd_delay( i *		/* i * 1/20 revolution */
+			 machine_current->timings.processor_speed / 1000 ),
 			 fdc_event, f );
       return;
     }
@@ -559,8 +559,8 @@ start_read_diag( upd_fdc *f )
     i = f->current_drive->disk.bpt ? 
       ( f->current_drive->disk.i - i ) * 200 / f->current_drive->disk.bpt : 200;
     if( i > 0 ) {
-      event_add_with_data( tstates + i *		/* i * 1/20 revolution */
-			 machine_current->timings.processor_speed / 1000,
+      event_add_with_data( tstates + fdd_delay( i *		/* i * 1/20 revolution */
+			 machine_current->timings.processor_speed / 1000 ),
 			 fdc_event, f );
       return;
     }
@@ -629,8 +629,8 @@ multi_track_next:
       i = f->current_drive->disk.bpt ? 
           ( f->current_drive->disk.i - i ) * 200 / f->current_drive->disk.bpt : 200;
       if( i > 0 ) {
-        event_add_with_data( tstates + i *		/* i * 1/20 revolution */
-			     machine_current->timings.processor_speed / 1000,
+        event_add_with_data( tstates + fdd_delay( i *		/* i * 1/20 revolution */
+			     machine_current->timings.processor_speed / 1000 ),
 			     fdc_event, f );
         return;
       }
@@ -722,8 +722,8 @@ multi_track_next:
       i = f->current_drive->disk.bpt ? 
           ( f->current_drive->disk.i - i ) * 200 / f->current_drive->disk.bpt : 200;
       if( i > 0 ) {
-        event_add_with_data( tstates + i *		/* i * 1/20 revolution */
-			     machine_current->timings.processor_speed / 1000,
+        event_add_with_data( tstates + fdd_delay( i *		/* i * 1/20 revolution */
+			     machine_current->timings.processor_speed / 1000 ),
 			     fdc_event, f );
         return;
       }
@@ -845,8 +845,8 @@ head_load( upd_fdc *f )
   } else {
     fdd_head_load( f->current_drive, 1 );
     f->head_load = 1;
-    event_add_with_data( tstates + f->hld_time * 
-			 machine_current->timings.processor_speed / 1000,
+    event_add_with_data( tstates + fdd_delay( f->hld_time * 
+			 machine_current->timings.processor_speed / 1000 ),
 			 fdc_event, f );
   }
 }
@@ -413,8 +413,8 @@ wd_fdc_seek_verify_read_id( wd_fdc *f )
         f->id_mark = WD_FDC_AM_NONE;
       i = d->disk.bpt ? ( d->disk.i - i ) * 200 / d->disk.bpt : 200;
       if( i > 0 ) {
-        event_add_with_data( tstates + i *		/* i * 1/20 revolution */
-			   machine_current->timings.processor_speed / 1000,
+        event_add_with_data( tstates + fdd_delay( i *		/* i * 1/20 revolution */
+			   machine_current->timings.processor_speed / 1000 ),
 			   fdc_event, f );
         return;
       } else if( f->id_mark != WD_FDC_AM_NONE )
@@ -437,8 +437,8 @@ wd_fdc_seek_verify( wd_fdc *f )
   event_remove_type( fdc_event );
   if( f->type == WD1773 || f->type == FD1793 || f->type == WD2797 ) {
     if( !f->hlt ) {
-      event_add_with_data( tstates + 5 * 			/* sample every 5 ms */
-		    machine_current->timings.processor_speed / 1000,
+      event_add_with_data( tstates + fdd_delay( 5 * 			/* sample every 5 ms */
+		    machine_current->timings.processor_speed / 1000 ),
 			fdc_event, f );
       return;
     }
@@ -500,8 +500,8 @@ type_i_noupdate:
       fdd_step( d, f->direction );
       f->state = WD_FDC_STATE_SEEK_DELAY;
       event_remove_type( fdc_event );
-      event_add_with_data( tstates + f->rates[ b & 0x03 ] *
-			   machine_current->timings.processor_speed / 1000,
+      event_add_with_data( tstates + fdd_delay( f->rates[ b & 0x03 ] *
+			   machine_current->timings.processor_speed / 1000 ),
 			   fdc_event, f );
       return;
     }
@@ -518,8 +518,8 @@ type_i_verify:
       else
         fdd_head_load( d, 1 );
       event_remove_type( fdc_event );
-      event_add_with_data( tstates + 15 * 				/* 15ms */
-		    machine_current->timings.processor_speed / 1000,
+      event_add_with_data( tstates + fdd_delay( 15 * 				/* 15ms */
+		    machine_current->timings.processor_speed / 1000 ),
 			fdc_event, f );
     }
 
@@ -530,8 +530,8 @@ type_i_verify:
       f->status_register |= WD_FDC_SR_MOTORON;
       fdd_motoron( f->current_drive, 1 );
       event_remove_type( fdc_event );
-      event_add_with_data( tstates + 12 * 		/* 6 revolution 6 * 200 / 1000 */
-		    machine_current->timings.processor_speed / 10,
+      event_add_with_data( tstates + fdd_delay( 12 * 		/* 6 revolution 6 * 200 / 1000 */
+		    machine_current->timings.processor_speed / 10 ),
 			fdc_event, f );
       return;
     }
@@ -573,8 +573,8 @@ wd_fdc_type_ii_seek( wd_fdc *f )
       i = d->disk.bpt ?
 	( d->disk.i - i ) * 200 / d->disk.bpt : 200;
       if( i > 0 ) {
-        event_add_with_data( tstates + i *		/* i * 1/20 revolution */
-			     machine_current->timings.processor_speed / 1000,
+        event_add_with_data( tstates + fdd_delay( i *		/* i * 1/20 revolution */
+			     machine_current->timings.processor_speed / 1000 ),
 			     fdc_event, f );
         return;
       } else if( f->id_mark != WD_FDC_AM_NONE ) {
@@ -654,8 +654,8 @@ wd_fdc_type_ii( wd_fdc *f )
       return;
     }
     if( !f->hlt ) {
-      event_add_with_data( tstates + 5 *
-    		    machine_current->timings.processor_speed / 1000,
+      event_add_with_data( tstates + fdd_delay( 5 *
+    		    machine_current->timings.processor_speed / 1000 ),
 			fdc_event, f );
       return;
     }
@@ -693,8 +693,8 @@ wd_fdc_type_iii( wd_fdc *f )
       return;
     }
     if( !f->hlt ) {
-      event_add_with_data( tstates + 5 *
-    		    machine_current->timings.processor_speed / 1000,
+      event_add_with_data( tstates + fdd_delay( 5 *
+    		    machine_current->timings.processor_speed / 1000 ),
 			fdc_event, f );
       return;
     }
@@ -728,8 +728,8 @@ wd_fdc_type_iii( wd_fdc *f )
         i = d->disk.bpt ?
 	    ( d->disk.i - i ) * 200 / d->disk.bpt : 200;
 	if( i > 0 ) {
-          event_add_with_data( tstates + i *		/* i * 1/20 revolution */
-			       machine_current->timings.processor_speed / 1000,
+          event_add_with_data( tstates + fdd_delay( i *		/* i * 1/20 revolution */
+			       machine_current->timings.processor_speed / 1000 ),
 			       fdc_event, f );
           return;
 	} else if( f->id_mark != WD_FDC_AM_NONE )
@@ -912,8 +912,8 @@ wd_fdc_spinup( wd_fdc *f, libspectrum_byte b )
 
   if( delay ) {
     event_remove_type( fdc_event );
-    event_add_with_data( tstates + delay *
-    		    machine_current->timings.processor_speed / 1000,
+    event_add_with_data( tstates + fdd_delay( delay *
+    		    machine_current->timings.processor_speed / 1000 ),
 			fdc_event, f );
     return 1;
   }
@@ -1087,8 +1087,8 @@ wd_fdc_dr_read( wd_fdc *f )
 	  event_add_with_data( tstates +	 	/* 5 revolutions: 5 * 200 / 1000 */
 			       machine_current->timings.processor_speed,
 			       timeout_event, f );
-	  event_add_with_data( tstates + 2 * 		/* 20 ms delay */
-			       machine_current->timings.processor_speed / 100,
+	  event_add_with_data( tstates + fdd_delay( 2 * 		/* 20 ms delay */
+			       machine_current->timings.processor_speed / 100 ),
 			       fdc_event, f );
 	} else {
 	  f->status_register &= ~WD_FDC_SR_BUSY;
@@ -1183,8 +1183,8 @@ wd_fdc_dr_write( wd_fdc *f, libspectrum_byte b )
 	event_add_with_data( tstates +		/* 5 revolutions: 5 * 200 / 1000 */
 			     machine_current->timings.processor_speed,
 			     timeout_event, f );
-	event_add_with_data( tstates + 2 * 		/* 20ms delay */
-			     machine_current->timings.processor_speed / 100,
+	event_add_with_data( tstates + fdd_delay( 2 * 		/* 20ms delay */
+			     machine_current->timings.processor_speed / 100 ),
 			     fdc_event, f );
       } else {
 	f->status_register &= ~WD_FDC_SR_BUSY;
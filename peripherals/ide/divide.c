@@ -123,6 +123,7 @@ static void
 divide_end( void )
 {
   divxxx_free( divide_state );
+  ide_write_back_remove( divide_idechn0 );
   libspectrum_ide_free( divide_idechn0 );
   libspectrum_ide_free( divide_idechn1 );
 }
@@ -79,6 +79,8 @@ static libspectrum_mmc_card *current_card;
 #define DIVMMC_PAGE_LENGTH 0x2000
 
 static void divmmc_reset( int hard_reset );
+static int dirty_fn_wrapper( void *context );
+static libspectrum_error commit_fn_wrapper( void *context );
 static void divmmc_memory_map( void );
 static void divmmc_enabled_snapshot( libspectrum_snap *snap );
 static void divmmc_from_snapshot( libspectrum_snap *snap );
@@ -110,6 +112,7 @@ static int
 divmmc_init( void *context )
 {
   card = libspectrum_mmc_alloc();
+  ide_write_back_add( dirty_fn_wrapper, commit_fn_wrapper, card );
 
   ui_menu_activate( eject_menu_item, 0 );
 
@@ -143,6 +146,7 @@ static void
 divmmc_end( void )
 {
   divxxx_free( divmmc_state );
+  ide_write_back_remove( card );
   libspectrum_mmc_free( card );
 }
 
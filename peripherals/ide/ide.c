@@ -29,6 +29,24 @@
 #include "ui/ui.h"
 #include "settings.h"
 
+/* How often to write modified sectors back to the images, in frames */
+#define IDE_WRITE_BACK_FRAMES 250
+
+/* A unit whose modified sectors are written back periodically */
+typedef struct ide_write_back_t {
+  int (*is_dirty_fn)( void *context );
+  libspectrum_error (*commit_fn)( void *context );
+  void *context;
+  void *owner;
+  struct ide_unit_t {
+    libspectrum_ide_channel *chn;
+    libspectrum_ide_unit unit;
+  } ide;
+} ide_write_back_t;
+
+static GSList *write_back_units = NULL;
+static int write_back_frames = 0;
+
 static int
 ide_insert_file( libspectrum_ide_channel *channel, libspectrum_ide_unit unit,
 		 const char *filename, ui_menu_item menu_item )
@@ -50,6 +68,8 @@ ide_init( libspectrum_ide_channel *channel,
   ui_menu_activate( master_menu_item, 0 );
   ui_menu_activate( slave_menu_item, 0 );
 
+  ide_write_back_add_channel( channel );
+
   if( master_setting ) {
     error = ide_insert_file( channel, LIBSPECTRUM_IDE_MASTER, master_setting,
 		             master_menu_item );
@@ -211,3 +231,93 @@ ide_eject( libspectrum_ide_channel *chn, libspectrum_ide_unit unit,
       "Hard disk has been modified.\nDo you want to save it?",
       setting, item );
 }
+
+static int
+ide_dirty_fn( void *context )
+{
+  struct ide_unit_t *ide = context;
+  return libspectrum_ide_dirty( ide->chn, ide->unit );
+}
+
+static libspectrum_error
+ide_commit_fn( void *context )
+{
+  struct ide_unit_t *ide = context;
+  return libspectrum_ide_commit( ide->chn, ide->unit );
+}
+
+void
+ide_write_back_add( int (*is_dirty_fn)( void *context ),
+                    libspectrum_error (*commit_fn)( void *context ),
+                    void *context )
+{
+  ide_write_back_t *entry = libspectrum_new( ide_write_back_t, 1 );
+
+  entry->is_dirty_fn = is_dirty_fn;
+  entry->commit_fn = commit_fn;
+  entry->context = context;
+  entry->owner = context;
+
+  write_back_units = g_slist_append( write_back_units, entry );
+}
+
+static void
+ide_write_back_add_unit( libspectrum_ide_channel *chn,
+                         libspectrum_ide_unit unit )
+{
+  ide_write_back_t *entry = libspectrum_new( ide_write_back_t, 1 );
+
+  entry->is_dirty_fn = ide_dirty_fn;
+  entry->commit_fn = ide_commit_fn;
+  entry->context = &entry->ide;
+  entry->owner = chn;
+  entry->ide.chn = chn;
+  entry->ide.unit = unit;
+
+  write_back_units = g_slist_append( write_back_units, entry );
+}
+
+void
+ide_write_back_add_channel( libspectrum_ide_channel *chn )
+{
+  ide_write_back_add_unit( chn, LIBSPECTRUM_IDE_MASTER );
+  ide_write_back_add_unit( chn, LIBSPECTRUM_IDE_SLAVE );
+}
+
+void
+ide_write_back_remove( void *owner )
+{
+  GSList *ptr = write_back_units;
+
+  while( ptr ) {
+    ide_write_back_t *entry = ptr->data;
+    ptr = ptr->next;
+
+    if( entry->owner == owner ) {
+      write_back_units = g_slist_remove( write_back_units, entry );
+      libspectrum_free( entry );
+    }
+  }
+}
+
+/* Called once a frame. Every so often, write any sectors modified since the
+   last commit back to their images. libspectrum only keeps the written
+   sectors in memory and reads everything else straight from the image, so
+   this keeps memory use bounded for large cards and means a crash loses at
+   most a few seconds of writes */
+void
+ide_frame( void )
+{
+  GSList *ptr;
+
+  if( !settings_current.ide_write_back ) return;
+
+  if( ++write_back_frames < IDE_WRITE_BACK_FRAMES ) return;
+  write_back_frames = 0;
+
+  for( ptr = write_back_units; ptr; ptr = ptr->next ) {
+    ide_write_back_t *entry = ptr->data;
+    if( entry->is_dirty_fn( entry->context ) )
+      entry->commit_fn( entry->context );
+  }
+}
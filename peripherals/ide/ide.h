@@ -60,4 +60,15 @@ ide_eject_mass_storage(
     libspectrum_error (*eject_fn)( void *context ),
     void *context, const char *message, char **setting, ui_menu_item item );
 
+/* Periodic write back of modified sectors */
+void
+ide_write_back_add( int (*is_dirty_fn)( void *context ),
+                    libspectrum_error (*commit_fn)( void *context ),
+                    void *context );
+
+void ide_write_back_add_channel( libspectrum_ide_channel *chn );
+void ide_write_back_remove( void *owner );
+
+void ide_frame( void );
+
 #endif			/* #ifndef FUSE_IDE_H */
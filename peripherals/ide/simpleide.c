@@ -94,6 +94,7 @@ simpleide_init( void *context )
 static void
 simpleide_end( void )
 {
+  ide_write_back_remove( simpleide_idechn );
   libspectrum_ide_free( simpleide_idechn );
 }
 
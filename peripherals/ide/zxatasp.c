@@ -198,6 +198,7 @@ zxatasp_init( void *context )
 static void
 zxatasp_end( void )
 {
+  ide_write_back_remove( zxatasp_idechn0 );
   libspectrum_ide_free( zxatasp_idechn0 );
   libspectrum_ide_free( zxatasp_idechn1 );
 }
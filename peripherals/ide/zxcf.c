@@ -117,6 +117,7 @@ zxcf_init( void *context )
   last_memctl = 0x00;
                                 
   zxcf_idechn = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  ide_write_back_add_channel( zxcf_idechn );
 
   ui_menu_activate( UI_MENU_ITEM_MEDIA_IDE_ZXCF_EJECT, 0 );
 
@@ -143,6 +144,7 @@ zxcf_init( void *context )
 static void
 zxcf_end( void )
 {
+  ide_write_back_remove( zxcf_idechn );
   libspectrum_ide_free( zxcf_idechn );
 }
 
@@ -65,6 +65,8 @@ static libspectrum_mmc_card *card;
 static libspectrum_mmc_card *current_card;
 
 static void zxmmc_reset( int hard_reset );
+static int dirty_fn_wrapper( void *context );
+static libspectrum_error commit_fn_wrapper( void *context );
 static void zxmmc_enabled_snapshot( libspectrum_snap *snap );
 static void zxmmc_to_snapshot( libspectrum_snap *snap );
 
@@ -87,6 +89,7 @@ static int
 zxmmc_init( void *context )
 {
   card = libspectrum_mmc_alloc();
+  ide_write_back_add( dirty_fn_wrapper, commit_fn_wrapper, card );
 
   ui_menu_activate( eject_menu_item, 0 );
 
@@ -111,6 +114,7 @@ zxmmc_init( void *context )
 static void
 zxmmc_end( void )
 {
+  ide_write_back_remove( card );
   libspectrum_mmc_free( card );
 }
 
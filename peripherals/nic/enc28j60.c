@@ -31,9 +31,16 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef HAVE_PTHREAD
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD */
+
 #include "compat.h"
 #include "enc28j60.h"
 #include "fuse.h"
@@ -66,12 +73,19 @@
 #define ECON2(_x)             (_x)->registers[0][0x1e]
 #define ECON1(_x)             (_x)->registers[0][0x1f]
 
+#define ERXFCON(_x)           (_x)->registers[1][0x18]
 #define EPKTCNT(_x)           (_x)->registers[1][0x19]
 #define MIRDH(_x)             (_x)->registers[2][0x19]
 
 #define ECON1_RXEN            (0x04)
 #define ECON1_TXRTS           (0x08)
 #define ECON2_PKTDEC          (0x40)
+#define ERXFCON_UCEN          (0x80)
+#define ERXFCON_PMEN          (0x10)
+#define ERXFCON_MPEN          (0x08)
+#define ERXFCON_HTEN          (0x04)
+#define ERXFCON_MCEN          (0x02)
+#define ERXFCON_BCEN          (0x01)
 #define ESTAT_CLKRDY          (0x01)
 
 #define PHSTAT2_HI_LSTAT      (0x04)
@@ -100,8 +114,26 @@
 #define ETH_STATUS_NEXT_HI              (1)
 #define ETH_STATUS_LENGTH               (6)
 
+/* Length of a MAC address */
+#define ETH_ADDRESS_LENGTH              (6)
+
 /* ------------------------------------------------------------------------- */
 
+#ifdef HAVE_PTHREAD
+
+/* Number of received frames the I/O thread can hold while they wait for
+   space in the receive buffer */
+#define ENC28J60_RING_FRAMES            (16)
+
+typedef struct nic_enc28j60_frame_t {
+  ssize_t length;
+
+  /* Laid out as eth_rx_buf below */
+  libspectrum_byte data[ETH_STATUS_LENGTH + ETH_MAX];
+} nic_enc28j60_frame_t;
+
+#endif				/* #ifdef HAVE_PTHREAD */
+
 struct nic_enc28j60_t {
 
   /* Reserve 6 bytes before the Ethernet frame for next pointer + RSV */
@@ -117,6 +149,31 @@ struct nic_enc28j60_t {
   /* TAP file descriptor */
   int tap_fd;
 
+#ifdef HAVE_PTHREAD
+
+  /* ---------------------------------------------------------------------------
+   * Receive thread; everything below the mutex is protected by it
+   * ------------------------------------------------------------------------ */
+
+  pthread_t thread;
+  int thread_running;
+  int wake_pipe[2];
+
+  pthread_mutex_t mutex;
+
+  int stop;
+
+  /* Frames read from the TAP device, oldest first */
+  nic_enc28j60_frame_t ring[ ENC28J60_RING_FRAMES ];
+  size_t ring_head, ring_count;
+
+  /* Copies of the receive filter registers for the thread to use */
+  int receiving;
+  libspectrum_byte filter;
+  libspectrum_byte mac_address[ ETH_ADDRESS_LENGTH ];
+
+#endif				/* #ifdef HAVE_PTHREAD */
+
   /* ---------------------------------------------------------------------------
    * SPI state
    * ------------------------------------------------------------------------ */
@@ -132,71 +189,393 @@ struct nic_enc28j60_t {
 
 };
 
+#ifdef HAVE_PTHREAD
+static void start_io_thread( nic_enc28j60_t *self );
+static void stop_io_thread( nic_enc28j60_t *self );
+static void update_filter( nic_enc28j60_t *self );
+#endif				/* #ifdef HAVE_PTHREAD */
+
 nic_enc28j60_t*
 nic_enc28j60_alloc( void )
 {
-  nic_enc28j60_t *self = libspectrum_new( nic_enc28j60_t, 1 );
+  nic_enc28j60_t *self = libspectrum_new0( nic_enc28j60_t, 1 );
 
   self->tap_fd = -1;
   self->spi_state = SPI_IDLE;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init( &self->mutex, NULL );
+#endif				/* #ifdef HAVE_PTHREAD */
+
   return self;
 }
 
 void
 nic_enc28j60_init( nic_enc28j60_t *self )
 {
-  self->tap_fd = compat_get_tap( settings_current.speccyboot_tap );
+  nic_enc28j60_set_tap_fd( self,
+                           compat_get_tap( settings_current.speccyboot_tap ) );
+}
+
+void
+nic_enc28j60_set_tap_fd( nic_enc28j60_t *self, int tap_fd )
+{
+#ifdef HAVE_PTHREAD
+  stop_io_thread( self );
+#endif				/* #ifdef HAVE_PTHREAD */
+
+  self->tap_fd = tap_fd;
+
+#ifdef HAVE_PTHREAD
+  if ( tap_fd >= 0 )
+    start_io_thread( self );
+#endif				/* #ifdef HAVE_PTHREAD */
 }
 
 void
 nic_enc28j60_free( nic_enc28j60_t *self )
 {
+#ifdef HAVE_PTHREAD
+  stop_io_thread( self );
+  pthread_mutex_destroy( &self->mutex );
+#endif				/* #ifdef HAVE_PTHREAD */
+
   libspectrum_free( self );
 }
 
+/* Copy a frame read from the TAP device, with room for the status info in
+   front of it, into the receive buffer. Returns non-zero if there isn't
+   space for it yet; frames which could never fit are dropped */
+static int
+store_frame( nic_enc28j60_t *self, libspectrum_byte *buf, ssize_t n )
+{
+  libspectrum_word erxwrpt = GET_PTR_REG( self, ERXWRPT );
+  libspectrum_word erxrdpt = GET_PTR_REG( self, ERXRDPT );
+  libspectrum_word erxst   = GET_PTR_REG( self, ERXST );
+  libspectrum_word erxnd   = GET_PTR_REG( self, ERXND );
+
+  /* Round total_length upwards to an even value */
+  libspectrum_word total_length = (ETH_STATUS_LENGTH + n + 1) & 0x1ffe;
+  libspectrum_word next_addr    = erxwrpt + total_length;
+
+  /* Sanity check */
+  if (erxwrpt > erxnd)
+    return 0;
+
+  /* Like the real chip, never write over data the Spectrum hasn't yet
+     finished with. Only check when the pointers make sense, so odd
+     configurations still get frames as they always did */
+  if ( erxst <= erxrdpt && erxrdpt <= erxnd && erxst <= erxwrpt ) {
+    libspectrum_word size = erxnd - erxst + 1;
+    libspectrum_word used = ( erxwrpt + size - erxrdpt ) % size;
+
+    /* A frame bigger than the whole buffer would never fit, so drop it
+       rather than holding up the frames behind it */
+    if ( total_length >= size )
+      return 0;
+
+    if ( used + total_length >= size )
+      return 1;
+  }
+
+  if ( next_addr > erxnd ) {  /* FIFO wrap-around? */  
+    libspectrum_word first_part = (erxnd - erxwrpt) + 1;
+
+    next_addr = (next_addr - erxnd) + erxst;
+        
+    buf[ ETH_STATUS_NEXT_LO ] = LOBYTE( next_addr );
+    buf[ ETH_STATUS_NEXT_HI ] = HIBYTE( next_addr );
+    
+    memcpy( self->sram + erxwrpt, buf, first_part );
+    memcpy( self->sram + erxst, buf + first_part, total_length - first_part );
+  } else {         
+    buf[ ETH_STATUS_NEXT_LO ] = LOBYTE( next_addr );
+    buf[ ETH_STATUS_NEXT_HI ] = HIBYTE( next_addr );
+
+    memcpy( self->sram + erxwrpt, buf, total_length );
+  }
+
+  SET_PTR_REG( self, ERXWRPT, next_addr );
+
+  ++EPKTCNT(self);
+
+  return 0;
+}
+
+/* Would the receive filters (ENC28J60 data sheet, section 8) let this
+   frame through? Only the unicast, multicast and broadcast filters are
+   emulated, combined as in OR mode; if any of the others are enabled,
+   everything gets through for the Spectrum to sort out */
+static int
+frame_accepted( const libspectrum_byte *frame, ssize_t length,
+                libspectrum_byte filter, const libspectrum_byte *mac_address )
+{
+  static const libspectrum_byte broadcast[ ETH_ADDRESS_LENGTH ] =
+    { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+  if ( length < ETH_ADDRESS_LENGTH )
+    return 0;
+
+  if ( filter & ( ERXFCON_PMEN | ERXFCON_MPEN | ERXFCON_HTEN ) ||
+       !( filter & ( ERXFCON_UCEN | ERXFCON_MCEN | ERXFCON_BCEN ) ) )
+    return 1;
+
+  if ( ( filter & ERXFCON_BCEN ) &&
+       !memcmp( frame, broadcast, ETH_ADDRESS_LENGTH ) )
+    return 1;
+
+  if ( ( filter & ERXFCON_MCEN ) && ( frame[0] & 0x01 ) )
+    return 1;
+
+  return ( filter & ERXFCON_UCEN ) &&
+         !memcmp( frame, mac_address, ETH_ADDRESS_LENGTH );
+}
+
+/* MAADR1, the first byte on the wire, lives at 0x04 in bank 3 */
+static void
+get_mac_address( nic_enc28j60_t *self, libspectrum_byte *mac_address )
+{
+  mac_address[0] = self->registers[3][0x04];
+  mac_address[1] = self->registers[3][0x05];
+  mac_address[2] = self->registers[3][0x02];
+  mac_address[3] = self->registers[3][0x03];
+  mac_address[4] = self->registers[3][0x00];
+  mac_address[5] = self->registers[3][0x01];
+}
+
+#ifdef HAVE_PTHREAD
+
+/* ---------------------------------------------------------------------------
+ * Receive thread
+ *
+ * The thread waits on the TAP device, filters what arrives and queues it
+ * in the ring; nic_enc28j60_poll() then only has to copy queued frames
+ * into the receive buffer, so the emulation never waits on a system
+ * call. The copy stays on the emulation thread as the Spectrum reads the
+ * buffer memory and registers without any locking.
+ * ------------------------------------------------------------------------ */
+
+static void
+wake_io_thread( nic_enc28j60_t *self )
+{
+  const char dummy = 0;
+
+  /* If the pipe's full, the thread has plenty of wake ups pending already */
+  if ( write( self->wake_pipe[1], &dummy, 1 ) == -1 ) {
+    /* Do nothing */
+  }
+}
+
+static void*
+io_thread( void *arg )
+{
+  nic_enc28j60_t *self = arg;
+  nic_enc28j60_frame_t *frame;
+  struct pollfd fds[2];
+  char dummy[ 64 ];
+  ssize_t n;
+
+  fds[0].fd = self->wake_pipe[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = self->tap_fd;
+
+  while ( 1 ) {
+    pthread_mutex_lock( &self->mutex );
+
+    if ( self->stop ) {
+      pthread_mutex_unlock( &self->mutex );
+      break;
+    }
+
+    /* Once the ring is full, leave further frames in the TAP device */
+    if ( self->ring_count < ENC28J60_RING_FRAMES ) {
+      frame = &self->ring[ ( self->ring_head + self->ring_count ) %
+                           ENC28J60_RING_FRAMES ];
+      fds[1].events = POLLIN;
+    } else {
+      frame = NULL;
+      fds[1].events = 0;
+    }
+
+    pthread_mutex_unlock( &self->mutex );
+
+    if ( poll( fds, 2, -1 ) == -1 ) {
+      if ( errno == EINTR )
+        continue;
+      break;
+    }
+
+    if ( fds[0].revents & POLLIN ) {
+      while ( read( self->wake_pipe[0], dummy, sizeof( dummy ) ) > 0 );
+    }
+
+    if ( fds[1].revents & POLLNVAL )
+      break;
+
+    if ( !frame || !( fds[1].revents & ( POLLIN | POLLERR | POLLHUP ) ) )
+      continue;
+
+    /* The emulation thread only looks at the frames already counted, so
+       this slot is ours until we count it */
+    n = read( fds[1].fd, frame->data + ETH_STATUS_LENGTH, ETH_MAX );
+    if ( n == -1 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+        continue;
+      break;
+    }
+
+    /* The TAP device has gone away */
+    if ( n == 0 )
+      break;
+
+    pthread_mutex_lock( &self->mutex );
+
+    /* Like the real chip, drop frames which arrive while reception is
+       disabled */
+    if ( self->receiving &&
+         frame_accepted( frame->data + ETH_STATUS_LENGTH, n, self->filter,
+                         self->mac_address ) ) {
+      frame->length = n;
+      self->ring_count++;
+    }
+
+    pthread_mutex_unlock( &self->mutex );
+  }
+
+  return NULL;
+}
+
+static void
+start_io_thread( nic_enc28j60_t *self )
+{
+  int error;
+
+  if ( pipe( self->wake_pipe ) ) {
+    ui_error( UI_ERROR_ERROR, "%s:%d: couldn't create pipe: %s", __FILE__,
+              __LINE__, strerror( errno ) );
+    return;
+  }
+
+  fcntl( self->wake_pipe[0], F_SETFL, O_NONBLOCK );
+  fcntl( self->wake_pipe[1], F_SETFL, O_NONBLOCK );
+
+  self->stop = 0;
+  self->ring_head = self->ring_count = 0;
+  update_filter( self );
+
+  error = pthread_create( &self->thread, NULL, io_thread, self );
+  if ( error ) {
+    ui_error( UI_ERROR_ERROR, "%s:%d: error %d creating thread", __FILE__,
+              __LINE__, error );
+    close( self->wake_pipe[0] );
+    close( self->wake_pipe[1] );
+    return;
+  }
+
+  self->thread_running = 1;
+}
+
+static void
+stop_io_thread( nic_enc28j60_t *self )
+{
+  if ( !self->thread_running )
+    return;
+
+  pthread_mutex_lock( &self->mutex );
+  self->stop = 1;
+  pthread_mutex_unlock( &self->mutex );
+
+  wake_io_thread( self );
+  pthread_join( self->thread, NULL );
+
+  close( self->wake_pipe[0] );
+  close( self->wake_pipe[1] );
+
+  self->thread_running = 0;
+}
+
+/* Pass the receive filter settings on to the thread */
+static void
+update_filter( nic_enc28j60_t *self )
+{
+  int was_full = 0;
+
+  pthread_mutex_lock( &self->mutex );
+
+  self->receiving = ECON1(self) & ECON1_RXEN;
+  self->filter = ERXFCON(self);
+  get_mac_address( self, self->mac_address );
+
+  /* Frames still queued when reception is disabled are lost, as they
+     would be on the real chip. Skip over them rather than resetting the
+     ring so the slot the thread may be reading into stays the next one */
+  if ( !self->receiving ) {
+    was_full = self->ring_count == ENC28J60_RING_FRAMES;
+    self->ring_head = ( self->ring_head + self->ring_count ) %
+                      ENC28J60_RING_FRAMES;
+    self->ring_count = 0;
+  }
+
+  pthread_mutex_unlock( &self->mutex );
+
+  if ( was_full && self->thread_running )
+    wake_io_thread( self );
+}
+
+/* Move frames the thread has queued into the receive buffer */
+static void
+store_queued_frames( nic_enc28j60_t *self )
+{
+  int was_full;
+  size_t stored = 0;
+
+  pthread_mutex_lock( &self->mutex );
+
+  was_full = self->ring_count == ENC28J60_RING_FRAMES;
+
+  while ( self->ring_count ) {
+    nic_enc28j60_frame_t *frame = &self->ring[ self->ring_head ];
+
+    if ( store_frame( self, frame->data, frame->length ) )
+      break;
+
+    self->ring_head = ( self->ring_head + 1 ) % ENC28J60_RING_FRAMES;
+    self->ring_count--;
+    stored++;
+  }
+
+  pthread_mutex_unlock( &self->mutex );
+
+  if ( was_full && stored )
+    wake_io_thread( self );
+}
+
+#endif				/* #ifdef HAVE_PTHREAD */
+
 /* Poll for received frames. */
 void
 nic_enc28j60_poll( nic_enc28j60_t *self )
 {
+  libspectrum_byte mac_address[ ETH_ADDRESS_LENGTH ];
   ssize_t n;
 
-  if ( (ECON1(self) & ECON1_RXEN)     /* Ethernet RX enabled? */
-       && self->tap_fd > 0
-       && (n = read( self->tap_fd,
-                     self->eth_rx_buf + ETH_STATUS_LENGTH,
-                     ETH_MAX )) > 0) {
-    libspectrum_word erxwrpt = GET_PTR_REG( self, ERXWRPT );
-    libspectrum_word erxst   = GET_PTR_REG( self, ERXST );
-    libspectrum_word erxnd   = GET_PTR_REG( self, ERXND );
-
-    /* Round total_length upwards to an even value */
-    libspectrum_word total_length = (ETH_STATUS_LENGTH + n + 1) & 0x1ffe;
-    libspectrum_word next_addr    = erxwrpt + total_length;
-
-    /* Sanity check */
-    if (erxwrpt > erxnd)
-      return;
-
-    if ( next_addr > erxnd ) {  /* FIFO wrap-around? */  
-      libspectrum_word first_part = (erxnd - erxwrpt) + 1;
-
-      next_addr = (next_addr - erxnd) + erxst;
-          
-      self->eth_rx_buf[ ETH_STATUS_NEXT_LO ] = LOBYTE( next_addr );
-      self->eth_rx_buf[ ETH_STATUS_NEXT_HI ] = HIBYTE( next_addr );
-      
-      memcpy( self->sram + erxwrpt, self->eth_rx_buf, first_part );
-      memcpy( self->sram + erxst, self->eth_rx_buf + first_part, total_length - first_part );
-    } else {         
-      self->eth_rx_buf[ ETH_STATUS_NEXT_LO ] = LOBYTE( next_addr );
-      self->eth_rx_buf[ ETH_STATUS_NEXT_HI ] = HIBYTE( next_addr );
-
-      memcpy( self->sram + erxwrpt, self->eth_rx_buf, total_length );
-    }
-
-    SET_PTR_REG( self, ERXWRPT, next_addr );
+  if ( !(ECON1(self) & ECON1_RXEN)    /* Ethernet RX enabled? */
+       || self->tap_fd <= 0 )
+    return;
 
-    ++EPKTCNT(self);
+#ifdef HAVE_PTHREAD
+  if ( self->thread_running ) {
+    store_queued_frames( self );
+    return;
+  }
+#endif				/* #ifdef HAVE_PTHREAD */
+
+  n = read( self->tap_fd, self->eth_rx_buf + ETH_STATUS_LENGTH, ETH_MAX );
+  if ( n > 0 ) {
+    get_mac_address( self, mac_address );
+    if ( frame_accepted( self->eth_rx_buf + ETH_STATUS_LENGTH, n,
+                         ERXFCON(self), mac_address ) )
+      store_frame( self, self->eth_rx_buf, n );
   }
 }
 
@@ -211,7 +590,7 @@ perform_side_effects_for_write( nic_enc28j60_t *self )
     if ( frame_end > frame_start && self->tap_fd >= 0) {
       ssize_t length = (frame_end - frame_start) + 1;
       if ( write( self->tap_fd, self->sram + frame_start, length ) != length )
-        self->tap_fd = -1; /* write failed: disable TAP */
+        nic_enc28j60_set_tap_fd( self, -1 ); /* write failed: disable TAP */
     }
 
     ECON1(self) &= ~ECON1_TXRTS;
@@ -221,6 +600,14 @@ perform_side_effects_for_write( nic_enc28j60_t *self )
     --EPKTCNT(self);
     ECON2(self) &= ~ECON2_PKTDEC;
   }
+
+#ifdef HAVE_PTHREAD
+  /* ECON1 (in every bank), ERXFCON or one of the MAADR registers */
+  if ( self->curr_register == 0x1f ||
+       ( self->curr_register_bank == 1 && self->curr_register == 0x18 ) ||
+       ( self->curr_register_bank == 3 && self->curr_register <= 0x05 ) )
+    update_filter( self );
+#endif				/* #ifdef HAVE_PTHREAD */
 }
 
 void
@@ -239,6 +626,10 @@ nic_enc28j60_reset( nic_enc28j60_t *self )
 
   MIRDH(self) = PHSTAT2_HI_LSTAT;  /* Assume PHSTAT2 is mapped to MIRDH */
   ESTAT(self) = ESTAT_CLKRDY;
+
+#ifdef HAVE_PTHREAD
+  update_filter( self );
+#endif				/* #ifdef HAVE_PTHREAD */
 }
 
 /* Produce one bit for MISO for the next IN I/O operation */
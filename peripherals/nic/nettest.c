@@ -0,0 +1,1097 @@
+/* nettest.c: Loopback throughput and edge case tests for the emulated NICs
+   Copyright (c) 2026 Fuse contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/* This drives the W5100 (Spectranet) and ENC28J60 (SpeccyBoot) models
+   through the same register and SPI accesses the Spectrum-side software
+   makes, against echo servers on 127.0.0.1 (for the W5100) and a
+   socketpair standing in for the TAP device (for the ENC28J60):
+
+   - a TCP echo transfer and a UDP ping-pong through the W5100, and a frame
+     echo through the ENC28J60, each checked byte for byte and reported as
+     bytes per emulated second and host CPU time per byte;
+   - socket edge cases: closed sockets, listen and accept, the peer closing,
+     a full receive buffer, closing with a send pending and a chip reset;
+   - ENC28J60 edge cases: frames arriving with reception disabled, receive
+     buffer wrap, empty transmits and the system reset command.
+
+   Emulated time is estimated by charging a nominal number of T-states for
+   each W5100 access or SPI bit, which is about what the Spectrum-side
+   loops take. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "libspectrum.h"
+
+#include "compat.h"
+#include "fuse.h"
+#include "peripherals/nic/w5100.h"
+#include "peripherals/nic/w5100_internals.h"
+#ifdef BUILD_SPECCYBOOT
+#include "peripherals/nic/enc28j60.h"
+#endif
+#include "settings.h"
+#include "ui/ui.h"
+
+/* Nominal Spectrum clock speed */
+#define NOMINAL_CLOCK 3500000
+
+/* The Spectranet pages the W5100 into memory; a block copy takes 21
+   T-states per byte */
+#define W5100_TSTATES_PER_ACCESS 21
+
+/* SpeccyBoot bit-bangs SPI: an OUT to raise SCK, an IN to sample MISO and
+   an OUT to drop SCK again, plus shifting */
+#define ENC28J60_TSTATES_PER_BIT 48
+
+/* Give up on anything which takes longer than this, in seconds */
+#define TIMEOUT 10
+
+/* The W5100 commands */
+#define W5100_OPEN 0x01
+#define W5100_LISTEN 0x02
+#define W5100_CONNECT 0x04
+#define W5100_DISCON 0x08
+#define W5100_CLOSE 0x10
+#define W5100_SEND 0x20
+#define W5100_RECV 0x40
+
+#define SOCKET_REG( n, reg ) ( 0x400 + ( n ) * 0x100 + ( reg ) )
+#define TX_BUFFER( n ) ( 0x4000 + ( n ) * 0x800 )
+#define RX_BUFFER( n ) ( 0x6000 + ( n ) * 0x800 )
+
+static const char *progname;		/* argv[0] */
+
+/* Count of W5100 accesses or SPI bits, for the emulated time */
+static unsigned long accesses;
+
+settings_info settings_current;
+
+typedef struct stats_t {
+  double wall;
+  clock_t cpu;
+  unsigned long accesses;
+} stats_t;
+
+/* A host-side socket which sends back everything it receives */
+typedef struct echo_t {
+  int fd;
+  libspectrum_byte buffer[ 0x4000 ];
+  size_t length;
+} echo_t;
+
+static int w5100_tcp_test( size_t total );
+static int w5100_udp_test( size_t total );
+static int w5100_edge_tests( void );
+#ifdef BUILD_SPECCYBOOT
+static int enc28j60_echo_test( size_t total );
+static int enc28j60_edge_tests( void );
+#endif
+
+int
+main( int argc, char **argv )
+{
+  size_t total = 0x40000;
+  int error = 0;
+
+  progname = argv[0];
+
+  if( argc == 3 && !strcmp( argv[1], "-n" ) ) {
+    total = strtoul( argv[2], NULL, 0 );
+  } else if( argc != 1 ) {
+    fprintf( stderr, "Usage: %s [-n <bytes>]\n", progname );
+    return 1;
+  }
+
+  if( libspectrum_init() ) return 1;
+
+  if( w5100_edge_tests() ) error = 1;
+  if( w5100_tcp_test( total ) ) error = 1;
+  if( w5100_udp_test( total / 4 ) ) error = 1;
+
+#ifdef BUILD_SPECCYBOOT
+  if( enc28j60_edge_tests() ) error = 1;
+  if( enc28j60_echo_test( total / 4 ) ) error = 1;
+#endif
+
+  return error;
+}
+
+/* Things the NIC code needs from the rest of Fuse */
+
+int
+ui_error( ui_error_level severity GCC_UNUSED, const char *format, ... )
+{
+  va_list ap;
+
+  va_start( ap, format );
+  fprintf( stderr, "%s: ", progname );
+  vfprintf( stderr, format, ap );
+  fputc( '\n', stderr );
+  va_end( ap );
+
+  return 0;
+}
+
+void
+fuse_abort( void )
+{
+  abort();
+}
+
+/* Helpers */
+
+static double
+get_time( void )
+{
+  struct timeval tv;
+
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+stats_start( stats_t *stats )
+{
+  stats->wall = get_time();
+  stats->cpu = clock();
+  stats->accesses = accesses;
+}
+
+static void
+stats_report( const char *what, const stats_t *stats, size_t bytes,
+	      int tstates_per_access )
+{
+  double wall = get_time() - stats->wall;
+  double cpu = (double)( clock() - stats->cpu ) / CLOCKS_PER_SEC;
+  double emulated = (double)( accesses - stats->accesses ) *
+    tstates_per_access / NOMINAL_CLOCK;
+
+  printf( "%s: %lu bytes; %.0f bytes per emulated second; "
+	  "%.1f ns host CPU per byte; %.2f s\n", what, (unsigned long)bytes,
+	  emulated > 0 ? bytes / emulated : 0, bytes ? cpu * 1e9 / bytes : 0,
+	  wall );
+}
+
+static int
+failed( const char *what, const char *message )
+{
+  fprintf( stderr, "%s: %s: %s\n", progname, what, message );
+  return 1;
+}
+
+static int
+timed_out( double start )
+{
+  return get_time() - start > TIMEOUT;
+}
+
+/* The test data; varies with each of the low bytes of the offset so
+   misplaced wraps show up */
+static libspectrum_byte
+pattern( size_t offset )
+{
+  return ( offset ^ ( offset >> 8 ) ^ ( offset >> 16 ) ) & 0xff;
+}
+
+static void
+fill_pattern( libspectrum_byte *buffer, size_t offset, size_t length )
+{
+  size_t i;
+  for( i = 0; i < length; i++ ) buffer[i] = pattern( offset + i );
+}
+
+static int
+check_pattern( const libspectrum_byte *buffer, size_t offset, size_t length )
+{
+  size_t i;
+  for( i = 0; i < length; i++ )
+    if( buffer[i] != pattern( offset + i ) ) return 1;
+  return 0;
+}
+
+static int
+host_socket( int type, struct sockaddr_in *sa )
+{
+  socklen_t length = sizeof( *sa );
+  int fd, one = 1;
+
+  fd = socket( AF_INET, type, 0 );
+  if( fd == -1 ) return -1;
+
+  setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+  memset( sa, 0, sizeof( *sa ) );
+  sa->sin_family = AF_INET;
+  sa->sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+  if( bind( fd, (struct sockaddr*)sa, sizeof( *sa ) ) == -1 ||
+      getsockname( fd, (struct sockaddr*)sa, &length ) == -1 ||
+      ( type == SOCK_STREAM && listen( fd, 4 ) == -1 ) ) {
+    close( fd );
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Read and send back whatever's available without blocking. Returns -1 once
+   the other end has closed the connection */
+static int
+echo_pump( echo_t *echo )
+{
+  ssize_t n;
+
+  if( echo->length < sizeof( echo->buffer ) ) {
+    n = recv( echo->fd, echo->buffer + echo->length,
+	      sizeof( echo->buffer ) - echo->length, MSG_DONTWAIT );
+    if( n == 0 ) return -1;
+    if( n > 0 ) echo->length += n;
+  }
+
+  if( echo->length ) {
+    n = send( echo->fd, echo->buffer, echo->length, MSG_DONTWAIT );
+    if( n > 0 ) {
+      memmove( echo->buffer, echo->buffer + n, echo->length - n );
+      echo->length -= n;
+    }
+  }
+
+  return 0;
+}
+
+/* W5100 accesses as the Spectranet makes them */
+
+static libspectrum_byte
+w_read( nic_w5100_t *w, libspectrum_word reg )
+{
+  accesses++;
+  return nic_w5100_read( w, reg );
+}
+
+static void
+w_write( nic_w5100_t *w, libspectrum_word reg, libspectrum_byte b )
+{
+  accesses++;
+  nic_w5100_write( w, reg, b );
+}
+
+static libspectrum_word
+w_read16( nic_w5100_t *w, libspectrum_word reg )
+{
+  libspectrum_word high = w_read( w, reg );
+  return ( high << 8 ) | w_read( w, reg + 1 );
+}
+
+static void
+w_write16( nic_w5100_t *w, libspectrum_word reg, libspectrum_word value )
+{
+  w_write( w, reg, value >> 8 );
+  w_write( w, reg + 1, value & 0xff );
+}
+
+static libspectrum_byte
+w_state( nic_w5100_t *w, int n )
+{
+  return w_read( w, SOCKET_REG( n, W5100_SOCKET_SR ) );
+}
+
+static void
+w_command( nic_w5100_t *w, int n, libspectrum_byte command )
+{
+  w_write( w, SOCKET_REG( n, W5100_SOCKET_CR ), command );
+}
+
+static int
+w_wait_state( nic_w5100_t *w, int n, libspectrum_byte state )
+{
+  double start = get_time();
+
+  while( w_state( w, n ) != state ) {
+    if( timed_out( start ) ) return 1;
+    usleep( 1000 );
+  }
+
+  return 0;
+}
+
+static void
+w_set_address( nic_w5100_t *w, int n, const struct sockaddr_in *sa )
+{
+  const libspectrum_byte *ip = (const libspectrum_byte*)&sa->sin_addr.s_addr;
+  const libspectrum_byte *port = (const libspectrum_byte*)&sa->sin_port;
+  int i;
+
+  for( i = 0; i < 4; i++ )
+    w_write( w, SOCKET_REG( n, W5100_SOCKET_DIPR0 + i ), ip[i] );
+  w_write( w, SOCKET_REG( n, W5100_SOCKET_DPORT0 ), port[0] );
+  w_write( w, SOCKET_REG( n, W5100_SOCKET_DPORT1 ), port[1] );
+}
+
+static void
+w_set_port( nic_w5100_t *w, int n, libspectrum_word port )
+{
+  w_write( w, SOCKET_REG( n, W5100_SOCKET_PORT0 ), port >> 8 );
+  w_write( w, SOCKET_REG( n, W5100_SOCKET_PORT1 ), port & 0xff );
+}
+
+static nic_w5100_t*
+w_alloc( void )
+{
+  nic_w5100_t *w = nic_w5100_alloc();
+
+  /* Our address is 127.0.0.1 */
+  w_write( w, 0x00f, 127 );
+  w_write( w, 0x010, 0 );
+  w_write( w, 0x011, 0 );
+  w_write( w, 0x012, 1 );
+
+  return w;
+}
+
+/* Open socket `n' in TCP mode and connect it to `sa' */
+static int
+w_connect( nic_w5100_t *w, int n, const struct sockaddr_in *sa )
+{
+  w_write( w, SOCKET_REG( n, W5100_SOCKET_MR ), 0x21 );
+  w_command( w, n, W5100_OPEN );
+  if( w_state( w, n ) != W5100_SOCKET_STATE_INIT ) return 1;
+
+  w_set_port( w, n, 0 );
+  w_set_address( w, n, sa );
+  w_command( w, n, W5100_CONNECT );
+
+  return w_state( w, n ) != W5100_SOCKET_STATE_ESTABLISHED;
+}
+
+/* Copy as much of `data' as there's room for into the transmit buffer and
+   send it; returns the number of bytes sent */
+static size_t
+w_send( nic_w5100_t *w, int n, const libspectrum_byte *data, size_t length )
+{
+  libspectrum_word free_size, wr;
+  size_t i;
+
+  free_size = w_read16( w, SOCKET_REG( n, W5100_SOCKET_TX_FSR0 ) );
+  if( length > free_size ) length = free_size;
+  if( !length ) return 0;
+
+  wr = w_read16( w, SOCKET_REG( n, W5100_SOCKET_TX_WR0 ) );
+  for( i = 0; i < length; i++ )
+    w_write( w, TX_BUFFER( n ) + ( ( wr + i ) & 0x7ff ), data[i] );
+  w_write16( w, SOCKET_REG( n, W5100_SOCKET_TX_WR0 ), wr + length );
+  w_command( w, n, W5100_SEND );
+
+  return length;
+}
+
+/* Copy up to `length' received bytes out of the receive buffer; returns the
+   number of bytes received */
+static size_t
+w_recv( nic_w5100_t *w, int n, libspectrum_byte *data, size_t length )
+{
+  libspectrum_word size, rd;
+  size_t i;
+
+  size = w_read16( w, SOCKET_REG( n, W5100_SOCKET_RX_RSR0 ) );
+  if( length > size ) length = size;
+  if( !length ) return 0;
+
+  rd = w_read16( w, SOCKET_REG( n, W5100_SOCKET_RX_RD0 ) );
+  for( i = 0; i < length; i++ )
+    data[i] = w_read( w, RX_BUFFER( n ) + ( ( rd + i ) & 0x7ff ) );
+  w_write16( w, SOCKET_REG( n, W5100_SOCKET_RX_RD0 ), rd + length );
+  w_command( w, n, W5100_RECV );
+
+  return length;
+}
+
+/* The W5100 tests */
+
+static int
+w5100_tcp_test( size_t total )
+{
+  const char *what = "W5100 TCP echo";
+  libspectrum_byte data[ 0x800 ];
+  size_t sent = 0, received = 0, length;
+  struct sockaddr_in sa;
+  nic_w5100_t *w;
+  echo_t *echo;
+  stats_t stats;
+  double start;
+  int listener, error = 0;
+
+  listener = host_socket( SOCK_STREAM, &sa );
+  if( listener == -1 ) return failed( what, strerror( errno ) );
+
+  w = w_alloc();
+  echo = libspectrum_new( echo_t, 1 );
+  echo->length = 0;
+  echo->fd = -1;
+
+  if( w_connect( w, 0, &sa ) ||
+      ( echo->fd = accept( listener, NULL, NULL ) ) == -1 ) {
+    error = failed( what, "couldn't connect" );
+    goto end;
+  }
+
+  stats_start( &stats );
+  start = get_time();
+
+  while( received < total ) {
+    if( timed_out( start ) ) {
+      error = failed( what, "timed out" );
+      goto end;
+    }
+
+    if( sent < total ) {
+      length = total - sent < sizeof( data ) ? total - sent : sizeof( data );
+      fill_pattern( data, sent, length );
+      sent += w_send( w, 0, data, length );
+    }
+
+    if( echo_pump( echo ) ) {
+      error = failed( what, "connection closed" );
+      goto end;
+    }
+
+    length = w_recv( w, 0, data, sizeof( data ) );
+    if( check_pattern( data, received, length ) ) {
+      error = failed( what, "data corrupted" );
+      goto end;
+    }
+    received += length;
+  }
+
+  stats_report( what, &stats, total, W5100_TSTATES_PER_ACCESS );
+
+  w_command( w, 0, W5100_DISCON );
+  w_command( w, 0, W5100_CLOSE );
+
+ end:
+  nic_w5100_free( w );
+  if( echo->fd != -1 ) close( echo->fd );
+  libspectrum_free( echo );
+  close( listener );
+
+  return error;
+}
+
+static int
+w5100_udp_test( size_t total )
+{
+  const char *what = "W5100 UDP echo";
+  const size_t datagram = 1000;
+  libspectrum_byte data[ 0x800 ];
+  size_t done = 0, length;
+  struct sockaddr_in sa, from;
+  socklen_t from_length;
+  nic_w5100_t *w;
+  stats_t stats;
+  double start;
+  ssize_t n;
+  int fd, error = 0;
+
+  fd = host_socket( SOCK_DGRAM, &sa );
+  if( fd == -1 ) return failed( what, strerror( errno ) );
+
+  w = w_alloc();
+
+  w_write( w, SOCKET_REG( 0, W5100_SOCKET_MR ), 0x02 );
+  w_command( w, 0, W5100_OPEN );
+  if( w_state( w, 0 ) != W5100_SOCKET_STATE_UDP ) {
+    error = failed( what, "couldn't open socket" );
+    goto end;
+  }
+  w_set_port( w, 0, 0 );
+  w_set_address( w, 0, &sa );
+
+  stats_start( &stats );
+  start = get_time();
+
+  while( done < total ) {
+    length = total - done < datagram ? total - done : datagram;
+
+    fill_pattern( data, done, length );
+    while( w_send( w, 0, data, length ) != length ) {
+      if( timed_out( start ) ) {
+	error = failed( what, "timed out sending" );
+	goto end;
+      }
+    }
+
+    /* Send it straight back to wherever it came from */
+    do {
+      from_length = sizeof( from );
+      n = recvfrom( fd, data, sizeof( data ), MSG_DONTWAIT,
+		    (struct sockaddr*)&from, &from_length );
+      if( timed_out( start ) ) {
+	error = failed( what, "timed out echoing" );
+	goto end;
+      }
+    } while( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) );
+
+    if( n != (ssize_t)length || check_pattern( data, done, length ) ) {
+      error = failed( what, "datagram corrupted on the way out" );
+      goto end;
+    }
+    sendto( fd, data, n, 0, (struct sockaddr*)&from, from_length );
+
+    /* Each datagram comes with an 8 byte header: address, port and length */
+    while( w_read16( w, SOCKET_REG( 0, W5100_SOCKET_RX_RSR0 ) ) <
+	   length + 8 ) {
+      if( timed_out( start ) ) {
+	error = failed( what, "timed out receiving" );
+	goto end;
+      }
+    }
+
+    if( w_recv( w, 0, data, length + 8 ) != length + 8 ||
+	memcmp( data, &sa.sin_addr.s_addr, 4 ) ||
+	memcmp( data + 4, &sa.sin_port, 2 ) ||
+	( data[6] << 8 | data[7] ) != length ||
+	check_pattern( data + 8, done, length ) ) {
+      error = failed( what, "datagram corrupted on the way back" );
+      goto end;
+    }
+
+    done += length;
+  }
+
+  stats_report( what, &stats, total, W5100_TSTATES_PER_ACCESS );
+
+  w_command( w, 0, W5100_CLOSE );
+
+ end:
+  nic_w5100_free( w );
+  close( fd );
+
+  return error;
+}
+
+/* Find a local port which is free right now */
+static libspectrum_word
+free_port( void )
+{
+  struct sockaddr_in sa;
+  int fd = host_socket( SOCK_STREAM, &sa );
+
+  if( fd == -1 ) return 0;
+  close( fd );
+
+  return ntohs( sa.sin_port );
+}
+
+static int
+w5100_edge_tests( void )
+{
+  const char *what = "W5100 edge cases";
+  libspectrum_byte data[ 0x800 ];
+  struct sockaddr_in sa, listen_sa;
+  libspectrum_word port, size, max_size;
+  size_t received, length;
+  nic_w5100_t *w;
+  double start;
+  int listener, fd = -1, peer = -1, i, error = 0;
+
+  listener = host_socket( SOCK_STREAM, &sa );
+  if( listener == -1 ) return failed( what, strerror( errno ) );
+
+  w = w_alloc();
+
+  /* Closed sockets: commands are ignored and the buffers look empty */
+  for( i = 0; i < 4; i++ ) {
+    w_command( w, i, W5100_SEND );
+    w_command( w, i, W5100_RECV );
+    w_command( w, i, W5100_CLOSE );
+    if( w_state( w, i ) != W5100_SOCKET_STATE_CLOSED ||
+	w_read16( w, SOCKET_REG( i, W5100_SOCKET_TX_FSR0 ) ) != 0x800 ||
+	w_read16( w, SOCKET_REG( i, W5100_SOCKET_RX_RSR0 ) ) != 0 ) {
+      error = failed( what, "closed socket not idle" );
+      goto end;
+    }
+  }
+
+  /* Listen and accept, then the peer closing the connection */
+  port = free_port();
+  w_write( w, SOCKET_REG( 1, W5100_SOCKET_MR ), 0x21 );
+  w_command( w, 1, W5100_OPEN );
+  w_set_port( w, 1, port );
+  w_command( w, 1, W5100_LISTEN );
+  if( w_state( w, 1 ) != W5100_SOCKET_STATE_LISTEN ) {
+    error = failed( what, "couldn't listen" );
+    goto end;
+  }
+
+  listen_sa = sa;
+  listen_sa.sin_port = htons( port );
+  fd = socket( AF_INET, SOCK_STREAM, 0 );
+  if( fd == -1 ||
+      connect( fd, (struct sockaddr*)&listen_sa, sizeof( listen_sa ) ) ||
+      w_wait_state( w, 1, W5100_SOCKET_STATE_ESTABLISHED ) ) {
+    error = failed( what, "connection not accepted" );
+    goto end;
+  }
+
+  fill_pattern( data, 0, 100 );
+  if( send( fd, data, 100, 0 ) != 100 ) {
+    error = failed( what, strerror( errno ) );
+    goto end;
+  }
+  close( fd ); fd = -1;
+
+  if( w_wait_state( w, 1, W5100_SOCKET_STATE_CLOSE_WAIT ) ||
+      w_recv( w, 1, data, sizeof( data ) ) != 100 ||
+      check_pattern( data, 0, 100 ) ) {
+    error = failed( what, "data lost when peer closed" );
+    goto end;
+  }
+
+  w_command( w, 1, W5100_DISCON );
+  if( w_state( w, 1 ) != W5100_SOCKET_STATE_CLOSED ||
+      !( w_read( w, SOCKET_REG( 1, W5100_SOCKET_IR ) ) & 0x02 ) ) {
+    error = failed( what, "disconnect not signalled" );
+    goto end;
+  }
+  w_command( w, 1, W5100_CLOSE );
+
+  /* A full receive buffer holds back the rest of the data */
+  if( w_connect( w, 2, &sa ) ||
+      ( peer = accept( listener, NULL, NULL ) ) == -1 ) {
+    error = failed( what, "couldn't connect" );
+    goto end;
+  }
+
+  for( i = 0; i < 3; i++ ) {
+    fill_pattern( data, i * sizeof( data ), sizeof( data ) );
+    if( send( peer, data, sizeof( data ), 0 ) != sizeof( data ) ) {
+      error = failed( what, strerror( errno ) );
+      goto end;
+    }
+  }
+
+  start = get_time(); max_size = 0;
+  while( ( size = w_read16( w, SOCKET_REG( 2, W5100_SOCKET_RX_RSR0 ) ) ) <
+	 0x800 && !timed_out( start ) )
+    usleep( 1000 );
+
+  received = 0;
+  while( received < 3 * sizeof( data ) && !timed_out( start ) ) {
+    size = w_read16( w, SOCKET_REG( 2, W5100_SOCKET_RX_RSR0 ) );
+    if( size > max_size ) max_size = size;
+
+    length = w_recv( w, 2, data, sizeof( data ) );
+    if( check_pattern( data, received, length ) ) break;
+    received += length;
+  }
+
+  if( max_size > 0x800 || received != 3 * sizeof( data ) ) {
+    error = failed( what, "receive buffer overran or lost data" );
+    goto end;
+  }
+
+  /* Closing a socket with a send pending, then using it again */
+  if( w_connect( w, 3, &sa ) ) {
+    error = failed( what, "couldn't connect" );
+    goto end;
+  }
+  fill_pattern( data, 0, sizeof( data ) );
+  w_send( w, 3, data, sizeof( data ) );
+  w_command( w, 3, W5100_CLOSE );
+  if( w_state( w, 3 ) != W5100_SOCKET_STATE_CLOSED ||
+      w_connect( w, 3, &sa ) ) {
+    error = failed( what, "couldn't reuse closed socket" );
+    goto end;
+  }
+
+  /* A reset closes everything */
+  w_write( w, 0x000, 0x80 );
+  for( i = 0; i < 4; i++ )
+    if( w_state( w, i ) != W5100_SOCKET_STATE_CLOSED ) {
+      error = failed( what, "socket open after reset" );
+      goto end;
+    }
+
+  printf( "%s: passed\n", what );
+
+ end:
+  nic_w5100_free( w );
+  if( fd != -1 ) close( fd );
+  if( peer != -1 ) close( peer );
+  close( listener );
+
+  return error;
+}
+
+#ifdef BUILD_SPECCYBOOT
+
+/* ENC28J60 registers and SPI commands */
+#define ERDPTL 0x00
+#define EWRPTL 0x02
+#define ETXSTL 0x04
+#define ETXNDL 0x06
+#define ERXSTL 0x08
+#define ERXNDL 0x0a
+#define ERXRDPTL 0x0c
+#define ERXFCON 0x18
+#define EPKTCNT 0x19
+#define ESTAT 0x1d
+#define ECON2 0x1e
+#define ECON1 0x1f
+
+#define ENC_RCR( reg ) ( 0x00 | ( reg ) )
+#define ENC_RBM 0x3a
+#define ENC_WCR( reg ) ( 0x40 | ( reg ) )
+#define ENC_WBM 0x7a
+#define ENC_BFS( reg ) ( 0x80 | ( reg ) )
+#define ENC_BFC( reg ) ( 0xa0 | ( reg ) )
+#define ENC_SRC 0xff
+
+/* The receive buffer and where frames are transmitted from */
+#define RX_START 0x0000
+#define RX_END 0x0fff
+#define TX_START 0x1000
+
+/* Clock one byte through SPI, as SpeccyBoot does */
+static libspectrum_byte
+spi_transfer( nic_enc28j60_t *e, libspectrum_byte out )
+{
+  libspectrum_byte in = 0;
+  int i;
+
+  for( i = 7; i >= 0; i-- ) {
+    /* SpeccyBoot polls for frames on every port write: one to raise SCK
+       and one to drop it */
+    nic_enc28j60_poll( e );
+    in = ( in << 1 ) | nic_enc28j60_spi_produce_bit( e );
+    nic_enc28j60_spi_consume_bit( e, ( out >> i ) & 1 );
+    nic_enc28j60_poll( e );
+    accesses++;
+  }
+
+  return in;
+}
+
+/* Chip select, then the command byte */
+static void
+spi_command( nic_enc28j60_t *e, libspectrum_byte command )
+{
+  nic_enc28j60_set_spi_state( e, SPI_CMD );
+  spi_transfer( e, command );
+}
+
+static libspectrum_byte
+enc_read_reg( nic_enc28j60_t *e, libspectrum_byte reg )
+{
+  spi_command( e, ENC_RCR( reg ) );
+  return spi_transfer( e, 0 );
+}
+
+static void
+enc_write_reg( nic_enc28j60_t *e, libspectrum_byte reg, libspectrum_byte b )
+{
+  spi_command( e, ENC_WCR( reg ) );
+  spi_transfer( e, b );
+}
+
+static void
+enc_set_bits( nic_enc28j60_t *e, libspectrum_byte reg, libspectrum_byte b )
+{
+  spi_command( e, ENC_BFS( reg ) );
+  spi_transfer( e, b );
+}
+
+static void
+enc_clear_bits( nic_enc28j60_t *e, libspectrum_byte reg, libspectrum_byte b )
+{
+  spi_command( e, ENC_BFC( reg ) );
+  spi_transfer( e, b );
+}
+
+static void
+enc_bank( nic_enc28j60_t *e, int bank )
+{
+  enc_clear_bits( e, ECON1, 0x03 );
+  if( bank ) enc_set_bits( e, ECON1, bank );
+}
+
+static void
+enc_write_ptr( nic_enc28j60_t *e, libspectrum_byte reg, libspectrum_word ptr )
+{
+  enc_write_reg( e, reg, ptr & 0xff );
+  enc_write_reg( e, reg + 1, ptr >> 8 );
+}
+
+static nic_enc28j60_t*
+enc_alloc( int fd )
+{
+  nic_enc28j60_t *e = nic_enc28j60_alloc();
+
+  nic_enc28j60_reset( e );
+  nic_enc28j60_set_tap_fd( e, fd );
+
+  enc_bank( e, 0 );
+  enc_write_ptr( e, ERXSTL, RX_START );
+  enc_write_ptr( e, ERXNDL, RX_END );
+  enc_write_ptr( e, ERXRDPTL, RX_START );
+
+  return e;
+}
+
+static void
+enc_transmit( nic_enc28j60_t *e, const libspectrum_byte *frame, size_t length )
+{
+  size_t i;
+
+  enc_write_ptr( e, EWRPTL, TX_START );
+  spi_command( e, ENC_WBM );
+  spi_transfer( e, 0x00 );		/* per-packet control byte */
+  for( i = 0; i < length; i++ ) spi_transfer( e, frame[i] );
+
+  enc_write_ptr( e, ETXSTL, TX_START );
+  enc_write_ptr( e, ETXNDL, TX_START + length );
+  enc_set_bits( e, ECON1, 0x08 );	/* TXRTS */
+}
+
+static int
+enc_packets( nic_enc28j60_t *e )
+{
+  int count;
+
+  enc_bank( e, 1 );
+  count = enc_read_reg( e, EPKTCNT );
+  enc_bank( e, 0 );
+
+  return count;
+}
+
+/* Read `length' bytes of the frame at `*next' and move on to the next
+   one */
+static void
+enc_receive( nic_enc28j60_t *e, libspectrum_word *next,
+	     libspectrum_byte *frame, size_t length )
+{
+  libspectrum_byte header[6];
+  size_t i;
+
+  enc_write_ptr( e, ERDPTL, *next );
+  spi_command( e, ENC_RBM );
+  for( i = 0; i < sizeof( header ); i++ ) header[i] = spi_transfer( e, 0 );
+  for( i = 0; i < length; i++ ) frame[i] = spi_transfer( e, 0 );
+
+  *next = header[0] | ( header[1] << 8 );
+  enc_write_ptr( e, ERXRDPTL, *next );
+  enc_set_bits( e, ECON2, 0x40 );	/* PKTDEC */
+}
+
+/* Wait for a frame to arrive at the ENC28J60 */
+static int
+enc_wait( nic_enc28j60_t *e )
+{
+  double start = get_time();
+
+  while( !enc_packets( e ) )
+    if( timed_out( start ) ) return 1;
+
+  return 0;
+}
+
+static int
+enc28j60_echo_test( size_t total )
+{
+  const char *what = "ENC28J60 frame echo";
+  const size_t frame_length = 1000;
+  libspectrum_byte frame[ 0x600 ];
+  libspectrum_word next = RX_START;
+  size_t done = 0, length;
+  nic_enc28j60_t *e;
+  stats_t stats;
+  int sv[2], error = 0;
+  ssize_t n;
+
+  /* A datagram socketpair behaves like a TAP device: one frame per read */
+  if( socketpair( AF_UNIX, SOCK_DGRAM, 0, sv ) ||
+      compat_socket_blocking_mode( sv[0], 1 ) )
+    return failed( what, strerror( errno ) );
+
+  e = enc_alloc( sv[0] );
+  enc_set_bits( e, ECON1, 0x04 );	/* RXEN */
+
+  stats_start( &stats );
+
+  while( done < total ) {
+    length = total - done < frame_length ? total - done : frame_length;
+    if( length < 60 ) length = 60;
+
+    fill_pattern( frame, done, length );
+    enc_transmit( e, frame, length );
+
+    n = recv( sv[1], frame, sizeof( frame ), MSG_DONTWAIT );
+    if( n != (ssize_t)length || check_pattern( frame, done, length ) ) {
+      error = failed( what, "frame corrupted on the way out" );
+      goto end;
+    }
+    send( sv[1], frame, n, 0 );
+
+    if( enc_wait( e ) ) {
+      error = failed( what, "timed out receiving" );
+      goto end;
+    }
+
+    enc_receive( e, &next, frame, length );
+    if( check_pattern( frame, done, length ) ) {
+      error = failed( what, "frame corrupted on the way back" );
+      goto end;
+    }
+
+    done += length;
+  }
+
+  stats_report( what, &stats, done, ENC28J60_TSTATES_PER_BIT );
+
+ end:
+  nic_enc28j60_free( e );
+  close( sv[0] );
+  close( sv[1] );
+
+  return error;
+}
+
+static int
+enc28j60_edge_tests( void )
+{
+  const char *what = "ENC28J60 edge cases";
+  /* MAADR1 to MAADR6, in bank 3 */
+  const libspectrum_byte maadr[6] = { 0x04, 0x05, 0x02, 0x03, 0x00, 0x01 };
+  const libspectrum_byte mac_address[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+  const libspectrum_byte broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+  libspectrum_byte frame[ 0x600 ];
+  libspectrum_word next = RX_START;
+  nic_enc28j60_t *e;
+  int sv[2], i, error = 0;
+
+  if( socketpair( AF_UNIX, SOCK_DGRAM, 0, sv ) ||
+      compat_socket_blocking_mode( sv[0], 1 ) )
+    return failed( what, strerror( errno ) );
+
+  e = enc_alloc( sv[0] );
+
+  /* Frames wait in the TAP device until reception is enabled */
+  fill_pattern( frame, 0, 100 );
+  send( sv[1], frame, 100, 0 );
+  enc_packets( e );
+  if( enc_packets( e ) ) {
+    error = failed( what, "frame received while disabled" );
+    goto end;
+  }
+
+  enc_set_bits( e, ECON1, 0x04 );	/* RXEN */
+  if( enc_wait( e ) ) {
+    error = failed( what, "frame not received once enabled" );
+    goto end;
+  }
+  enc_receive( e, &next, frame, 100 );
+  if( check_pattern( frame, 0, 100 ) || enc_packets( e ) ) {
+    error = failed( what, "frame corrupted" );
+    goto end;
+  }
+
+  /* Enough frames to wrap round the receive buffer a few times */
+  for( i = 0; i < 20; i++ ) {
+    fill_pattern( frame, i, 1001 );
+    send( sv[1], frame, 1001, 0 );
+    if( enc_wait( e ) ) {
+      error = failed( what, "frame lost" );
+      goto end;
+    }
+    enc_receive( e, &next, frame, 1001 );
+    if( check_pattern( frame, i, 1001 ) ) {
+      error = failed( what, "frame corrupted by receive buffer wrap" );
+      goto end;
+    }
+  }
+
+  /* With the unicast and broadcast filters on, frames for other stations
+     are dropped */
+  enc_bank( e, 3 );
+  for( i = 0; i < 6; i++ ) enc_write_reg( e, maadr[i], mac_address[i] );
+  enc_bank( e, 1 );
+  enc_write_reg( e, ERXFCON, 0x81 );
+  enc_bank( e, 0 );
+
+  memset( frame, 0x02, 60 );
+  send( sv[1], frame, 60, 0 );
+  memcpy( frame, mac_address, 6 );
+  send( sv[1], frame, 60, 0 );
+  memset( frame, 0xff, 60 );
+  send( sv[1], frame, 60, 0 );
+
+  for( i = 0; i < 2; i++ ) {
+    if( enc_wait( e ) ) {
+      error = failed( what, "filtered frame lost" );
+      goto end;
+    }
+    enc_receive( e, &next, frame, 60 );
+    if( memcmp( frame, i ? broadcast : mac_address, 6 ) ) {
+      error = failed( what, "frame for another station received" );
+      goto end;
+    }
+  }
+
+  /* An empty transmit sends nothing but still completes */
+  enc_write_ptr( e, ETXSTL, TX_START );
+  enc_write_ptr( e, ETXNDL, TX_START );
+  enc_set_bits( e, ECON1, 0x08 );	/* TXRTS */
+  if( ( enc_read_reg( e, ECON1 ) & 0x08 ) ||
+      recv( sv[1], frame, sizeof( frame ), MSG_DONTWAIT ) != -1 ) {
+    error = failed( what, "empty transmit misbehaved" );
+    goto end;
+  }
+
+  /* The system reset command stops reception */
+  spi_command( e, ENC_SRC );
+  if( !( enc_read_reg( e, ESTAT ) & 0x01 ) || enc_read_reg( e, ECON1 ) ) {
+    error = failed( what, "system reset didn't reset" );
+    goto end;
+  }
+
+  printf( "%s: passed\n", what );
+
+ end:
+  nic_enc28j60_free( e );
+  close( sv[0] );
+  close( sv[1] );
+
+  return error;
+}
+
+#endif				/* #ifdef BUILD_SPECCYBOOT */
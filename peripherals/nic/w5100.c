@@ -26,11 +26,16 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "fuse.h"
 #include "ui/ui.h"
 #include "w5100.h"
@@ -83,57 +88,139 @@ nic_w5100_reset( nic_w5100_t *self )
     nic_w5100_socket_reset( &self->socket[i] );
 }
 
-static void*
-w5100_io_thread( void *arg )
+static void
+w5100_io_select( nic_w5100_t *self )
 {
-  nic_w5100_t *self = arg;
-  int i;
+  fd_set readfds, writefds;
+  int active, i;
+  compat_socket_t selfpipe_socket =
+    compat_socket_selfpipe_get_read_fd( self->selfpipe );
+  int max_fd = selfpipe_socket;
 
-  while( !self->stop_io_thread ) {
-    fd_set readfds, writefds;
-    int active;
-    compat_socket_t selfpipe_socket =
-      compat_socket_selfpipe_get_read_fd( self->selfpipe );
-    int max_fd = selfpipe_socket;
+  FD_ZERO( &readfds );
+  FD_ZERO( &writefds );
 
-    FD_ZERO( &readfds );
-    FD_ZERO( &writefds );
+  FD_SET( selfpipe_socket, &readfds );
 
-    FD_SET( selfpipe_socket, &readfds );
+  for( i = 0; i < 4; i++ )
+    nic_w5100_socket_add_to_sets( &self->socket[i], &readfds, &writefds,
+      &max_fd );
+
+  /* Note that if a socket is closed between when we added it to the sets
+     above and when we call select() below, it will cause the select to fail
+     with EBADF. We catch this and just run around the loop again - the
+     offending socket will not be added to the sets again as it's now been
+     closed */
+
+  nic_w5100_debug( "w5100: io thread select\n" );
+
+  active = select( max_fd + 1, &readfds, &writefds, NULL, NULL );
+
+  nic_w5100_debug( "w5100: io thread wake; %d active\n", active );
+
+  if( active != -1 ) {
+    if( FD_ISSET( selfpipe_socket, &readfds ) ) {
+      nic_w5100_debug( "w5100: discarding selfpipe data\n" );
+      compat_socket_selfpipe_discard_data( self->selfpipe );
+    }
 
     for( i = 0; i < 4; i++ )
-      nic_w5100_socket_add_to_sets( &self->socket[i], &readfds, &writefds,
-        &max_fd );
+      nic_w5100_socket_process_io( &self->socket[i], readfds, writefds );
+  }
+  else if( compat_socket_get_error() == compat_socket_EBADF ) {
+    /* Do nothing - just loop again */
+  }
+  else {
+    nic_w5100_debug( "w5100: select returned unexpected errno %d: %s\n",
+                     compat_socket_get_error(),
+                     compat_socket_get_strerror() );
+  }
+}
 
-    /* Note that if a socket is closed between when we added it to the sets
-       above and when we call select() below, it will cause the select to fail
-       with EBADF. We catch this and just run around the loop again - the
-       offending socket will not be added to the sets again as it's now been
-       closed */
+#ifdef HAVE_SYS_EPOLL_H
 
-    nic_w5100_debug( "w5100: io thread select\n" );
+/* The socket number used in epoll data for the self-pipe */
+#define W5100_EPOLL_SELFPIPE 0xff
 
-    active = select( max_fd + 1, &readfds, &writefds, NULL, NULL );
+/* As w5100_io_select(), but only the sockets whose interest has changed
+   need touching each time round rather than rebuilding the whole set */
+static void
+w5100_io_epoll( nic_w5100_t *self )
+{
+  struct epoll_event events[5];
+  int active, i;
+
+  for( i = 0; i < 4; i++ )
+    nic_w5100_socket_update_epoll( &self->socket[i], self->epoll_fd );
 
-    nic_w5100_debug( "w5100: io thread wake; %d active\n", active );
+  nic_w5100_debug( "w5100: io thread epoll_wait\n" );
 
-    if( active != -1 ) {
-      if( FD_ISSET( selfpipe_socket, &readfds ) ) {
-        nic_w5100_debug( "w5100: discarding selfpipe data\n" );
-        compat_socket_selfpipe_discard_data( self->selfpipe );
-      }
+  active = epoll_wait( self->epoll_fd, events, ARRAY_SIZE( events ), -1 );
 
-      for( i = 0; i < 4; i++ )
-        nic_w5100_socket_process_io( &self->socket[i], readfds, writefds );
-    }
-    else if( compat_socket_get_error() == compat_socket_EBADF ) {
-      /* Do nothing - just loop again */
+  nic_w5100_debug( "w5100: io thread wake; %d active\n", active );
+
+  if( active == -1 ) {
+    if( errno != EINTR )
+      nic_w5100_debug( "w5100: epoll_wait returned unexpected errno %d: %s\n",
+                       errno, strerror( errno ) );
+    return;
+  }
+
+  for( i = 0; i < active; i++ ) {
+    libspectrum_qword data = events[i].data.u64;
+    int id = data & 0xff;
+    int error = events[i].events & ( EPOLLERR | EPOLLHUP );
+
+    if( id == W5100_EPOLL_SELFPIPE ) {
+      nic_w5100_debug( "w5100: discarding selfpipe data\n" );
+      compat_socket_selfpipe_discard_data( self->selfpipe );
+      continue;
     }
-    else {
-      nic_w5100_debug( "w5100: select returned unexpected errno %d: %s\n",
-                       compat_socket_get_error(),
-                       compat_socket_get_strerror() );
+
+    nic_w5100_socket_process_events( &self->socket[id], data >> 8,
+                                     ( events[i].events & EPOLLIN ) || error,
+                                     ( events[i].events & EPOLLOUT ) || error );
+  }
+}
+
+static int
+w5100_epoll_init( nic_w5100_t *self )
+{
+  struct epoll_event event;
+
+  self->epoll_fd = epoll_create( 5 );
+  if( self->epoll_fd == -1 ) return 1;
+
+  memset( &event, 0, sizeof( event ) );
+  event.events = EPOLLIN;
+  event.data.u64 = W5100_EPOLL_SELFPIPE;
+
+  if( epoll_ctl( self->epoll_fd, EPOLL_CTL_ADD,
+                 compat_socket_selfpipe_get_read_fd( self->selfpipe ),
+                 &event ) == -1 ) {
+    close( self->epoll_fd );
+    self->epoll_fd = -1;
+    return 1;
+  }
+
+  return 0;
+}
+
+#endif				/* #ifdef HAVE_SYS_EPOLL_H */
+
+static void*
+w5100_io_thread( void *arg )
+{
+  nic_w5100_t *self = arg;
+
+  while( !self->stop_io_thread ) {
+#ifdef HAVE_SYS_EPOLL_H
+    if( self->epoll_fd != -1 ) {
+      w5100_io_epoll( self );
+      continue;
     }
+#endif
+    w5100_io_select( self );
   }
 
   return NULL;
@@ -152,6 +239,14 @@ nic_w5100_alloc( void )
 
   self->selfpipe = compat_socket_selfpipe_alloc();
 
+  /* Fall back to select() if epoll isn't available */
+  self->epoll_fd = -1;
+#ifdef HAVE_SYS_EPOLL_H
+  if( w5100_epoll_init( self ) )
+    nic_w5100_debug( "w5100: epoll unavailable; errno %d: %s\n", errno,
+                     strerror( errno ) );
+#endif
+
   for( i = 0; i < 4; i++ )
     nic_w5100_socket_init( &self->socket[i], i );
 
@@ -182,6 +277,10 @@ nic_w5100_free( nic_w5100_t *self )
     for( i = 0; i < 4; i++ )
       nic_w5100_socket_end( &self->socket[i] );
 
+#ifdef HAVE_SYS_EPOLL_H
+    if( self->epoll_fd != -1 ) close( self->epoll_fd );
+#endif
+
     compat_socket_selfpipe_free( self->selfpipe );
 
     compat_socket_networking_end();
@@ -128,6 +128,15 @@ typedef struct nic_w5100_socket_t {
      longer be used */
   int ok_for_io;
 
+  /* The descriptor the I/O thread is making a system call on with the lock
+     dropped; closing it is deferred until that call has finished */
+  compat_socket_t io_fd;
+  compat_socket_t deferred_close_fd;
+
+  /* The descriptor and events registered with epoll, if in use */
+  compat_socket_t registered_fd;
+  int registered_events;
+
   pthread_mutex_t lock;     /* Mutex for this socket */
 
 } nic_w5100_socket_t;
@@ -143,6 +152,7 @@ struct nic_w5100_t {
   pthread_t thread;         /* Thread for doing I/O */
   sig_atomic_t stop_io_thread; /* Flag to stop I/O thread */
   compat_socket_selfpipe_t *selfpipe; /* Device for waking I/O thread */
+  int epoll_fd;             /* epoll instance, or -1 to use select() */
 };
 
 void nic_w5100_socket_init( nic_w5100_socket_t *socket, int which );
@@ -161,6 +171,12 @@ void nic_w5100_socket_add_to_sets( nic_w5100_socket_t *socket, fd_set *readfds,
 void nic_w5100_socket_process_io( nic_w5100_socket_t *socket, fd_set readfds,
   fd_set writefds );
 
+#ifdef HAVE_SYS_EPOLL_H
+void nic_w5100_socket_update_epoll( nic_w5100_socket_t *socket, int epoll_fd );
+void nic_w5100_socket_process_events( nic_w5100_socket_t *socket,
+  compat_socket_t fd, int readable, int writable );
+#endif
+
 /* Debug routines */
 
 /* Define this to spew debugging info to stdout */
@@ -40,6 +40,10 @@
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "fuse.h"
 #include "ui/ui.h"
 #include "w5100.h"
@@ -63,12 +67,16 @@ w5100_socket_init_common( nic_w5100_socket_t *socket )
   socket->socket_bound = 0;
   socket->ok_for_io = 0;
   socket->write_pending = 0;
+  socket->registered_fd = compat_socket_invalid;
+  socket->registered_events = 0;
 }
 
 void
 nic_w5100_socket_init( nic_w5100_socket_t *socket, int which )
 {
   socket->id = which;
+  socket->io_fd = compat_socket_invalid;
+  socket->deferred_close_fd = compat_socket_invalid;
   w5100_socket_init_common( socket );
   pthread_mutex_init( &socket->lock, NULL );
 }
@@ -102,6 +110,47 @@ w5100_socket_release_lock( nic_w5100_socket_t *socket )
   }
 }
 
+/* Close the host socket. If the I/O thread is in the middle of a call on
+   it, leave that thread to close it once the call has returned so the
+   descriptor can't be reused under it */
+static void
+w5100_socket_close_fd( nic_w5100_socket_t *socket )
+{
+  if( socket->fd == socket->io_fd )
+    socket->deferred_close_fd = socket->fd;
+  else
+    compat_socket_close( socket->fd );
+}
+
+/* Drop the lock on a socket while the I/O thread makes a system call on it,
+   so the emulation thread isn't held up waiting for the call */
+static compat_socket_t
+w5100_socket_begin_io( nic_w5100_socket_t *socket )
+{
+  compat_socket_t fd = socket->fd;
+
+  socket->io_fd = fd;
+  w5100_socket_release_lock( socket );
+
+  return fd;
+}
+
+/* Take the lock back after a system call. Returns non-zero if the socket
+   was closed in the meantime, in which case the results should be dropped */
+static int
+w5100_socket_end_io( nic_w5100_socket_t *socket, compat_socket_t fd )
+{
+  w5100_socket_acquire_lock( socket );
+
+  socket->io_fd = compat_socket_invalid;
+  if( socket->deferred_close_fd != compat_socket_invalid ) {
+    compat_socket_close( socket->deferred_close_fd );
+    socket->deferred_close_fd = compat_socket_invalid;
+  }
+
+  return socket->fd != fd;
+}
+
 static void
 w5100_socket_clean( nic_w5100_socket_t *socket )
 {
@@ -117,7 +166,7 @@ w5100_socket_clean( nic_w5100_socket_t *socket )
   socket->datagram_count = 0;
 
   if( socket->fd != compat_socket_invalid ) {
-    compat_socket_close( socket->fd );
+    w5100_socket_close_fd( socket );
     w5100_socket_init_common( socket );
   }
 }
@@ -299,6 +348,9 @@ w5100_socket_connect( nic_w5100_t *self, nic_w5100_socket_t *socket )
 
     socket->ir |= 1 << 0;
     socket->state = W5100_SOCKET_STATE_ESTABLISHED;
+
+    /* Get the I/O thread watching the new connection */
+    compat_socket_selfpipe_wake( self->selfpipe );
   }
 }
 
@@ -319,10 +371,11 @@ static void
 w5100_socket_close( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
   if( socket->fd != compat_socket_invalid ) {
-    compat_socket_close( socket->fd );
+    w5100_socket_close_fd( socket );
     socket->fd = compat_socket_invalid;
     socket->socket_bound = 0;
     socket->ok_for_io = 0;
+    socket->registered_fd = compat_socket_invalid;
     socket->state = W5100_SOCKET_STATE_CLOSED;
     compat_socket_selfpipe_wake( self->selfpipe );
     nic_w5100_debug( "w5100: closed socket %d\n", socket->id );
@@ -345,6 +398,9 @@ w5100_socket_send( nic_w5100_t *self, nic_w5100_socket_t *socket )
     compat_socket_selfpipe_wake( self->selfpipe );
   }
   else if( socket->state == W5100_SOCKET_STATE_ESTABLISHED ) {
+    /* Only send up to where Sn_TX_WR was at the time of the command, so
+       the I/O thread can't see it half written for the next block */
+    socket->last_send = socket->tx_wr;
     socket->write_pending = 1;
     compat_socket_selfpipe_wake( self->selfpipe );
   }
@@ -554,6 +610,27 @@ nic_w5100_socket_write_tx_buffer( nic_w5100_t *self, libspectrum_word reg, libsp
   socket->tx_buffer[offset] = b;
 }
 
+/* Work out whether we're interested in reading from or writing to the
+   host socket at the moment */
+static void
+w5100_socket_wanted_io( nic_w5100_socket_t *socket, int *read, int *write )
+{
+  /* We can process a UDP read if we're in a UDP state and there are at least
+     9 bytes free in our buffer (8 byte UDP header and 1 byte of actual
+     data). */
+  int udp_read = socket->state == W5100_SOCKET_STATE_UDP &&
+    0x800 - socket->rx_rsr >= 9;
+  /* We can process a TCP read if we're in the established state and have
+     any room in our buffer (no header necessary for TCP). */
+  int tcp_read = socket->state == W5100_SOCKET_STATE_ESTABLISHED &&
+    0x800 - socket->rx_rsr >= 1;
+
+  int tcp_listen = socket->state == W5100_SOCKET_STATE_LISTEN;
+
+  *read = udp_read || tcp_read || tcp_listen;
+  *write = socket->write_pending;
+}
+
 void
 nic_w5100_socket_add_to_sets( nic_w5100_socket_t *socket, fd_set *readfds,
   fd_set *writefds, int *max_fd )
@@ -561,28 +638,20 @@ nic_w5100_socket_add_to_sets( nic_w5100_socket_t *socket, fd_set *readfds,
   w5100_socket_acquire_lock( socket );
 
   if( socket->fd != compat_socket_invalid ) {
-    /* We can process a UDP read if we're in a UDP state and there are at least
-       9 bytes free in our buffer (8 byte UDP header and 1 byte of actual
-       data). */
-    int udp_read = socket->state == W5100_SOCKET_STATE_UDP &&
-      0x800 - socket->rx_rsr >= 9;
-    /* We can process a TCP read if we're in the established state and have
-       any room in our buffer (no header necessary for TCP). */
-    int tcp_read = socket->state == W5100_SOCKET_STATE_ESTABLISHED &&
-      0x800 - socket->rx_rsr >= 1;
-
-    int tcp_listen = socket->state == W5100_SOCKET_STATE_LISTEN;
+    int read, write;
+
+    w5100_socket_wanted_io( socket, &read, &write );
 
     socket->ok_for_io = 1;
 
-    if( udp_read || tcp_read || tcp_listen ) {
+    if( read ) {
       FD_SET( socket->fd, readfds );
       if( socket->fd > *max_fd )
         *max_fd = socket->fd;
       nic_w5100_debug( "w5100: checking for read on socket %d with fd %d; max fd %d\n", socket->id, socket->fd, *max_fd );
     }
 
-    if( socket->write_pending ) {
+    if( write ) {
       FD_SET( socket->fd, writefds );
       if( socket->fd > *max_fd )
         *max_fd = socket->fd;
@@ -616,6 +685,7 @@ w5100_socket_process_accept( nic_w5100_socket_t *socket )
     nic_w5100_debug( "w5100: error attempting to close fd %d for socket %d\n", socket->fd, socket->id );
 
   socket->fd = new_fd;
+  socket->registered_fd = compat_socket_invalid;
   socket->state = W5100_SOCKET_STATE_ESTABLISHED;
 }
 
@@ -626,19 +696,27 @@ w5100_socket_process_read( nic_w5100_socket_t *socket )
   int bytes_free = 0x800 - socket->rx_rsr;
   ssize_t bytes_read;
   struct sockaddr_in sa;
+  compat_socket_t fd;
 
   int udp = socket->state == W5100_SOCKET_STATE_UDP;
   const char *description = udp ? "UDP" : "TCP";
 
   nic_w5100_debug( "w5100: reading from socket %d\n", socket->id );
 
+  /* The emulated side can only free up space in the receive buffer while
+     we're reading, and the end of the received data stays put, so it's
+     safe to fill in the buffer once we have the lock back */
+  fd = w5100_socket_begin_io( socket );
+
   if( udp ) {
     socklen_t sa_length = sizeof(sa);
-    bytes_read = recvfrom( socket->fd, (char*)buffer + 8, bytes_free - 8, 0,
+    bytes_read = recvfrom( fd, (char*)buffer + 8, bytes_free - 8, 0,
       (struct sockaddr*)&sa, &sa_length );
   }
   else
-    bytes_read = recv( socket->fd, (char*)buffer, bytes_free, 0 );
+    bytes_read = recv( fd, (char*)buffer, bytes_free, 0 );
+
+  if( w5100_socket_end_io( socket, fd ) ) return;
 
   nic_w5100_debug( "w5100: read 0x%03x bytes from %s socket %d\n", (int)bytes_read, description, socket->id );
 
@@ -689,6 +767,7 @@ w5100_socket_process_udp_write( nic_w5100_socket_t *socket )
   libspectrum_byte *data = &socket->tx_buffer[ offset ];
   struct sockaddr_in sa;
   libspectrum_byte buffer[0x800];
+  compat_socket_t fd;
 
   nic_w5100_debug( "w5100: writing to UDP socket %d\n", socket->id );
 
@@ -706,7 +785,12 @@ w5100_socket_process_udp_write( nic_w5100_socket_t *socket )
   memcpy( &sa.sin_port, socket->dport, 2 );
   memcpy( &sa.sin_addr.s_addr, socket->dip, 4 );
 
-  bytes_sent = sendto( socket->fd, (const char*)data, length, 0, (struct sockaddr*)&sa, sizeof(sa) );
+  /* The data between Sn_TX_RR and Sn_TX_WR isn't touched by the emulated
+     side until we've moved Sn_TX_RR past it */
+  fd = w5100_socket_begin_io( socket );
+  bytes_sent = sendto( fd, (const char*)data, length, 0, (struct sockaddr*)&sa, sizeof(sa) );
+  if( w5100_socket_end_io( socket, fd ) ) return;
+
   nic_w5100_debug( "w5100: sent 0x%03x bytes of 0x%03x to UDP socket %d\n",
                    (int)bytes_sent, length, socket->id );
 
@@ -734,8 +818,9 @@ w5100_socket_process_tcp_write( nic_w5100_socket_t *socket )
 {
   ssize_t bytes_sent;
   int offset = socket->tx_rr & 0x7ff;
-  libspectrum_word length = socket->tx_wr - socket->tx_rr;
+  libspectrum_word length = socket->last_send - socket->tx_rr;
   libspectrum_byte *data = &socket->tx_buffer[ offset ];
+  compat_socket_t fd;
 
   nic_w5100_debug( "w5100: writing to TCP socket %d\n", socket->id );
 
@@ -743,13 +828,16 @@ w5100_socket_process_tcp_write( nic_w5100_socket_t *socket )
   if( offset + length > 0x800 )
     length = 0x800 - offset;
 
-  bytes_sent = send( socket->fd, (const char*)data, length, 0 );
+  fd = w5100_socket_begin_io( socket );
+  bytes_sent = send( fd, (const char*)data, length, 0 );
+  if( w5100_socket_end_io( socket, fd ) ) return;
+
   nic_w5100_debug( "w5100: sent 0x%03x bytes of 0x%03x to TCP socket %d\n",
                    (int)bytes_sent, length, socket->id );
 
   if( bytes_sent != -1 ) {
     socket->tx_rr += bytes_sent;
-    if( socket->tx_rr == socket->tx_wr ) {
+    if( socket->tx_rr == socket->last_send ) {
       socket->write_pending = 0;
       socket->ir |= 1 << 4;
     }
@@ -760,6 +848,28 @@ w5100_socket_process_tcp_write( nic_w5100_socket_t *socket )
                      compat_socket_get_strerror() );
 }
 
+/* Called with the lock held */
+static void
+w5100_socket_process( nic_w5100_socket_t *socket, int readable, int writable )
+{
+  if( readable ) {
+    if( socket->state == W5100_SOCKET_STATE_LISTEN )
+      w5100_socket_process_accept( socket );
+    else
+      w5100_socket_process_read( socket );
+  }
+
+  /* Reading may have dropped the lock and seen the socket closed */
+  if( writable && socket->fd != compat_socket_invalid ) {
+    if( socket->state == W5100_SOCKET_STATE_UDP ) {
+      w5100_socket_process_udp_write( socket );
+    }
+    else if( socket->state == W5100_SOCKET_STATE_ESTABLISHED ) {
+      w5100_socket_process_tcp_write( socket );
+    }
+  }
+}
+
 void
 nic_w5100_socket_process_io( nic_w5100_socket_t *socket, fd_set readfds,
   fd_set writefds )
@@ -768,23 +878,87 @@ nic_w5100_socket_process_io( nic_w5100_socket_t *socket, fd_set readfds,
 
   /* Process only if we're an open socket, and we haven't been closed and
      re-opened since the select() started */
-  if( socket->fd != compat_socket_invalid && socket->ok_for_io ) {
-    if( FD_ISSET( socket->fd, &readfds ) ) {
-      if( socket->state == W5100_SOCKET_STATE_LISTEN )
-        w5100_socket_process_accept( socket );
-      else
-        w5100_socket_process_read( socket );
-    }
+  if( socket->fd != compat_socket_invalid && socket->ok_for_io )
+    w5100_socket_process( socket, FD_ISSET( socket->fd, &readfds ),
+                          FD_ISSET( socket->fd, &writefds ) );
 
-    if( FD_ISSET( socket->fd, &writefds ) ) {
-      if( socket->state == W5100_SOCKET_STATE_UDP ) {
-        w5100_socket_process_udp_write( socket );
-      }
-      else if( socket->state == W5100_SOCKET_STATE_ESTABLISHED ) {
-        w5100_socket_process_tcp_write( socket );
-      }
+  w5100_socket_release_lock( socket );
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Bring the socket's epoll registration into line with the I/O we're
+   currently interested in. A closed descriptor drops out of the epoll set
+   by itself, so we only ever need to add the current one */
+void
+nic_w5100_socket_update_epoll( nic_w5100_socket_t *socket, int epoll_fd )
+{
+  struct epoll_event event;
+  int read, write, events, op;
+
+  w5100_socket_acquire_lock( socket );
+
+  if( socket->fd == compat_socket_invalid ) {
+    w5100_socket_release_lock( socket );
+    return;
+  }
+
+  w5100_socket_wanted_io( socket, &read, &write );
+  events = ( read ? EPOLLIN : 0 ) | ( write ? EPOLLOUT : 0 );
+
+  /* Remove the descriptor entirely when we want nothing from it, as epoll
+     reports hangups whether asked for or not */
+  if( socket->registered_fd != socket->fd ) {
+    op = events ? EPOLL_CTL_ADD : 0;
+  }
+  else if( events != socket->registered_events ) {
+    op = events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+  }
+  else {
+    op = 0;
+  }
+
+  if( op ) {
+    memset( &event, 0, sizeof( event ) );
+    event.events = events;
+    event.data.u64 = ( (libspectrum_qword)socket->fd << 8 ) | socket->id;
+
+    if( epoll_ctl( epoll_fd, op, socket->fd, &event ) == -1 ) {
+      nic_w5100_debug( "w5100: epoll_ctl %d failed for socket %d; errno %d: %s\n",
+                       op, socket->id, compat_socket_get_error(),
+                       compat_socket_get_strerror() );
+      socket->registered_fd = compat_socket_invalid;
+    }
+    else if( op == EPOLL_CTL_DEL ) {
+      socket->registered_fd = compat_socket_invalid;
     }
+    else {
+      socket->registered_fd = socket->fd;
+      socket->registered_events = events;
+    }
+  }
+
+  w5100_socket_release_lock( socket );
+}
+
+void
+nic_w5100_socket_process_events( nic_w5100_socket_t *socket,
+  compat_socket_t fd, int readable, int writable )
+{
+  w5100_socket_acquire_lock( socket );
+
+  /* Ignore events for a descriptor which has since been closed, possibly
+     with the number reused */
+  if( socket->fd == fd && socket->registered_fd == fd ) {
+    int read, write;
+
+    /* Errors and hangups wake us for either direction; only act on what
+       we can handle right now */
+    w5100_socket_wanted_io( socket, &read, &write );
+    w5100_socket_process( socket, readable && read, writable && write );
   }
 
   w5100_socket_release_lock( socket );
 }
+
+#endif				/* #ifdef HAVE_SYS_EPOLL_H */
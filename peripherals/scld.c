@@ -38,6 +38,7 @@
 #include "memory_pages.h"
 #include "module.h"
 #include "periph.h"
+#include "runahead.h"
 #include "scld.h"
 #include "spectrum.h"
 #include "ui/ui.h"
@@ -87,6 +88,10 @@ scld_init( void *context )
   module_register( &scld_module_info );
   periph_register( PERIPH_TYPE_SCLD, &scld_periph );
 
+  runahead_state_register( &scld_last_dec, sizeof( scld_last_dec ) );
+  runahead_state_register( &scld_last_hsr, sizeof( scld_last_hsr ) );
+  runahead_state_register( timex_home, sizeof( timex_home ) );
+
   return 0;
 }
 
@@ -38,6 +38,7 @@
 #include "module.h"
 #include "periph.h"
 #include "phantom_typist.h"
+#include "runahead.h"
 #include "settings.h"
 #include "sound.h"
 #include "spectrum.h"
@@ -162,6 +163,8 @@ ula_init( void *context )
 
   ula_default_value = 0xff;
 
+  runahead_state_register( &last_byte, sizeof( last_byte ) );
+
   return 0;
 }
 
@@ -184,6 +187,7 @@ ula_read( libspectrum_word port, libspectrum_byte *attached )
 
   *attached = 0xff;
 
+  tape_sync_edges( tstates );
   loader_detect_loader();
 
   r &= phantom_typist_ula_read( port );
@@ -201,6 +205,7 @@ ula_write( libspectrum_word port GCC_UNUSED, libspectrum_byte b )
   last_byte = b;
 
   display_set_lores_border( b & 0x07 );
+  tape_sync_edges( tstates );
   sound_beeper( tstates,
                 (!!(b & 0x10) << 1) + ( (!(b & 0x8)) | tape_microphone ) );
 
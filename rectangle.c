@@ -27,9 +27,9 @@
 
 #include <stdlib.h>
 
+#include "display.h"
 #include "fuse.h"
 #include "rectangle.h"
-#include "settings.h"
 #include "ui/ui.h"
 
 /* Those rectangles which were modified on the last line to be displayed */
@@ -86,56 +86,172 @@ rectangle_add( int y, int x, int w )
 #define MIN(a,b)    (((a) < (b)) ? (a) : (b))
 #endif
 
+/* The fixed cost of drawing one rectangle (a scaler call, an entry in
+   the UI's update list, ...) expressed as the number of 8x1 chunks which
+   could be drawn for the same price */
+#define RECTANGLE_OVERHEAD 32
+
+/* Limits on the number of rectangles handed to the UI in a frame */
+#define RECTANGLE_MIN_COUNT 16
+#define RECTANGLE_MAX_COUNT 128
+
+/* Past this many rectangles, the overhead alone costs more than
+   redrawing the whole screen */
+#define RECTANGLE_COLLAPSE_COUNT \
+  ( DISPLAY_SCREEN_WIDTH_COLS * DISPLAY_SCREEN_HEIGHT / RECTANGLE_OVERHEAD )
+
+static inline int
+rectangle_area( const struct rectangle *r )
+{
+  return r->w * r->h;
+}
+
+/* Put the bounding box of `a' and `b' into `merged' and return how much
+   more it costs to draw that than to draw `a' and `b' separately; zero or
+   less means the merge is worth doing */
+static inline int
+merge_cost( const struct rectangle *a, const struct rectangle *b,
+            struct rectangle *merged )
+{
+  int x = MIN( a->x, b->x ), y = MIN( a->y, b->y );
+
+  merged->w = MAX( a->x + a->w, b->x + b->w ) - x;
+  merged->h = MAX( a->y + a->h, b->y + b->h ) - y;
+  merged->x = x; merged->y = y;
+
+  return rectangle_area( merged ) - rectangle_area( a ) - rectangle_area( b ) -
+         RECTANGLE_OVERHEAD;
+}
+
+/* Replace the inactive list with one rectangle covering the screen */
+static void
+collapse_rectangles( void )
+{
+  rectangle_inactive[0].x = 0; rectangle_inactive[0].y = 0;
+  rectangle_inactive[0].w = DISPLAY_SCREEN_WIDTH_COLS;
+  rectangle_inactive[0].h = DISPLAY_SCREEN_HEIGHT;
+  rectangle_inactive_count = 1;
+}
+
 static inline int
 compare_and_merge_rectangles( struct rectangle *source )
 {
   size_t z;
+  struct rectangle merged;
 
-  /* Now look to see if there is an overlapping rectangle in the inactive
-     list.  These occur when frame skip is on and the same lines are
-     covered more than once... */
+  /* Look for a rectangle in the inactive list which is cheaper to draw
+     together with this one than apart. This catches the same lines being
+     covered more than once when frame skip is on as well as neighbouring
+     and overlapping areas */
   for( z = 0; z < rectangle_inactive_count; z++ ) {
-    if( rectangle_inactive[z].x == source->x &&
-          rectangle_inactive[z].w == source->w ) {
-      if( rectangle_inactive[z].y == source->y &&
-            rectangle_inactive[z].h == source->h )
-        return 1;
-
-      if( ( rectangle_inactive[z].y < source->y && 
-          ( source->y < ( rectangle_inactive[z].y +
-            rectangle_inactive[z].h + 1 ) ) ) ||
-          ( source->y < rectangle_inactive[z].y && 
-          ( rectangle_inactive[z].y < ( source->y + source->h + 1 ) ) ) ) {
-        /* rects overlap or touch in the y dimension, merge */
-        rectangle_inactive[z].h = MAX( rectangle_inactive[z].y +
-                                    rectangle_inactive[z].h,
-                                    source->y + source->h ) -
-                                  MIN( rectangle_inactive[z].y, source->y );
-        rectangle_inactive[z].y = MIN( rectangle_inactive[z].y, source->y );
-
-        return 1;
+    if( merge_cost( &rectangle_inactive[z], source, &merged ) <= 0 ) {
+      rectangle_inactive[z] = merged;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Remove rectangle `i' from the inactive list */
+static inline void
+remove_rectangle( size_t i )
+{
+  rectangle_inactive[i] = rectangle_inactive[ --rectangle_inactive_count ];
+}
+
+/* Merge every pair of rectangles in the inactive list which is cheaper
+   to draw as one */
+static void
+merge_profitable_rectangles( void )
+{
+  size_t i, j;
+  struct rectangle merged;
+  int changed;
+
+  do {
+    changed = 0;
+
+    for( i = 0; i < rectangle_inactive_count; i++ ) {
+      for( j = i + 1; j < rectangle_inactive_count; j++ ) {
+        if( merge_cost( &rectangle_inactive[i], &rectangle_inactive[j],
+                        &merged ) <= 0 ) {
+          rectangle_inactive[i] = merged;
+          remove_rectangle( j );
+          /* The grown rectangle may now be worth merging with ones
+             already passed over */
+          j = i;
+          changed = 1;
+        }
       }
     }
-    if( rectangle_inactive[z].y == source->y &&
-          rectangle_inactive[z].h == source->h ) {
-
-      if( (rectangle_inactive[z].x < source->x && 
-          ( source->x < ( rectangle_inactive[z].x +
-            rectangle_inactive[z].w + 1 ) ) ) ||
-          ( source->x < rectangle_inactive[z].x && 
-          ( rectangle_inactive[z].x < ( source->x + source->w + 1 ) ) ) ) {
-        /* rects overlap or touch in the x dimension, merge */
-        rectangle_inactive[z].w = MAX( rectangle_inactive[z].x +
-          rectangle_inactive[z].w, source->x +
-          source->w ) - MIN( rectangle_inactive[z].x, source->x );
-        rectangle_inactive[z].x = MIN( rectangle_inactive[z].x, source->x );
-        return 1;
+  } while( changed );
+}
+
+/* Merge the cheapest pairs of rectangles until there are at most `limit'
+   of them. Each pass lets every rectangle absorb its best partner, so the
+   count roughly halves per pass */
+static void
+merge_to_limit( size_t limit )
+{
+  size_t i, j, best;
+  struct rectangle merged, best_merged;
+  int cost, best_cost;
+
+  while( rectangle_inactive_count > limit ) {
+    for( i = 0;
+         i < rectangle_inactive_count && rectangle_inactive_count > limit;
+         i++ ) {
+
+      best = i; best_cost = 0;
+
+      for( j = 0; j < rectangle_inactive_count; j++ ) {
+        if( j == i ) continue;
+        cost = merge_cost( &rectangle_inactive[i], &rectangle_inactive[j],
+                           &merged );
+        if( best == i || cost < best_cost ) {
+          best = j; best_cost = cost; best_merged = merged;
+        }
       }
+
+      if( best == i ) break;
+
+      rectangle_inactive[i] = best_merged;
+      remove_rectangle( best );
     }
-     /* Handle overlaps offset by both x and y? how much overlap and hence 
-        overdraw can be tolerated? */
   }
-  return 0;
+}
+
+/* Tidy up the inactive list before it is drawn: merge rectangles where
+   the saved per-rectangle overhead outweighs the extra area drawn, and
+   then keep merging the cheapest pairs until the count is within a cap.
+   The cap scales with the dirty area, so a frame with little to draw is
+   not allowed to spend most of its time on overhead */
+void
+rectangle_merge( void )
+{
+  size_t i, limit;
+  int area;
+
+  if( rectangle_inactive_count < 2 ) return;
+
+  merge_profitable_rectangles();
+
+  for( i = 0, area = 0; i < rectangle_inactive_count; i++ )
+    area += rectangle_area( &rectangle_inactive[i] );
+
+  limit = area / RECTANGLE_OVERHEAD;
+  if( limit < RECTANGLE_MIN_COUNT ) limit = RECTANGLE_MIN_COUNT;
+  if( limit > RECTANGLE_MAX_COUNT ) limit = RECTANGLE_MAX_COUNT;
+
+  merge_to_limit( limit );
+
+  for( i = 0, area = 0; i < rectangle_inactive_count; i++ )
+    area += rectangle_area( &rectangle_inactive[i] );
+
+  if( area + ( rectangle_inactive_count - 1 ) * RECTANGLE_OVERHEAD >=
+      DISPLAY_SCREEN_WIDTH_COLS * DISPLAY_SCREEN_HEIGHT )
+    collapse_rectangles();
 }
 
 /* Move all rectangles not updated on this line to the inactive list */
@@ -150,14 +266,20 @@ rectangle_end_line( int y )
     /* Skip if this rectangle was updated this line */
     if( rectangle_active[i].y + rectangle_active[i].h == y + 1 ) continue;
 
-    if ( settings_current.frame_rate > 1 &&
-	 compare_and_merge_rectangles( &rectangle_active[i] ) ) {
+    if( compare_and_merge_rectangles( &rectangle_active[i] ) ) {
 
       /* Mark the active rectangle as done */
       rectangle_active[i].h = 0;
       continue;
     }
 
+    /* Once there are this many rectangles the whole screen is cheaper */
+    if( rectangle_inactive_count >= RECTANGLE_COLLAPSE_COUNT ) {
+      collapse_rectangles();
+      rectangle_active[i].h = 0;
+      continue;
+    }
+
     /* We couldn't find a rectangle to extend, so create a new one */
     if( ++rectangle_inactive_count > rectangle_inactive_allocated ) {
 
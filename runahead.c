@@ -0,0 +1,273 @@
+/* runahead.c: running frames ahead to hide input latency
+   Copyright (c) 2026 Fuse contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/* Most games read the keyboard or joystick once a frame, so whatever the
+   player does shows up on screen at least a frame later, plus whatever the
+   display itself adds. Running ahead hides some of that: at the end of
+   each real frame, with the input just read, the machine is saved, run on
+   for a few frames with no sound and only the last of them drawn, and
+   then put back to carry on from the real frame. The sound is always
+   that of the real frames.
+
+   This happens every frame, so the state is saved with plain memory
+   copies rather than through a libspectrum_snap. That only covers the
+   machine itself: anything with state of its own outside the saved
+   blocks (disk and IDE interfaces, tapes, recordings, the debugger and
+   so on) turns running ahead off while it is in use */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "libspectrum.h"
+
+#include "compat.h"
+#include "debugger/debugger.h"
+#include "display.h"
+#include "event.h"
+#include "fuse.h"
+#include "infrastructure/startup_manager.h"
+#include "machine.h"
+#include "memory_pages.h"
+#include "movie.h"
+#include "periph.h"
+#include "phantom_typist.h"
+#include "profile.h"
+#include "psg.h"
+#include "runahead.h"
+#include "rzx.h"
+#include "settings.h"
+#include "spectrum.h"
+#include "tape.h"
+#include "ui/ui.h"
+#include "z80/z80.h"
+
+/* Are we currently running frames which will be thrown away? */
+int runahead_running = 0;
+
+/* Frames still to be run before the state is put back */
+static int frames_left;
+
+/* The blocks registered with runahead_state_register() */
+typedef struct runahead_block_t {
+  void *data;
+  size_t length;
+} runahead_block_t;
+
+#define RUNAHEAD_MAX_BLOCKS 32
+
+static runahead_block_t blocks[ RUNAHEAD_MAX_BLOCKS ];
+static size_t block_count = 0;
+
+/* The saved state and the event list that goes with it */
+static libspectrum_byte *saved_state = NULL;
+static size_t saved_state_size = 0;
+static GSList *saved_events = NULL;
+
+/* Peripherals which keep state of their own, or talk to the outside
+   world, while the Spectrum is running */
+static const periph_type unsupported_peripherals[] = {
+  PERIPH_TYPE_BETA128,
+  PERIPH_TYPE_BETA128_PENTAGON,
+  PERIPH_TYPE_BETA128_PENTAGON_LATE,
+  PERIPH_TYPE_DIVIDE,
+  PERIPH_TYPE_DIVMMC,
+  PERIPH_TYPE_PLUSD,
+  PERIPH_TYPE_DIDAKTIK80,
+  PERIPH_TYPE_DISCIPLE,
+  PERIPH_TYPE_INTERFACE1,
+  PERIPH_TYPE_MULTIFACE_1,
+  PERIPH_TYPE_MULTIFACE_128,
+  PERIPH_TYPE_MULTIFACE_3,
+  PERIPH_TYPE_OPUS,
+  PERIPH_TYPE_SE_MEMORY,
+  PERIPH_TYPE_SIMPLEIDE,
+  PERIPH_TYPE_SPECCYBOOT,
+  PERIPH_TYPE_SPECTRANET,
+  PERIPH_TYPE_TTX2000S,
+  PERIPH_TYPE_UPD765,
+  PERIPH_TYPE_USOURCE,
+  PERIPH_TYPE_ZXATASP,
+  PERIPH_TYPE_ZXCF,
+  PERIPH_TYPE_ZXMMC,
+};
+
+static void
+runahead_end( void )
+{
+  libspectrum_free( saved_state );
+  saved_state = NULL;
+  saved_state_size = 0;
+}
+
+void
+runahead_register_startup( void )
+{
+  startup_manager_module dependencies[] = { STARTUP_MANAGER_MODULE_SETUID };
+  startup_manager_register( STARTUP_MANAGER_MODULE_RUNAHEAD, dependencies,
+                            ARRAY_SIZE( dependencies ), NULL, NULL,
+                            runahead_end );
+}
+
+void
+runahead_state_register( void *data, size_t length )
+{
+  if( block_count == RUNAHEAD_MAX_BLOCKS ) {
+    ui_error( UI_ERROR_ERROR, "too many run-ahead state blocks" );
+    fuse_abort();
+  }
+
+  blocks[ block_count ].data = data;
+  blocks[ block_count ].length = length;
+  block_count++;
+}
+
+/* The RAM pages which are saved; every machine has at least the 128K
+   pages in use, whatever 'valid_pages' says */
+static size_t
+ram_pages( void )
+{
+  return machine_current->ram.valid_pages > 8 ?
+         machine_current->ram.valid_pages : 8;
+}
+
+void
+runahead_state_save( void )
+{
+  libspectrum_byte *ptr;
+  size_t i, length;
+
+  length = ram_pages() * sizeof( RAM[0] ) + sizeof( machine_current->ram ) +
+           sizeof( machine_current->ay );
+  for( i = 0; i < block_count; i++ ) length += blocks[i].length;
+
+  if( length > saved_state_size ) {
+    saved_state = libspectrum_renew( libspectrum_byte, saved_state, length );
+    saved_state_size = length;
+  }
+
+  ptr = saved_state;
+
+  memcpy( ptr, RAM, ram_pages() * sizeof( RAM[0] ) );
+  ptr += ram_pages() * sizeof( RAM[0] );
+
+  memcpy( ptr, &machine_current->ram, sizeof( machine_current->ram ) );
+  ptr += sizeof( machine_current->ram );
+
+  memcpy( ptr, &machine_current->ay, sizeof( machine_current->ay ) );
+  ptr += sizeof( machine_current->ay );
+
+  for( i = 0; i < block_count; i++ ) {
+    memcpy( ptr, blocks[i].data, blocks[i].length );
+    ptr += blocks[i].length;
+  }
+
+  saved_events = event_list_copy();
+}
+
+void
+runahead_state_restore( void )
+{
+  libspectrum_byte *ptr = saved_state;
+  size_t i;
+
+  memcpy( RAM, ptr, ram_pages() * sizeof( RAM[0] ) );
+  ptr += ram_pages() * sizeof( RAM[0] );
+
+  memcpy( &machine_current->ram, ptr, sizeof( machine_current->ram ) );
+  ptr += sizeof( machine_current->ram );
+
+  memcpy( &machine_current->ay, ptr, sizeof( machine_current->ay ) );
+  ptr += sizeof( machine_current->ay );
+
+  for( i = 0; i < block_count; i++ ) {
+    memcpy( blocks[i].data, ptr, blocks[i].length );
+    ptr += blocks[i].length;
+  }
+
+  event_list_replace( saved_events );
+  saved_events = NULL;
+
+  display_rollback();
+}
+
+int
+runahead_available( void )
+{
+  size_t i;
+
+  if( settings_current.run_ahead <= 0 ) return 0;
+
+  if( rzx_playback || rzx_recording || movie_recording || psg_recording ||
+      profile_active || tape_is_playing() || tape_recording ||
+      phantom_typist_is_active() ||
+      debugger_mode != DEBUGGER_MODE_INACTIVE )
+    return 0;
+
+  /* The ZX Printer is always attached but only does anything when
+     printers are being emulated, so look at that rather than at it */
+  if( settings_current.printer ) return 0;
+
+  for( i = 0; i < ARRAY_SIZE( unsupported_peripherals ); i++ )
+    if( periph_is_active( unsupported_peripherals[i] ) ) return 0;
+
+  /* Writes to anything other than RAM (writable ROMs, Timex dock RAM or
+     RAM on an interface) wouldn't be put back */
+  for( i = 0; i < MEMORY_PAGES_IN_64K; i++ )
+    if( memory_map_write[i].writable &&
+        memory_map_write[i].source != memory_source_ram )
+      return 0;
+
+  return 1;
+}
+
+int
+runahead_frame_hidden( void )
+{
+  /* Only the last frame run ahead is shown */
+  if( runahead_running ) return frames_left > 1;
+
+  return runahead_available();
+}
+
+void
+runahead_frame( void )
+{
+  if( runahead_running ) {
+    frames_left--;
+    return;
+  }
+
+  if( !runahead_available() ) return;
+
+  runahead_state_save();
+
+  runahead_running = 1;
+  frames_left = settings_current.run_ahead > RUNAHEAD_MAX_FRAMES ?
+                RUNAHEAD_MAX_FRAMES : settings_current.run_ahead;
+
+  while( frames_left ) {
+    z80_do_opcodes();
+    event_do_events();
+  }
+
+  runahead_running = 0;
+
+  runahead_state_restore();
+}
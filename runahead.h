@@ -0,0 +1,51 @@
+/* runahead.h: running frames ahead to hide input latency
+   Copyright (c) 2026 Fuse contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef FUSE_RUNAHEAD_H
+#define FUSE_RUNAHEAD_H
+
+#include <stdlib.h>
+
+/* The most frames which will be run ahead of the real one */
+#define RUNAHEAD_MAX_FRAMES 3
+
+/* Are we currently running frames which will be thrown away? */
+extern int runahead_running;
+
+void runahead_register_startup( void );
+
+/* Add a block of memory to the state which is saved before running ahead
+   and put back afterwards. Only for data which doesn't move and holds no
+   pointers to things which could be freed while running ahead */
+void runahead_state_register( void *data, size_t length );
+
+/* Save and restore the machine state without going through libspectrum */
+void runahead_state_save( void );
+void runahead_state_restore( void );
+
+/* Can frames be run ahead with the current machine and settings? */
+int runahead_available( void );
+
+/* Should the frame now ending be kept away from the UI? */
+int runahead_frame_hidden( void );
+
+/* Called at the end of every emulated frame */
+void runahead_frame( void );
+
+#endif			/* #ifndef FUSE_RUNAHEAD_H */
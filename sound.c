@@ -33,6 +33,7 @@
 #include "machine.h"
 #include "movie.h"
 #include "options.h"
+#include "runahead.h"
 #include "settings.h"
 #include "sound.h"
 #include "tape.h"
@@ -658,6 +659,9 @@ sound_ay_overlay( void )
 void
 sound_ay_write( int reg, int val, libspectrum_dword now )
 {
+  /* Frames run ahead are never heard */
+  if( runahead_running ) return;
+
   if( ay_change_count < AY_CHANGE_MAX ) {
     ay_change[ ay_change_count ].tstates = now;
     ay_change[ ay_change_count ].reg = ( reg & 15 );
@@ -692,7 +696,7 @@ sound_ay_reset( void )
 void
 sound_specdrum_write( libspectrum_word port GCC_UNUSED, libspectrum_byte val )
 {
-  if( periph_is_active( PERIPH_TYPE_SPECDRUM ) ) {
+  if( periph_is_active( PERIPH_TYPE_SPECDRUM ) && !runahead_running ) {
     blip_synth_update( left_specdrum_synth, tstates, ( val - 128) * 128);
     if( right_specdrum_synth ) {
       blip_synth_update( right_specdrum_synth, tstates, ( val - 128) * 128);
@@ -708,8 +712,8 @@ sound_specdrum_write( libspectrum_word port GCC_UNUSED, libspectrum_byte val )
 void
 sound_covox_write( libspectrum_word port GCC_UNUSED, libspectrum_byte val )
 {
-  if( periph_is_active( PERIPH_TYPE_COVOX_FB ) ||
-      periph_is_active( PERIPH_TYPE_COVOX_DD ) ) {
+  if( ( periph_is_active( PERIPH_TYPE_COVOX_FB ) ||
+        periph_is_active( PERIPH_TYPE_COVOX_DD ) ) && !runahead_running ) {
     blip_synth_update( left_covox_synth, tstates, val * 128);
     if( right_covox_synth ) {
       blip_synth_update( right_covox_synth, tstates, val * 128);
@@ -791,7 +795,7 @@ sound_beeper( libspectrum_dword at_tstates, int on )
                                AMPL_BEEPER+AMPL_TAPE };
   int val;
 
-  if( !sound_enabled ) return;
+  if( !sound_enabled || runahead_running ) return;
 
   if( tape_is_playing() ) {
     /* Timex machines have no loading noise */
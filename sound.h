@@ -64,8 +64,8 @@ int sound_lowlevel_init( const char *device, int *freqptr, int *stereoptr );
 void sound_lowlevel_end( void );
 void sound_lowlevel_frame( libspectrum_signed_word *data, int len );
 
-#ifdef GCWZERO
+/* How full the sound output buffer is, from 0 (empty) to 1 (full), or
+   less than 0 if the driver can't tell */
 double sound_fill_level( void );
-#endif
 
 #endif				/* #ifndef FUSE_SOUND_H */
@@ -389,14 +389,13 @@ sound_lowlevel_frame( libspectrum_signed_word *data, int len )
   }
 }
 
-#ifdef GCWZERO
 double
 sound_fill_level( void )
 {
   snd_pcm_sframes_t  frames;
   
   frames = snd_pcm_avail(pcm_handle);
+  if( frames < 0 ) return -1;
   
   return (double) ( exact_bsize - frames ) / exact_bsize;
 }
-#endif
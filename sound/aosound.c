@@ -231,3 +231,9 @@ sound_lowlevel_frame( libspectrum_signed_word *data, int len )
 
   ao_play( dev_for_ao, data8, len );
 }
+
+double
+sound_fill_level( void )
+{
+  return -1;
+}
@@ -315,3 +315,9 @@ OSStatus coreaudiowrite( void *inRefCon,
 
   return noErr;
 }
+
+double
+sound_fill_level( void )
+{
+  return (double) sfifo_used( &sound_fifo ) / sound_fifo.size;
+}
@@ -228,3 +228,9 @@ sound_lowlevel_frame( libspectrum_signed_word *data, int len )
     IDirectSoundBuffer_Unlock( lpDSBuffer, ucbuffer1, i1, ucbuffer2, i2 );
   }
 }
+
+double
+sound_fill_level( void )
+{
+  return -1;
+}
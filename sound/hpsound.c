@@ -161,3 +161,9 @@ sound_lowlevel_frame( libspectrum_signed_word *data, int len )
     }
   }
 }
+
+double
+sound_fill_level( void )
+{
+  return -1;
+}
@@ -42,3 +42,9 @@ sound_lowlevel_frame( unsigned char *data, int len )
 {
   fuse_abort();
 }
+
+double
+sound_fill_level( void )
+{
+  return -1;
+}
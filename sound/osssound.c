@@ -177,3 +177,9 @@ while(len)
     ofs+=ret,len-=ret;
   }
 }
+
+double
+sound_fill_level( void )
+{
+  return -1;
+}
@@ -142,3 +142,9 @@ sound_lowlevel_frame( libspectrum_signed_word *data, int len )
              pa_strerror( error ) );
   }
 }
+
+double
+sound_fill_level( void )
+{
+  return -1;
+}
@@ -219,10 +219,8 @@ sdlwrite( void *userdata, Uint8 *stream, int len )
      the output buffer with silence :( */
 }
 
-#ifdef GCWZERO
 double
 sound_fill_level( void )
 {
   return (double) ( sound_fifo.size - sfifo_space( &sound_fifo ) ) / sound_fifo.size;
 }
-#endif
@@ -201,3 +201,9 @@ sound_lowlevel_frame( libspectrum_signed_word *data, int len )
 		}
 	}
 }
+
+double
+sound_fill_level( void )
+{
+  return -1;
+}
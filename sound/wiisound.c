@@ -109,3 +109,9 @@ sound_lowlevel_frame(libspectrum_signed_word *data, int len)
     len -= i;
   }
 }
+
+double
+sound_fill_level( void )
+{
+  return (double) sfifo_used( &sound_fifo ) / sound_fifo.size;
+}
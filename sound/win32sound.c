@@ -227,3 +227,9 @@ sound_callback( HWAVEOUT hwo, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam
     LeaveCriticalSection( &sound_lock );
   }
 }
+
+double
+sound_fill_level( void )
+{
+  return -1;
+}
@@ -35,11 +35,13 @@
 #include "machine.h"
 #include "memory_pages.h"
 #include "module.h"
+#include "peripherals/ide/ide.h"
 #include "peripherals/printer.h"
 #include "peripherals/ula.h"
 #include "phantom_typist.h"
 #include "psg.h"
 #include "profile.h"
+#include "runahead.h"
 #include "rzx.h"
 #include "settings.h"
 #include "sound.h"
@@ -96,11 +98,21 @@ spectrum_frame_event_fn( libspectrum_dword last_tstates, int type,
   psg_frame();
   spectrum_frame();
   z80_interrupt();
+
+  /* Frames run ahead are thrown away; there's no input to read for them
+     and nothing to tell the UI */
+  if( runahead_running ) {
+    runahead_frame();
+    return;
+  }
+
   ui_joystick_poll();
   timer_estimate_speed();
   debugger_add_time_events();
   ui_event();
   ui_error_frame();
+
+  runahead_frame();
 }
 
 static libspectrum_dword
@@ -117,6 +129,9 @@ spectrum_init( void *context )
 
   module_register( &module_info );
 
+  runahead_state_register( &tstates, sizeof( tstates ) );
+  runahead_state_register( &frames_since_reset, sizeof( frames_since_reset ) );
+
   debugger_system_variable_register( debugger_type_string,
       frame_count_name, get_frame_count, NULL );
 
@@ -147,17 +162,19 @@ spectrum_frame( void )
   frame_length = rzx_playback ? tstates
 			      : machine_current->timings.tstates_per_frame;
 
+  tape_frame( frame_length );
   event_frame( frame_length );
   debugger_breakpoint_reduce_tstates( frame_length );
   tstates -= frame_length;
   if( z80.interrupts_enabled_at >= 0 )
     z80.interrupts_enabled_at -= frame_length;
 
-  if( sound_enabled ) sound_frame();
+  if( sound_enabled && !runahead_running ) sound_frame();
 
   if( display_frame() ) return 1;
   if( profile_active ) profile_frame( frame_length );
   printer_frame();
+  ide_frame();
 
   /* Add an interrupt unless they're being generated by .rzx playback */
   if( !rzx_playback )
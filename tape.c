@@ -32,6 +32,7 @@
 
 #include "libspectrum.h"
 
+#include "compat.h"
 #include "debugger/debugger.h"
 #include "event.h"
 #include "fuse.h"
@@ -41,6 +42,7 @@
 #include "memory_pages.h"
 #include "peripherals/ula.h"
 #include "phantom_typist.h"
+#include "runahead.h"
 #include "rzx.h"
 #include "settings.h"
 #include "sound.h"
@@ -83,6 +85,46 @@ static int tape_mic_off_event;
 
 static libspectrum_dword next_tape_edge_tstates;
 
+/* Edges decoded ahead of time, so the event queue is only woken once per
+   run of edges rather than for every edge. A run is ended early by any edge
+   which ends a block or may stop the tape, so libspectrum's idea of the
+   current block is never ahead of what has been played */
+#define TAPE_PULSE_CACHE_SIZE 1024
+
+typedef struct tape_pulse_t {
+  libspectrum_dword length;	/* tstates until the following edge */
+  int flags;
+} tape_pulse_t;
+
+static tape_pulse_t pulse_cache[ TAPE_PULSE_CACHE_SIZE ];
+static size_t pulse_cache_next, pulse_cache_count;
+
+/* When the next edge (cached or not) and the last cached edge happen */
+static libspectrum_dword pulse_cache_next_tstates, pulse_cache_last_tstates;
+
+/* Large .tap files aren't read into memory in one go; instead, the
+   blocks are indexed when the file is opened and only a window of them
+   starting at the current block is read into 'tape' */
+#define TAPE_LAZY_MIN_LENGTH ( 256 * 1024 )
+#define TAPE_LAZY_WINDOW_LENGTH ( 64 * 1024 )
+
+/* How much of a file is looked at to decide whether it's a .tap file */
+#define TAPE_LAZY_HEAD_LENGTH 64
+
+typedef struct tape_lazy_block_t {
+  off_t offset;
+  size_t length;
+  libspectrum_byte header[19];	/* The data of blocks which could be
+				   headers, for the tape browser */
+} tape_lazy_block_t;
+
+static compat_fd lazy_fd = NULL;	/* NULL if the tape isn't lazy */
+static GArray *lazy_blocks;
+
+/* Which blocks of the file are in 'tape', and where we were in it */
+static size_t lazy_first, lazy_last;
+static int lazy_position;
+
 /* Function prototypes */
 
 static int tape_autoload( libspectrum_machine hardware );
@@ -94,6 +136,17 @@ tape_event_record_sample( libspectrum_dword last_tstates, int type,
 			  void *user_data );
 static void tape_stop_mic_off( libspectrum_dword last_tstates, int type,
                                void *user_data );
+static void tape_pulse_cache_flush( void );
+static int tape_lazy_select( size_t n );
+static void tape_lazy_advance( void );
+static int tape_lazy_materialise( void );
+static void tape_lazy_end( void );
+static compat_fd tape_lazy_candidate( const char *filename );
+static int tape_lazy_read( compat_fd fd );
+static int tape_opened( int autoload );
+static libspectrum_tape_block* tape_lazy_block( size_t n );
+static int tape_lazy_write( libspectrum_byte **buffer, size_t *length,
+                            libspectrum_id_t type );
 
 /* Function definitions */
 
@@ -103,10 +156,148 @@ get_microphone( void )
   return tape_microphone;
 }
 
+/* Decode edges into the cache until it is full or we reach an edge which
+   needs the tape to be looked at again; returns the number of edges
+   decoded. Only called when the cache is empty */
+static size_t
+tape_pulse_cache_fill( void )
+{
+  libspectrum_error libspec_error;
+  libspectrum_dword edge_tstates = pulse_cache_next_tstates;
+  libspectrum_tape_state_type state;
+  tape_pulse_t *pulse;
+
+  pulse_cache_next = pulse_cache_count = 0;
+
+  while( pulse_cache_count < TAPE_PULSE_CACHE_SIZE ) {
+    pulse = &pulse_cache[ pulse_cache_count ];
+    state = libspectrum_tape_state( tape );
+
+    libspec_error = libspectrum_tape_get_next_edge( &pulse->length,
+                                                    &pulse->flags, tape );
+    if( libspec_error != LIBSPECTRUM_ERROR_NONE ) break;
+
+    pulse_cache_last_tstates = edge_tstates;
+    edge_tstates += pulse->length;
+    pulse_cache_count++;
+
+    if( pulse->flags & ( LIBSPECTRUM_TAPE_FLAGS_BLOCK |
+                         LIBSPECTRUM_TAPE_FLAGS_STOP |
+                         LIBSPECTRUM_TAPE_FLAGS_STOP48 ) )
+      break;
+
+    /* Also end the run with the pilot tone, so a flash load can tell
+       the block's data hasn't been started on */
+    if( state == LIBSPECTRUM_TAPE_STATE_PILOT &&
+        libspectrum_tape_state( tape ) != LIBSPECTRUM_TAPE_STATE_PILOT )
+      break;
+  }
+
+  return pulse_cache_count;
+}
+
+/* Move the remaining cached edges so the next one happens at 'at_tstates' */
+static void
+tape_pulse_cache_move( libspectrum_dword at_tstates )
+{
+  pulse_cache_last_tstates += at_tstates - pulse_cache_next_tstates;
+  pulse_cache_next_tstates = at_tstates;
+}
+
+/* Wake up again when we've run out of cached edges */
+static libspectrum_dword
+tape_pulse_cache_wakeup( void )
+{
+  return pulse_cache_next < pulse_cache_count ? pulse_cache_last_tstates :
+                                                pulse_cache_next_tstates;
+}
+
+/* Play the next cached edge, which happens at pulse_cache_next_tstates;
+   returns non-zero if the tape was stopped */
+static int
+tape_pulse_do( int from_acceleration )
+{
+  libspectrum_tape_block *block;
+  tape_pulse_t *pulse = &pulse_cache[ pulse_cache_next++ ];
+  libspectrum_dword edge_tstates = pulse->length;
+  int flags = pulse->flags;
+
+  /* Invert the microphone state */
+  if( edge_tstates ||
+      !( flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE ) ||
+      ( flags & ( LIBSPECTRUM_TAPE_FLAGS_STOP |
+                  LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW |
+                  LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH ) ) ) {
+
+    if( flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE ) {
+      /* Do nothing */
+    } else if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW ) {
+      tape_microphone = 0;
+    } else if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH ) {
+      tape_microphone = 1;
+    } else {
+      tape_microphone = !tape_microphone;
+    }
+  }
+
+  sound_beeper( pulse_cache_next_tstates, tape_microphone );
+
+  /* If we've been requested to stop the tape, do so and then
+     return without moving on to another edge */
+  if( ( flags & LIBSPECTRUM_TAPE_FLAGS_STOP ) ||
+      ( ( flags & LIBSPECTRUM_TAPE_FLAGS_STOP48 ) && 
+	( !( libspectrum_machine_capabilities( machine_current->machine ) &
+	     LIBSPECTRUM_MACHINE_CAPABILITY_128_MEMORY
+	   )
+	)
+      )
+    )
+  {
+    tape_stop();
+    return 1;
+  }
+
+  /* If that was the end of a block, update the browser */
+  if( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) {
+
+    tape_lazy_advance();
+    ui_tape_browser_update( UI_TAPE_BROWSER_SELECT_BLOCK, NULL );
+
+    /* If the tape was started automatically, tape traps are active
+       and the new block is a ROM loader, stop the tape and return
+       without moving on to another edge */
+    block = libspectrum_tape_current_block( tape );
+    if( tape_autoplay && settings_current.tape_traps && !rzx_recording &&
+        libspectrum_tape_block_type( block ) == LIBSPECTRUM_TAPE_BLOCK_ROM
+      ) {
+      tape_stop();
+      return 1;
+    }
+  }
+
+  /* Remember that the next edge should occur 'edge_tstates' after this
+     edge, not after the current time (these will be slightly different
+     as we only process events between instructions). */
+  pulse_cache_next_tstates += edge_tstates;
+
+  /* Store length flags for acceleration purposes */
+  loader_set_acceleration_flags( flags, from_acceleration );
+
+  return 0;
+}
+
 static void
 next_edge( libspectrum_dword last_tstates, int type, void *user_data )
 {
-  tape_next_edge( last_tstates, 0 );
+  tape_sync_edges( last_tstates );
+
+  /* Decode some more edges if we've used all the ones we had */
+  while( tape_playing && pulse_cache_next == pulse_cache_count ) {
+    if( !tape_pulse_cache_fill() ) return;
+    tape_sync_edges( last_tstates );
+  }
+
+  if( tape_playing ) event_add( tape_pulse_cache_wakeup(), tape_edge_event );
 }
 
 static int
@@ -135,6 +326,7 @@ tape_init( void *context )
   tape_microphone = 0;
 
   next_tape_edge_tstates = 0;
+  pulse_cache_next = pulse_cache_count = 0;
   
   return 0;
 }
@@ -142,6 +334,7 @@ tape_init( void *context )
 static void
 tape_end( void )
 {
+  tape_lazy_end();
   libspectrum_tape_free( tape );
   tape = NULL;
 }
@@ -163,13 +356,33 @@ int
 tape_open( const char *filename, int autoload )
 {
   utils_file file;
+  libspectrum_id_t type = LIBSPECTRUM_ID_UNKNOWN;
+  compat_fd fd;
   int error;
 
+  /* Large .tap files are read a window of blocks at a time */
+  fd = tape_lazy_candidate( filename );
+  if( fd ) {
+
+    /* If it can't be indexed, it's still known to be a .tap file */
+    type = LIBSPECTRUM_ID_TAPE_TAP;
+
+    if( libspectrum_tape_present( tape ) ) {
+      error = tape_close();
+      if( error ) { compat_file_close( fd ); return error; }
+    }
+
+    if( !tape_lazy_read( fd ) ) {
+      tape_pulse_cache_flush();
+      return tape_opened( autoload );
+    }
+  }
+
   error = utils_read_file( filename, &file );
   if( error ) return error;
 
-  error = tape_read_buffer( file.buffer, file.length, LIBSPECTRUM_ID_UNKNOWN,
-			    filename, autoload );
+  error = tape_read_buffer( file.buffer, file.length, type, filename,
+			    autoload );
   if( error ) { utils_close_file( &file ); return error; }
 
   utils_close_file( &file );
@@ -189,8 +402,18 @@ tape_read_buffer( unsigned char *buffer, size_t length, libspectrum_id_t type,
   }
 
   error = libspectrum_tape_read( tape, buffer, length, type, filename );
+  tape_pulse_cache_flush();
   if( error ) return error;
 
+  return tape_opened( autoload );
+}
+
+/* Things to do once a new tape is in place */
+static int
+tape_opened( int autoload )
+{
+  int error;
+
   tape_modified = 0;
   ui_tape_browser_update( UI_TAPE_BROWSER_NEW_TAPE, NULL );
 
@@ -282,7 +505,9 @@ tape_close( void )
   }
 
   /* And then remove it from memory */
+  tape_lazy_end();
   error = libspectrum_tape_clear( tape );
+  tape_pulse_cache_flush();
   if( error ) return error;
 
   tape_modified = 0;
@@ -317,7 +542,16 @@ tape_select_block( size_t n )
 int
 tape_select_block_no_update( size_t n )
 {
-  return libspectrum_tape_nth_block( tape, n );
+  int error;
+
+  if( lazy_fd ) {
+    error = tape_lazy_select( n );
+  } else {
+    error = libspectrum_tape_nth_block( tape, n );
+  }
+  tape_pulse_cache_flush();
+
+  return error;
 }
 
 /* Which block is current? */
@@ -332,6 +566,8 @@ tape_get_current_block( void )
   error = libspectrum_tape_position( &n, tape );
   if( error ) return -1;
 
+  if( lazy_fd ) n += lazy_first;
+
   return n;
 }
 
@@ -356,7 +592,11 @@ tape_write( const char* filename )
 
   length = 0;
 
-  error = libspectrum_tape_write( &buffer, &length, tape, type );
+  if( lazy_fd ) {
+    error = tape_lazy_write( &buffer, &length, type );
+  } else {
+    error = libspectrum_tape_write( &buffer, &length, tape, type );
+  }
   if( error != LIBSPECTRUM_ERROR_NONE ) return error;
 
   error = utils_write_file( filename, buffer, length );
@@ -392,7 +632,7 @@ tape_load_trap( void )
 
   /* Do nothing if tape traps aren't active, or the tape is already playing */
   if( !settings_current.tape_traps || tape_playing ||
-      rzx_playback || rzx_recording )
+      rzx_playback || rzx_recording || runahead_running )
     return 2;
 
   /* Do nothing if we're not in the correct ROM */
@@ -407,6 +647,8 @@ tape_load_trap( void )
   while( libspectrum_tape_block_metadata( block ) ) {
     block = libspectrum_tape_select_next_block( tape );
     if( !block ) return 1;
+    tape_lazy_advance();
+    block = libspectrum_tape_current_block( tape );
   }
   
   /* If this block isn't a ROM loader, start the block playing. After
@@ -419,8 +661,10 @@ tape_load_trap( void )
   }
 
   /* We don't properly handle the case of partial loading, so don't run
-     the traps in that situation */
-  if( libspectrum_tape_block_data_length( block ) != DE + 2 ) {
+     the traps in that situation; this includes a tape which was stopped
+     with some of the block's edges already decoded */
+  if( libspectrum_tape_block_data_length( block ) != DE + 2 ||
+      pulse_cache_next < pulse_cache_count ) {
     tape_play( 1 );
     return -1;
   }
@@ -447,6 +691,7 @@ tape_load_trap( void )
 
     next_block = libspectrum_tape_select_next_block( tape );
     if( !next_block ) return 1;
+    tape_lazy_advance();
 
     ui_tape_browser_update( UI_TAPE_BROWSER_SELECT_BLOCK, NULL );
 
@@ -566,6 +811,121 @@ common_ret:
   return 0;
 }
 
+/* Load the current block in one go for a custom loader which decodes
+   bits in the same way as LD-BYTES, leaving the registers as the tape
+   traps do. A pair of edges shorter than 'threshold' tstates is read by
+   the loader as a 0 bit and a longer one as a 1; the block's bits must
+   be at least 'margin' tstates away from that. Returns 0 if the block
+   was loaded, or non-zero if it is not suitable for flash loading */
+int
+tape_flash_load( libspectrum_dword threshold, libspectrum_dword margin )
+{
+  libspectrum_tape_block *block, *next_block;
+  libspectrum_tape_state_type state;
+  libspectrum_dword bit0, bit1;
+  int error;
+
+  if( !tape_playing ) return 1;
+
+  block = libspectrum_tape_current_block( tape );
+
+  /* Only a block whose data hasn't been started on yet */
+  state = libspectrum_tape_state( tape );
+  if( state != LIBSPECTRUM_TAPE_STATE_PILOT &&
+      state != LIBSPECTRUM_TAPE_STATE_SYNC1 )
+    return 1;
+
+  switch( libspectrum_tape_block_type( block ) ) {
+
+  case LIBSPECTRUM_TAPE_BLOCK_ROM:
+    bit0 = 855; bit1 = 1710;
+    break;
+
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+    if( libspectrum_tape_block_bits_in_last_byte( block ) != 8 ) return 1;
+    bit0 = libspectrum_tape_block_bit0_length( block );
+    bit1 = libspectrum_tape_block_bit1_length( block );
+    break;
+
+  default:
+    return 1;
+
+  }
+
+  /* Check the loader would read the bits the same way... */
+  if( 2 * bit0 + margin > threshold || 2 * bit1 < threshold + margin )
+    return 1;
+
+  /* ...and as with the traps, don't try to handle partial loading */
+  if( libspectrum_tape_block_data_length( block ) != DE + 2 ) return 1;
+
+  error = trap_load_block( block );
+  if( error ) return error;
+
+  /* Move on to the next block if it's one we might flash load as well,
+     otherwise play the pause at the end of this one */
+  next_block = libspectrum_tape_peek_next_block( tape );
+
+  switch( libspectrum_tape_block_type( next_block ) ) {
+
+  case LIBSPECTRUM_TAPE_BLOCK_ROM:
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+    if( !libspectrum_tape_select_next_block( tape ) ) {
+      /* The block is already in memory, so the load itself worked */
+      ui_error( UI_ERROR_ERROR, "couldn't move on to the next tape block" );
+      tape_stop();
+      return 0;
+    }
+    tape_lazy_advance();
+    ui_tape_browser_update( UI_TAPE_BROWSER_SELECT_BLOCK, NULL );
+    break;
+
+  default:
+    libspectrum_tape_set_state( tape, LIBSPECTRUM_TAPE_STATE_PAUSE );
+    break;
+
+  }
+
+  /* And carry on playing from here */
+  pulse_cache_next_tstates = tstates;
+  tape_pulse_cache_flush();
+
+  return 0;
+}
+
+/* For a loader which last looked at the tape 'since' tstates ago, get the
+   length of the pulse now playing and of the 'count' - 1 pulses after it.
+   Returns non-zero if the loader hasn't seen the edge which started the
+   current pulse, if the pulses haven't all been decoded yet, or if one of
+   the edges does anything more than change the level */
+int
+tape_peek_pulses( libspectrum_dword since, libspectrum_dword *lengths,
+                  size_t count )
+{
+  tape_pulse_t *pulse;
+  size_t i;
+
+  if( !tape_playing ) return 1;
+
+  tape_sync_edges( tstates );
+
+  if( !pulse_cache_next || pulse_cache_next + count > pulse_cache_count )
+    return 1;
+
+  pulse = &pulse_cache[ pulse_cache_next - 1 ];
+  if( tstates - ( pulse_cache_next_tstates - pulse->length ) <= since )
+    return 1;
+
+  for( i = 0; i < count; i++, pulse++ ) {
+    if( pulse[1].flags & ~( LIBSPECTRUM_TAPE_FLAGS_LENGTH_SHORT |
+                            LIBSPECTRUM_TAPE_FLAGS_LENGTH_LONG ) )
+      return 1;
+    lengths[i] = pulse->length;
+  }
+
+  return 0;
+}
+
 /* Append to the current tape file in memory; returns 0 if a block was
    saved or non-zero if there was an error at the emulator level, or tape
    traps are not active */
@@ -580,12 +940,15 @@ tape_save_trap( void )
 
   /* Do nothing if tape traps aren't active */
   if( !settings_current.tape_traps || tape_recording ||
-      rzx_playback || rzx_recording )
+      rzx_playback || rzx_recording || runahead_running )
     return 2;
 
   /* Check we're in the right ROM */
   if( !trap_check_rom( CHECK_TAPE_ROM ) ) return 3;
 
+  /* New blocks go on the end of the whole tape */
+  if( tape_lazy_materialise() ) return 1;
+
   block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
   
   /* The +2 here is for the flag and parity bytes */
@@ -647,7 +1010,8 @@ tape_play( int autoplay )
 
   loader_tape_play();
 
-  event_add( tstates + next_tape_edge_tstates, tape_edge_event );
+  tape_pulse_cache_move( tstates + next_tape_edge_tstates );
+  event_add( tape_pulse_cache_wakeup(), tape_edge_event );
   next_tape_edge_tstates = 0;
 
   /* Once the tape has started, the phantom typist has done its job so
@@ -679,34 +1043,22 @@ tape_toggle_play( int autoplay )
   }
 }
 
-static void
-save_next_tape_edge( gpointer data, gpointer user_data )
-{
-  event_t *ptr = data;
-
-  if( ptr->type == tape_edge_event ) {
-    next_tape_edge_tstates = ptr->tstates - tstates;
-  }
-}
-
-static void
-tape_save_next_edge( void )
-{
-  event_foreach( save_next_tape_edge, NULL );
-}
-
 int
 tape_stop( void )
 {
   if( tape_playing ) {
 
+    /* Play any edges up to now */
+    tape_sync_edges( tstates );
+
     tape_playing = 0;
     ui_statusbar_update( UI_STATUSBAR_ITEM_TAPE, UI_STATUSBAR_STATE_INACTIVE );
     loader_tape_stop();
 
     timer_stop_fastloading();
 
-    tape_save_next_edge();
+    next_tape_edge_tstates = pulse_cache_next_tstates > tstates ?
+                             pulse_cache_next_tstates - tstates : 0;
     event_remove_type( tape_edge_event );
 
     /* Turn off any lingering MIC level in a second (some loaders like Alkatraz
@@ -733,11 +1085,22 @@ tape_present( void )
   return libspectrum_tape_present( tape );
 }
 
+/* Recorded pulses are written out to a temporary file whenever this many
+   bytes have been collected, so long recordings don't grow in memory */
+#define TAPE_REC_BUFFER_SIZE 8192
+
+/* and read back into blocks of at most this many bytes when recording
+   stops, so the recording never has to be in one buffer */
+#define TAPE_REC_BLOCK_SIZE ( 1024 * 1024 )
+
 typedef struct
 {
   libspectrum_byte *tape_buffer;
   libspectrum_dword tape_buffer_size;
   libspectrum_dword tape_buffer_used;
+  FILE *spill;			/* NULL if everything is in tape_buffer */
+  libspectrum_dword spill_length;
+  int spill_failed;
   int tstates_per_sample;
   int last_level;
   int last_level_count;
@@ -754,11 +1117,16 @@ tape_record_start( void )
   rec_state.tstates_per_sample =
     machine_current->timings.processor_speed/44100;
 
-  rec_state.tape_buffer_size = 8192;
+  rec_state.tape_buffer_size = TAPE_REC_BUFFER_SIZE;
   rec_state.tape_buffer = libspectrum_new(libspectrum_byte,
 					  rec_state.tape_buffer_size);
   rec_state.tape_buffer_used = 0;
 
+  /* If there's no temporary file, everything is kept in memory instead */
+  rec_state.spill = tmpfile();
+  rec_state.spill_length = 0;
+  rec_state.spill_failed = 0;
+
   /* start scheduling events that record into a buffer that we
      start allocating here */
   event_add( tstates + rec_state.tstates_per_sample, record_event );
@@ -790,6 +1158,136 @@ write_rec_buffer( libspectrum_byte *tape_buffer,
   return tape_buffer_used;
 }
 
+/* Move the recording buffer out to the temporary file; returns non-zero
+   if it has to stay in memory */
+static int
+write_rec_spill( void )
+{
+  if( !rec_state.spill || rec_state.spill_failed ) return 1;
+
+  if( fwrite( rec_state.tape_buffer, 1, rec_state.tape_buffer_used,
+              rec_state.spill ) != rec_state.tape_buffer_used ) {
+    /* Anything written before this is still good, so just keep the rest
+       of the recording in memory */
+    ui_error( UI_ERROR_WARNING, "couldn't write tape recording to disk: %s",
+              strerror( errno ) );
+    rec_state.spill_failed = 1;
+    return 1;
+  }
+
+  rec_state.spill_length += rec_state.tape_buffer_used;
+  rec_state.tape_buffer_used = 0;
+
+  return 0;
+}
+
+/* How many bytes at the start of 'buffer' are whole samples, as written
+   by write_rec_buffer() */
+static size_t
+rec_samples_length( const libspectrum_byte *buffer, size_t length )
+{
+  size_t used = 0, sample_length;
+
+  while( used < length ) {
+    sample_length = buffer[ used ] ? 1 : 5;
+    if( used + sample_length > length ) break;
+    used += sample_length;
+  }
+
+  return used;
+}
+
+/* Put 'length' bytes of samples on the end of the tape */
+static void
+append_rec_block( libspectrum_byte *data, size_t length )
+{
+  libspectrum_tape_block* block;
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE );
+
+  libspectrum_tape_block_set_scale( block, rec_state.tstates_per_sample );
+  libspectrum_tape_block_set_data_length( block, length );
+  libspectrum_tape_block_set_data( block, data );
+
+  libspectrum_tape_append_block( tape, block );
+
+  ui_tape_browser_update( UI_TAPE_BROWSER_NEW_BLOCK, block );
+}
+
+/* Turn the recording into blocks on the end of the tape, reading the
+   temporary file back a block at a time. A sample is never split between
+   blocks, so the blocks play back exactly as one would */
+static int
+append_rec_blocks( void )
+{
+  libspectrum_byte *data, carry[4];
+  size_t left, length, chunk, used, carried = 0;
+
+  if( !rec_state.spill ) {
+    append_rec_block( rec_state.tape_buffer, rec_state.tape_buffer_used );
+    rec_state.tape_buffer = NULL;
+    return 0;
+  }
+
+  rewind( rec_state.spill );
+  left = rec_state.spill_length;
+
+  while( left ) {
+
+    length = carried + left > TAPE_REC_BLOCK_SIZE ?
+             TAPE_REC_BLOCK_SIZE : carried + left;
+    chunk = length - carried;
+
+    data = libspectrum_new( libspectrum_byte, length );
+    memcpy( data, carry, carried );
+
+    if( fread( data + carried, 1, chunk, rec_state.spill ) != chunk ) {
+      ui_error( UI_ERROR_ERROR, "couldn't read back tape recording" );
+      libspectrum_free( data );
+      return 1;
+    }
+    left -= chunk;
+
+    /* Keep the start of any sample which carries on in the next block */
+    used = rec_samples_length( data, length );
+    carried = length - used;
+    memcpy( carry, data + used, carried );
+
+    if( used ) {
+      append_rec_block( data, used );
+    } else {
+      libspectrum_free( data );
+    }
+  }
+
+  /* Whatever didn't make it out to the temporary file */
+  length = carried + rec_state.tape_buffer_used;
+  if( length ) {
+    data = libspectrum_new( libspectrum_byte, length );
+    memcpy( data, carry, carried );
+    memcpy( data + carried, rec_state.tape_buffer,
+            rec_state.tape_buffer_used );
+    append_rec_block( data, length );
+  }
+
+  return 0;
+}
+
+/* Throw away the recording */
+static void
+free_rec_state( void )
+{
+  if( rec_state.spill ) {
+    fclose( rec_state.spill );
+    rec_state.spill = NULL;
+  }
+
+  libspectrum_free( rec_state.tape_buffer );
+  rec_state.tape_buffer = NULL;
+  rec_state.tape_buffer_size = 0;
+  rec_state.tape_buffer_used = 0;
+}
+
 void
 tape_event_record_sample( libspectrum_dword last_tstates, int type,
 			  void *user_data )
@@ -804,7 +1302,8 @@ tape_event_record_sample( libspectrum_dword last_tstates, int type,
     rec_state.last_level_count = 0;
     rec_state.last_level = ula_tape_level();
     /* make sure we can still fit a dword and a flag byte in the buffer */
-    if( rec_state.tape_buffer_used+5 >= rec_state.tape_buffer_size ) {
+    if( rec_state.tape_buffer_used+5 >= rec_state.tape_buffer_size &&
+        write_rec_spill() ) {
       rec_state.tape_buffer_size = rec_state.tape_buffer_size*2;
       rec_state.tape_buffer =
         libspectrum_renew( libspectrum_byte, rec_state.tape_buffer,
@@ -821,7 +1320,7 @@ tape_event_record_sample( libspectrum_dword last_tstates, int type,
 int
 tape_record_stop( void )
 {
-  libspectrum_tape_block* block;
+  int error;
 
   /* put last sample into the recording buffer */
   rec_state.tape_buffer_used = write_rec_buffer( rec_state.tape_buffer,
@@ -832,106 +1331,325 @@ tape_record_stop( void )
      pop into the current tape */
   event_remove_type( record_event );
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE );
+  /* The recording goes on the end of the whole tape, so give up on it if
+     the rest of the tape can't be read */
+  if( tape_lazy_materialise() ) {
+    ui_error( UI_ERROR_ERROR,
+              "couldn't read the tape to add the recording to" );
+    free_rec_state();
+    tape_recording = 0;
+    ui_menu_activate( UI_MENU_ITEM_TAPE_RECORDING, 0 );
+    return 1;
+  }
 
-  libspectrum_tape_block_set_scale( block, rec_state.tstates_per_sample );
-  libspectrum_tape_block_set_data_length( block, rec_state.tape_buffer_used );
-  libspectrum_tape_block_set_data( block, rec_state.tape_buffer );
+  error = append_rec_blocks();
 
-  libspectrum_tape_append_block( tape, block );
-
-  rec_state.tape_buffer = NULL;
-  rec_state.tape_buffer_size = 0;
-  rec_state.tape_buffer_used = 0;
+  free_rec_state();
 
   tape_modified = 1;
-  ui_tape_browser_update( UI_TAPE_BROWSER_NEW_BLOCK, block );
 
   tape_recording = 0;
 
   /* Also want to reenable other tape actions */
   ui_menu_activate( UI_MENU_ITEM_TAPE_RECORDING, 0 );
 
-  return 0;
+  return error;
 }
 
+/* Make the next edge happen at 'last_tstates' rather than when it would
+   have done; used by the loader acceleration */
 void
 tape_next_edge( libspectrum_dword last_tstates, int from_acceleration )
 {
-  libspectrum_error libspec_error;
+  /* If the tape's not playing, just return */
+  if( ! tape_playing ) return;
+
+  if( pulse_cache_next == pulse_cache_count && !tape_pulse_cache_fill() )
+    return;
+
+  event_remove_type( tape_edge_event );
+
+  tape_pulse_cache_move( last_tstates );
+  if( tape_pulse_do( from_acceleration ) ) return;
+
+  event_add( tape_pulse_cache_wakeup(), tape_edge_event );
+}
+
+/* Play all the cached edges which happen no later than 'at_tstates'; must be
+   called before anything looks at tape_microphone */
+void
+tape_sync_edges( libspectrum_dword at_tstates )
+{
+  while( tape_playing && pulse_cache_next < pulse_cache_count &&
+         pulse_cache_next_tstates <= at_tstates ) {
+    if( tape_pulse_do( 0 ) ) return;
+  }
+}
+
+/* Play the edges in this frame and move the rest into the next frame */
+void
+tape_frame( libspectrum_dword frame_length )
+{
+  if( !tape_playing ) return;
+
+  tape_sync_edges( frame_length - 1 );
+
+  pulse_cache_next_tstates -= frame_length;
+  pulse_cache_last_tstates -= frame_length;
+}
+
+/* Forget any edges decoded before the tape position was changed */
+static void
+tape_pulse_cache_flush( void )
+{
+  pulse_cache_next = pulse_cache_count = 0;
+
+  if( tape_playing ) {
+    event_remove_type( tape_edge_event );
+    event_add( pulse_cache_next_tstates, tape_edge_event );
+  }
+}
+
+/* Open 'filename' if it's a .tap file big enough to be worth reading a
+   window of blocks at a time; returns NULL if not */
+static compat_fd
+tape_lazy_candidate( const char *filename )
+{
+  libspectrum_byte head[ TAPE_LAZY_HEAD_LENGTH ];
+  libspectrum_id_t type;
+  utils_file file;
+  compat_fd fd;
+
+  fd = compat_file_open( filename, 0 );
+  if( fd == COMPAT_FILE_OPEN_FAILED ) return NULL;
+
+  file.buffer = head;
+  file.length = sizeof( head );
+
+  /* Compressed files aren't looked inside, so are always read as normal */
+  if( compat_file_get_length( fd ) < TAPE_LAZY_MIN_LENGTH ||
+      compat_file_read( fd, &file ) ||
+      libspectrum_identify_file_raw( &type, filename, head, sizeof( head ) ) ||
+      type != LIBSPECTRUM_ID_TAPE_TAP ) {
+    compat_file_close( fd );
+    return NULL;
+  }
+
+  return fd;
+}
+
+/* Index the blocks of a .tap file, reading just the length of each block
+   (and the data of anything which could be a header); the blocks are then
+   read from the file as they're needed. Takes over 'fd'. Returns non-zero
+   if the file couldn't be indexed, in which case it should be read as
+   normal */
+static int
+tape_lazy_read( compat_fd fd )
+{
+  tape_lazy_block_t lazy_block;
+  libspectrum_byte length_bytes[2];
+  utils_file file;
+  off_t offset, length;
+
+  lazy_fd = fd;
+  lazy_blocks = g_array_new( FALSE, FALSE, sizeof( tape_lazy_block_t ) );
+
+  length = compat_file_get_length( fd );
+
+  for( offset = 0; offset + 2 <= length; offset += 2 + lazy_block.length ) {
+
+    file.buffer = length_bytes;
+    file.length = sizeof( length_bytes );
+    if( compat_file_seek( fd, offset ) || compat_file_read( fd, &file ) )
+      break;
+
+    lazy_block.offset = offset + 2;
+    lazy_block.length = length_bytes[0] | length_bytes[1] << 8;
+
+    /* Leave libspectrum to complain about truncated files */
+    if( lazy_block.offset + (off_t)lazy_block.length > length ) break;
+
+    if( lazy_block.length == sizeof( lazy_block.header ) ) {
+      file.buffer = lazy_block.header;
+      file.length = sizeof( lazy_block.header );
+      if( compat_file_read( fd, &file ) ) break;
+    }
+
+    g_array_append_val( lazy_blocks, lazy_block );
+  }
+
+  if( offset != length || !lazy_blocks->len || tape_lazy_select( 0 ) ) {
+    tape_lazy_end();
+    libspectrum_tape_clear( tape );
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Read block 'n' of the file into a new ROM block, as libspectrum would */
+static libspectrum_tape_block*
+tape_lazy_block( size_t n )
+{
+  tape_lazy_block_t *lazy_block =
+    &g_array_index( lazy_blocks, tape_lazy_block_t, n );
   libspectrum_tape_block *block;
+  utils_file file;
 
-  libspectrum_dword edge_tstates;
-  int flags;
+  file.length = lazy_block->length;
+  file.buffer = libspectrum_new( unsigned char, file.length );
 
-  /* If the tape's not playing, just return */
-  if( ! tape_playing ) return;
+  if( compat_file_seek( lazy_fd, lazy_block->offset ) ||
+      compat_file_read( lazy_fd, &file ) ) {
+    libspectrum_free( file.buffer );
+    return NULL;
+  }
 
-  /* Get the time until the next edge */
-  libspec_error = libspectrum_tape_get_next_edge( &edge_tstates, &flags,
-						  tape );
-  if( libspec_error != LIBSPECTRUM_ERROR_NONE ) return;
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
+  libspectrum_tape_block_set_data_length( block, file.length );
+  libspectrum_tape_block_set_data( block, file.buffer );
+  libspectrum_tape_block_set_pause( block, 1000 );
 
-  /* Invert the microphone state */
-  if( edge_tstates ||
-      !( flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE ) ||
-      ( flags & ( LIBSPECTRUM_TAPE_FLAGS_STOP |
-                  LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW |
-                  LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH ) ) ) {
+  return block;
+}
 
-    if( flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE ) {
-      /* Do nothing */
-    } else if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW ) {
-      tape_microphone = 0;
-    } else if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH ) {
-      tape_microphone = 1;
-    } else {
-      tape_microphone = !tape_microphone;
+/* Make block 'n' of the file the current block, reading a new window of
+   blocks if it isn't already in memory or is the last block of the window
+   but not of the file */
+static int
+tape_lazy_select( size_t n )
+{
+  libspectrum_tape_block *block;
+  size_t length;
+  libspectrum_error error;
+
+  if( n >= lazy_blocks->len ) return 1;
+
+  if( n < lazy_first || n >= lazy_last ||
+      ( n == lazy_last - 1 && lazy_last < lazy_blocks->len ) ) {
+
+    libspectrum_tape_clear( tape );
+
+    for( lazy_last = n, length = 0;
+         lazy_last < lazy_blocks->len &&
+           ( lazy_last < n + 2 || length < TAPE_LAZY_WINDOW_LENGTH );
+         lazy_last++ ) {
+      block = tape_lazy_block( lazy_last );
+      if( !block ) return 1;
+      libspectrum_tape_append_block( tape, block );
+      length += libspectrum_tape_block_data_length( block );
     }
+
+    lazy_first = n;
   }
 
-  sound_beeper( last_tstates, tape_microphone );
+  error = libspectrum_tape_nth_block( tape, n - lazy_first );
+  if( error ) return error;
 
-  /* If we've been requested to stop the tape, do so and then
-     return without stacking another edge */
-  if( ( flags & LIBSPECTRUM_TAPE_FLAGS_STOP ) ||
-      ( ( flags & LIBSPECTRUM_TAPE_FLAGS_STOP48 ) && 
-	( !( libspectrum_machine_capabilities( machine_current->machine ) &
-	     LIBSPECTRUM_MACHINE_CAPABILITY_128_MEMORY
-	   )
-	)
-      )
-    )
-  {
-    tape_stop();
-    return;
+  lazy_position = n - lazy_first;
+
+  return 0;
+}
+
+/* Called whenever libspectrum has moved on to another block, to keep the
+   window ahead of the current block and to rewind to the start of the
+   file rather than the start of the window */
+static void
+tape_lazy_advance( void )
+{
+  int position;
+  size_t n;
+
+  if( !lazy_fd ) return;
+
+  if( libspectrum_tape_position( &position, tape ) ) return;
+
+  n = position < lazy_position ? 0 : lazy_first + position;
+  lazy_position = position;
+
+  if( n != lazy_first + position ||
+      ( n == lazy_last - 1 && lazy_last < lazy_blocks->len ) ) {
+    if( tape_lazy_select( n ) )
+      ui_error( UI_ERROR_ERROR, "couldn't read tape block %lu",
+                (unsigned long)n + 1 );
   }
+}
 
-  /* If that was the end of a block, update the browser */
-  if( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) {
+/* Read the rest of the file, for when the whole tape is needed */
+static int
+tape_lazy_materialise( void )
+{
+  libspectrum_tape_block *block;
+  size_t i;
+  int current, error;
 
-    ui_tape_browser_update( UI_TAPE_BROWSER_SELECT_BLOCK, NULL );
+  if( !lazy_fd ) return 0;
 
-    /* If the tape was started automatically, tape traps are active
-       and the new block is a ROM loader, stop the tape and return
-       without putting another event into the queue */
-    block = libspectrum_tape_current_block( tape );
-    if( tape_autoplay && settings_current.tape_traps && !rzx_recording &&
-        libspectrum_tape_block_type( block ) == LIBSPECTRUM_TAPE_BLOCK_ROM
-      ) {
-      tape_stop();
-      return;
+  current = tape_get_current_block();
+
+  libspectrum_tape_clear( tape );
+
+  for( i = 0; i < lazy_blocks->len; i++ ) {
+    block = tape_lazy_block( i );
+    if( !block ) {
+      tape_lazy_end();
+      libspectrum_tape_clear( tape );
+      tape_pulse_cache_flush();
+      ui_tape_browser_update( UI_TAPE_BROWSER_NEW_TAPE, NULL );
+      return 1;
     }
+    libspectrum_tape_append_block( tape, block );
   }
 
-  /* Otherwise, put this into the event queue; remember that this edge
-     should occur 'edge_tstates' after the last edge, not after the
-     current time (these will be slightly different as we only process
-     events between instructions). */
-  event_add( last_tstates + edge_tstates, tape_edge_event );
+  tape_lazy_end();
 
-  /* Store length flags for acceleration purposes */
-  loader_set_acceleration_flags( flags, from_acceleration );
+  error = libspectrum_tape_nth_block( tape, current );
+  tape_pulse_cache_flush();
+
+  return error;
+}
+
+/* Write out the whole of a lazy tape without disturbing the window */
+static int
+tape_lazy_write( libspectrum_byte **buffer, size_t *length,
+                 libspectrum_id_t type )
+{
+  libspectrum_tape *whole_tape;
+  libspectrum_tape_block *block;
+  size_t i;
+  int error;
+
+  whole_tape = libspectrum_tape_alloc();
+
+  for( i = 0; i < lazy_blocks->len; i++ ) {
+    block = tape_lazy_block( i );
+    if( !block ) { libspectrum_tape_free( whole_tape ); return 1; }
+    libspectrum_tape_append_block( whole_tape, block );
+  }
+
+  error = libspectrum_tape_write( buffer, length, whole_tape, type );
+
+  libspectrum_tape_free( whole_tape );
+
+  return error;
+}
+
+/* Forget about the file behind a lazy tape */
+static void
+tape_lazy_end( void )
+{
+  if( lazy_fd ) {
+    compat_file_close( lazy_fd );
+    lazy_fd = NULL;
+  }
+
+  if( lazy_blocks ) {
+    g_array_free( lazy_blocks, TRUE );
+    lazy_blocks = NULL;
+  }
+
+  lazy_first = lazy_last = 0;
+  lazy_position = 0;
 }
 
 static void
@@ -948,6 +1666,31 @@ tape_foreach( void (*function)( libspectrum_tape_block *block,
 {
   libspectrum_tape_block *block;
   libspectrum_tape_iterator iterator;
+  tape_lazy_block_t *lazy_block;
+  libspectrum_byte *data;
+  size_t i;
+
+  /* Blocks which aren't in memory are made up from the index just for the
+     call, with the data filled in only for blocks which could be headers */
+  if( lazy_fd ) {
+    for( i = 0; i < lazy_blocks->len; i++ ) {
+      lazy_block = &g_array_index( lazy_blocks, tape_lazy_block_t, i );
+
+      block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
+      libspectrum_tape_block_set_data_length( block, lazy_block->length );
+      libspectrum_tape_block_set_pause( block, 1000 );
+
+      if( lazy_block->length == sizeof( lazy_block->header ) ) {
+        data = libspectrum_new( libspectrum_byte, lazy_block->length );
+        memcpy( data, lazy_block->header, lazy_block->length );
+        libspectrum_tape_block_set_data( block, data );
+      }
+
+      function( block, user_data );
+      libspectrum_tape_block_free( block );
+    }
+    return 0;
+  }
 
   for( block = libspectrum_tape_iterator_init( &iterator, tape );
        block;
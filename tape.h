@@ -45,12 +45,18 @@ int tape_write( const char *filename );
 int tape_can_autoload( void );
 
 int tape_load_trap( void );
+int tape_flash_load( libspectrum_dword threshold,
+                     libspectrum_dword margin );
+int tape_peek_pulses( libspectrum_dword since, libspectrum_dword *lengths,
+                      size_t count );
 int tape_save_trap( void );
 
 int tape_do_play( int autoplay );
 int tape_toggle_play( int autoplay );
 
 void tape_next_edge( libspectrum_dword last_tstates, int from_acceleration );
+void tape_sync_edges( libspectrum_dword at_tstates );
+void tape_frame( libspectrum_dword frame_length );
 
 int tape_stop( void );
 int tape_is_playing( void );
@@ -59,7 +65,9 @@ int tape_present( void );
 void tape_record_start( void );
 int tape_record_stop( void );
 
-/* Call a user-supplied function for every block in the current tape */
+/* Call a user-supplied function for every block in the current tape. For
+   a large .tap file read from disk as it plays, blocks which aren't in
+   memory come with their data only if they could be headers */
 int
 tape_foreach( void (*function)( libspectrum_tape_block *block,
 				void *user_data),
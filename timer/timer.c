@@ -27,6 +27,7 @@
 #include "infrastructure/startup_manager.h"
 #include "movie.h"
 #include "phantom_typist.h"
+#include "runahead.h"
 #include "settings.h"
 #include "sound.h"
 #include "tape.h"
@@ -225,6 +226,10 @@ timer_frame( libspectrum_dword last_tstates, int event GCC_UNUSED,
   double current_time, difference;
   long tstates;
 
+  /* Frames run ahead take no time on the Spectrum's clock. The event list
+     is put back afterwards, so this event doesn't need adding again */
+  if( runahead_running ) return;
+
   if( sound_enabled && settings_current.sound ) {
     timer_frame_callback_sound( last_tstates );
     return;
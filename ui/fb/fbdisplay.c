@@ -41,6 +41,7 @@
 #include "fuse.h"
 #include "display.h"
 #include "screenshot.h"
+#include "ui/scaler/scaler.h"
 #include "ui/ui.h"
 #include "ui/uidisplay.h"
 #include "settings.h"
@@ -50,6 +51,33 @@ libspectrum_word
   fbdisplay_image[ 2 * DISPLAY_SCREEN_HEIGHT ][ DISPLAY_SCREEN_WIDTH ];
 ptrdiff_t fbdisplay_pitch = DISPLAY_SCREEN_WIDTH * sizeof( libspectrum_word );
 
+/* The same as framebuffer pixels, with two lines above and below and a
+   pixel either side for the scalers to look at */
+static libspectrum_word
+  rgb_image[ 2 * DISPLAY_SCREEN_HEIGHT + 4 ][ DISPLAY_SCREEN_WIDTH + 3 ];
+static const ptrdiff_t rgb_pitch =
+  ( DISPLAY_SCREEN_WIDTH + 3 ) * sizeof( libspectrum_word );
+
+/* The whole screen as it should look. Changed areas are drawn here and
+   then copied into video memory at the end of the frame */
+static libspectrum_word *shadow;
+
+typedef struct fbdisplay_rect {
+  int x, y, w, h;
+} fbdisplay_rect;
+
+/* The areas of the image changed since the last frame end */
+#define MAX_UPDATE_RECT 300
+static fbdisplay_rect updated_rects[ MAX_UPDATE_RECT ];
+static int num_rects = 0;
+static int fbdisplay_force_full_refresh = 1;
+
+/* The areas of the screen changed in the last frame shown. With two
+   pages these are still missing from the page we'll show next */
+static fbdisplay_rect last_rects[ MAX_UPDATE_RECT ];
+static int num_last_rects = 0;
+static int last_full_refresh = 1;
+
 /* The environment variable specifying which device to use */
 static const char * const DEVICE_VARIABLE = "FRAMEBUFFER";
 
@@ -73,6 +101,16 @@ static short rgbs[16], greys[16];
 
 static int fb_fd = -1;		/* The framebuffer's file descriptor */
 static libspectrum_word *gm = 0;
+static int fb_pitch;		/* Pixels from one line of `gm' to the next */
+
+/* With two pages we draw into the one not being shown and pan over to it
+   at the end of the frame; otherwise we copy into the only one during
+   the vertical blank */
+static int fb_pages = 1;
+static int fb_back_page = 0;
+
+/* Cleared if the driver can't tell us when the vertical blank starts */
+static int fb_vsync = 1;
 
 static struct fb_fix_screeninfo fixed;
 static struct fb_var_screeninfo orig_display, display;
@@ -133,6 +171,7 @@ static unsigned short red16[256], green16[256], blue16[256], transp16[256];
 static struct fb_cmap orig_cmap = {0, 256, red16, green16, blue16, transp16};
 
 static int fb_set_mode( void );
+static void fb_start_pages( void );
 
 int uidisplay_init( int width, int height )
 {
@@ -143,6 +182,7 @@ int uidisplay_init( int width, int height )
 
   register_scalers();
 
+  fbdisplay_force_full_refresh = 1;
   display_ui_initialised = 1;
 
   display_refresh_all();
@@ -150,12 +190,60 @@ int uidisplay_init( int width, int height )
   return 0;
 }
 
+/* The mode fixes the size of the picture, so offer just the scalers which
+   take the image to that size */
 static void
 register_scalers( void )
 {
+  scaler_type preferred;
+
   scaler_register_clear();
-  scaler_select_bitformat( 565 );		/* 16bit always */
-  scaler_register( SCALER_NORMAL );
+  scaler_select_bitformat( display.green.length == 6 ? 565 : 555 );
+
+  switch( fb_resolution ) {
+
+  case FB_RES( 640, 480 ):
+    if( hires ) {
+      scaler_register( SCALER_NORMAL );
+      scaler_register( SCALER_TIMEXTV );
+      scaler_register( SCALER_PALTV );
+      preferred = SCALER_NORMAL;
+    } else {
+      scaler_register( SCALER_DOUBLESIZE );
+      scaler_register( SCALER_2XSAI );
+      scaler_register( SCALER_SUPER2XSAI );
+      scaler_register( SCALER_SUPEREAGLE );
+      scaler_register( SCALER_ADVMAME2X );
+      scaler_register( SCALER_TV2X );
+      scaler_register( SCALER_DOTMATRIX );
+      scaler_register( SCALER_PALTV2X );
+      scaler_register( SCALER_HQ2X );
+      preferred = SCALER_DOUBLESIZE;
+    }
+    break;
+
+  case FB_RES( 320, 240 ):
+    if( hires ) {
+      scaler_register( SCALER_HALF );
+      scaler_register( SCALER_HALFSKIP );
+      preferred = SCALER_HALFSKIP;
+    } else {
+      scaler_register( SCALER_NORMAL );
+      scaler_register( SCALER_PALTV );
+      preferred = SCALER_NORMAL;
+    }
+    break;
+
+  default:
+    /* The 640x240 modes stretch the image themselves */
+    scaler_register( SCALER_NORMAL );
+    preferred = SCALER_NORMAL;
+    break;
+
+  }
+
+  if( current_scaler == SCALER_NUM || !scaler_is_supported( current_scaler ) )
+    scaler_select_scaler( preferred );
 }
 
 static void
@@ -217,6 +305,12 @@ int fbdisplay_init(void)
   }
 
   ioctl( fb_fd, FBIOGET_VSCREENINFO, &display);
+  ioctl( fb_fd, FBIOGET_FSCREENINFO, &fixed );
+  fb_pitch = fixed.line_length / sizeof( libspectrum_word );
+  fb_start_pages();
+
+  shadow = libspectrum_new0( libspectrum_word, display.xres * display.yres );
+
   for( i = 0; i < 16; i++ ) {
     int v = ( i & 8 ) ? 0xff : 0xbf;
     int c;
@@ -285,8 +379,16 @@ fb_select_mode( const fuse_fb_mode_t *fb_mode )
     return 1;
   }
 
+  /* Ask for room for a second page below the first if there's enough
+     video memory, and do without if the driver won't have it */
   display.activate = FB_ACTIVATE_TEST;
-  if( ioctl( fb_fd, FBIOPUT_VSCREENINFO, &display ) ) {
+  if( fixed.smem_len >= 2 * display.xres * display.yres * 2 ) {
+    display.yres_virtual = 2 * display.yres;
+    if( ioctl( fb_fd, FBIOPUT_VSCREENINFO, &display ) )
+      display.yres_virtual = display.yres;
+  }
+  if( display.yres_virtual == display.yres &&
+      ioctl( fb_fd, FBIOPUT_VSCREENINFO, &display ) ) {
     munmap( gm, fixed.smem_len );
     return 1;
   }
@@ -322,105 +424,225 @@ fb_set_mode( void )
   return 1;
 }
 
+/* Use two pages if the mode has room for them and the driver lets us pan
+   between them */
+static void
+fb_start_pages( void )
+{
+  fb_pages = 1;
+  fb_back_page = 0;
+
+  if( display.yres_virtual >= 2 * display.yres && fixed.ypanstep ) {
+    display.xoffset = display.yoffset = 0;
+    if( !ioctl( fb_fd, FBIOPAN_DISPLAY, &display ) ) {
+      fb_pages = 2;
+      fb_back_page = 1;
+    }
+  }
+}
+
+static void
+fb_wait_vsync( void )
+{
+#ifdef FBIO_WAITFORVSYNC
+  __u32 crtc = 0;
+
+  if( fb_vsync && ioctl( fb_fd, FBIO_WAITFORVSYNC, &crtc ) ) fb_vsync = 0;
+#endif			/* #ifdef FBIO_WAITFORVSYNC */
+}
+
+/* Show the back page, then wait for the vertical blank so that the page
+   we've just left is no longer being displayed when we draw into it */
+static void
+fb_flip( void )
+{
+  display.yoffset = fb_back_page * display.yres;
+  ioctl( fb_fd, FBIOPAN_DISPLAY, &display );
+  fb_wait_vsync();
+
+  fb_back_page ^= 1;
+}
+
 int
 uidisplay_hotswap_gfx_mode( void )
 {
+  fbdisplay_force_full_refresh = 1;
   return 0;
 }
 
-void
-uidisplay_frame_end( void ) 
+/* Turn an area of the image into framebuffer pixels */
+static void
+fb_convert_area( const fbdisplay_rect *r )
 {
-  return;
+  const short *colours = settings_current.bw_tv ? greys : rgbs;
+  int x, y;
+
+  for( y = r->y; y < r->y + r->h; y++ )
+    for( x = r->x; x < r->x + r->w; x++ )
+      rgb_image[ y + 2 ][ x + 1 ] = colours[ fbdisplay_image[y][x] ];
 }
 
-void
-uidisplay_area( int x, int start, int width, int height)
+/* The 640x240 modes keep the full width but only half the height of a
+   Timex image, so are stretched here rather than by a scaler */
+static void
+fb_stretch_area( const fbdisplay_rect *r, fbdisplay_rect *screen )
 {
-  int y;
   const short *colours = settings_current.bw_tv ? greys : rgbs;
+  int x = r->x, start = r->y, width = r->w, height = r->h, y;
 
-  switch( fb_resolution ) {
-  case FB_RES( 640, 480 ):
-    for( y = start; y < start + height; y++ )
-    {
-      int i;
-      libspectrum_word *point;
+  if( hires ) { start >>= 1; height >>= 1; }
+  for( y = start; y < start + height; y++ )
+  {
+    int i;
+    libspectrum_word *point;
 
-      if( hires ) {
+    if( hires ) {
 
-	for( i = 0, point = gm + y * display.xres_virtual + x;
-	     i < width;
-	     i++, point++ )
-	  *point = colours[fbdisplay_image[y][x+i]];
+      for ( i = 0, point = shadow + y * display.xres + x;
+	    i < width;
+	    i++, point++ )
+	*point = colours[fbdisplay_image[y*2][x+i]];
 
-      } else {
+    } else {
 
-	for( i = 0, point = gm + 2 * y * display.xres_virtual + x * 2;
-	     i < width;
-	     i++, point += 2 )
-	  *  point       = *( point +     display.xres_virtual ) =
-	  *( point + 1 ) = *( point + 1 + display.xres_virtual ) = 
-	    colours[fbdisplay_image[y][x+i]];
+      for( i = 0, point = shadow + y * display.xres + x * 2;
+	   i < width;
+	   i++, point+=2 )
+	*point = *(point+1) = colours[fbdisplay_image[y][x+i]];
 
-      }
     }
-    break;
+  }
 
-  case FB_RES( 640, 240 ):
-    if( hires ) { start >>= 1; height >>= 1; }
-    for( y = start; y < start + height; y++ )
-    {
-      int i;
-      libspectrum_word *point;
+  screen->x = hires ? x : x * 2;
+  screen->w = hires ? width : width * 2;
+  screen->y = start;
+  screen->h = height;
+}
 
-      if( hires ) {
+/* Scale an area of the image into the shadow screen and return the area
+   of the screen it covered */
+static void
+fb_scale_area( const fbdisplay_rect *r, fbdisplay_rect *screen )
+{
+  float factor = scaler_get_scaling_factor( current_scaler );
+  int x = r->x, y = r->y, w = r->w, h = r->h;
 
-	for ( i = 0, point = gm + y * display.xres_virtual + x;
-	      i < width;
-	      i++, point++ )
-	  *point = colours[fbdisplay_image[y*2][x+i]];
+  if( fb_resolution == FB_RES( 640, 240 ) ) {
+    fb_stretch_area( r, screen );
+    return;
+  }
 
-      } else {
+  /* Extend the dirty region by 1 pixel for scalers
+     that "smear" the screen, e.g. 2xSAI */
+  if( scaler_flags & SCALER_FLAGS_EXPAND )
+    scaler_expander( &x, &y, &w, &h, image_width, image_height );
+
+  screen->x = x * factor;
+  screen->y = y * factor;
+  screen->w = ceil( ( x + w ) * factor ) - screen->x;
+  screen->h = ceil( ( y + h ) * factor ) - screen->y;
+  if( screen->w > (int)display.xres - screen->x )
+    screen->w = display.xres - screen->x;
+  if( screen->h > (int)display.yres - screen->y )
+    screen->h = display.yres - screen->y;
+
+  scaler_proc_bands(
+    scaler_proc16, (libspectrum_byte *)&rgb_image[ y + 2 ][ x + 1 ], rgb_pitch,
+    (libspectrum_byte *)( shadow + screen->y * display.xres + screen->x ),
+    display.xres * sizeof( libspectrum_word ), w, h
+  );
+}
 
-	for( i = 0, point = gm + y * display.xres_virtual + x * 2;
-	     i < width;
-	     i++, point+=2 )
-	  *point = *(point+1) = colours[fbdisplay_image[y][x+i]];
+/* Copy an area of the shadow screen into a page of video memory */
+static void
+fb_copy_area( const fbdisplay_rect *r, int page )
+{
+  const libspectrum_word *src = shadow + r->y * display.xres + r->x;
+  libspectrum_word *dst = gm + ( page * display.yres + r->y ) * fb_pitch + r->x;
+  int y;
 
-      }
-    }
-    break;
+  for( y = 0; y < r->h; y++, src += display.xres, dst += fb_pitch )
+    memcpy( dst, src, r->w * sizeof( libspectrum_word ) );
+}
 
-  case FB_RES( 320, 240 ):
-    if( hires ) { start >>= 1; height >>= 1; x >>= 1; width >>= 1; }
-    for( y = start; y < start + height; y++ )
-    {
-      int i;
-      libspectrum_word *point;
+void
+uidisplay_frame_end( void ) 
+{
+  fbdisplay_rect screen_rects[ MAX_UPDATE_RECT ], whole_screen;
+  int i, full_refresh;
+
+  if( !display_ui_initialised || !shadow ) return;
+  if( !fbdisplay_force_full_refresh && !num_rects ) return;
+
+  full_refresh = fbdisplay_force_full_refresh;
+  if( full_refresh ) {
+    updated_rects[0].x = updated_rects[0].y = 0;
+    updated_rects[0].w = image_width;
+    updated_rects[0].h = image_height;
+    num_rects = 1;
+  }
 
-      if( hires ) {
+  /* Convert everything before scaling anything, so no scaler reads
+     pixels around its area which are yet to be updated */
+  if( fb_resolution != FB_RES( 640, 240 ) )
+    for( i = 0; i < num_rects; i++ ) fb_convert_area( &updated_rects[i] );
 
-	/* Drop every second pixel */
-	for ( i = 0, point = gm + y * display.xres_virtual + x;
-	      i < width;
-	      i++, point++ )
-	  *point = colours[fbdisplay_image[y*2][(x+i)*2]];
+  for( i = 0; i < num_rects; i++ )
+    fb_scale_area( &updated_rects[i], &screen_rects[i] );
 
-      } else {
+  whole_screen.x = whole_screen.y = 0;
+  whole_screen.w = display.xres; whole_screen.h = display.yres;
 
-	for( i = 0, point = gm + y * display.xres_virtual + x;
-	     i < width;
-	     i++, point++ )
-	  *point = colours[fbdisplay_image[y][x+i]];
+  if( fb_pages == 2 ) {
 
-      }
+    /* The back page was last drawn two frames ago, so bring it up to
+       date with the last frame's changes as well as this one's */
+    if( full_refresh || last_full_refresh ) {
+      fb_copy_area( &whole_screen, fb_back_page );
+    } else {
+      for( i = 0; i < num_last_rects; i++ )
+	fb_copy_area( &last_rects[i], fb_back_page );
+      for( i = 0; i < num_rects; i++ )
+	fb_copy_area( &screen_rects[i], fb_back_page );
+    }
+
+    fb_flip();
+
+    memcpy( last_rects, screen_rects, num_rects * sizeof( fbdisplay_rect ) );
+    num_last_rects = num_rects;
+    last_full_refresh = full_refresh;
+
+  } else {
+
+    fb_wait_vsync();
 
+    if( full_refresh ) {
+      fb_copy_area( &whole_screen, 0 );
+    } else {
+      for( i = 0; i < num_rects; i++ ) fb_copy_area( &screen_rects[i], 0 );
     }
-    break;
 
-  default:;		/* Shut gcc up */
   }
+
+  num_rects = 0;
+  fbdisplay_force_full_refresh = 0;
+}
+
+void
+uidisplay_area( int x, int y, int width, int height )
+{
+  if( fbdisplay_force_full_refresh ) return;
+
+  if( num_rects == MAX_UPDATE_RECT ) {
+    fbdisplay_force_full_refresh = 1;
+    return;
+  }
+
+  updated_rects[ num_rects ].x = x;
+  updated_rects[ num_rects ].y = y;
+  updated_rects[ num_rects ].w = width;
+  updated_rects[ num_rects ].h = height;
+  num_rects++;
 }
 
 int
@@ -442,6 +664,7 @@ fbdisplay_end( void )
     }
     close( fb_fd );
     fb_fd = -1;
+    libspectrum_free( shadow ); shadow = NULL;
     fputs( "\x1B[H\x1B[J\x1B[?25h", stdout );	/* clear screen, show cursor */
   }
 
@@ -472,36 +695,11 @@ uidisplay_plot8( int x, int y, libspectrum_byte data,
   x <<= 3;
 
   if( machine_current->timex ) {
-    int i;
-
     x <<= 1; y <<= 1;
-    for( i=0; i<2; i++,y++ ) {
-      fbdisplay_image[y][x+ 0] = ( data & 0x80 ) ? ink : paper;
-      fbdisplay_image[y][x+ 1] = ( data & 0x80 ) ? ink : paper;
-      fbdisplay_image[y][x+ 2] = ( data & 0x40 ) ? ink : paper;
-      fbdisplay_image[y][x+ 3] = ( data & 0x40 ) ? ink : paper;
-      fbdisplay_image[y][x+ 4] = ( data & 0x20 ) ? ink : paper;
-      fbdisplay_image[y][x+ 5] = ( data & 0x20 ) ? ink : paper;
-      fbdisplay_image[y][x+ 6] = ( data & 0x10 ) ? ink : paper;
-      fbdisplay_image[y][x+ 7] = ( data & 0x10 ) ? ink : paper;
-      fbdisplay_image[y][x+ 8] = ( data & 0x08 ) ? ink : paper;
-      fbdisplay_image[y][x+ 9] = ( data & 0x08 ) ? ink : paper;
-      fbdisplay_image[y][x+10] = ( data & 0x04 ) ? ink : paper;
-      fbdisplay_image[y][x+11] = ( data & 0x04 ) ? ink : paper;
-      fbdisplay_image[y][x+12] = ( data & 0x02 ) ? ink : paper;
-      fbdisplay_image[y][x+13] = ( data & 0x02 ) ? ink : paper;
-      fbdisplay_image[y][x+14] = ( data & 0x01 ) ? ink : paper;
-      fbdisplay_image[y][x+15] = ( data & 0x01 ) ? ink : paper;
-    }
+    uidisplay_expand8_double( &fbdisplay_image[y  ][x], data, ink, paper );
+    uidisplay_expand8_double( &fbdisplay_image[y+1][x], data, ink, paper );
   } else {
-    fbdisplay_image[y][x+ 0] = ( data & 0x80 ) ? ink : paper;
-    fbdisplay_image[y][x+ 1] = ( data & 0x40 ) ? ink : paper;
-    fbdisplay_image[y][x+ 2] = ( data & 0x20 ) ? ink : paper;
-    fbdisplay_image[y][x+ 3] = ( data & 0x10 ) ? ink : paper;
-    fbdisplay_image[y][x+ 4] = ( data & 0x08 ) ? ink : paper;
-    fbdisplay_image[y][x+ 5] = ( data & 0x04 ) ? ink : paper;
-    fbdisplay_image[y][x+ 6] = ( data & 0x02 ) ? ink : paper;
-    fbdisplay_image[y][x+ 7] = ( data & 0x01 ) ? ink : paper;
+    uidisplay_expand8( &fbdisplay_image[y][x], data, ink, paper );
   }
 }
 
@@ -511,26 +709,32 @@ void
 uidisplay_plot16( int x, int y, libspectrum_word data,
                  libspectrum_byte ink, libspectrum_byte paper )
 {
-  int i;
   x <<= 4; y <<= 1;
 
-  for( i=0; i<2; i++,y++ ) {
-    fbdisplay_image[y][x+ 0] = ( data & 0x8000 ) ? ink : paper;
-    fbdisplay_image[y][x+ 1] = ( data & 0x4000 ) ? ink : paper;
-    fbdisplay_image[y][x+ 2] = ( data & 0x2000 ) ? ink : paper;
-    fbdisplay_image[y][x+ 3] = ( data & 0x1000 ) ? ink : paper;
-    fbdisplay_image[y][x+ 4] = ( data & 0x0800 ) ? ink : paper;
-    fbdisplay_image[y][x+ 5] = ( data & 0x0400 ) ? ink : paper;
-    fbdisplay_image[y][x+ 6] = ( data & 0x0200 ) ? ink : paper;
-    fbdisplay_image[y][x+ 7] = ( data & 0x0100 ) ? ink : paper;
-    fbdisplay_image[y][x+ 8] = ( data & 0x0080 ) ? ink : paper;
-    fbdisplay_image[y][x+ 9] = ( data & 0x0040 ) ? ink : paper;
-    fbdisplay_image[y][x+10] = ( data & 0x0020 ) ? ink : paper;
-    fbdisplay_image[y][x+11] = ( data & 0x0010 ) ? ink : paper;
-    fbdisplay_image[y][x+12] = ( data & 0x0008 ) ? ink : paper;
-    fbdisplay_image[y][x+13] = ( data & 0x0004 ) ? ink : paper;
-    fbdisplay_image[y][x+14] = ( data & 0x0002 ) ? ink : paper;
-    fbdisplay_image[y][x+15] = ( data & 0x0001 ) ? ink : paper;
+  uidisplay_expand16( &fbdisplay_image[y  ][x], data, ink, paper );
+  uidisplay_expand16( &fbdisplay_image[y+1][x], data, ink, paper );
+}
+
+/* Print the 8 * `count' pixels in `data' using the ink colours in `ink'
+   and paper colours in `paper' to the screen starting at ( (8*x) , y ) */
+void
+uidisplay_plot8_line( int x, int y, int count, const libspectrum_byte *data,
+                      const libspectrum_byte *ink,
+                      const libspectrum_byte *paper )
+{
+  int i;
+
+  x <<= 3;
+
+  if( machine_current->timex ) {
+    x <<= 1; y <<= 1;
+    for( i = 0; i < count; i++, x += 16 ) {
+      uidisplay_expand8_double( &fbdisplay_image[y  ][x], data[i], ink[i], paper[i] );
+      uidisplay_expand8_double( &fbdisplay_image[y+1][x], data[i], ink[i], paper[i] );
+    }
+  } else {
+    for( i = 0; i < count; i++, x += 8 )
+      uidisplay_expand8( &fbdisplay_image[y][x], data[i], ink[i], paper[i] );
   }
 }
 
@@ -245,6 +245,13 @@ uidisplay_plot16( int x, int y, libspectrum_word data,
   /* Do nothing */
 }
 
+void
+uidisplay_plot8_line( int x, int y, int count, const libspectrum_byte *data,
+    const libspectrum_byte *ink, const libspectrum_byte *paper )
+{
+  /* Do nothing */
+}
+
 void
 uidisplay_plot8( int x, int y, libspectrum_byte data,
     libspectrum_byte ink, libspectrum_byte paper )
@@ -28,6 +28,11 @@
 #include "config.h"
 
 #include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif			/* #ifdef HAVE_PTHREAD */
 
 #include "libspectrum.h"
 
@@ -126,8 +131,92 @@ static const struct scaler_info available_scalers[] = {
     scaler_HQ4x_16,       scaler_HQ4x_32,       expand_1            },
 };
 
+/* The indexed versions of the scalers above, where they exist. Again,
+   keep this in the same order as scaler.h:scaler_type */
+static ScalerProc* const indexed_scalers[] = {
+  scaler_Half_16_indexed,		/* SCALER_HALF */
+  scaler_HalfSkip_16_indexed,		/* SCALER_HALFSKIP */
+  scaler_Normal1x_16_indexed,		/* SCALER_NORMAL */
+  scaler_Normal2x_16_indexed,		/* SCALER_DOUBLESIZE */
+  scaler_Normal3x_16_indexed,		/* SCALER_TRIPLESIZE */
+  scaler_Normal4x_16_indexed,		/* SCALER_QUADSIZE */
+  NULL,					/* SCALER_2XSAI */
+  NULL,					/* SCALER_SUPER2XSAI */
+  NULL,					/* SCALER_SUPEREAGLE */
+  NULL,					/* SCALER_ADVMAME2X */
+  NULL,					/* SCALER_ADVMAME3X */
+  scaler_TV2x_16_indexed,		/* SCALER_TV2X */
+  scaler_TV3x_16_indexed,		/* SCALER_TV3X */
+  scaler_TV4x_16_indexed,		/* SCALER_TV4X */
+  NULL,					/* SCALER_TIMEXTV */
+  NULL,					/* SCALER_DOTMATRIX */
+  NULL,					/* SCALER_TIMEX1_5X */
+  scaler_Normal2x_16_indexed,		/* SCALER_TIMEX2X */
+  scaler_PalTV_16_indexed,		/* SCALER_PALTV */
+  scaler_PalTV2x_16_indexed,		/* SCALER_PALTV2X */
+  scaler_PalTV3x_16_indexed,		/* SCALER_PALTV3X */
+  scaler_PalTV4x_16_indexed,		/* SCALER_PALTV4X */
+  NULL,					/* SCALER_HQ2X */
+  NULL,					/* SCALER_HQ3X */
+  NULL,					/* SCALER_HQ4X */
+};
+
+/* The HQ scalers are several times slower than the others, but look at
+   no more than one pixel around each one, so their output for each 8x8
+   cell of the image can be cached. The cheaper scalers like 2xSaI and
+   AdvMAME are quicker to run again than to look up in the cache */
+static void scaler_cache_run( ScalerProc *proc, int pixel_size, int factor,
+			      int before, int after,
+			      const libspectrum_byte *srcPtr,
+			      libspectrum_dword srcPitch,
+			      libspectrum_byte *dstPtr,
+			      libspectrum_dword dstPitch, int width,
+			      int height );
+
+/* `before' and `after' are how many pixels the scaler reads to the left
+   of and above each pixel, and to the right of and below it */
+#define CACHED_SCALER( name, factor, before, after ) \
+static void \
+scaler_##name##_16_cached( const libspectrum_byte *srcPtr, \
+			   libspectrum_dword srcPitch, \
+			   libspectrum_byte *dstPtr, \
+			   libspectrum_dword dstPitch, int width, int height ) \
+{ \
+  scaler_cache_run( scaler_##name##_16, 2, factor, before, after, \
+		    srcPtr, srcPitch, dstPtr, dstPitch, width, height ); \
+} \
+\
+static void \
+scaler_##name##_32_cached( const libspectrum_byte *srcPtr, \
+			   libspectrum_dword srcPitch, \
+			   libspectrum_byte *dstPtr, \
+			   libspectrum_dword dstPitch, int width, int height ) \
+{ \
+  scaler_cache_run( scaler_##name##_32, 4, factor, before, after, \
+		    srcPtr, srcPitch, dstPtr, dstPitch, width, height ); \
+}
+
+CACHED_SCALER( HQ2x, 2, 1, 1 )
+CACHED_SCALER( HQ3x, 3, 1, 1 )
+CACHED_SCALER( HQ4x, 4, 1, 1 )
+
+static const struct {
+
+  scaler_type scaler;
+  ScalerProc *scaler16, *scaler32;
+
+} cached_scalers[] = {
+
+  { SCALER_HQ2X, scaler_HQ2x_16_cached, scaler_HQ2x_32_cached },
+  { SCALER_HQ3X, scaler_HQ3x_16_cached, scaler_HQ3x_32_cached },
+  { SCALER_HQ4X, scaler_HQ4x_16_cached, scaler_HQ4x_32_cached },
+
+};
+
 scaler_type current_scaler = SCALER_NUM;
 ScalerProc *scaler_proc16, *scaler_proc32;
+ScalerProc *scaler_proc16_indexed;
+const libspectrum_dword *scaler_palette;
 scaler_flags_t scaler_flags;
 scaler_expand_fn *scaler_expander;
 
@@ -146,6 +235,7 @@ scaler_select_scaler( scaler_type scaler )
 
   scaler_proc16 = scaler_get_proc16( current_scaler );
   scaler_proc32 = scaler_get_proc32( current_scaler );
+  scaler_proc16_indexed = scaler_get_proc16_indexed( current_scaler );
   scaler_flags = scaler_get_flags( current_scaler );
   scaler_expander = scaler_get_expander( current_scaler );
 
@@ -198,15 +288,31 @@ scaler_name( scaler_type scaler )
 ScalerProc*
 scaler_get_proc16( scaler_type scaler )
 {
+  size_t i;
+
+  for( i = 0; i < ARRAY_SIZE( cached_scalers ); i++ )
+    if( cached_scalers[i].scaler == scaler ) return cached_scalers[i].scaler16;
+
   return available_scalers[scaler].scaler16;
 }
 
 ScalerProc*
 scaler_get_proc32( scaler_type scaler )
 {
+  size_t i;
+
+  for( i = 0; i < ARRAY_SIZE( cached_scalers ); i++ )
+    if( cached_scalers[i].scaler == scaler ) return cached_scalers[i].scaler32;
+
   return available_scalers[scaler].scaler32;
 }
 
+ScalerProc*
+scaler_get_proc16_indexed( scaler_type scaler )
+{
+  return indexed_scalers[scaler];
+}
+
 scaler_flags_t
 scaler_get_flags( scaler_type scaler )
 {
@@ -282,3 +388,358 @@ expand_dotmatrix( int *x GCC_UNUSED, int *y GCC_UNUSED, int *w GCC_UNUSED,
   (*y)-=y_mod;
   (*h)+=y_mod;
 }
+
+/* Scaling in bands. The scalers work on a line at a time with at most a
+   couple of lines of context either side, so a large area can be cut into
+   horizontal bands and each band scaled on its own thread. The source is
+   never written while scaling, so a band reads its neighbouring lines
+   straight from the image and needs no copy of them; each band writes
+   only its own destination lines */
+
+/* At most this many bands, so one thread here plus three workers */
+#define SCALER_BANDS_MAX 4
+
+/* Don't bother splitting off bands shorter than this many source lines */
+#define SCALER_BAND_MIN_LINES 24
+
+typedef struct scaler_band_t {
+  ScalerProc *proc;
+  const libspectrum_byte *src;
+  libspectrum_dword src_pitch;
+  libspectrum_byte *dst;
+  libspectrum_dword dst_pitch;
+  int width, height;
+} scaler_band_t;
+
+static scaler_band_t bands[ SCALER_BANDS_MAX ];
+
+static void
+scaler_band_run( const scaler_band_t *band )
+{
+  band->proc( band->src, band->src_pitch, band->dst, band->dst_pitch,
+	      band->width, band->height );
+}
+
+#ifdef HAVE_PTHREAD
+
+static pthread_t band_threads[ SCALER_BANDS_MAX - 1 ];
+static int band_workers = -1;	/* -1 until the workers are started */
+static pthread_mutex_t band_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t band_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t band_done = PTHREAD_COND_INITIALIZER;
+static unsigned int band_generation;	/* bumped for each new set of bands */
+static unsigned int band_first_generation;	/* as it was at start up */
+static int band_count;			/* bands in the current set */
+static int bands_pending;		/* bands given to workers and not done */
+static int band_quit;
+
+/* Worker n always scales band n + 1 of each set, if there is one */
+static void*
+scaler_band_worker( void *arg )
+{
+  int band = (int)(size_t)arg + 1;
+  unsigned int seen;
+
+  /* Not band_generation, which may already have moved on to a set this
+     worker must take part in */
+  seen = band_first_generation;
+
+  pthread_mutex_lock( &band_mutex );
+
+  while( 1 ) {
+    while( band_generation == seen && !band_quit )
+      pthread_cond_wait( &band_start, &band_mutex );
+    if( band_quit ) break;
+    seen = band_generation;
+
+    if( band < band_count ) {
+      pthread_mutex_unlock( &band_mutex );
+      scaler_band_run( &bands[ band ] );
+      pthread_mutex_lock( &band_mutex );
+      if( !--bands_pending ) pthread_cond_signal( &band_done );
+    }
+  }
+
+  pthread_mutex_unlock( &band_mutex );
+  return NULL;
+}
+
+/* Start one worker per spare processor, up to SCALER_BANDS_MAX - 1 */
+static void
+scaler_bands_start( void )
+{
+  int i, n = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  n = sysconf( _SC_NPROCESSORS_ONLN ) - 1;
+  if( n > SCALER_BANDS_MAX - 1 ) n = SCALER_BANDS_MAX - 1;
+  if( n < 0 ) n = 0;
+#endif			/* #ifdef _SC_NPROCESSORS_ONLN */
+
+  band_quit = 0;
+  band_first_generation = band_generation;
+  for( i = 0; i < n; i++ )
+    if( pthread_create( &band_threads[i], NULL, scaler_band_worker,
+			(void *)(size_t)i ) ) break;
+
+  band_workers = i;
+}
+
+#endif			/* #ifdef HAVE_PTHREAD */
+
+/* Scale a width x height area with `proc', splitting it into bands over
+   the worker threads if it's big enough to be worth it */
+void
+scaler_proc_bands( ScalerProc *proc, const libspectrum_byte *srcPtr,
+		   libspectrum_dword srcPitch, libspectrum_byte *dstPtr,
+		   libspectrum_dword dstPitch, int width, int height )
+{
+  float factor;
+  int i, n = 1, band_height, y;
+
+#ifdef HAVE_PTHREAD
+  if( band_workers < 0 ) scaler_bands_start();
+  n = band_workers + 1;
+  if( n > height / SCALER_BAND_MIN_LINES )
+    n = height / SCALER_BAND_MIN_LINES;
+#endif			/* #ifdef HAVE_PTHREAD */
+
+  /* Some scalers treat odd and even lines differently: the dot matrix
+     counts from the top of the area, the half size, 1.5x and Timex TV
+     ones from the bottom. Bands of an even height starting on even lines
+     keep both the same as scaling the area in one go, and a fractional
+     scaling factor still gives a whole number of lines, but that needs
+     the area itself to be of an even height */
+  if( n < 2 || height & 1 ) {
+    proc( srcPtr, srcPitch, dstPtr, dstPitch, width, height );
+    return;
+  }
+
+  factor = scaler_get_scaling_factor( current_scaler );
+  band_height = ( height / n ) & ~1;
+
+  for( i = 0, y = 0; i < n; i++, y += band_height ) {
+    bands[i].proc = proc;
+    bands[i].src = srcPtr + y * srcPitch;
+    bands[i].src_pitch = srcPitch;
+    bands[i].dst = dstPtr + (int)( y * factor ) * dstPitch;
+    bands[i].dst_pitch = dstPitch;
+    bands[i].width = width;
+    bands[i].height = i == n - 1 ? height - y : band_height;
+  }
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock( &band_mutex );
+  band_count = n;
+  bands_pending = n - 1;
+  band_generation++;
+  pthread_cond_broadcast( &band_start );
+  pthread_mutex_unlock( &band_mutex );
+
+  scaler_band_run( &bands[0] );
+
+  pthread_mutex_lock( &band_mutex );
+  while( bands_pending )
+    pthread_cond_wait( &band_done, &band_mutex );
+  pthread_mutex_unlock( &band_mutex );
+#endif			/* #ifdef HAVE_PTHREAD */
+}
+
+/* Stop the worker threads; they'll be started again if needed */
+void
+scaler_bands_end( void )
+{
+#ifdef HAVE_PTHREAD
+  int i;
+
+  if( band_workers <= 0 ) {
+    band_workers = -1;
+    return;
+  }
+
+  pthread_mutex_lock( &band_mutex );
+  band_quit = 1;
+  pthread_cond_broadcast( &band_start );
+  pthread_mutex_unlock( &band_mutex );
+
+  for( i = 0; i < band_workers; i++ )
+    pthread_join( band_threads[i], NULL );
+
+  band_workers = -1;
+#endif			/* #ifdef HAVE_PTHREAD */
+}
+
+/* The cell cache. Each entry holds the pixels of one 8x8 cell together
+   with the border of pixels around it the scaler reads, and the scaler's
+   output for that cell. A cell whose pixels and border match an entry for
+   the same scaler is copied from the cache instead of being scaled
+   again, which makes the HQ scalers much cheaper on text and tiles */
+
+#define SCALER_CACHE_CELL 8
+#define SCALER_CACHE_ENTRIES 256	/* must be a power of 2 */
+
+/* Enough for a cell with a pixel of border all round, or scaled four
+   times, at 32 bits per pixel */
+#define SCALER_CACHE_KEY_SIZE \
+  ( ( SCALER_CACHE_CELL + 2 ) * ( SCALER_CACHE_CELL + 2 ) * 4 )
+#define SCALER_CACHE_OUTPUT_SIZE \
+  ( ( SCALER_CACHE_CELL * 4 ) * ( SCALER_CACHE_CELL * 4 ) * 4 )
+
+typedef struct scaler_cache_entry_t {
+  ScalerProc *proc;		/* NULL if the entry is empty */
+  libspectrum_dword key[ SCALER_CACHE_KEY_SIZE / 4 ];
+  libspectrum_byte output[ SCALER_CACHE_OUTPUT_SIZE ];
+} scaler_cache_entry_t;
+
+static scaler_cache_entry_t scaler_cache[ SCALER_CACHE_ENTRIES ];
+static unsigned long scaler_cache_hits, scaler_cache_misses;
+
+#ifdef HAVE_PTHREAD
+/* The bands of one area may be scaled on several threads at once */
+static pthread_mutex_t scaler_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define SCALER_CACHE_LOCK() pthread_mutex_lock( &scaler_cache_mutex )
+#define SCALER_CACHE_UNLOCK() pthread_mutex_unlock( &scaler_cache_mutex )
+#else			/* #ifdef HAVE_PTHREAD */
+#define SCALER_CACHE_LOCK()
+#define SCALER_CACHE_UNLOCK()
+#endif			/* #ifdef HAVE_PTHREAD */
+
+/* Copy a cell and its border into `key', padding it out to a whole
+   number of dwords, and return its length in dwords and its hash */
+static size_t
+scaler_cache_key( libspectrum_dword *key, libspectrum_dword *hash,
+		  const libspectrum_byte *src, libspectrum_dword src_pitch,
+		  size_t row_size, int rows )
+{
+  libspectrum_byte *k = (libspectrum_byte *)key;
+  libspectrum_dword h = 2166136261U;
+  size_t j, length;
+  int i;
+
+  for( i = 0; i < rows; i++, src += src_pitch, k += row_size )
+    memcpy( k, src, row_size );
+
+  length = ( rows * row_size + 3 ) / 4;
+  memset( k, 0, length * 4 - rows * row_size );
+
+  for( j = 0; j < length; j++ ) h = ( h ^ key[j] ) * 16777619U;
+
+  *hash = h ^ ( h >> 16 );
+  return length;
+}
+
+/* Copy `rows' rows of `row_size' bytes between a cache entry, in which
+   they're packed together, and an image */
+static void
+scaler_cache_copy( libspectrum_byte *dst, libspectrum_dword dst_pitch,
+		   const libspectrum_byte *src, libspectrum_dword src_pitch,
+		   size_t row_size, int rows )
+{
+  while( rows-- ) {
+    memcpy( dst, src, row_size );
+    dst += dst_pitch; src += src_pitch;
+  }
+}
+
+static void
+scaler_cache_cell( ScalerProc *proc, int pixel_size, int factor,
+		   int before, int after, const libspectrum_byte *src,
+		   libspectrum_dword src_pitch, libspectrum_byte *dst,
+		   libspectrum_dword dst_pitch )
+{
+  libspectrum_dword key[ SCALER_CACHE_KEY_SIZE / 4 ], hash;
+  scaler_cache_entry_t *entry;
+  size_t length;
+  int size = SCALER_CACHE_CELL * factor;
+  int row_size = size * pixel_size;
+
+  length = scaler_cache_key(
+    key, &hash, src - before * src_pitch - before * pixel_size, src_pitch,
+    ( SCALER_CACHE_CELL + before + after ) * pixel_size,
+    SCALER_CACHE_CELL + before + after
+  );
+  entry = &scaler_cache[ hash & ( SCALER_CACHE_ENTRIES - 1 ) ];
+
+  SCALER_CACHE_LOCK();
+
+  if( entry->proc == proc && !memcmp( entry->key, key, length * 4 ) ) {
+    scaler_cache_copy( dst, dst_pitch, entry->output, row_size, row_size,
+		       size );
+    scaler_cache_hits++;
+    SCALER_CACHE_UNLOCK();
+    return;
+  }
+
+  scaler_cache_misses++;
+  SCALER_CACHE_UNLOCK();
+
+  proc( src, src_pitch, dst, dst_pitch, SCALER_CACHE_CELL,
+	SCALER_CACHE_CELL );
+
+  SCALER_CACHE_LOCK();
+  entry->proc = proc;
+  memcpy( entry->key, key, length * 4 );
+  scaler_cache_copy( entry->output, row_size, dst, dst_pitch, row_size,
+		     size );
+  SCALER_CACHE_UNLOCK();
+}
+
+/* Scale an area a cell at a time through the cache; any part cell left
+   over at the right or bottom is just scaled */
+static void
+scaler_cache_run( ScalerProc *proc, int pixel_size, int factor,
+		  int before, int after, const libspectrum_byte *srcPtr,
+		  libspectrum_dword srcPitch, libspectrum_byte *dstPtr,
+		  libspectrum_dword dstPitch, int width, int height )
+{
+  int x, y, cells_width, cells_height;
+
+  if( !settings_current.scaler_cache ) {
+    proc( srcPtr, srcPitch, dstPtr, dstPitch, width, height );
+    return;
+  }
+
+  cells_width = width - width % SCALER_CACHE_CELL;
+  cells_height = height - height % SCALER_CACHE_CELL;
+
+  for( y = 0; y < cells_height; y += SCALER_CACHE_CELL ) {
+
+    const libspectrum_byte *src = srcPtr + y * srcPitch;
+    libspectrum_byte *dst = dstPtr + y * factor * dstPitch;
+
+    for( x = 0; x < cells_width; x += SCALER_CACHE_CELL )
+      scaler_cache_cell( proc, pixel_size, factor, before, after,
+			 src + x * pixel_size, srcPitch,
+			 dst + x * factor * pixel_size, dstPitch );
+
+    if( cells_width < width )
+      proc( src + cells_width * pixel_size, srcPitch,
+	    dst + cells_width * factor * pixel_size, dstPitch,
+	    width - cells_width, SCALER_CACHE_CELL );
+  }
+
+  if( cells_height < height )
+    proc( srcPtr + cells_height * srcPitch, srcPitch,
+	  dstPtr + cells_height * factor * dstPitch, dstPitch,
+	  width, height - cells_height );
+}
+
+/* Forget everything cached; needed whenever the pixel format changes */
+void
+scaler_cache_clear( void )
+{
+  size_t i;
+
+  SCALER_CACHE_LOCK();
+  for( i = 0; i < SCALER_CACHE_ENTRIES; i++ ) scaler_cache[i].proc = NULL;
+  SCALER_CACHE_UNLOCK();
+}
+
+void
+scaler_cache_stats( unsigned long *hits, unsigned long *misses )
+{
+  SCALER_CACHE_LOCK();
+  *hits = scaler_cache_hits;
+  *misses = scaler_cache_misses;
+  SCALER_CACHE_UNLOCK();
+}
@@ -73,6 +73,12 @@ typedef void scaler_expand_fn( int *x, int *y, int *w, int *h,
 
 extern scaler_type current_scaler;
 extern ScalerProc *scaler_proc16, *scaler_proc32;
+
+/* The 16-bit scaler for a screen held as Spectrum colour numbers rather
+   than pixels, or NULL if the current scaler can't read one. Each number
+   is turned into a pixel through scaler_palette as it is read */
+extern ScalerProc *scaler_proc16_indexed;
+extern const libspectrum_dword *scaler_palette;
 extern scaler_flags_t scaler_flags;
 extern scaler_expand_fn *scaler_expander;
 extern int scalers_registered;
@@ -87,10 +93,21 @@ int scaler_is_supported( scaler_type scaler );
 const char *scaler_name( scaler_type scaler );
 ScalerProc *scaler_get_proc16( scaler_type scaler );
 ScalerProc *scaler_get_proc32( scaler_type scaler );
+ScalerProc *scaler_get_proc16_indexed( scaler_type scaler );
 scaler_flags_t scaler_get_flags( scaler_type scaler );
 float scaler_get_scaling_factor( scaler_type scaler );
 scaler_expand_fn* scaler_get_expander( scaler_type scaler );
 
 int scaler_select_bitformat( libspectrum_dword BitFormat );
 
+/* Scale an area with the given scaler, sharing the work out in horizontal
+   bands over a few threads when the area is large enough */
+void scaler_proc_bands( ScalerProc *proc, const libspectrum_byte *srcPtr,
+			libspectrum_dword srcPitch, libspectrum_byte *dstPtr,
+			libspectrum_dword dstPitch, int width, int height );
+void scaler_bands_end( void );
+
+/* How many 8x8 cells have been copied from and added to the scaler cache */
+void scaler_cache_stats( unsigned long *hits, unsigned long *misses );
+
 #endif
@@ -68,4 +68,32 @@ DECLARE_SCALER(HQ2x);
 DECLARE_SCALER(HQ3x);
 DECLARE_SCALER(HQ4x);
 
+/* The scalers which can also read Spectrum colour numbers; see
+   scaler_palette */
+#define DECLARE_INDEXED_SCALER( name ) \
+         extern void scaler_##name##_16_indexed( \
+					 const libspectrum_byte *srcPtr, \
+					 libspectrum_dword srcPitch, \
+					 libspectrum_byte *dstPtr, \
+					 libspectrum_dword dstPitch, \
+					 int width, int height );
+
+DECLARE_INDEXED_SCALER(Half);
+DECLARE_INDEXED_SCALER(HalfSkip);
+DECLARE_INDEXED_SCALER(Normal1x);
+DECLARE_INDEXED_SCALER(Normal2x);
+DECLARE_INDEXED_SCALER(Normal3x);
+DECLARE_INDEXED_SCALER(Normal4x);
+DECLARE_INDEXED_SCALER(TV2x);
+DECLARE_INDEXED_SCALER(TV3x);
+DECLARE_INDEXED_SCALER(TV4x);
+DECLARE_INDEXED_SCALER(PalTV);
+DECLARE_INDEXED_SCALER(PalTV2x);
+DECLARE_INDEXED_SCALER(PalTV3x);
+DECLARE_INDEXED_SCALER(PalTV4x);
+
+int scaler_select_bitformat_indexed( libspectrum_dword BitFormat );
+
+void scaler_cache_clear( void );
+
 #endif				/* #ifndef FUSE_SCALER_INTERNALS_H */
@@ -46,10 +46,20 @@
 
 /* The actual code for the scalers starts here */
 
+#if defined( SCALER_INDEXED ) && SCALER_DATA_SIZE != 2
+#error Indexed scalers are only built for 16-bit output
+#endif
+
 #if SCALER_DATA_SIZE == 2
 
 typedef libspectrum_word scaler_data_type;
+#ifdef SCALER_INDEXED
+#define FUNCTION( name ) name##_16_indexed
+/* This build keeps its own copy of the colour masks */
+#define scaler_select_bitformat scaler_select_bitformat_indexed
+#else				/* #ifdef SCALER_INDEXED */
 #define FUNCTION( name ) name##_16
+#endif				/* #ifdef SCALER_INDEXED */
 
 static libspectrum_dword colorMask;
 static libspectrum_dword lowPixelMask;
@@ -134,7 +144,12 @@ scaler_select_bitformat( libspectrum_dword BitFormat )
 
   }
 
+#ifdef SCALER_INDEXED
   return 0;
+#else
+  scaler_cache_clear();
+  return scaler_select_bitformat_indexed( BitFormat );
+#endif
 }
 
 #elif SCALER_DATA_SIZE == 4	/* #if SCALER_DATA_SIZE == 2 */
@@ -197,6 +212,17 @@ static const libspectrum_dword dotmatrix[16] = {
 #error Unknown SCALER_DATA_SIZE
 #endif				/* #if SCALER_DATA_SIZE == 2 or 4 */
 
+/* The indexed build reads Spectrum colour numbers rather than pixels and
+   looks them up in scaler_palette as it goes, so the screen never has to
+   be converted to RGB before being scaled */
+#ifdef SCALER_INDEXED
+typedef libspectrum_byte scaler_source_type;
+#define SOURCE_PIXEL( p ) ( (scaler_data_type)scaler_palette[ *(p) ] )
+#else				/* #ifdef SCALER_INDEXED */
+typedef scaler_data_type scaler_source_type;
+#define SOURCE_PIXEL( p ) ( *(p) )
+#endif				/* #ifdef SCALER_INDEXED */
+
 static inline int 
 GetResult( libspectrum_dword A, libspectrum_dword B, libspectrum_dword C,
 	   libspectrum_dword D )
@@ -576,6 +602,8 @@ HQ_INTERPOLATE_10( libspectrum_dword A, libspectrum_dword B,
     ( ABS( u1 - u2 ) > HQ_trU ) || \
     ( ABS( v1 - v2 ) > HQ_trV ) )
 
+#ifndef SCALER_INDEXED
+
 void 
 FUNCTION( scaler_Super2xSaI )( const libspectrum_byte *srcPtr,
 			       libspectrum_dword srcPitch,
@@ -1062,6 +1090,7 @@ FUNCTION( scaler_AdvMame3x )( const libspectrum_byte *srcPtr,
     q += (nextlineDst - width) * 3;
   }
 }
+#endif				/* #ifndef SCALER_INDEXED */
 
 void 
 FUNCTION( scaler_Half )( const libspectrum_byte *srcPtr,
@@ -1077,8 +1106,10 @@ FUNCTION( scaler_Half )( const libspectrum_byte *srcPtr,
 
     if( ( height & 1 ) == 0 ) {
       for (i = 0; i < width; i+=2, ++r) {
-        scaler_data_type color1 = *(((scaler_data_type*) srcPtr) + i);
-        scaler_data_type color2 = *(((scaler_data_type*) srcPtr) + i + 1);
+        scaler_data_type color1 =
+          SOURCE_PIXEL( ((const scaler_source_type*) srcPtr) + i );
+        scaler_data_type color2 =
+          SOURCE_PIXEL( ((const scaler_source_type*) srcPtr) + i + 1 );
 
         *r = INTERPOLATE(color1, color2);
       }
@@ -1104,7 +1135,7 @@ FUNCTION( scaler_HalfSkip )( const libspectrum_byte *srcPtr,
 
     if( ( height & 1 ) == 0 ) {
       for (i = 0; i < width; i+=2, ++r) {
-        *r = *(((const scaler_data_type*) srcPtr) + i + 1);
+        *r = SOURCE_PIXEL( ((const scaler_source_type*) srcPtr) + i + 1 );
       }
       dstPtr += dstPitch;
     }
@@ -1120,11 +1151,28 @@ FUNCTION( scaler_Normal1x )( const libspectrum_byte *srcPtr,
 			     libspectrum_dword dstPitch,
 			     int width, int height )
 {
+#ifdef SCALER_INDEXED
+  const scaler_source_type *s;
+  scaler_data_type *d;
+  int i;
+
+  while( height-- ) {
+    for( i = 0, s = (const scaler_source_type*)srcPtr,
+           d = (scaler_data_type*)dstPtr;
+         i < width;
+         i++ )
+      *d++ = SOURCE_PIXEL( s++ );
+
+    srcPtr += srcPitch;
+    dstPtr += dstPitch;
+  }
+#else				/* #ifdef SCALER_INDEXED */
   while( height-- ) {
     memcpy( dstPtr, srcPtr, SCALER_DATA_SIZE * width );
     srcPtr += srcPitch;
     dstPtr += dstPitch;
   }
+#endif				/* #ifdef SCALER_INDEXED */
 }
 
 void 
@@ -1134,17 +1182,18 @@ FUNCTION( scaler_Normal2x )( const libspectrum_byte *srcPtr,
 			     libspectrum_dword dstPitch,
 			     int width, int height )
 {
-  const scaler_data_type *s;
-  scaler_data_type i, *d, *d2;
+  const scaler_source_type *s;
+  scaler_data_type i, *d, *d2, color;
 
   while( height-- ) {
 
-    for( i = 0, s = (const scaler_data_type*)srcPtr,
+    for( i = 0, s = (const scaler_source_type*)srcPtr,
 	   d = (scaler_data_type*)dstPtr,
 	   d2 = (scaler_data_type*)(dstPtr + dstPitch);
 	 i < width;
 	 i++ ) {
-      *d++ = *d2++ = *s; *d++ = *d2++ = *s++;
+      color = SOURCE_PIXEL( s++ );
+      *d++ = *d2++ = color; *d++ = *d2++ = color;
     }
 
     srcPtr += srcPitch;
@@ -1167,7 +1216,8 @@ FUNCTION( scaler_Normal3x )( const libspectrum_byte *srcPtr,
     int i;
     r = dstPtr;
     for (i = 0; i < width; ++i, r += 3 * SCALER_DATA_SIZE ) {
-      scaler_data_type color = *(((const scaler_data_type*) srcPtr) + i);
+      scaler_data_type color =
+        SOURCE_PIXEL( ((const scaler_source_type*) srcPtr) + i );
 
       *(scaler_data_type*)( r +                    0             ) = color;
       *(scaler_data_type*)( r +     SCALER_DATA_SIZE             ) = color;
@@ -1200,7 +1250,8 @@ FUNCTION( scaler_Normal4x )( const libspectrum_byte *srcPtr,
     int i;
     r = dstPtr;
     for (i = 0; i < width; ++i, r += 4 * SCALER_DATA_SIZE ) {
-      scaler_data_type color = *(((const scaler_data_type*) srcPtr) + i);
+      scaler_data_type color =
+        SOURCE_PIXEL( ((const scaler_source_type*) srcPtr) + i );
 
       *(scaler_data_type*)( r +                    0             ) = color;
       *(scaler_data_type*)( r +     SCALER_DATA_SIZE             ) = color;
@@ -1227,6 +1278,8 @@ FUNCTION( scaler_Normal4x )( const libspectrum_byte *srcPtr,
   }
 }
 
+#ifndef SCALER_INDEXED
+
 void 
 FUNCTION( scaler_Timex1_5x )( const libspectrum_byte *srcPtr,
            libspectrum_dword srcPitch,
@@ -1263,6 +1316,7 @@ FUNCTION( scaler_Timex1_5x )( const libspectrum_byte *srcPtr,
     srcPtr += srcPitch;
   }
 }
+#endif				/* #ifndef SCALER_INDEXED */
 
 void
 FUNCTION( scaler_TV2x )( const libspectrum_byte *srcPtr,
@@ -1271,15 +1325,15 @@ FUNCTION( scaler_TV2x )( const libspectrum_byte *srcPtr,
 			 int width, int height )
 {
   int i, j;
-  unsigned int nextlineSrc = srcPitch / sizeof( scaler_data_type );
-  const scaler_data_type *p = (const scaler_data_type*)srcPtr;
+  unsigned int nextlineSrc = srcPitch / sizeof( scaler_source_type );
+  const scaler_source_type *p = (const scaler_source_type*)srcPtr;
 
   unsigned int nextlineDst = dstPitch / sizeof( scaler_data_type );
   scaler_data_type *q = (scaler_data_type*)dstPtr;
 
   while(height--) {
     for (i = 0, j = 0; i < width; ++i, j += 2) {
-      scaler_data_type p1 = *(p + i);
+      scaler_data_type p1 = SOURCE_PIXEL( p + i );
       scaler_data_type pi;
 
       pi  = (((p1 & redblueMask) * 7) >> 3) & redblueMask;
@@ -1302,15 +1356,15 @@ FUNCTION( scaler_TV3x )( const libspectrum_byte *srcPtr,
                          int width, int height )
 {
   int i, j;
-  unsigned int nextlineSrc = srcPitch / sizeof( scaler_data_type );
-  const scaler_data_type *p = (const scaler_data_type*)srcPtr;
+  unsigned int nextlineSrc = srcPitch / sizeof( scaler_source_type );
+  const scaler_source_type *p = (const scaler_source_type*)srcPtr;
 
   unsigned int nextlineDst = dstPitch / sizeof( scaler_data_type );
   scaler_data_type *q = (scaler_data_type*)dstPtr;
 
   while(height--) {
     for (i = 0, j = 0; i < width; ++i, j += 3) {
-      scaler_data_type p1 = *(p + i);
+      scaler_data_type p1 = SOURCE_PIXEL( p + i );
       scaler_data_type pi;
 
       pi  = (((p1 & redblueMask) * 7) >> 3) & redblueMask;
@@ -1340,15 +1394,15 @@ FUNCTION( scaler_TV4x )( const libspectrum_byte *srcPtr,
                          int width, int height )
 {
   int i, j;
-  unsigned int nextlineSrc = srcPitch / sizeof( scaler_data_type );
-  const scaler_data_type *p = (const scaler_data_type*)srcPtr;
+  unsigned int nextlineSrc = srcPitch / sizeof( scaler_source_type );
+  const scaler_source_type *p = (const scaler_source_type*)srcPtr;
 
   unsigned int nextlineDst = dstPitch / sizeof( scaler_data_type );
   scaler_data_type *q = (scaler_data_type*)dstPtr;
 
   while(height--) {
     for (i = 0, j = 0; i < width; ++i, j += 4) {
-      scaler_data_type p1 = *(p + i);
+      scaler_data_type p1 = SOURCE_PIXEL( p + i );
       scaler_data_type pi;
 
       pi  = (((p1 & redblueMask) * 7) >> 3) & redblueMask;
@@ -1379,6 +1433,8 @@ FUNCTION( scaler_TV4x )( const libspectrum_byte *srcPtr,
   }
 }
 
+#ifndef SCALER_INDEXED
+
 void
 FUNCTION( scaler_TimexTV )( const libspectrum_byte *srcPtr,
 			    libspectrum_dword srcPitch,
@@ -1441,6 +1497,7 @@ FUNCTION( scaler_DotMatrix )( const libspectrum_byte *srcPtr,
     q += nextlineDst << 1;
   }
 }
+#endif				/* #ifndef SCALER_INDEXED */
 
 /*
     Y  =  0.29900 * R + 0.58700 * G + 0.11400 * B
@@ -1498,8 +1555,8 @@ FUNCTION( scaler_PalTV )( const libspectrum_byte *srcPtr,
    3.b  255,255,255 RGB => RGB
 */
   int i, j;
-  unsigned int nextlineSrc = srcPitch / sizeof( scaler_data_type );
-  const scaler_data_type *p, *p0 = (const scaler_data_type *)srcPtr;
+  unsigned int nextlineSrc = srcPitch / sizeof( scaler_source_type );
+  const scaler_source_type *p, *p0 = (const scaler_source_type *)srcPtr;
 
   unsigned int nextlineDst = dstPitch / sizeof( scaler_data_type );
   scaler_data_type *q, *q0 = (scaler_data_type *)dstPtr;
@@ -1524,17 +1581,17 @@ FUNCTION( scaler_PalTV )( const libspectrum_byte *srcPtr,
     p = p0 - 1; q = q0;
 #if SCALER_DATA_SIZE == 2
     /* 1.a. RGB => RGB */
-    r2 = R_TO_R( *p );
-    g2 = G_TO_G( *p );
-    b2 = B_TO_B( *p );
+    r2 = R_TO_R( SOURCE_PIXEL( p ) );
+    g2 = G_TO_G( SOURCE_PIXEL( p ) );
+    b2 = B_TO_B( SOURCE_PIXEL( p ) );
     p++;
-    r0 = R_TO_R( *p );
-    g0 = G_TO_G( *p );
-    b0 = B_TO_B( *p );
+    r0 = R_TO_R( SOURCE_PIXEL( p ) );
+    g0 = G_TO_G( SOURCE_PIXEL( p ) );
+    b0 = B_TO_B( SOURCE_PIXEL( p ) );
     p++;
-    r1 = R_TO_R( *p );
-    g1 = G_TO_G( *p );
-    b1 = B_TO_B( *p );
+    r1 = R_TO_R( SOURCE_PIXEL( p ) );
+    g1 = G_TO_G( SOURCE_PIXEL( p ) );
+    b1 = B_TO_B( SOURCE_PIXEL( p ) );
     p++;
 #else
     r2 = (*p & redMask);
@@ -1562,13 +1619,13 @@ FUNCTION( scaler_PalTV )( const libspectrum_byte *srcPtr,
 #endif
 #if SCALER_DATA_SIZE == 2
       /* 1.a. RGB => RGB */
-      r2 = R_TO_R( *p );
-      g2 = G_TO_G( *p );
-      b2 = B_TO_B( *p );
+      r2 = R_TO_R( SOURCE_PIXEL( p ) );
+      g2 = G_TO_G( SOURCE_PIXEL( p ) );
+      b2 = B_TO_B( SOURCE_PIXEL( p ) );
       p++;
-      r3 = R_TO_R( *p );
-      g3 = G_TO_G( *p );
-      b3 = B_TO_B( *p );
+      r3 = R_TO_R( SOURCE_PIXEL( p ) );
+      g3 = G_TO_G( SOURCE_PIXEL( p ) );
+      b3 = B_TO_B( SOURCE_PIXEL( p ) );
       p++;
 #else
       r2 = (*p & redMask);
@@ -1636,8 +1693,8 @@ FUNCTION( scaler_PalTV2x )( const libspectrum_byte *srcPtr,
    3.b  255,255,255 RGB => RGB
 */
   int i, j;
-  unsigned int nextlineSrc = srcPitch / sizeof( scaler_data_type );
-  const scaler_data_type *p, *p0 = (const scaler_data_type *)srcPtr;
+  unsigned int nextlineSrc = srcPitch / sizeof( scaler_source_type );
+  const scaler_source_type *p, *p0 = (const scaler_source_type *)srcPtr;
 
   unsigned int nextlineDst = dstPitch / sizeof( scaler_data_type );
   scaler_data_type *q, *q0 = (scaler_data_type *)dstPtr;
@@ -1660,13 +1717,13 @@ FUNCTION( scaler_PalTV2x )( const libspectrum_byte *srcPtr,
   for( j = height; j; j-- ) {
     p = p0 - 1; q = q0;
 #if SCALER_DATA_SIZE == 2
-    r0 = R_TO_R( *p );
-    g0 = G_TO_G( *p );
-    b0 = B_TO_B( *p );
+    r0 = R_TO_R( SOURCE_PIXEL( p ) );
+    g0 = G_TO_G( SOURCE_PIXEL( p ) );
+    b0 = B_TO_B( SOURCE_PIXEL( p ) );
     p++;
-    r1 = R_TO_R( *p );
-    g1 = G_TO_G( *p );
-    b1 = B_TO_B( *p );
+    r1 = R_TO_R( SOURCE_PIXEL( p ) );
+    g1 = G_TO_G( SOURCE_PIXEL( p ) );
+    b1 = B_TO_B( SOURCE_PIXEL( p ) );
 #else
     r0 = *p & redMask;
     g0 = (*p & greenMask) >> 8;
@@ -1683,9 +1740,9 @@ FUNCTION( scaler_PalTV2x )( const libspectrum_byte *srcPtr,
       p++;      /* next point */
 #if SCALER_DATA_SIZE == 2
       /* 1.a. RGB => RGB */
-      r0 = R_TO_R( *p );
-      g0 = G_TO_G( *p );
-      b0 = B_TO_B( *p );
+      r0 = R_TO_R( SOURCE_PIXEL( p ) );
+      g0 = G_TO_G( SOURCE_PIXEL( p ) );
+      b0 = B_TO_B( SOURCE_PIXEL( p ) );
 #else
       r0 = (*p & redMask);
       g0 = (*p & greenMask) >> 8;
@@ -1768,8 +1825,8 @@ FUNCTION( scaler_PalTV3x )( const libspectrum_byte *srcPtr,
    3.b  255,255,255 RGB => RGB
 */
   int i, j;
-  unsigned int nextlineSrc = srcPitch / sizeof( scaler_data_type );
-  const scaler_data_type *p, *p0 = (const scaler_data_type *)srcPtr;
+  unsigned int nextlineSrc = srcPitch / sizeof( scaler_source_type );
+  const scaler_source_type *p, *p0 = (const scaler_source_type *)srcPtr;
 
   unsigned int nextlineDst = dstPitch / sizeof( scaler_data_type );
   scaler_data_type *q, *q0 = (scaler_data_type *)dstPtr;
@@ -1793,13 +1850,13 @@ FUNCTION( scaler_PalTV3x )( const libspectrum_byte *srcPtr,
   for( j = height; j; j-- ) {
     p = p0 - 1; q = q0;
 #if SCALER_DATA_SIZE == 2
-    r0 = R_TO_R( *p );
-    g0 = G_TO_G( *p );
-    b0 = B_TO_B( *p );
+    r0 = R_TO_R( SOURCE_PIXEL( p ) );
+    g0 = G_TO_G( SOURCE_PIXEL( p ) );
+    b0 = B_TO_B( SOURCE_PIXEL( p ) );
     p++;
-    r1 = R_TO_R( *p );
-    g1 = G_TO_G( *p );
-    b1 = B_TO_B( *p );
+    r1 = R_TO_R( SOURCE_PIXEL( p ) );
+    g1 = G_TO_G( SOURCE_PIXEL( p ) );
+    b1 = B_TO_B( SOURCE_PIXEL( p ) );
 #else
     r0 = *p & redMask;
     g0 = (*p & greenMask) >> 8;
@@ -1816,9 +1873,9 @@ FUNCTION( scaler_PalTV3x )( const libspectrum_byte *srcPtr,
       p++;
 #if SCALER_DATA_SIZE == 2
       /* 1.a. RGB => RGB */
-      r0 = R_TO_R( *p );
-      g0 = G_TO_G( *p );
-      b0 = B_TO_B( *p );
+      r0 = R_TO_R( SOURCE_PIXEL( p ) );
+      g0 = G_TO_G( SOURCE_PIXEL( p ) );
+      b0 = B_TO_B( SOURCE_PIXEL( p ) );
 #else
       r0 = (*p & redMask);
       g0 = (*p & greenMask) >> 8;
@@ -1932,8 +1989,8 @@ FUNCTION( scaler_PalTV4x )( const libspectrum_byte *srcPtr,
    3.b  255,255,255 RGB => RGB
 */
   int i, j;
-  unsigned int nextlineSrc = srcPitch / sizeof( scaler_data_type );
-  const scaler_data_type *p, *p0 = (const scaler_data_type *)srcPtr;
+  unsigned int nextlineSrc = srcPitch / sizeof( scaler_source_type );
+  const scaler_source_type *p, *p0 = (const scaler_source_type *)srcPtr;
 
   unsigned int nextlineDst = dstPitch / sizeof( scaler_data_type );
   scaler_data_type *q, *q0 = (scaler_data_type *)dstPtr;
@@ -1956,13 +2013,13 @@ FUNCTION( scaler_PalTV4x )( const libspectrum_byte *srcPtr,
   for( j = height; j; j-- ) {
     p = p0 - 1; q = q0;
 #if SCALER_DATA_SIZE == 2
-    r0 = R_TO_R( *p );
-    g0 = G_TO_G( *p );
-    b0 = B_TO_B( *p );
+    r0 = R_TO_R( SOURCE_PIXEL( p ) );
+    g0 = G_TO_G( SOURCE_PIXEL( p ) );
+    b0 = B_TO_B( SOURCE_PIXEL( p ) );
     p++;
-    r1 = R_TO_R( *p );
-    g1 = G_TO_G( *p );
-    b1 = B_TO_B( *p );
+    r1 = R_TO_R( SOURCE_PIXEL( p ) );
+    g1 = G_TO_G( SOURCE_PIXEL( p ) );
+    b1 = B_TO_B( SOURCE_PIXEL( p ) );
 #else
     r0 = *p & redMask;
     g0 = (*p & greenMask) >> 8;
@@ -1979,9 +2036,9 @@ FUNCTION( scaler_PalTV4x )( const libspectrum_byte *srcPtr,
       p++;      /* next point */
 #if SCALER_DATA_SIZE == 2
       /* 1.a. RGB => RGB */
-      r0 = R_TO_R( *p );
-      g0 = G_TO_G( *p );
-      b0 = B_TO_B( *p );
+      r0 = R_TO_R( SOURCE_PIXEL( p ) );
+      g0 = G_TO_G( SOURCE_PIXEL( p ) );
+      b0 = B_TO_B( SOURCE_PIXEL( p ) );
 #else
       r0 = (*p & redMask);
       g0 = (*p & greenMask) >> 8;
@@ -2063,6 +2120,8 @@ FUNCTION( scaler_PalTV4x )( const libspectrum_byte *srcPtr,
   }
 }
 
+#ifndef SCALER_INDEXED
+
 #define prevline (-nextlineSrc)
 #define nextline nextlineSrc
 #define MOVE_B_TO_A(A,B) \
@@ -2374,3 +2433,4 @@ FUNCTION( scaler_HQ4x ) ( const libspectrum_byte *srcPtr,
     q0 += ( nextlineDst << 2 );
   }
 }
+#endif				/* #ifndef SCALER_INDEXED */
@@ -115,6 +115,14 @@ static int sdl_status_updated;
 
 static int tmp_screen_width;
 
+/* The emulated screen as Spectrum colour numbers, laid out like
+   tmp_screen. While sdldisplay_indexed is set the emulator draws here
+   rather than into tmp_screen, and the scaler reads the colour numbers
+   directly; tmp_screen is then only brought up to date where something
+   has to be drawn on top of the emulated screen */
+static libspectrum_byte *index_screen = NULL;
+static int sdldisplay_indexed = 0;
+
 static Uint32 colour_values[16];
 
 static SDL_Color colour_palette[] = {
@@ -297,6 +305,9 @@ static void uidisplay_show_msg_info_overlay( void );
 #endif
 
 static int sdldisplay_load_gfx_mode( void );
+static int sdldisplay_want_indexed( void );
+static void sdldisplay_set_indexed( int indexed );
+static void sdldisplay_resolve_area( int x, int y, int w, int h );
 
 static void
 init_scalers( void )
@@ -1101,6 +1112,10 @@ sdldisplay_load_gfx_mode( void )
     fuse_abort();
   }
 
+  libspectrum_free( index_screen );
+  index_screen =
+    libspectrum_new0( libspectrum_byte, tmp_screen_width * ( image_height + 3 ) );
+
 #if VKEYBOARD
   /* Create the surface that contains the keyboard graphics in 32 bit mode */
   SDL_Surface *swap_screen;
@@ -1150,11 +1165,65 @@ sdldisplay_load_gfx_mode( void )
 #endif
 
   /* Redraw the entire screen... */
+  sdldisplay_indexed = sdldisplay_want_indexed();
   display_refresh_all();
 
   return 0;
 }
 
+/* Can the emulated screen be scaled straight from index_screen? Widgets
+   save and restore tmp_screen themselves, so use that while they are up */
+static int
+sdldisplay_want_indexed( void )
+{
+  return scaler_proc16_indexed && ui_widget_level == -1;
+}
+
+static void
+sdldisplay_set_indexed( int indexed )
+{
+  if( indexed == sdldisplay_indexed ) return;
+
+  if( indexed ) {
+    /* index_screen hasn't been kept up to date, so draw everything again */
+    display_refresh_all();
+  } else {
+    sdldisplay_resolve_area( 0, 0, tmp_screen_width, image_height + 3 );
+    sdldisplay_force_full_refresh = 1;
+  }
+
+  sdldisplay_indexed = indexed;
+}
+
+/* Bring the area of tmp_screen at ( x, y ) in tmp_screen co-ordinates up to
+   date from index_screen, along with the neighbouring pixels which the
+   smoothing scalers read */
+static void
+sdldisplay_resolve_area( int x, int y, int w, int h )
+{
+  Uint32 *palette_values = settings_current.bw_tv ? bw_values :
+                           colour_values;
+  const libspectrum_byte *src;
+  libspectrum_word *dest;
+  int i;
+
+  if( !sdldisplay_indexed ) return;
+
+  x -= 4; w += 8; y--; h += 2;
+  if( x < 0 ) { w += x; x = 0; }
+  if( y < 0 ) { h += y; y = 0; }
+  if( w > tmp_screen_width - x ) w = tmp_screen_width - x;
+  if( h > image_height + 3 - y ) h = image_height + 3 - y;
+
+  for( ; h > 0; h--, y++ ) {
+    src = index_screen + y * tmp_screen_width + x;
+    dest = (libspectrum_word*)( (libspectrum_byte*)tmp_screen->pixels +
+                                y * tmp_screen->pitch ) + x;
+    for( i = 0; i < w; i++ )
+      dest[i] = palette_values[ src[i] ];
+  }
+}
+
 int
 uidisplay_hotswap_gfx_mode( void )
 {
@@ -1210,6 +1279,7 @@ uidisplay_frame_save( void )
     saved = NULL;
   }
 
+  sdldisplay_resolve_area( 0, 0, tmp_screen_width, image_height + 3 );
   saved = SDL_ConvertSurface( tmp_screen, tmp_screen->format,
                               SDL_SWSURFACE );
 }
@@ -1218,6 +1288,8 @@ void
 uidisplay_frame_restore( void )
 {
   if( saved ) {
+    /* The restored tmp_screen is now the only up to date copy */
+    sdldisplay_set_indexed( 0 );
     SDL_BlitSurface( saved, NULL, tmp_screen, NULL );
     sdldisplay_force_full_refresh = 1;
   }
@@ -1244,6 +1316,7 @@ sdl_blit_icon( SDL_Surface **icon,
   r->x++;
   r->y++;
 
+  sdldisplay_resolve_area( r->x, r->y, r->w, r->h );
   if( SDL_BlitSurface( icon[timex], NULL, tmp_screen, r ) ) return;
 
   /* Extend the dirty region by 1 pixel for scalers
@@ -1348,6 +1421,13 @@ sdl_icon_overlay( Uint32 tmp_screen_pitch, Uint32 dstPitch )
   sdl_status_updated = 0;
 }
 
+/* The byte in index_screen for the pixel at ( x, y ) */
+static inline libspectrum_byte*
+sdldisplay_index_pixel( int x, int y )
+{
+  return index_screen + ( x + 1 ) + ( y + 1 ) * tmp_screen_width;
+}
+
 /* Set one pixel in the display */
 void
 uidisplay_putpixel( int x, int y, int colour )
@@ -1362,6 +1442,20 @@ uidisplay_putpixel( int x, int y, int colour )
   }
 #endif
 
+  if( sdldisplay_indexed ) {
+    libspectrum_byte *index;
+
+    if( machine_current->timex ) {
+      x <<= 1; y <<= 1;
+      index = sdldisplay_index_pixel( x, y );
+      index[0] = index[1] = colour;
+      index[ tmp_screen_width ] = index[ tmp_screen_width + 1 ] = colour;
+    } else {
+      *sdldisplay_index_pixel( x, y ) = colour;
+    }
+    return;
+  }
+
   Uint32 *palette_values = settings_current.bw_tv ? bw_values :
                            colour_values;
 
@@ -1438,6 +1532,7 @@ uidisplay_area_overlay( SDL_Surface* area, int length, widget_overlay_callback_f
   print_info();
   overlay_alpha_surface = NULL;
 
+  sdldisplay_resolve_area( r1.x, r1.y, r1.w, r1.h );
   SDL_BlitSurface(area, NULL, tmp_screen, &r1);
 
   updated_rects[num_rects].x = r1.x;
@@ -1526,6 +1621,7 @@ uidisplay_vkeyboard( void (*print_fn)(void), int position ) {
   print_fn();
   overlay_alpha_surface = NULL;
 
+  sdldisplay_resolve_area( r1.x, r1.y, r1.w, r1.h );
   SDL_BlitSurface(keyb_screen, NULL, tmp_screen, &r1);
 
   updated_rects[num_rects].x = r1.x;
@@ -1584,40 +1680,33 @@ uidisplay_plot8( int x, int y, libspectrum_byte data,
   Uint32 palette_ink = palette_values[ ink ];
   Uint32 palette_paper = palette_values[ paper ];
 
-  if( machine_current->timex ) {
-    int i;
-    libspectrum_word *dest_base;
+  if( sdldisplay_indexed ) {
+    libspectrum_byte *index;
 
+    if( machine_current->timex ) {
+      x <<= 4; y <<= 1;
+      index = sdldisplay_index_pixel( x, y );
+      uidisplay_expand8_index_double( index, data, ink, paper );
+      uidisplay_expand8_index_double( index + tmp_screen_width, data, ink,
+                                      paper );
+    } else {
+      uidisplay_expand8_index( sdldisplay_index_pixel( x << 3, y ), data, ink,
+                               paper );
+    }
+    return;
+  }
+
+  if( machine_current->timex ) {
     x <<= 4; y <<= 1;
 
-    dest_base =
+    dest =
       (libspectrum_word*)( (libspectrum_byte*)tmp_screen->pixels +
                            (x+1) * tmp_screen->format->BytesPerPixel +
                            (y+1) * tmp_screen->pitch);
 
-    for( i=0; i<2; i++ ) {
-      dest = dest_base;
-
-      *(dest++) = ( data & 0x80 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x80 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x40 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x40 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x20 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x20 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x10 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x10 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x08 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x08 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x04 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x04 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x02 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x02 ) ? palette_ink : palette_paper;
-      *(dest++) = ( data & 0x01 ) ? palette_ink : palette_paper;
-      *dest     = ( data & 0x01 ) ? palette_ink : palette_paper;
-
-      dest_base = (libspectrum_word*)
-        ( (libspectrum_byte*)dest_base + tmp_screen->pitch);
-    }
+    uidisplay_expand8_double( dest, data, palette_ink, palette_paper );
+    dest = (libspectrum_word*)( (libspectrum_byte*)dest + tmp_screen->pitch );
+    uidisplay_expand8_double( dest, data, palette_ink, palette_paper );
   } else {
     x <<= 3;
 
@@ -1626,14 +1715,7 @@ uidisplay_plot8( int x, int y, libspectrum_byte data,
                            (x+1) * tmp_screen->format->BytesPerPixel +
                            (y+1) * tmp_screen->pitch);
 
-    *(dest++) = ( data & 0x80 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x40 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x20 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x10 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x08 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x04 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x02 ) ? palette_ink : palette_paper;
-    *dest     = ( data & 0x01 ) ? palette_ink : palette_paper;
+    uidisplay_expand8( dest, data, palette_ink, palette_paper );
   }
 }
 
@@ -1643,41 +1725,87 @@ void
 uidisplay_plot16( int x, int y, libspectrum_word data,
 		  libspectrum_byte ink, libspectrum_byte paper )
 {
-  libspectrum_word *dest_base, *dest;
-  int i;
+  libspectrum_word *dest;
   Uint32 *palette_values = settings_current.bw_tv ? bw_values :
                            colour_values;
   Uint32 palette_ink = palette_values[ ink ];
   Uint32 palette_paper = palette_values[ paper ];
   x <<= 4; y <<= 1;
 
-  dest_base =
+  if( sdldisplay_indexed ) {
+    libspectrum_byte *index = sdldisplay_index_pixel( x, y );
+
+    uidisplay_expand16_index( index, data, ink, paper );
+    uidisplay_expand16_index( index + tmp_screen_width, data, ink, paper );
+    return;
+  }
+
+  dest =
     (libspectrum_word*)( (libspectrum_byte*)tmp_screen->pixels +
                          (x+1) * tmp_screen->format->BytesPerPixel +
                          (y+1) * tmp_screen->pitch);
 
-  for( i=0; i<2; i++ ) {
-    dest = dest_base;
-
-    *(dest++) = ( data & 0x8000 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x4000 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x2000 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x1000 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0800 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0400 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0200 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0100 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0080 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0040 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0020 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0010 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0008 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0004 ) ? palette_ink : palette_paper;
-    *(dest++) = ( data & 0x0002 ) ? palette_ink : palette_paper;
-    *dest     = ( data & 0x0001 ) ? palette_ink : palette_paper;
-
-    dest_base = (libspectrum_word*)
-      ( (libspectrum_byte*)dest_base + tmp_screen->pitch);
+  uidisplay_expand16( dest, data, palette_ink, palette_paper );
+  dest = (libspectrum_word*)( (libspectrum_byte*)dest + tmp_screen->pitch );
+  uidisplay_expand16( dest, data, palette_ink, palette_paper );
+}
+
+/* Print the 8 * `count' pixels in `data' using the ink colours in `ink'
+   and paper colours in `paper' to the screen starting at ( (8*x) , y ) */
+void
+uidisplay_plot8_line( int x, int y, int count, const libspectrum_byte *data,
+                      const libspectrum_byte *ink,
+                      const libspectrum_byte *paper )
+{
+  libspectrum_word *dest;
+  Uint32 *palette_values = settings_current.bw_tv ? bw_values :
+                           colour_values;
+  int i, pitch = tmp_screen->pitch / sizeof( libspectrum_word );
+
+  if( sdldisplay_indexed ) {
+    libspectrum_byte *index;
+
+    if( machine_current->timex ) {
+      index = sdldisplay_index_pixel( x << 4, y << 1 );
+      for( i = 0; i < count; i++, index += 16 ) {
+        uidisplay_expand8_index_double( index, data[i], ink[i], paper[i] );
+        uidisplay_expand8_index_double( index + tmp_screen_width, data[i],
+                                        ink[i], paper[i] );
+      }
+    } else {
+      index = sdldisplay_index_pixel( x << 3, y );
+      for( i = 0; i < count; i++, index += 8 )
+        uidisplay_expand8_index( index, data[i], ink[i], paper[i] );
+    }
+    return;
+  }
+
+  if( machine_current->timex ) {
+    x <<= 4; y <<= 1;
+
+    dest =
+      (libspectrum_word*)( (libspectrum_byte*)tmp_screen->pixels +
+                           (x+1) * tmp_screen->format->BytesPerPixel +
+                           (y+1) * tmp_screen->pitch);
+
+    for( i = 0; i < count; i++, dest += 16 ) {
+      uidisplay_expand8_double( dest, data[i], palette_values[ ink[i] ],
+                                palette_values[ paper[i] ] );
+      uidisplay_expand8_double( dest + pitch, data[i],
+                                palette_values[ ink[i] ],
+                                palette_values[ paper[i] ] );
+    }
+  } else {
+    x <<= 3;
+
+    dest =
+      (libspectrum_word*)( (libspectrum_byte*)tmp_screen->pixels +
+                           (x+1) * tmp_screen->format->BytesPerPixel +
+                           (y+1) * tmp_screen->pitch);
+
+    for( i = 0; i < count; i++, dest += 8 )
+      uidisplay_expand8( dest, data[i], palette_values[ ink[i] ],
+                         palette_values[ paper[i] ] );
   }
 }
 
@@ -1687,6 +1815,7 @@ uidisplay_frame_end( void )
   SDL_Rect *r;
   Uint32 tmp_screen_pitch, dstPitch;
   SDL_Rect *last_rect;
+  int indexed, first_overlay_rect;
 
   /* We check for a switch to fullscreen here to give systems with a
      windowed-only UI a chance to free menu etc. resources before
@@ -1703,6 +1832,13 @@ uidisplay_frame_end( void )
     fuse_abort();
   }
 
+  indexed = sdldisplay_want_indexed();
+  if( !indexed ) sdldisplay_set_indexed( 0 );
+
+  /* Anything after this is drawn on top of the emulated screen and so
+     has to come from tmp_screen */
+  first_overlay_rect = num_rects;
+
 #if VKEYBOARD
   if ( vkeyboard_enabled )
     ui_widget_print_vkeyboard();
@@ -1722,7 +1858,15 @@ uidisplay_frame_end( void )
 #else
   if ( sdldisplay_force_full_refresh ) {
 #endif
-    num_rects = 1;
+    if( sdldisplay_indexed ) {
+      /* Keep the overlays, which are drawn from tmp_screen */
+      memmove( updated_rects + 1, updated_rects + first_overlay_rect,
+               ( num_rects - first_overlay_rect ) * sizeof( SDL_Rect ) );
+      num_rects -= first_overlay_rect - 1;
+      first_overlay_rect = 1;
+    } else {
+      num_rects = 1;
+    }
 
     updated_rects[0].x = 0;
     updated_rects[0].y = 0;
@@ -1741,6 +1885,8 @@ uidisplay_frame_end( void )
 
   last_rect = updated_rects + num_rects;
 
+  scaler_palette = settings_current.bw_tv ? bw_values : colour_values;
+
   for( r = updated_rects; r != last_rect; r++ ) {
 #ifdef GCWZERO
     if ( sdldisplay_current_od_border ) {
@@ -1767,16 +1913,26 @@ uidisplay_frame_end( void )
     int dst_h = r->h;
     int dst_x = r->x * sdldisplay_current_size + fullscreen_x_off;
 
-    scaler_proc16(
-      (libspectrum_byte*)tmp_screen->pixels +
-                        (r->x+1) * tmp_screen->format->BytesPerPixel +
-	                (r->y+1)*tmp_screen_pitch,
-      tmp_screen_pitch,
-      (libspectrum_byte*)sdldisplay_gc->pixels +
-	                 dst_x * sdldisplay_gc->format->BytesPerPixel +
-			 dst_y*dstPitch,
-      dstPitch, r->w, dst_h
-    );
+    if( sdldisplay_indexed && r - updated_rects < first_overlay_rect ) {
+      scaler_proc_bands( scaler_proc16_indexed,
+        sdldisplay_index_pixel( r->x, r->y ), tmp_screen_width,
+        (libspectrum_byte*)sdldisplay_gc->pixels +
+                           dst_x * sdldisplay_gc->format->BytesPerPixel +
+                           dst_y*dstPitch,
+        dstPitch, r->w, dst_h
+      );
+    } else {
+      scaler_proc_bands( scaler_proc16,
+        (libspectrum_byte*)tmp_screen->pixels +
+                          (r->x+1) * tmp_screen->format->BytesPerPixel +
+	                  (r->y+1)*tmp_screen_pitch,
+        tmp_screen_pitch,
+        (libspectrum_byte*)sdldisplay_gc->pixels +
+	                   dst_x * sdldisplay_gc->format->BytesPerPixel +
+			   dst_y*dstPitch,
+        dstPitch, r->w, dst_h
+      );
+    }
 
     /* Adjust rects for the destination rect size */
     r->x = dst_x;
@@ -1807,6 +1963,10 @@ uidisplay_frame_end( void )
 
   num_rects = 0;
   sdldisplay_force_full_refresh = 0;
+
+  /* Once this frame has been drawn from tmp_screen, the emulator can start
+     drawing into index_screen */
+  if( indexed ) sdldisplay_set_indexed( 1 );
 }
 
 void
@@ -1845,6 +2005,11 @@ uidisplay_end( void )
     SDL_FreeSurface( tmp_screen ); tmp_screen = NULL;
   }
 
+  libspectrum_free( index_screen ); index_screen = NULL;
+  sdldisplay_indexed = 0;
+
+  scaler_bands_end();
+
   if( saved ) {
     SDL_FreeSurface( saved ); saved = NULL;
   }
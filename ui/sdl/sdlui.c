@@ -176,10 +176,14 @@ ui_end( void )
 int
 ui_statusbar_update_speed( float speed )
 {
-  char buffer[15];
+  char buffer[32];
   const char fuse[] = "Fuse";
 
-  snprintf( buffer, 15, "%s - %3.0f%%", fuse, speed );
+  if( settings_current.auto_frame_skip )
+    snprintf( buffer, 32, "%s - %3.0f%% (%d skipped)", fuse, speed,
+              display_frames_skipped );
+  else
+    snprintf( buffer, 32, "%s - %3.0f%%", fuse, speed );
 
 #ifdef GCWZERO
   if ( settings_current.statusbar )
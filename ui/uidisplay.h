@@ -24,6 +24,8 @@
 #ifndef FUSE_UIDISPLAY_H
 #define FUSE_UIDISPLAY_H
 
+#include <string.h>
+
 #include "libspectrum.h"
 
 /* User interface specific functions */
@@ -52,5 +54,109 @@ void uidisplay_plot8( int x, int y, libspectrum_byte data, libspectrum_byte ink,
                       libspectrum_byte paper );
 void uidisplay_plot16( int x, int y, libspectrum_word data, libspectrum_byte ink,
                        libspectrum_byte paper);
+void uidisplay_plot8_line( int x, int y, int count,
+                           const libspectrum_byte *data,
+                           const libspectrum_byte *ink,
+                           const libspectrum_byte *paper );
+
+/* Expanding bitmap data into 16-bit pixels for the uidisplay_plot*()
+   routines. Each table entry holds one all-ones or all-zeroes pixel mask
+   per bit of the index, packed four to a 64-bit word; the pixels are then
+   formed as paper ^ ( mask & ( ink ^ paper ) ) four at a time */
+
+extern libspectrum_qword uidisplay_expand_table[256][2];
+extern libspectrum_qword uidisplay_expand_double_table[256][4];
+
+void uidisplay_expand_init( void );
+
+static inline void
+uidisplay_expand( libspectrum_word *dest, const libspectrum_qword *masks,
+                  size_t count, libspectrum_word ink, libspectrum_word paper )
+{
+  const libspectrum_qword spread = 0x0001000100010001ULL;
+  libspectrum_qword paper4 = paper * spread;
+  libspectrum_qword diff4 = ( ink ^ paper ) * spread;
+  libspectrum_qword pixels;
+  size_t i;
+
+  /* memcpy() as `dest' needn't be aligned; it becomes a single store */
+  for( i = 0; i < count; i++ ) {
+    pixels = paper4 ^ ( masks[i] & diff4 );
+    memcpy( dest + 4 * i, &pixels, sizeof( pixels ) );
+  }
+}
+
+/* The 8 pixels in `data' */
+static inline void
+uidisplay_expand8( libspectrum_word *dest, libspectrum_byte data,
+                   libspectrum_word ink, libspectrum_word paper )
+{
+  uidisplay_expand( dest, uidisplay_expand_table[ data ], 2, ink, paper );
+}
+
+/* The 8 pixels in `data', each doubled in width */
+static inline void
+uidisplay_expand8_double( libspectrum_word *dest, libspectrum_byte data,
+                          libspectrum_word ink, libspectrum_word paper )
+{
+  uidisplay_expand( dest, uidisplay_expand_double_table[ data ], 4, ink,
+                    paper );
+}
+
+/* The 16 pixels in `data' */
+static inline void
+uidisplay_expand16( libspectrum_word *dest, libspectrum_word data,
+                    libspectrum_word ink, libspectrum_word paper )
+{
+  uidisplay_expand8( dest, data >> 8, ink, paper );
+  uidisplay_expand8( dest + 8, data & 0xff, ink, paper );
+}
+
+/* The same for UIs which keep the screen as one byte per pixel holding
+   the Spectrum colour number. The 16-bit masks double up as masks for
+   pairs of bytes when each pixel is doubled in width */
+
+extern libspectrum_qword uidisplay_expand_index_table[256];
+
+static inline void
+uidisplay_expand_index( libspectrum_byte *dest,
+                        const libspectrum_qword *masks, size_t count,
+                        libspectrum_byte ink, libspectrum_byte paper )
+{
+  const libspectrum_qword spread = 0x0101010101010101ULL;
+  libspectrum_qword paper8 = paper * spread;
+  libspectrum_qword diff8 = ( ink ^ paper ) * spread;
+  libspectrum_qword pixels;
+  size_t i;
+
+  for( i = 0; i < count; i++ ) {
+    pixels = paper8 ^ ( masks[i] & diff8 );
+    memcpy( dest + 8 * i, &pixels, sizeof( pixels ) );
+  }
+}
+
+static inline void
+uidisplay_expand8_index( libspectrum_byte *dest, libspectrum_byte data,
+                         libspectrum_byte ink, libspectrum_byte paper )
+{
+  uidisplay_expand_index( dest, &uidisplay_expand_index_table[ data ], 1,
+                          ink, paper );
+}
+
+static inline void
+uidisplay_expand8_index_double( libspectrum_byte *dest, libspectrum_byte data,
+                                libspectrum_byte ink, libspectrum_byte paper )
+{
+  uidisplay_expand_index( dest, uidisplay_expand_table[ data ], 2, ink,
+                          paper );
+}
+
+static inline void
+uidisplay_expand16_index( libspectrum_byte *dest, libspectrum_word data,
+                          libspectrum_byte ink, libspectrum_byte paper )
+{
+  uidisplay_expand8_index( dest, data >> 8, ink, paper );
+  uidisplay_expand8_index( dest + 8, data & 0xff, ink, paper );
+}
 
 #endif			/* #ifndef FUSE_UIDISPLAY_H */
@@ -567,11 +567,18 @@ static char* od_machine_name( libspectrum_machine type ) {
 
 size_t widget_statusbar_update_info( float speed ) {
   char suffix[14];
-  snprintf(status_info, WIDGET_MAX_INFO_LENGTH,
-           settings_current.od_show_fps ? "%s - %3.0ffps (1:%d)" : "%s - %3.0f%% (1:%d)",
-           od_machine_name( machine_current->machine ),
-           speed,
-           settings_current.frame_rate);
+  if ( settings_current.auto_frame_skip )
+    snprintf(status_info, WIDGET_MAX_INFO_LENGTH,
+             settings_current.od_show_fps ? "%s - %3.0ffps (-%d)" : "%s - %3.0f%% (-%d)",
+             od_machine_name( machine_current->machine ),
+             speed,
+             display_frames_skipped);
+  else
+    snprintf(status_info, WIDGET_MAX_INFO_LENGTH,
+             settings_current.od_show_fps ? "%s - %3.0ffps (1:%d)" : "%s - %3.0f%% (1:%d)",
+             od_machine_name( machine_current->machine ),
+             speed,
+             settings_current.frame_rate);
   if ( settings_current.joystick_1_output || settings_current.joystick_gcw0_output ) {
     snprintf(suffix, 14, " [%s]",
              settings_current.joystick_1_output ? joystick_name[settings_current.joystick_1_output]
@@ -481,36 +481,11 @@ uidisplay_plot8( int x, int y, libspectrum_byte data,
   x <<= 3;
 
   if( machine_current->timex ) {
-    int i;
-
     x <<= 1; y <<= 1;
-    for( i=0; i<2; i++,y++ ) {
-      display_image[y][x+ 0] = ( data & 0x80 ) ? ink : paper;
-      display_image[y][x+ 1] = ( data & 0x80 ) ? ink : paper;
-      display_image[y][x+ 2] = ( data & 0x40 ) ? ink : paper;
-      display_image[y][x+ 3] = ( data & 0x40 ) ? ink : paper;
-      display_image[y][x+ 4] = ( data & 0x20 ) ? ink : paper;
-      display_image[y][x+ 5] = ( data & 0x20 ) ? ink : paper;
-      display_image[y][x+ 6] = ( data & 0x10 ) ? ink : paper;
-      display_image[y][x+ 7] = ( data & 0x10 ) ? ink : paper;
-      display_image[y][x+ 8] = ( data & 0x08 ) ? ink : paper;
-      display_image[y][x+ 9] = ( data & 0x08 ) ? ink : paper;
-      display_image[y][x+10] = ( data & 0x04 ) ? ink : paper;
-      display_image[y][x+11] = ( data & 0x04 ) ? ink : paper;
-      display_image[y][x+12] = ( data & 0x02 ) ? ink : paper;
-      display_image[y][x+13] = ( data & 0x02 ) ? ink : paper;
-      display_image[y][x+14] = ( data & 0x01 ) ? ink : paper;
-      display_image[y][x+15] = ( data & 0x01 ) ? ink : paper;
-    }
+    uidisplay_expand8_double( &display_image[y  ][x], data, ink, paper );
+    uidisplay_expand8_double( &display_image[y+1][x], data, ink, paper );
   } else {
-    display_image[y][x+ 0] = ( data & 0x80 ) ? ink : paper;
-    display_image[y][x+ 1] = ( data & 0x40 ) ? ink : paper;
-    display_image[y][x+ 2] = ( data & 0x20 ) ? ink : paper;
-    display_image[y][x+ 3] = ( data & 0x10 ) ? ink : paper;
-    display_image[y][x+ 4] = ( data & 0x08 ) ? ink : paper;
-    display_image[y][x+ 5] = ( data & 0x04 ) ? ink : paper;
-    display_image[y][x+ 6] = ( data & 0x02 ) ? ink : paper;
-    display_image[y][x+ 7] = ( data & 0x01 ) ? ink : paper;
+    uidisplay_expand8( &display_image[y][x], data, ink, paper );
   }
 }
 
@@ -524,6 +499,29 @@ uidisplay_plot16( int x, int y, libspectrum_word data,
   return;
 }
 
+/* Print the 8 * `count' pixels in `data' using the ink colours in `ink'
+   and paper colours in `paper' to the screen starting at ( (8*x) , y ) */
+void
+uidisplay_plot8_line( int x, int y, int count, const libspectrum_byte *data,
+                      const libspectrum_byte *ink,
+                      const libspectrum_byte *paper )
+{
+  int i;
+
+  x <<= 3;
+
+  if( machine_current->timex ) {
+    x <<= 1; y <<= 1;
+    for( i = 0; i < count; i++, x += 16 ) {
+      uidisplay_expand8_double( &display_image[y  ][x], data[i], ink[i], paper[i] );
+      uidisplay_expand8_double( &display_image[y+1][x], data[i], ink[i], paper[i] );
+    }
+  } else {
+    for( i = 0; i < count; i++, x += 8 )
+      uidisplay_expand8( &display_image[y][x], data[i], ink[i], paper[i] );
+  }
+}
+
 void
 uidisplay_frame_save( void )
 {
@@ -437,36 +437,11 @@ uidisplay_plot8( int x, int y, libspectrum_byte data,
   x <<= 3;
 
   if( machine_current->timex ) {
-    int i;
-
     x <<= 1; y <<= 1;
-    for( i=0; i<2; i++,y++ ) {
-      win32display_image[y][x+ 0] = ( data & 0x80 ) ? ink : paper;
-      win32display_image[y][x+ 1] = ( data & 0x80 ) ? ink : paper;
-      win32display_image[y][x+ 2] = ( data & 0x40 ) ? ink : paper;
-      win32display_image[y][x+ 3] = ( data & 0x40 ) ? ink : paper;
-      win32display_image[y][x+ 4] = ( data & 0x20 ) ? ink : paper;
-      win32display_image[y][x+ 5] = ( data & 0x20 ) ? ink : paper;
-      win32display_image[y][x+ 6] = ( data & 0x10 ) ? ink : paper;
-      win32display_image[y][x+ 7] = ( data & 0x10 ) ? ink : paper;
-      win32display_image[y][x+ 8] = ( data & 0x08 ) ? ink : paper;
-      win32display_image[y][x+ 9] = ( data & 0x08 ) ? ink : paper;
-      win32display_image[y][x+10] = ( data & 0x04 ) ? ink : paper;
-      win32display_image[y][x+11] = ( data & 0x04 ) ? ink : paper;
-      win32display_image[y][x+12] = ( data & 0x02 ) ? ink : paper;
-      win32display_image[y][x+13] = ( data & 0x02 ) ? ink : paper;
-      win32display_image[y][x+14] = ( data & 0x01 ) ? ink : paper;
-      win32display_image[y][x+15] = ( data & 0x01 ) ? ink : paper;
-    }
+    uidisplay_expand8_double( &win32display_image[y  ][x], data, ink, paper );
+    uidisplay_expand8_double( &win32display_image[y+1][x], data, ink, paper );
   } else {
-    win32display_image[y][x+ 0] = ( data & 0x80 ) ? ink : paper;
-    win32display_image[y][x+ 1] = ( data & 0x40 ) ? ink : paper;
-    win32display_image[y][x+ 2] = ( data & 0x20 ) ? ink : paper;
-    win32display_image[y][x+ 3] = ( data & 0x10 ) ? ink : paper;
-    win32display_image[y][x+ 4] = ( data & 0x08 ) ? ink : paper;
-    win32display_image[y][x+ 5] = ( data & 0x04 ) ? ink : paper;
-    win32display_image[y][x+ 6] = ( data & 0x02 ) ? ink : paper;
-    win32display_image[y][x+ 7] = ( data & 0x01 ) ? ink : paper;
+    uidisplay_expand8( &win32display_image[y][x], data, ink, paper );
   }
 }
 
@@ -476,26 +451,32 @@ void
 uidisplay_plot16( int x, int y, libspectrum_word data,
                   libspectrum_byte ink, libspectrum_byte paper )
 {
-  int i;
   x <<= 4; y <<= 1;
 
-  for( i=0; i<2; i++,y++ ) {
-    win32display_image[y][x+ 0] = ( data & 0x8000 ) ? ink : paper;
-    win32display_image[y][x+ 1] = ( data & 0x4000 ) ? ink : paper;
-    win32display_image[y][x+ 2] = ( data & 0x2000 ) ? ink : paper;
-    win32display_image[y][x+ 3] = ( data & 0x1000 ) ? ink : paper;
-    win32display_image[y][x+ 4] = ( data & 0x0800 ) ? ink : paper;
-    win32display_image[y][x+ 5] = ( data & 0x0400 ) ? ink : paper;
-    win32display_image[y][x+ 6] = ( data & 0x0200 ) ? ink : paper;
-    win32display_image[y][x+ 7] = ( data & 0x0100 ) ? ink : paper;
-    win32display_image[y][x+ 8] = ( data & 0x0080 ) ? ink : paper;
-    win32display_image[y][x+ 9] = ( data & 0x0040 ) ? ink : paper;
-    win32display_image[y][x+10] = ( data & 0x0020 ) ? ink : paper;
-    win32display_image[y][x+11] = ( data & 0x0010 ) ? ink : paper;
-    win32display_image[y][x+12] = ( data & 0x0008 ) ? ink : paper;
-    win32display_image[y][x+13] = ( data & 0x0004 ) ? ink : paper;
-    win32display_image[y][x+14] = ( data & 0x0002 ) ? ink : paper;
-    win32display_image[y][x+15] = ( data & 0x0001 ) ? ink : paper;
+  uidisplay_expand16( &win32display_image[y  ][x], data, ink, paper );
+  uidisplay_expand16( &win32display_image[y+1][x], data, ink, paper );
+}
+
+/* Print the 8 * `count' pixels in `data' using the ink colours in `ink'
+   and paper colours in `paper' to the screen starting at ( (8*x) , y ) */
+void
+uidisplay_plot8_line( int x, int y, int count, const libspectrum_byte *data,
+                      const libspectrum_byte *ink,
+                      const libspectrum_byte *paper )
+{
+  int i;
+
+  x <<= 3;
+
+  if( machine_current->timex ) {
+    x <<= 1; y <<= 1;
+    for( i = 0; i < count; i++, x += 16 ) {
+      uidisplay_expand8_double( &win32display_image[y  ][x], data[i], ink[i], paper[i] );
+      uidisplay_expand8_double( &win32display_image[y+1][x], data[i], ink[i], paper[i] );
+    }
+  } else {
+    for( i = 0; i < count; i++, x += 8 )
+      uidisplay_expand8( &win32display_image[y][x], data[i], ink[i], paper[i] );
   }
 }
 
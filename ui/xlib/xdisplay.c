@@ -1091,36 +1091,13 @@ uidisplay_plot8( int x, int y, libspectrum_byte data,
     x <<= 4; y <<= 1;
 
     dest = &(rgb_image[y + 2][x + 1]);
-
-    *(dest + rgb_pitch) = *dest = ( data & 0x80 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x80 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x40 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x40 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x20 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x20 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x10 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x10 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x08 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x08 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x04 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x04 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x02 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x02 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x01 ) ? pi : pp; dest++;
-    *(dest + rgb_pitch) = *dest = ( data & 0x01 ) ? pi : pp;
+    uidisplay_expand8_double( dest, data, pi, pp );
+    uidisplay_expand8_double( dest + rgb_pitch, data, pi, pp );
   } else {
     x <<= 3;
 
     dest = &(rgb_image[y + 2][x + 1]);
-
-    *(dest++) = ( data & 0x80 ) ? pi : pp;
-    *(dest++) = ( data & 0x40 ) ? pi : pp;
-    *(dest++) = ( data & 0x20 ) ? pi : pp;
-    *(dest++) = ( data & 0x10 ) ? pi : pp;
-    *(dest++) = ( data & 0x08 ) ? pi : pp;
-    *(dest++) = ( data & 0x04 ) ? pi : pp;
-    *(dest++) = ( data & 0x02 ) ? pi : pp;
-    *dest     = ( data & 0x01 ) ? pi : pp;
+    uidisplay_expand8( dest, data, pi, pp );
   }
 }
 
@@ -1138,22 +1115,40 @@ uidisplay_plot16( int x, int y, libspectrum_word data,
   x <<= 4; y <<= 1;
 
   dest = &(rgb_image[y + 2][x + 1]);
-  *(dest + rgb_pitch) = *dest = ( data & 0x8000 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x4000 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x2000 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x1000 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0800 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0400 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0200 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0100 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0080 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0040 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0020 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0010 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0008 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0004 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0002 ) ? pi : pp; dest++;
-  *(dest + rgb_pitch) = *dest = ( data & 0x0001 ) ? pi : pp;
+  uidisplay_expand16( dest, data, pi, pp );
+  uidisplay_expand16( dest + rgb_pitch, data, pi, pp );
+}
+
+/* Print the 8 * `count' pixels in `data' using the ink colours in `ink'
+   and paper colours in `paper' to the screen starting at ( (8*x) , y ) */
+void
+uidisplay_plot8_line( int x, int y, int count, const libspectrum_byte *data,
+                      const libspectrum_byte *ink,
+                      const libspectrum_byte *paper )
+{
+  libspectrum_word *dest;
+  const libspectrum_word *palette = settings_current.bw_tv ? pal_grey :
+                                                             pal_colour;
+  int i;
+
+  if( machine_current->timex ) {
+    x <<= 4; y <<= 1;
+
+    dest = &(rgb_image[y + 2][x + 1]);
+    for( i = 0; i < count; i++, dest += 16 ) {
+      uidisplay_expand8_double( dest, data[i], palette[ ink[i] ],
+                                palette[ paper[i] ] );
+      uidisplay_expand8_double( dest + rgb_pitch, data[i], palette[ ink[i] ],
+                                palette[ paper[i] ] );
+    }
+  } else {
+    x <<= 3;
+
+    dest = &(rgb_image[y + 2][x + 1]);
+    for( i = 0; i < count; i++, dest += 8 )
+      uidisplay_expand8( dest, data[i], palette[ ink[i] ],
+                         palette[ paper[i] ] );
+  }
 }
 
 int
@@ -23,12 +23,46 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "libspectrum.h"
 
 #include "display.h"
 #include "machine.h"
 #include "ui/uidisplay.h"
 
+libspectrum_qword uidisplay_expand_table[256][2];
+libspectrum_qword uidisplay_expand_double_table[256][4];
+libspectrum_qword uidisplay_expand_index_table[256];
+
+void
+uidisplay_expand_init( void )
+{
+  libspectrum_word masks[16];
+  libspectrum_byte index_masks[8];
+  int data, i;
+
+  /* Build the masks pixel by pixel and copy them into place so the
+     layout within each word matches the host's byte order */
+  for( data = 0; data < 256; data++ ) {
+
+    for( i = 0; i < 8; i++ )
+      masks[i] = ( data & ( 0x80 >> i ) ) ? 0xffff : 0x0000;
+    memcpy( uidisplay_expand_table[ data ], masks,
+            sizeof( uidisplay_expand_table[ data ] ) );
+
+    for( i = 0; i < 16; i++ )
+      masks[i] = ( data & ( 0x80 >> ( i / 2 ) ) ) ? 0xffff : 0x0000;
+    memcpy( uidisplay_expand_double_table[ data ], masks,
+            sizeof( uidisplay_expand_double_table[ data ] ) );
+
+    for( i = 0; i < 8; i++ )
+      index_masks[i] = ( data & ( 0x80 >> i ) ) ? 0xff : 0x00;
+    memcpy( &uidisplay_expand_index_table[ data ], index_masks,
+            sizeof( uidisplay_expand_index_table[ data ] ) );
+  }
+}
+
 void uidisplay_spectrum_screen( const libspectrum_byte *screen, int border )
 {
   int x,y;
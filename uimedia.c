@@ -31,6 +31,7 @@
 
 #include "fuse.h"
 #include "options.h"
+#include "settings.h"
 #include "ui/ui.h"
 #include "ui/uimedia.h"
 #include "utils.h"
@@ -293,6 +294,10 @@ drive_eject( const ui_media_drive_info_t *drive )
   if( !drive->fdd->loaded )
     return 0;
 
+  /* if this fails, fall back to asking about saving the whole disk */
+  if( drive->fdd->disk.dirty && settings_current.disk_write_back )
+    disk_write_back( &drive->fdd->disk );
+
   if( drive->fdd->disk.dirty ) {
 
     ui_confirm_save_t confirm = ui_confirm_save(
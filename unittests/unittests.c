@@ -24,9 +24,12 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "libspectrum.h"
 
 #include "debugger/debugger.h"
+#include "event.h"
 #include "fuse.h"
 #include "machine.h"
 #include "mempool.h"
@@ -47,8 +50,12 @@
 #include "peripherals/ttx2000s.h"
 #include "peripherals/ula.h"
 #include "peripherals/usource.h"
+#include "runahead.h"
 #include "settings.h"
+#include "tape.h"
 #include "unittests.h"
+#include "z80/z80.h"
+#include "z80/z80_macros.h"
 
 static int
 contention_test( void )
@@ -309,6 +316,240 @@ mempool_test( void )
   return 0;
 }
 
+static void
+runahead_count_event( gpointer data GCC_UNUSED, gpointer user_data )
+{
+  size_t *count = user_data;
+
+  (*count)++;
+}
+
+static size_t
+runahead_event_count( void )
+{
+  size_t count = 0;
+
+  event_foreach( runahead_count_event, &count );
+
+  return count;
+}
+
+static int
+runahead_test( void )
+{
+  libspectrum_byte byte, last_byte;
+  libspectrum_byte *page_c000;
+  libspectrum_word pc;
+  libspectrum_dword saved_tstates, next_event;
+  size_t events;
+
+  byte = readbyte_internal( 0x5b00 );
+  last_byte = machine_current->ram.last_byte;
+  page_c000 = memory_map_read[ 0xc000 >> MEMORY_PAGE_SIZE_LOGARITHM ].page;
+  pc = z80.pc.w;
+  saved_tstates = tstates;
+  next_event = event_next_event;
+  events = runahead_event_count();
+
+  runahead_state_save();
+
+  writebyte_internal( 0x5b00, byte ^ 0xff );
+  writeport_internal( 0x7ffd, last_byte ^ 0x01 );
+  z80.pc.w = pc + 1;
+  tstates = saved_tstates + 100;
+  event_add( 0, event_type_null );
+
+  TEST_ASSERT( readbyte_internal( 0x5b00 ) != byte );
+  TEST_ASSERT( runahead_event_count() == events + 1 );
+
+  runahead_state_restore();
+
+  TEST_ASSERT( readbyte_internal( 0x5b00 ) == byte );
+  TEST_ASSERT( machine_current->ram.last_byte == last_byte );
+  TEST_ASSERT( memory_map_read[ 0xc000 >> MEMORY_PAGE_SIZE_LOGARITHM ].page ==
+               page_c000 );
+  TEST_ASSERT( z80.pc.w == pc );
+  TEST_ASSERT( tstates == saved_tstates );
+  TEST_ASSERT( event_next_event == next_event );
+  TEST_ASSERT( runahead_event_count() == events );
+
+  return 0;
+}
+
+/* The flash load test copies the ROM's LD-BYTES into RAM, where the tape
+   traps won't catch it, and loads a block with it */
+#define FLASH_TEST_ROM 0x0556
+#define FLASH_TEST_ROM_LENGTH 0xaf
+#define FLASH_TEST_CODE 0x6000
+#define FLASH_TEST_RETURN 0x6100
+#define FLASH_TEST_DATA 0x6800
+#define FLASH_TEST_STACK 0x7000
+#define FLASH_TEST_LENGTH 64
+
+typedef struct flash_test_result_t {
+  processor z80;
+  libspectrum_byte memory[ FLASH_TEST_LENGTH + 2 ];
+} flash_test_result_t;
+
+/* Is LD-8-BITS where it is in the 48K ROM? */
+static int
+flash_test_rom_present( void )
+{
+  static const libspectrum_byte ld_8_bits[] = {
+    0xcd, 0xe3, 0x05, 0xd0, 0x3e, 0xcb, 0xb8, 0xcb, 0x15, 0x06, 0xb0, 0xd2,
+    0xca, 0x05
+  };
+  size_t i;
+
+  for( i = 0; i < sizeof( ld_8_bits ); i++ )
+    if( readbyte_internal( 0x05ca + i ) != ld_8_bits[i] ) return 0;
+
+  return 1;
+}
+
+/* Load the test block, flash loaded or edge by edge. If 'sample_and_a' is
+   set, the BREAK check in LD-SAMPLE becomes an AND A, as in the Microsphere
+   loaders, which is no longer a copy of LD-BYTES and so is flash loaded a
+   byte at a time */
+static int
+flash_test_load( int flash, int sample_and_a, flash_test_result_t *result )
+{
+  libspectrum_byte tap[ FLASH_TEST_LENGTH + 4 ], opcode, parity;
+  libspectrum_word address;
+  int flash_load, accelerate_loader, detect_loader, fastload;
+  size_t i;
+  int error;
+
+  tap[0] = ( FLASH_TEST_LENGTH + 2 ) & 0xff;
+  tap[1] = ( FLASH_TEST_LENGTH + 2 ) >> 8;
+  tap[2] = parity = 0xff;
+  for( i = 0; i < FLASH_TEST_LENGTH; i++ ) {
+    tap[ i + 3 ] = i * 0x25 + 0x5a;
+    parity ^= tap[ i + 3 ];
+  }
+  tap[ FLASH_TEST_LENGTH + 3 ] = parity;
+
+  error = tape_read_buffer( tap, sizeof( tap ), LIBSPECTRUM_ID_TAPE_TAP, NULL,
+                            0 );
+  if( error ) return error;
+
+  /* Copy LD-BYTES, pointing its CALLs and JPs at the copy and having it
+     return to a JR $ rather than SA/LD-RET */
+  for( i = 0; i < FLASH_TEST_ROM_LENGTH; i++ )
+    writebyte_internal( FLASH_TEST_CODE + i,
+                        readbyte_internal( FLASH_TEST_ROM + i ) );
+
+  for( i = 0; i + 2 < FLASH_TEST_ROM_LENGTH; i++ ) {
+    opcode = readbyte_internal( FLASH_TEST_CODE + i );
+    address = readbyte_internal( FLASH_TEST_CODE + i + 1 ) |
+              readbyte_internal( FLASH_TEST_CODE + i + 2 ) << 8;
+
+    if( ( opcode == 0xcd || opcode == 0xd2 ) && address >= FLASH_TEST_ROM &&
+        address < FLASH_TEST_ROM + FLASH_TEST_ROM_LENGTH )
+      address += FLASH_TEST_CODE - FLASH_TEST_ROM;
+    else if( opcode == 0x21 && address == 0x053f )
+      address = FLASH_TEST_RETURN;
+    else
+      continue;
+
+    writebyte_internal( FLASH_TEST_CODE + i + 1, address & 0xff );
+    writebyte_internal( FLASH_TEST_CODE + i + 2, address >> 8 );
+  }
+
+  if( sample_and_a )
+    writebyte_internal( FLASH_TEST_CODE + 0x05f4 - FLASH_TEST_ROM, 0xa7 );
+
+  writebyte_internal( FLASH_TEST_RETURN, 0x18 );
+  writebyte_internal( FLASH_TEST_RETURN + 1, 0xfe );
+
+  for( i = 0; i < sizeof( result->memory ); i++ )
+    writebyte_internal( FLASH_TEST_DATA + i, 0 );
+
+  /* LOAD 64 bytes of data with flag 0xff */
+  z80.af.w = 0xff00 | FLAG_C; z80.bc.w = 0x0000;
+  z80.de.w = FLASH_TEST_LENGTH; z80.hl.w = 0x0000;
+  z80.af_.w = 0x0000; z80.bc_.w = 0x0000; z80.de_.w = 0x0000;
+  z80.hl_.w = 0x0000;
+  z80.ix.w = FLASH_TEST_DATA; z80.iy.w = 0x5c3a;
+  z80.sp.w = FLASH_TEST_STACK; z80.pc.w = FLASH_TEST_CODE;
+  z80.iff1 = z80.iff2 = 0; z80.halted = 0;
+
+  flash_load = settings_current.flash_load;
+  accelerate_loader = settings_current.accelerate_loader;
+  detect_loader = settings_current.detect_loader;
+  fastload = settings_current.fastload;
+
+  settings_current.flash_load = flash;
+  settings_current.accelerate_loader = 0;
+  settings_current.detect_loader = 0;
+  settings_current.fastload = 1;
+
+  error = tape_do_play( 0 );
+
+  for( i = 0; !error && z80.pc.w != FLASH_TEST_RETURN && i < 100000; i++ ) {
+    z80_do_opcodes();
+    event_do_events();
+  }
+
+  tape_stop();
+
+  settings_current.flash_load = flash_load;
+  settings_current.accelerate_loader = accelerate_loader;
+  settings_current.detect_loader = detect_loader;
+  settings_current.fastload = fastload;
+
+  if( error ) return error;
+
+  TEST_ASSERT( z80.pc.w == FLASH_TEST_RETURN );
+
+  result->z80 = z80;
+  for( i = 0; i < sizeof( result->memory ); i++ )
+    result->memory[i] = readbyte_internal( FLASH_TEST_DATA + i );
+
+  /* The load itself should have worked */
+  TEST_ASSERT( z80.af.b.l & FLAG_C );
+  TEST_ASSERT( !memcmp( result->memory, &tap[3], FLASH_TEST_LENGTH ) );
+
+  return 0;
+}
+
+/* Flash loading must leave memory and the registers as loading the block
+   edge by edge does. A whole block is loaded as the tape traps do, which
+   doesn't set C, L or AF' exactly as LD-BYTES does */
+static int
+flash_load_test( void )
+{
+  flash_test_result_t edge, flash;
+  int sample_and_a;
+
+  if( !flash_test_rom_present() ) return 0;
+
+  for( sample_and_a = 0; sample_and_a < 2; sample_and_a++ ) {
+
+    if( flash_test_load( 0, sample_and_a, &edge ) ) return 1;
+    if( flash_test_load( 1, sample_and_a, &flash ) ) return 1;
+
+    TEST_ASSERT( !memcmp( edge.memory, flash.memory, sizeof( edge.memory ) ) );
+    TEST_ASSERT( edge.z80.af.w == flash.z80.af.w );
+    TEST_ASSERT( edge.z80.bc.b.h == flash.z80.bc.b.h );
+    TEST_ASSERT( edge.z80.de.w == flash.z80.de.w );
+    TEST_ASSERT( edge.z80.hl.b.h == flash.z80.hl.b.h );
+    TEST_ASSERT( edge.z80.ix.w == flash.z80.ix.w );
+    TEST_ASSERT( edge.z80.iy.w == flash.z80.iy.w );
+    TEST_ASSERT( edge.z80.sp.w == flash.z80.sp.w );
+
+    if( sample_and_a ) {
+      TEST_ASSERT( edge.z80.bc.w == flash.z80.bc.w );
+      TEST_ASSERT( edge.z80.hl.w == flash.z80.hl.w );
+      TEST_ASSERT( edge.z80.af_.w == flash.z80.af_.w );
+    }
+  }
+
+  tape_close();
+
+  return 0;
+}
+
 static int
 assert_page( libspectrum_word base, libspectrum_word length, int source, int page )
 {
@@ -786,6 +1027,8 @@ unittests_run( void )
   r += floating_bus_test();
   r += floating_bus_merge_test();
   r += mempool_test();
+  r += runahead_test();
+  r += flash_load_test();
   r += paging_test();
   r += debugger_disassemble_unittest();
 
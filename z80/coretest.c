@@ -41,6 +41,7 @@
 #include "peripherals/ula.h"
 #include "peripherals/usource.h"
 #include "profile.h"
+#include "runahead.h"
 #include "rzx.h"
 #include "slt.h"
 #include "tape.h"
@@ -631,6 +632,11 @@ module_register( module_info_t *module GCC_UNUSED )
   return 0;
 }
 
+void
+runahead_state_register( void *data GCC_UNUSED, size_t length GCC_UNUSED )
+{
+}
+
 void
 z80_debugger_variables_init( void )
 {
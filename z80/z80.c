@@ -34,6 +34,7 @@
 #include "module.h"
 #include "peripherals/scld.h"
 #include "peripherals/spectranet.h"
+#include "runahead.h"
 #include "rzx.h"
 #include "settings.h"
 #include "spectrum.h"
@@ -112,6 +113,8 @@ z80_init( void *context )
 
   module_register( &z80_module_info );
 
+  runahead_state_register( &z80, sizeof( z80 ) );
+
   z80_debugger_variables_init();
 
   return 0;